@@ -33,6 +33,7 @@
 #include "language.h"
 #include "manifest.h"
 #include "cloud.h"
+#include "costs.h"
 #include "daemon.h"
 
 #include <sys/time.h>
@@ -64,6 +65,7 @@ static const char USAGE_TEXT[] =
 "    -C, --clear           clear the cache completely (except configuration)\n"
 "        --daemon          ensure a connection sharing agent is running\n"
 "        --force-daemon    replace any existing connection sharing agent\n"
+"        --daemon-stats    show connection sharing agent statistics\n"
 "    -F, --max-files=N     set maximum number of files in cache to N (use 0 for\n"
 "                          no limit)\n"
 "    -M, --max-size=SIZE   set maximum size of cache to SIZE (use 0 for no\n"
@@ -72,6 +74,7 @@ static const char USAGE_TEXT[] =
 "    -o, --set-config=K=V  set configuration key K to value V\n"
 "    -p, --print-config    print current configuration options\n"
 "    -s, --show-stats      show statistics summary\n"
+"        --simulate-smart  replay recorded compiles against each cloud mode\n"
 "    -z, --zero-stats      zero statistics counters\n"
 "\n"
 "    -h, --help            print this help text\n"
@@ -79,115 +82,151 @@ static const char USAGE_TEXT[] =
 "\n"
 "See also <http://www.cloudsourcery.com>.\n";
 
+/*
+ * The globals below are per thread: see ccache_compile, which may run
+ * several compilations at once, one per thread.
+ */
+
 /* Global configuration data. */
-struct conf *conf = NULL;
+THREAD_LOCAL struct conf *conf = NULL;
 
 /* Where to write configuration changes. */
-char *primary_config_path = NULL;
+THREAD_LOCAL char *primary_config_path = NULL;
 
 /* Secondary, read-only configuration files (if any). */
-char *secondary_config_path1 = NULL;
-char *secondary_config_path2 = NULL;
+THREAD_LOCAL char *secondary_config_path1 = NULL;
+THREAD_LOCAL char *secondary_config_path2 = NULL;
 
 /* current working directory taken from $PWD, or getcwd() if $PWD is bad */
-char *current_working_dir = NULL;
+THREAD_LOCAL char *current_working_dir = NULL;
 
 /* the original argument list */
-struct args *orig_args;
+THREAD_LOCAL struct args *orig_args;
 
 /* the location of the cs binary */
-char *cs_argv0 = NULL;
+THREAD_LOCAL char *cs_argv0 = NULL;
 
-/* the source file */
-static char *input_file;
+/*
+ * Full path to the statistics file in the subdirectory where the cached result
+ * belongs (<cache_dir>/<x>/stats).
+ */
+THREAD_LOCAL char *stats_file = NULL;
 
-/* The output file being compiled to. */
-static char *output_obj;
+/* The state of one compilation, passed through all its phases. */
+struct compile_context {
+	/* the source file */
+	char *input_file;
 
-/* The path to the dependency file (implicit or specified with -MF). */
-static char *output_dep;
+	/* The output file being compiled to. */
+	char *output_obj;
 
-/*
- * Name (represented as a struct file_hash) of the file containing the cached
- * object code.
- */
-static struct file_hash *cached_obj_hash;
+	/* The path to the dependency file (implicit or specified with -MF). */
+	char *output_dep;
 
-/*
- * Full path to the file containing the cached object code
- * (cachedir/a/b/cdef[...]-size.o).
- */
-static char *cached_obj;
+	/*
+	 * Name (represented as a struct file_hash) of the file containing the
+	 * cached object code.
+	 */
+	struct file_hash *cached_obj_hash;
 
-/*
- * Full path to the file containing the standard error output
- * (cachedir/a/b/cdef[...]-size.stderr).
- */
-static char *cached_stderr;
+	/*
+	 * Full path to the file containing the cached object code
+	 * (cachedir/a/b/cdef[...]-size.o).
+	 */
+	char *cached_obj;
 
-/*
- * Full path to the file containing the dependency information
- * (cachedir/a/b/cdef[...]-size.d).
- */
-static char *cached_dep;
+	/*
+	 * Full path to the file containing the standard error output
+	 * (cachedir/a/b/cdef[...]-size.stderr).
+	 */
+	char *cached_stderr;
 
-/*
- * Full path to the file containing the manifest
- * (cachedir/a/b/cdef[...]-size.manifest).
- */
-static char *manifest_path;
+	/*
+	 * The object we hold the in-flight lock for while compiling it, if any,
+	 * and the process that took the lock.
+	 */
+	char *inflight_obj;
+	pid_t inflight_pid;
 
-/*
- * Time of compilation. Used to see if include files have changed after
- * compilation.
- */
-static time_t time_of_compilation;
+	/*
+	 * Full path to the file containing the dependency information
+	 * (cachedir/a/b/cdef[...]-size.d).
+	 */
+	char *cached_dep;
 
-/*
- * Files included by the preprocessor and their hashes/sizes. Key: file path.
- * Value: struct file_hash.
- */
-static struct hashtable *included_files;
+	/*
+	 * Full path to the file containing the manifest
+	 * (cachedir/a/b/cdef[...]-size.manifest).
+	 */
+	char *manifest_path;
+
+	/*
+	 * Time of compilation. Used to see if include files have changed after
+	 * compilation.
+	 */
+	time_t time_of_compilation;
 
-/* is gcc being asked to output dependencies? */
-static bool generating_dependencies;
+	/*
+	 * Files included by the preprocessor and their hashes/sizes. Key: file
+	 * path. Value: struct file_hash.
+	 */
+	struct hashtable *included_files;
 
-/* the name of the temporary pre-processor file */
-static char *i_tmpfile;
+	/* is gcc being asked to output dependencies? */
+	bool generating_dependencies;
 
-/* are we compiling a .i or .ii file directly? */
-static bool direct_i_file;
+	/* the name of the temporary pre-processor file */
+	char *i_tmpfile;
 
-/* the name of the cpp stderr file */
-static char *cpp_stderr;
+	/* are we compiling a .i or .ii file directly? */
+	bool direct_i_file;
 
-/*
- * Full path to the statistics file in the subdirectory where the cached result
- * belongs (<cache_dir>/<x>/stats).
- */
-char *stats_file = NULL;
+	/* the name of the cpp stderr file */
+	char *cpp_stderr;
 
-/* Whether the output is a precompiled header */
-static bool output_is_precompiled_header = false;
+	/* Whether the output is a precompiled header */
+	bool output_is_precompiled_header;
 
-/* Whether we should output to the real object first before saving into cache */
-static bool output_to_real_object_first = false;
+	/*
+	 * Whether we should output to the real object first before saving into
+	 * cache
+	 */
+	bool output_to_real_object_first;
 
-/* Profile generation / usage information */
-static char *profile_dir = NULL;
-static bool profile_use = false;
-static bool profile_generate = false;
+	/* Profile generation / usage information */
+	char *profile_dir;
+	bool profile_use;
+	bool profile_generate;
 
-/*
- * Whether we are using a precompiled header (either via -include, #include or
- * clang's -include-pch).
- */
-static bool using_precompiled_header = false;
+	/*
+	 * Whether we are using a precompiled header (either via -include,
+	 * #include or clang's -include-pch).
+	 */
+	bool using_precompiled_header;
 
-/*
- * The .gch/.pch file used for compilation.
- */
-static char *included_pch_file = NULL;
+	/*
+	 * The .gch/.pch file used for compilation.
+	 */
+	char *included_pch_file;
+
+	/* Arguments (except -E) to send to the preprocessor. */
+	struct args *preprocessor_args;
+
+	/* Arguments to send to the real compiler. */
+	struct args *compiler_args;
+
+	/*
+	 * Whether we run inside someone else's process (see ccache_compile), so
+	 * must return instead of exiting or replacing the process image.
+	 */
+	bool in_process;
+};
+
+/* The context used by cc_process_args and cc_reset, for the test suite. */
+static THREAD_LOCAL struct compile_context *test_context;
+
+/* Whether compiles run through ccache_compile, maybe several at once. */
+static bool compiling_in_process;
 
 /* How long (in microseconds) to wait before breaking a stale lock. */
 unsigned lock_staleness_limit = 2000000;
@@ -195,6 +234,7 @@ unsigned lock_staleness_limit = 2000000;
 enum fromcache_call_mode {
 	FROMCACHE_DIRECT_MODE,
 	FROMCACHE_CPP_MODE,
+	FROMCACHE_DEDUPLICATED_MODE, /* compiled by a process we waited for */
 	FROMCACHE_COMPILED_MODE
 };
 
@@ -245,7 +285,7 @@ add_prefix(struct args *args)
 
 /* Something went badly wrong - just execute the real compiler. */
 static void
-failed(void)
+failed(struct compile_context *ctx)
 {
 	assert(orig_args);
 
@@ -254,41 +294,52 @@ failed(void)
 
 	cc_log("Failed; falling back to running the real compiler");
 	cc_log_argv("Executing ", orig_args->argv);
+	if (ctx->in_process) {
+		/* Our caller's process isn't ours to replace. */
+		int status = execute_fd(orig_args->argv, NULL, 1, NULL, 2, NULL);
+		x_exit(status == -1 ? 1 : status);
+	}
 	exitfn_call();
 	execv(orig_args->argv[0], orig_args->argv);
 	fatal("execv of %s failed: %s", orig_args->argv[0], strerror(errno));
 }
 
 static void
-clean_up_tmp_files()
+clean_up_tmp_files(void *context)
 {
+	struct compile_context *ctx = context;
+
 	/* delete intermediate pre-processor file if needed */
-	if (i_tmpfile) {
-		if (!direct_i_file) {
-			tmp_unlink(i_tmpfile);
+	if (ctx->i_tmpfile) {
+		if (!ctx->direct_i_file) {
+			tmp_unlink(ctx->i_tmpfile);
+			free(ctx->i_tmpfile);
 		}
-		free(i_tmpfile);
-		i_tmpfile = NULL;
+		/* Else it is input_file. */
+		ctx->i_tmpfile = NULL;
 	}
 
 	/* delete the cpp stderr file if necessary */
-	if (cpp_stderr) {
-		tmp_unlink(cpp_stderr);
-		free(cpp_stderr);
-		cpp_stderr = NULL;
+	if (ctx->cpp_stderr) {
+		tmp_unlink(ctx->cpp_stderr);
+		free(ctx->cpp_stderr);
+		ctx->cpp_stderr = NULL;
 	}
 }
 
+/* The memo for temp_dir; initialize() clears it along with conf. */
+static THREAD_LOCAL char *temp_dir_path;
+
 const char *
 temp_dir()
 {
-	static char *path = NULL;
-	if (path) return path;  /* Memoize */
-	path = conf->temporary_dir;
-	if (str_eq(path, "")) {
-		path = format("%s/tmp", conf->cache_dir);
+	if (temp_dir_path) return temp_dir_path;  /* Memoize */
+	if (str_eq(conf->temporary_dir, "")) {
+		temp_dir_path = format("%s/tmp", conf->cache_dir);
+	} else {
+		temp_dir_path = x_strdup(conf->temporary_dir);
 	}
-	return path;
+	return temp_dir_path;
 }
 
 /*
@@ -316,11 +367,12 @@ get_path_in_cache(const char *name, const char *suffix)
 
 /*
  * This function hashes an include file and stores the path and hash in the
- * global included_files variable. If the include file is a PCH, cpp_hash is
+ * context's included_files table. If the include file is a PCH, cpp_hash is
  * also updated. Takes over ownership of path.
  */
 static void
-remember_include_file(char *path, struct mdfour *cpp_hash)
+remember_include_file(struct compile_context *ctx, char *path,
+                      struct mdfour *cpp_hash)
 {
 #ifdef _WIN32
 	DWORD attributes;
@@ -337,12 +389,12 @@ remember_include_file(char *path, struct mdfour *cpp_hash)
 		goto ignore;
 	}
 
-	if (str_eq(path, input_file)) {
+	if (str_eq(path, ctx->input_file)) {
 		/* Don't remember the input file. */
 		goto ignore;
 	}
 
-	if (hashtable_search(included_files, path)) {
+	if (hashtable_search(ctx->included_files, path)) {
 		/* Already known include file. */
 		goto ignore;
 	}
@@ -371,7 +423,7 @@ remember_include_file(char *path, struct mdfour *cpp_hash)
 
 	/* Let's hash the include file. */
 	if (!(conf->sloppiness & SLOPPY_INCLUDE_FILE_MTIME)
-	    && st.st_mtime >= time_of_compilation) {
+	    && st.st_mtime >= ctx->time_of_compilation) {
 		cc_log("Include file %s too new", path);
 		goto failure;
 	}
@@ -414,7 +466,7 @@ remember_include_file(char *path, struct mdfour *cpp_hash)
 		h = x_malloc(sizeof(*h));
 		hash_result_as_bytes(&fhash, h->hash);
 		h->size = fhash.totalN;
-		hashtable_insert(included_files, path, h);
+		hashtable_insert(ctx->included_files, path, h);
 		cloud_hook_include_file(path, h);
 	} else {
 		free(path);
@@ -439,7 +491,7 @@ ignore:
  * the base directory. Takes over ownership of path. Caller frees.
  */
 static char *
-make_relative_path(char *path)
+make_relative_path(struct compile_context *ctx, char *path)
 {
 	char *relpath, *canon_path;
 
@@ -456,7 +508,7 @@ make_relative_path(char *path)
 		if (!current_working_dir) {
 			cc_log("Unable to determine current working directory: %s",
 			       strerror(errno));
-			failed();
+			failed(ctx);
 		}
 	}
 
@@ -479,11 +531,12 @@ make_relative_path(char *path)
  *
  * - Makes include file paths for which the base directory is a prefix relative
  *   when computing the hash sum.
- * - Stores the paths and hashes of included files in the global variable
+ * - Stores the paths and hashes of included files in the context's
  *   included_files.
  */
 static bool
-process_preprocessed_file(struct mdfour *hash, const char *path)
+process_preprocessed_file(struct compile_context *ctx, struct mdfour *hash,
+                          const char *path)
 {
 	char *data;
 	char *p, *q, *end;
@@ -493,7 +546,7 @@ process_preprocessed_file(struct mdfour *hash, const char *path)
 		return false;
 	}
 
-	included_files = create_hashtable(1000, hash_from_string, strings_equal);
+	ctx->included_files = create_hashtable(1000, hash_from_string, strings_equal);
 
 	/* Bytes between p and q are pending to be hashed. */
 	end = data + size;
@@ -556,9 +609,9 @@ process_preprocessed_file(struct mdfour *hash, const char *path)
 			}
 			/* p and q span the include file path */
 			path = x_strndup(p, q - p);
-			path = make_relative_path(path);
+			path = make_relative_path(ctx, path);
 			hash_string(hash, path);
-			remember_include_file(path, hash);
+			remember_include_file(ctx, path, hash);
 			p = q;
 		} else {
 			q++;
@@ -572,21 +625,92 @@ process_preprocessed_file(struct mdfour *hash, const char *path)
 	 * Explicitly check the .gch/.pch file, Clang does not include any mention of
 	 * it in the preprocessed output.
 	 */
-	if (included_pch_file) {
-		char *path = x_strdup(included_pch_file);
-		path = make_relative_path(path);
+	if (ctx->included_pch_file) {
+		char *path = x_strdup(ctx->included_pch_file);
+		path = make_relative_path(ctx, path);
 		hash_string(hash, path);
-		remember_include_file(path, hash);
+		remember_include_file(ctx, path, hash);
 	}
 
 	return true;
 }
 
+/* Release the in-flight lock, if we hold it. */
+static void
+release_inflight_lock(void *context)
+{
+	struct compile_context *ctx = context;
+
+	/* Forked children must leave it to the parent. */
+	if (ctx->inflight_obj && getpid() == ctx->inflight_pid) {
+		lockfile_release(ctx->inflight_obj);
+		free(ctx->inflight_obj);
+		ctx->inflight_obj = NULL;
+	}
+}
+
+/*
+ * Take the in-flight lock for cached_obj before compiling it, so that a
+ * concurrent cs that wants the same object (a duplicate target, say) waits
+ * for our result instead of running the compiler too. If someone else holds
+ * the lock, wait for up to inflight_timeout seconds (default 60, 0 to
+ * disable) and return true if their object is now in the cache. A lock
+ * whose holder has died is broken at once, but one whose holder is still
+ * compiling on this host is left alone when we stop waiting.
+ */
+static bool
+wait_for_inflight_compile(struct compile_context *ctx)
+{
+	unsigned timeout = conf->inflight_timeout;
+	struct stat st;
+
+	if (timeout == 0) {
+		return false;
+	}
+	if (timeout > 4000) {
+		timeout = 4000; /* The limit is in microseconds. */
+	}
+	if (!lockfile_wait(ctx->cached_obj, timeout * 1000000)) {
+		cc_log("Not waiting any longer for a concurrent compile");
+		return false;
+	}
+	if (!ctx->inflight_obj) {
+		exitfn_add(release_inflight_lock, ctx);
+	}
+	ctx->inflight_obj = x_strdup(ctx->cached_obj);
+	ctx->inflight_pid = getpid();
+
+	if (stat(ctx->cached_obj, &st) == 0) {
+		cc_log("Object was compiled by a concurrent process");
+		release_inflight_lock(ctx);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Compute the cost database key for the input file, which, unlike the object
+ * hash, survives edits to it.
+ */
+static void
+input_cost_key(struct compile_context *ctx, uint8_t *key)
+{
+	struct mdfour md;
+
+	hash_start(&md);
+	hash_delimiter(&md, "costs");
+	if (!is_absolute_path(ctx->input_file)) {
+		hash_string(&md, current_working_dir);
+	}
+	hash_string(&md, ctx->input_file);
+	hash_result_as_bytes(&md, key);
+}
+
 /* Get the files from the Cloud or run the real compiler
    and put the result in local cache.
    Returns true for a cloud-cache hit or false for a local-compile. */
 static void
-to_cache(struct args *args)
+to_cache(struct compile_context *ctx, struct args *args)
 {
 	char *tmp_stdout, *tmp_stderr, *tmp_obj;
 	char *tmp_stderrR, *tmp_objR;
@@ -596,176 +720,146 @@ to_cache(struct args *args)
 	size_t added_bytes = 0;
 	unsigned added_files = 0;
 	int from_cloud = false;
-	bool do_cloud_get = true, do_compile = true;
-	int cloud_fork = -1, compile_fork = -1;
-	double load;
+	bool do_cloud_get = true, race = false, hedged = false;
+	double load = 0;
+	int ncpus = 1;
+	char *costs_path = NULL;
+	uint8_t input_key[16];
+	struct cost_record cost;
+	bool cost_known = false, keep_costs = false, log_costs = false;
+	off_t object_size;
+	/*
+	 * Turn off DEPENDENCIES_OUTPUT when running cc1, because otherwise it
+	 * will emit a line like
+	 *
+	 *  tmp.stdout.vexed.732.o: /home/mbp/.ccache/tmp.stdout.vexed.732.i
+	 */
+	char *compiler_env[] = {"DEPENDENCIES_OUTPUT", NULL};
 
-	if (create_parent_dirs(cached_obj) != 0) {
+	if (create_parent_dirs(ctx->cached_obj) != 0) {
 		fatal("Failed to create parent directory for %s: %s",
-		      cached_obj, strerror(errno));
+		      ctx->cached_obj, strerror(errno));
 	}
-	tmp_stdout = format("%s.tmp.stdout.%s", cached_obj, tmp_string());
-	tmp_stderr = format("%s.tmp.stderr.%s", cached_obj, tmp_string());
+	tmp_stdout = format("%s.tmp.stdout.%s", ctx->cached_obj, tmp_string());
+	tmp_stderr = format("%s.tmp.stderr.%s", ctx->cached_obj, tmp_string());
 
 	tmp_stderrR = format("%s.C", tmp_stderr);
 	tmp_stderrL = format("%s.L", tmp_stderr);
 
-	if (output_to_real_object_first) {
-		tmp_obj = x_strdup(output_obj);
+	if (ctx->output_to_real_object_first) {
+		tmp_obj = x_strdup(ctx->output_obj);
 		cc_log("Outputting to final destination: %s", tmp_obj);
 	} else {
-		tmp_obj = format("%s.tmp.%s", cached_obj, tmp_string());
+		tmp_obj = format("%s.tmp.%s", ctx->cached_obj, tmp_string());
 	}
 
 	tmp_objR = format ("%s.R", tmp_obj);
 	tmp_objL = format ("%s.L", tmp_obj);
 
+	/* What earlier compiles of this translation unit, or failing that of
+	   this file, cost.  Only smart mode keeps the database up to date,
+	   unless costs_log asks for a log of the compiles.  */
+	if (strcmp(conf->cloud_mode, "offline") != 0) {
+		log_costs = conf->costs_log;
+		keep_costs = log_costs || strcmp(conf->cloud_mode, "smart") == 0;
+		costs_path = format("%s/costs", conf->cache_dir);
+		input_cost_key(ctx, input_key);
+		cost_known = (costs_lookup(costs_path, ctx->cached_obj_hash->hash,
+		                           &cost)
+		              || costs_lookup(costs_path, input_key, &cost));
+		if (cost_known && cost.compile_time) {
+			cloud_hook_expected_compile_time(cost.compile_time);
+		}
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (getloadavg(&load, 1) != 1) {
+			/* Assume the worst.  */
+			load = ncpus;
+		}
+	}
+
 	if (conf->recache
 	    || strcmp(conf->cloud_mode, "offline") == 0
 	    || strcmp(conf->cloud_mode, "local") == 0)
 	    do_cloud_get = false;
-	else if (strcmp(conf->cloud_mode, "race") == 0
-		 || (strcmp(conf->cloud_mode, "smart") == 0
-		     && getloadavg(&load, 1) == 1
-		     && load < 2))
-	  {
+	else if (strcmp(conf->cloud_mode, "race") == 0)
 	    /* We're to run both the cloud cache fetch and the local compiler
-	       against each other as a race.
-	       We need two forks, one for each task.  */
-	    cloud_fork = fork();
-	    if (cloud_fork == 0)
-	      /* This runs in the first child.  */
-	      do_compile = false;
-
-	    else if (cloud_fork > 0)
-	      {
-		/* Still in the parent process .....
-		   and the first child will take care of the get.  */
+	       against each other as a race.  */
+	    race = true;
+	else if (strcmp(conf->cloud_mode, "hedged") == 0)
+	    /* The same, but the cloud cache gets a head start.  */
+	    race = hedged = true;
+	else if (strcmp(conf->cloud_mode, "smart") == 0) {
+	    enum cost_choice choice = costs_choose(cost_known ? &cost : NULL,
+	                                           load, ncpus);
+	    cc_log("Smart mode chose %s (load %.2f on %d CPUs)",
+	           costs_choice_name(choice), load, ncpus);
+	    if (choice == COST_LOCAL)
 		do_cloud_get = false;
-
-		compile_fork = fork();
-		if (compile_fork == 0)
-		  /* This runs in the second child.
-		     Create a new process group so that the parent
-		     can kill it later. */
-		  setpgrp();
-
-		else if (compile_fork > 0)
-		  /* And now the parent process need not do the compile.  */
-		  do_compile = false;
-
-		else
-		  fatal ("Could not fork: %s", strerror(errno));
-	      }
-
-	    /* If either fork failed, then the machine is ill.  */
-	    else
-	      fatal ("Could not fork: %s", strerror(errno));
-	  }
+	    else if (choice == COST_RACE)
+		race = true;
+	}
 	/* else assume cloud_mode == "remote" */
 
 	/* Check cloud cache!  */
 	/* TODO: support cached compiler-failures.  */
 	/* TODO: support server-side builds.  */
-	if (do_cloud_get
+	if (do_cloud_get && !race
 	    && cloud_cache_get (tmp_objR, tmp_stderrR, &status))
 	  {
 	    cc_log ("Downloaded the object from the cloud cache.");
 	    from_cloud = true;
 	  }
 
-	if (cloud_fork == 0)
-	  /* This is the exit point for the first child.  */
-	  _exit(from_cloud);
-
-	if (do_compile && !from_cloud)
+	if (!from_cloud)
 	  {
-	    if (strcmp(conf->cloud_mode, "offline") != 0)
+	    if (strcmp(conf->cloud_mode, "offline") != 0 && !race)
 	      cc_log ("The object was not found in the cloud cache.");
 
             args_add(args, "-o");
             args_add(args, tmp_objL);
 
-            /* Turn off DEPENDENCIES_OUTPUT when running cc1, because
-             * otherwise it will emit a line like
-             *
-             *  tmp.stdout.vexed.732.o: /home/mbp/.ccache/tmp.stdout.vexed.732.i
-             */
-            x_unsetenv("DEPENDENCIES_OUTPUT");
-
             if (conf->run_second_cpp) {
-                    args_add(args, input_file);
+                    args_add(args, ctx->input_file);
             } else {
-                    args_add(args, i_tmpfile);
+                    args_add(args, ctx->i_tmpfile);
             }
 
-            cc_log("Running real compiler");
-            cloud_hook_starting_compiler_execution();
-            status = execute(args->argv, tmp_stdout, tmp_stderrL);
-            cloud_hook_ending_compiler_execution();
+            if (race) {
+                    cc_log("Running real compiler in a race with the cloud cache");
+                    from_cloud = cloud_race(args->argv, tmp_stdout, tmp_stderrL,
+                                            compiler_env, tmp_objR, tmp_stderrR,
+                                            hedged, &status);
+                    if (from_cloud) {
+                            cc_log("Downloaded the object from the cloud cache.");
+                    }
+            } else {
+                    cc_log("Running real compiler");
+                    cloud_hook_starting_compiler_execution();
+                    status = execute_fd(args->argv, tmp_stdout, 0, tmp_stderrL, 0,
+                                        compiler_env);
+                    cloud_hook_ending_compiler_execution();
+            }
             args_pop(args, 3);
           }
 
-	if (compile_fork == 0)
-	  /* This is the exit point for the second child.  */
-	  _exit(status);
-
-	if (cloud_fork > 0)
-	  {
-	    /* If we're running in cloud_mode == "race" then we now need to
-	       see which fork will win the race.
-	       We deliberately do NOT wait for the second finisher. The "init"
-	       processes will have to clean up the orphaned zombie later.  */
-	    int retval;
-
-	    do
-	      {
-		int pid = wait(&retval);
-
-		if (pid == cloud_fork)
-		  {
-		    /* The cloud cache query was fastest, but it might have
-		       returned "cache miss".  */
-		    cc_log ("Cloud cache lookup complete.");
-		    if (WIFEXITED(retval) && WEXITSTATUS(retval) == 1)
-		      {
-			/* Cloud Cache Hit!
-			   Kill the now-unnecessary compiler.  */
-			killpg(compile_fork, SIGTERM);
-			from_cloud = 1;
-
-			status = cloud_cache_exit_status();
-			break;
-		      }
-		    else
-		      {
-		        /* Wait for the local compile to complete. */
-			cc_log ("Cloud cache miss; waiting for local compiler.");
-		        continue;
-		      }
-		  }
-		else if (pid == compile_fork)
-		  {
-		    /* The local compiler has finished.
-		       We just accept the exit status, good or bad.  */
-		    cc_log ("Local compiler complete.");
-		    status = retval;
-		    break;
-		  }
-		else
-		  fatal ("wait failed: %s", strerror(errno));
-	      }
-	    while (true);
-	  }
-
 	/* The cloud cache and the real compiler output to different files,
 	   so we have to move the winner's files into the expected place.  */
 	unlink (tmp_stderr);
 	unlink (tmp_obj);
 	if (from_cloud)
 	  {
-	    x_rename (tmp_stderrR, tmp_stderr);
+	    /* The cloud sends no stderr if the compiler printed nothing.  */
+	    if (x_rename (tmp_stderrR, tmp_stderr) != 0)
+	      create_empty_file (tmp_stderr);
 	    x_rename (tmp_objR, tmp_obj);
+
+	    /* Whatever the stopped compiler left behind.  */
+	    if (race)
+	      {
+		tmp_unlink (tmp_stdout);
+		tmp_unlink (tmp_stderrL);
+		tmp_unlink (tmp_objL);
+	      }
 	  }
 	else
 	  {
@@ -787,7 +881,7 @@ to_cache(struct args *args)
                     tmp_unlink(tmp_stdout);
                     tmp_unlink(tmp_stderr);
                     tmp_unlink(tmp_obj);
-                    failed();
+                    failed(ctx);
             }
             tmp_unlink(tmp_stdout);
           }
@@ -796,32 +890,32 @@ to_cache(struct args *args)
 	 * Merge stderr from the preprocessor (if any) and stderr from the real
 	 * compiler into tmp_stderr.
 	 */
-	if (cpp_stderr) {
+	if (ctx->cpp_stderr) {
 		int fd_cpp_stderr;
 		int fd_real_stderr;
 		int fd_result;
 		char *tmp_stderr2;
 
-		tmp_stderr2 = format("%s.tmp.stderr2.%s", cached_obj, tmp_string());
+		tmp_stderr2 = format("%s.tmp.stderr2.%s", ctx->cached_obj, tmp_string());
 		if (x_rename(tmp_stderr, tmp_stderr2)) {
 			cc_log("Failed to rename %s to %s: %s", tmp_stderr, tmp_stderr2,
 			       strerror(errno));
-			failed();
+			failed(ctx);
 		}
-		fd_cpp_stderr = open(cpp_stderr, O_RDONLY | O_BINARY);
+		fd_cpp_stderr = open(ctx->cpp_stderr, O_RDONLY | O_BINARY);
 		if (fd_cpp_stderr == -1) {
-			cc_log("Failed opening %s: %s", cpp_stderr, strerror(errno));
-			failed();
+			cc_log("Failed opening %s: %s", ctx->cpp_stderr, strerror(errno));
+			failed(ctx);
 		}
 		fd_real_stderr = open(tmp_stderr2, O_RDONLY | O_BINARY);
 		if (fd_real_stderr == -1) {
 			cc_log("Failed opening %s: %s", tmp_stderr2, strerror(errno));
-			failed();
+			failed(ctx);
 		}
 		fd_result = open(tmp_stderr, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
 		if (fd_result == -1) {
 			cc_log("Failed opening %s: %s", tmp_stderr, strerror(errno));
-			failed();
+			failed(ctx);
 		}
 		copy_fd(fd_cpp_stderr, fd_result);
 		copy_fd(fd_real_stderr, fd_result);
@@ -839,10 +933,10 @@ to_cache(struct args *args)
 
 		fd = open(tmp_stderr, O_RDONLY | O_BINARY);
 		if (fd != -1) {
-			if (str_eq(output_obj, "/dev/null")
-			    || (!output_to_real_object_first
+			if (str_eq(ctx->output_obj, "/dev/null")
+			    || (!ctx->output_to_real_object_first
 			        && access(tmp_obj, R_OK) == 0
-			        && move_file(tmp_obj, output_obj, 0) == 0)
+			        && move_file(tmp_obj, ctx->output_obj, 0) == 0)
 			    || errno == ENOENT) {
 				/* we can use a quick method of getting the failed output */
 				copy_fd(fd, 2);
@@ -854,39 +948,40 @@ to_cache(struct args *args)
 
 		tmp_unlink(tmp_stderr);
 		tmp_unlink(tmp_obj);
-		failed();
+		failed(ctx);
 	}
 
 	if (stat(tmp_obj, &st) != 0) {
 		cc_log("Compiler didn't produce an object file");
 		stats_update(STATS_NOOUTPUT);
-		failed();
+		failed(ctx);
 	}
 	if (st.st_size == 0) {
 		cc_log("Compiler produced an empty object file");
 		stats_update(STATS_EMPTYOUTPUT);
-		failed();
+		failed(ctx);
 	}
+	object_size = st.st_size;
 
 	if (stat(tmp_stderr, &st) != 0) {
 		cc_log("Failed to stat %s: %s", tmp_stderr, strerror(errno));
 		stats_update(STATS_ERROR);
-		failed();
+		failed(ctx);
 	}
 	if (st.st_size > 0) {
 		if (move_uncompressed_file(
-			    tmp_stderr, cached_stderr,
+			    tmp_stderr, ctx->cached_stderr,
 			    conf->compression ? conf->compression_level : 0) != 0) {
-			cc_log("Failed to move %s to %s: %s", tmp_stderr, cached_stderr,
+			cc_log("Failed to move %s to %s: %s", tmp_stderr, ctx->cached_stderr,
 			       strerror(errno));
 			stats_update(STATS_ERROR);
-			failed();
+			failed(ctx);
 		}
 	        /* FIXME: no need to push once cloud can compile.  */
-		cloud_hook_stderr_file (cached_stderr);
-		cc_log("Stored in cache: %s", cached_stderr);
+		cloud_hook_stderr_file (ctx->cached_stderr);
+		cc_log("Stored in cache: %s", ctx->cached_stderr);
 		if (conf->compression) {
-			stat(cached_stderr, &st);
+			stat(ctx->cached_stderr, &st);
 		}
 		added_bytes += file_size(&st);
 		added_files += 1;
@@ -894,32 +989,32 @@ to_cache(struct args *args)
 		tmp_unlink(tmp_stderr);
 		if (conf->recache) {
 			/* If recaching, we need to remove any previous .stderr. */
-			x_unlink(cached_stderr);
+			x_unlink(ctx->cached_stderr);
 		}
 	}
 
-	if (output_to_real_object_first) {
+	if (ctx->output_to_real_object_first) {
 		int ret;
 		if (conf->hard_link && !conf->compression) {
-			ret = link(tmp_obj, cached_obj);
+			ret = link(tmp_obj, ctx->cached_obj);
 		} else {
-			ret = copy_file(tmp_obj, cached_obj, conf->compression);
+			ret = copy_file(tmp_obj, ctx->cached_obj, conf->compression);
 		}
 		if (ret != 0) {
 			cc_log("Failed to copy/link %s to %s: %s",
-			       tmp_obj, cached_obj, strerror(errno));
+			       tmp_obj, ctx->cached_obj, strerror(errno));
 			stats_update(STATS_ERROR);
-			failed();
+			failed(ctx);
 		}
 	} else if (move_uncompressed_file(
-		           tmp_obj, cached_obj,
+		           tmp_obj, ctx->cached_obj,
 		           conf->compression ? conf->compression_level : 0) != 0) {
-		cc_log("Failed to move %s to %s: %s", tmp_obj, cached_obj, strerror(errno));
+		cc_log("Failed to move %s to %s: %s", tmp_obj, ctx->cached_obj, strerror(errno));
 		stats_update(STATS_ERROR);
-		failed();
+		failed(ctx);
 	}
-	cc_log("Stored in cache: %s", cached_obj);
-	stat(cached_obj, &st);
+	cc_log("Stored in cache: %s", ctx->cached_obj);
+	stat(ctx->cached_obj, &st);
 	added_bytes += file_size(&st);
 	added_files += 1;
 
@@ -927,10 +1022,10 @@ to_cache(struct args *args)
 	 * Do an extra stat on the potentially compressed object file for the
 	 * size statistics.
 	 */
-	if (stat(cached_obj, &st) != 0) {
-		cc_log("Failed to stat %s: %s", cached_obj, strerror(errno));
+	if (stat(ctx->cached_obj, &st) != 0) {
+		cc_log("Failed to stat %s: %s", ctx->cached_obj, strerror(errno));
 		stats_update(STATS_ERROR);
-		failed();
+		failed(ctx);
 	}
 
 	stats_update_size(from_cloud ? STATS_CACHEHIT_CLOUD : STATS_TOCACHE,
@@ -938,6 +1033,24 @@ to_cache(struct args *args)
 	cloud_hook_record_result_type(from_cloud ? RT_CLOUD_CACHE_HIT
 						 : RT_LOCAL_COMPILE);
 
+	if (keep_costs) {
+		struct cost_observation obs;
+		struct cost_log_entry log;
+		const uint8_t *keys[2];
+
+		cloud_observed_costs(from_cloud, &obs);
+		obs.object_size = object_size;
+		keys[0] = ctx->cached_obj_hash->hash;
+		keys[1] = input_key;
+		log.mode = !do_cloud_get ? "local" : hedged ? "hedged"
+		           : race ? "race" : "remote";
+		log.load = load;
+		log.ncpus = ncpus;
+		log.record = cost_known ? &cost : NULL;
+		costs_update(costs_path, keys, 2, &obs, log_costs ? &log : NULL);
+	}
+	free(costs_path);
+
 	/* Make sure we have a CACHEDIR.TAG
 	 * This can be almost anywhere, but might as well do it near the end
 	 * as if we exit early we save the stat call
@@ -946,7 +1059,7 @@ to_cache(struct args *args)
 		cc_log("Failed to create %s/CACHEDIR.TAG (%s)\n",
 		        conf->cache_dir, strerror(errno));
 		stats_update(STATS_ERROR);
-		failed();
+		failed(ctx);
 	}
 
 	free(tmp_obj);
@@ -963,7 +1076,8 @@ to_cache(struct args *args)
  * Returns the hash as a heap-allocated hex string.
  */
 static struct file_hash *
-get_object_name_from_cpp(struct args *args, struct mdfour *hash)
+get_object_name_from_cpp(struct compile_context *ctx, struct args *args,
+                         struct mdfour *hash)
 {
 	char *input_base;
 	char *tmp;
@@ -975,7 +1089,7 @@ get_object_name_from_cpp(struct args *args, struct mdfour *hash)
 	   limit the basename to 10
 	   characters in order to cope with filesystem with small
 	   maximum filename length limits */
-	input_base = basename(input_file);
+	input_base = basename(ctx->input_file);
 	tmp = strchr(input_base, '.');
 	if (tmp != NULL) {
 		*tmp = 0;
@@ -989,42 +1103,43 @@ get_object_name_from_cpp(struct args *args, struct mdfour *hash)
 		"%s/%s.tmp.%s.%s",
 		temp_dir(), input_base, tmp_string(), conf->cpp_extension);
 	path_stderr = format("%s/tmp.cpp_stderr.%s", temp_dir(), tmp_string());
+	free(input_base);
 
 	if (create_parent_dirs(path_stdout) != 0) {
 		fatal("Failed to create parent directory for %s: %s\n",
 		      path_stdout, strerror(errno));
 	}
 
-	time_of_compilation = time(NULL);
+	ctx->time_of_compilation = time(NULL);
 
-	if (!direct_i_file) {
+	if (!ctx->direct_i_file) {
 		/* run cpp on the input file to obtain the .i */
 		args_add(args, "-E");
-		args_add(args, input_file);
+		args_add(args, ctx->input_file);
 		cc_log("Running preprocessor");
 		status = execute(args->argv, path_stdout, path_stderr);
 		args_pop(args, 2);
 	} else {
 		/* we are compiling a .i or .ii file - that means we
 		   can skip the cpp stage and directly form the
-		   correct i_tmpfile */
-		path_stdout = input_file;
+		   correct ctx->i_tmpfile */
+		path_stdout = ctx->input_file;
 		if (create_empty_file(path_stderr) != 0) {
 			cc_log("Failed to create %s: %s", path_stderr, strerror(errno));
 			stats_update(STATS_ERROR);
-			failed();
+			failed(ctx);
 		}
 		status = 0;
 	}
 
 	if (status != 0) {
-		if (!direct_i_file) {
+		if (!ctx->direct_i_file) {
 			tmp_unlink(path_stdout);
 		}
 		tmp_unlink(path_stderr);
 		cc_log("Preprocessor gave exit status %d", status);
 		stats_update(STATS_PREPROCESSOR);
-		failed();
+		failed(ctx);
 	}
 
 	if (conf->unify) {
@@ -1033,21 +1148,21 @@ get_object_name_from_cpp(struct args *args, struct mdfour *hash)
 		 * input file name in the hash to get the warnings right.
 		 */
 		hash_delimiter(hash, "unifyfilename");
-		hash_string(hash, input_file);
+		hash_string(hash, ctx->input_file);
 
 		hash_delimiter(hash, "unifycpp");
 		if (unify_hash(hash, path_stdout) != 0) {
 			stats_update(STATS_ERROR);
 			tmp_unlink(path_stderr);
 			cc_log("Failed to unify %s", path_stdout);
-			failed();
+			failed(ctx);
 		}
 	} else {
 		hash_delimiter(hash, "cpp");
-		if (!process_preprocessed_file(hash, path_stdout)) {
+		if (!process_preprocessed_file(ctx, hash, path_stdout)) {
 			stats_update(STATS_ERROR);
 			tmp_unlink(path_stderr);
-			failed();
+			failed(ctx);
 		}
 	}
 
@@ -1056,7 +1171,7 @@ get_object_name_from_cpp(struct args *args, struct mdfour *hash)
 		fatal("Failed to open %s: %s", path_stderr, strerror(errno));
 	}
 
-	i_tmpfile = path_stdout;
+	ctx->i_tmpfile = path_stdout;
 
 	if (conf->run_second_cpp) {
 		tmp_unlink(path_stderr);
@@ -1067,7 +1182,7 @@ get_object_name_from_cpp(struct args *args, struct mdfour *hash)
 		 * stderr data and output it just before the main stderr from
 		 * the compiler pass.
 		 */
-		cpp_stderr = path_stderr;
+		ctx->cpp_stderr = path_stderr;
 	}
 
 	cloud_hook_preprocessed_file(path_stdout);
@@ -1079,17 +1194,24 @@ get_object_name_from_cpp(struct args *args, struct mdfour *hash)
 }
 
 static void
-update_cached_result_globals(struct file_hash *hash)
+update_cached_result(struct compile_context *ctx, struct file_hash *hash)
 {
 	char *object_name, *object_hash_str;
 
 	object_hash_str = format_hash_as_string(hash->hash, hash->size);
 	object_name = format ("%s-%s", object_hash_str, tool_id_get());
 
-	cached_obj_hash = hash;
-	cached_obj = get_path_in_cache(object_name, ".o");
-	cached_stderr = get_path_in_cache(object_name, ".stderr");
-	cached_dep = get_path_in_cache(object_name, ".d");
+	if (ctx->cached_obj_hash != hash) {
+		free(ctx->cached_obj_hash);
+		ctx->cached_obj_hash = hash;
+	}
+	free(ctx->cached_obj);
+	free(ctx->cached_stderr);
+	free(ctx->cached_dep);
+	free(stats_file);
+	ctx->cached_obj = get_path_in_cache(object_name, ".o");
+	ctx->cached_stderr = get_path_in_cache(object_name, ".stderr");
+	ctx->cached_dep = get_path_in_cache(object_name, ".d");
 	stats_file = format("%s/%c/stats", conf->cache_dir, object_name[0]);
 
 	cloud_hook_cpp_hash(object_hash_str);
@@ -1131,7 +1253,8 @@ hash_compiler(struct mdfour *hash, struct stat *st, const char *path,
  * modes.
  */
 static void
-calculate_common_hash(struct args *args, struct mdfour *hash)
+calculate_common_hash(struct compile_context *ctx, struct args *args,
+                      struct mdfour *hash)
 {
 	struct stat st;
 	char *p;
@@ -1148,7 +1271,7 @@ calculate_common_hash(struct args *args, struct mdfour *hash)
 	if (stat(args->argv[0], &st) != 0) {
 		cc_log("Couldn't stat compiler %s: %s", args->argv[0], strerror(errno));
 		stats_update(STATS_COMPILER);
-		failed();
+		failed(ctx);
 	}
 
 	/*
@@ -1184,7 +1307,7 @@ calculate_common_hash(struct args *args, struct mdfour *hash)
 			hash_delimiter(hash, "extrafile");
 			if (!hash_file(hash, path)) {
 				stats_update(STATS_BADEXTRAFILE);
-				failed();
+				failed(ctx);
 			}
 			q = NULL;
 		}
@@ -1198,7 +1321,8 @@ calculate_common_hash(struct args *args, struct mdfour *hash)
  * otherwise NULL. Caller frees.
  */
 static struct file_hash *
-calculate_object_hash(struct args *args, struct mdfour *hash, int direct_mode)
+calculate_object_hash(struct compile_context *ctx, struct args *args,
+                      struct mdfour *hash, int direct_mode)
 {
 	int i;
 	char *manifest_name, *tmp;
@@ -1222,8 +1346,8 @@ calculate_object_hash(struct args *args, struct mdfour *hash, int direct_mode)
 		   to the hash. The theory is that these arguments will change
 		   the output of -E if they are going to have any effect at
 		   all. For precompiled headers this might not be the case. */
-		if (!direct_mode && !output_is_precompiled_header
-		    && !using_precompiled_header) {
+		if (!direct_mode && !ctx->output_is_precompiled_header
+		    && !ctx->using_precompiled_header) {
 			if (compopt_affects_cpp(args->argv[i])) {
 				i++;
 				continue;
@@ -1288,25 +1412,25 @@ calculate_object_hash(struct args *args, struct mdfour *hash, int direct_mode)
 	 * We need to output to the real object first here, otherwise runtime
 	 * artifacts will be produced in the wrong place.
 	 */
-	if (profile_generate) {
-		output_to_real_object_first = true;
-		if (!profile_dir) {
-			profile_dir = get_cwd();
+	if (ctx->profile_generate) {
+		ctx->output_to_real_object_first = true;
+		if (!ctx->profile_dir) {
+			ctx->profile_dir = get_cwd();
 		}
-		cc_log("Adding profile directory %s to our hash", profile_dir);
+		cc_log("Adding profile directory %s to our hash", ctx->profile_dir);
 		hash_delimiter(hash, "-fprofile-dir");
-		hash_string(hash, profile_dir);
+		hash_string(hash, ctx->profile_dir);
 	}
-	if (profile_use) {
+	if (ctx->profile_use) {
 		/* Calculate gcda name */
 		char *gcda_name;
 		char *base_name;
-		output_to_real_object_first = true;
-		base_name = remove_extension(output_obj);
-		if (!profile_dir) {
-			profile_dir = get_cwd();
+		ctx->output_to_real_object_first = true;
+		base_name = remove_extension(ctx->output_obj);
+		if (!ctx->profile_dir) {
+			ctx->profile_dir = get_cwd();
 		}
-		gcda_name = format("%s/%s.gcda", profile_dir, base_name);
+		gcda_name = format("%s/%s.gcda", ctx->profile_dir, base_name);
 		cc_log("Adding profile data %s to our hash", gcda_name);
 		/* Add the gcda to our hash */
 		hash_delimiter(hash, "-fprofile-use");
@@ -1341,13 +1465,13 @@ calculate_object_hash(struct args *args, struct mdfour *hash, int direct_mode)
 			 * the file name.
 			 */
 			hash_delimiter(hash, "inputfile");
-			hash_string(hash, input_file);
+			hash_string(hash, ctx->input_file);
 		}
 
 		hash_delimiter(hash, "sourcecode");
-		result = hash_source_code_file(conf, hash, input_file);
+		result = hash_source_code_file(conf, hash, ctx->input_file);
 		if (result & HASH_SOURCE_CODE_ERROR) {
-			failed();
+			failed(ctx);
 		}
 		if (result & HASH_SOURCE_CODE_FOUND_TIME) {
 			cloud_hook_direct_mode_autodisabled("Found time macros");
@@ -1357,21 +1481,23 @@ calculate_object_hash(struct args *args, struct mdfour *hash, int direct_mode)
 		}
 		tmp = hash_result(hash);
 		manifest_name = format ("%s-%s", tmp, tool_id_get());
-		manifest_path = get_path_in_cache(manifest_name, ".manifest");
+		ctx->manifest_path = get_path_in_cache(manifest_name, ".manifest");
+		/* The cloud may have a manifest too; ask while we read ours. */
+		cloud_manifest_request(manifest_name);
 		free(manifest_name);
 		free(tmp);
-		cc_log("Looking for object file hash in %s", manifest_path);
-		object_hash = manifest_get(conf, manifest_path);
+		cc_log("Looking for object file hash in %s", ctx->manifest_path);
+		object_hash = manifest_get(conf, ctx->manifest_path);
 		if (object_hash) {
 			cc_log("Got object file hash from manifest");
 		} else {
 			cc_log("Did not find object file hash in manifest");
 		}
 	} else {
-		object_hash = get_object_name_from_cpp(args, hash);
+		object_hash = get_object_name_from_cpp(ctx, args, hash);
 		cc_log("Got object file hash from preprocessor");
-		if (generating_dependencies) {
-			cc_log("Preprocessor created %s", output_dep);
+		if (ctx->generating_dependencies) {
+			cc_log("Preprocessor created %s", ctx->output_dep);
 		}
 	}
 
@@ -1383,78 +1509,109 @@ calculate_object_hash(struct args *args, struct mdfour *hash, int direct_mode)
  * then this function exits with the correct status code, otherwise it returns.
  */
 static void
-from_cache(enum fromcache_call_mode mode, bool put_object_in_manifest)
+from_cache(struct compile_context *ctx, enum fromcache_call_mode mode,
+           bool put_object_in_manifest)
 {
-	int fd_stderr;
+	int fd_stderr, fd_obj, fd_dep;
+	const char *cached_files[3];
+	int fds[3];
 	int ret;
 	struct stat st;
-	bool produce_dep_file;
+	bool produce_dep_file, update_manifest;
 
 	/* the user might be disabling cache hits */
 	if (mode != FROMCACHE_COMPILED_MODE && conf->recache) {
 		return;
 	}
 
-	/* Check if the object file is there. */
-	if (stat(cached_obj, &st) != 0) {
-		cc_log("Object file %s not in cache", cached_obj);
-		return;
-	}
-
 	/*
 	 * (If mode != FROMCACHE_DIRECT_MODE, the dependency file is created by
 	 * gcc.)
 	 */
-	produce_dep_file = generating_dependencies && mode == FROMCACHE_DIRECT_MODE;
+	produce_dep_file = ctx->generating_dependencies && mode == FROMCACHE_DIRECT_MODE;
+
+	/* Open everything we need at once, through the daemon if one runs. */
+	cached_files[0] = ctx->cached_obj;
+	cached_files[1] = ctx->cached_stderr;
+	cached_files[2] = ctx->cached_dep;
+	open_cache_files(produce_dep_file ? 3 : 2, cached_files, fds);
+	fd_obj = fds[0];
+	fd_stderr = fds[1];
+	fd_dep = produce_dep_file ? fds[2] : -1;
+
+	/* Check if the object file is there. */
+	if (fd_obj == -1) {
+		cc_log("Object file %s not in cache", ctx->cached_obj);
+		if (fd_stderr != -1) {
+			close(fd_stderr);
+		}
+		if (fd_dep != -1) {
+			close(fd_dep);
+		}
+		return;
+	}
 
 	/* If the dependency file should be in the cache, check that it is. */
-	if (produce_dep_file && stat(cached_dep, &st) != 0) {
-		cc_log("Dependency file %s missing in cache", cached_dep);
+	if (produce_dep_file && fd_dep == -1) {
+		cc_log("Dependency file %s missing in cache", ctx->cached_dep);
+		close(fd_obj);
+		if (fd_stderr != -1) {
+			close(fd_stderr);
+		}
 		return;
 	}
 
-	if (str_eq(output_obj, "/dev/null")) {
+	if (str_eq(ctx->output_obj, "/dev/null")) {
 		ret = 0;
+		close(fd_obj);
 	} else {
-		x_unlink(output_obj);
+		x_unlink(ctx->output_obj);
 		/* only make a hardlink if the cache file is uncompressed */
-		if (conf->hard_link && !file_is_compressed(cached_obj)) {
-			ret = link(cached_obj, output_obj);
+		if (conf->hard_link && !file_is_compressed(ctx->cached_obj)) {
+			ret = link(ctx->cached_obj, ctx->output_obj);
+			close(fd_obj);
 		} else {
-			ret = copy_file(cached_obj, output_obj, 0);
+			ret = copy_fd_to_file(fd_obj, ctx->cached_obj, ctx->output_obj, 0);
 		}
 	}
 
 	if (ret == -1) {
 		if (errno == ENOENT) {
 			/* Someone removed the file just before we began copying? */
-			cc_log("Object file %s just disappeared from cache", cached_obj);
+			cc_log("Object file %s just disappeared from cache", ctx->cached_obj);
 			stats_update(STATS_MISSING);
 		} else {
 			cc_log("Failed to copy/link %s to %s: %s",
-			       cached_obj, output_obj, strerror(errno));
+			       ctx->cached_obj, ctx->output_obj, strerror(errno));
 			stats_update(STATS_ERROR);
-			failed();
+			failed(ctx);
+		}
+		if (fd_stderr != -1) {
+			close(fd_stderr);
 		}
-		x_unlink(output_obj);
-		x_unlink(cached_stderr);
-		x_unlink(cached_obj);
-		x_unlink(cached_dep);
+		if (fd_dep != -1) {
+			close(fd_dep);
+		}
+		x_unlink(ctx->output_obj);
+		x_unlink(ctx->cached_stderr);
+		x_unlink(ctx->cached_obj);
+		x_unlink(ctx->cached_dep);
 		return;
 	} else {
-		cc_log("Created %s from %s", output_obj, cached_obj);
+		cc_log("Created %s from %s", ctx->output_obj, ctx->cached_obj);
 	}
 
 	/* FIXME: no need to push once cloud can compile.  */
-        cloud_hook_object_file (cached_obj);
+        cloud_hook_object_file (ctx->cached_obj);
 
 	if (produce_dep_file) {
-		x_unlink(output_dep);
+		x_unlink(ctx->output_dep);
 		/* only make a hardlink if the cache file is uncompressed */
-		if (conf->hard_link && !file_is_compressed(cached_dep)) {
-			ret = link(cached_dep, output_dep);
+		if (conf->hard_link && !file_is_compressed(ctx->cached_dep)) {
+			ret = link(ctx->cached_dep, ctx->output_dep);
+			close(fd_dep);
 		} else {
-			ret = copy_file(cached_dep, output_dep, 0);
+			ret = copy_fd_to_file(fd_dep, ctx->cached_dep, ctx->output_dep, 0);
 		}
 		if (ret == -1) {
 			if (errno == ENOENT) {
@@ -1462,56 +1619,66 @@ from_cache(enum fromcache_call_mode mode, bool put_object_in_manifest)
 				 * Someone removed the file just before we
 				 * began copying?
 				 */
-				cc_log("Dependency file %s just disappeared from cache", output_obj);
+				cc_log("Dependency file %s just disappeared from cache", ctx->output_obj);
 				stats_update(STATS_MISSING);
 			} else {
 				cc_log("Failed to copy/link %s to %s: %s",
-				       cached_dep, output_dep, strerror(errno));
+				       ctx->cached_dep, ctx->output_dep, strerror(errno));
 				stats_update(STATS_ERROR);
-				failed();
+				failed(ctx);
+			}
+			if (fd_stderr != -1) {
+				close(fd_stderr);
 			}
-			x_unlink(output_obj);
-			x_unlink(output_dep);
-			x_unlink(cached_stderr);
-			x_unlink(cached_obj);
-			x_unlink(cached_dep);
+			x_unlink(ctx->output_obj);
+			x_unlink(ctx->output_dep);
+			x_unlink(ctx->cached_stderr);
+			x_unlink(ctx->cached_obj);
+			x_unlink(ctx->cached_dep);
 			return;
 		} else {
-			cc_log("Created %s from %s", output_dep, cached_dep);
+			cc_log("Created %s from %s", ctx->output_dep, ctx->cached_dep);
 		}
 	}
 
 	/* Update modification timestamps to save files from LRU cleanup.
 	   Also gives files a sensible mtime when hard-linking. */
-	update_mtime(cached_obj);
-	update_mtime(cached_stderr);
+	update_mtime(ctx->cached_obj);
+	update_mtime(ctx->cached_stderr);
 	if (produce_dep_file) {
-		update_mtime(cached_dep);
+		update_mtime(ctx->cached_dep);
 	}
 
-	if (generating_dependencies && mode != FROMCACHE_DIRECT_MODE) {
+	if (ctx->generating_dependencies && mode != FROMCACHE_DIRECT_MODE) {
 		/* Store the dependency file in the cache. */
-		ret = copy_file(output_dep, cached_dep, conf->compression);
+		ret = copy_file(ctx->output_dep, ctx->cached_dep, conf->compression);
 		if (ret == -1) {
-			cc_log("Failed to copy %s to %s: %s", output_dep, cached_dep,
+			cc_log("Failed to copy %s to %s: %s", ctx->output_dep, ctx->cached_dep,
 			       strerror(errno));
 			/* Continue despite the error. */
 		} else {
-			cc_log("Stored in cache: %s", cached_dep);
-			stat(cached_dep, &st);
+			cc_log("Stored in cache: %s", ctx->cached_dep);
+			stat(ctx->cached_dep, &st);
 			stats_update_size(STATS_NONE, file_size(&st), 1);
 		}
 	}
 
 	/* Send the stderr, if any. */
-	fd_stderr = open(cached_stderr, O_RDONLY | O_BINARY);
 	if (fd_stderr != -1) {
 		copy_fd(fd_stderr, 2);
 		close(fd_stderr);
 	}
 
+	update_manifest = (conf->direct_mode
+	                   && put_object_in_manifest
+	                   && ctx->included_files
+	                   && !conf->read_only);
+
 #ifndef DISABLE_FORK
-	int pid = fork();
+	/* Let the user go on while a child updates the manifest, unless we
+	   are running in someone else's process.  Uploading the results is
+	   the daemon's job, so otherwise there is little left to wait for. */
+	int pid = ctx->in_process || !update_manifest ? -1 : fork();
 	if (pid > 0)
 	  {
 	    cloud_hook_stop_overall_timer();
@@ -1522,27 +1689,36 @@ from_cache(enum fromcache_call_mode mode, bool put_object_in_manifest)
 #endif
 
 	/* Create or update the manifest file. */
-	if (conf->direct_mode
-	    && put_object_in_manifest
-	    && included_files
-	    && !conf->read_only) {
+	if (update_manifest) {
 		struct stat st;
 		size_t old_size = 0; /* in bytes */
-		if (stat(manifest_path, &st) == 0) {
+		if (stat(ctx->manifest_path, &st) == 0) {
 			old_size = file_size(&st);
 		}
-		if (manifest_put(manifest_path, cached_obj_hash, included_files)) {
-			cc_log("Added object file hash to %s", manifest_path);
-			update_mtime(manifest_path);
-			stat(manifest_path, &st);
+		if (manifest_put(ctx->manifest_path, ctx->cached_obj_hash, ctx->included_files)) {
+			cc_log("Added object file hash to %s", ctx->manifest_path);
+			update_mtime(ctx->manifest_path);
+			stat(ctx->manifest_path, &st);
 			stats_update_size(STATS_NONE,
 			                  (file_size(&st) - old_size),
 			                  old_size == 0 ? 1 : 0);
 		} else {
-			cc_log("Failed to add object file hash to %s", manifest_path);
+			cc_log("Failed to add object file hash to %s", ctx->manifest_path);
 		}
 	}
 
+	/* Offer the cloud a manifest holding just this object's entry. */
+	if (conf->direct_mode && ctx->included_files && !cloud_offline_mode()) {
+		char *cloud_manifest = format("%s.tmp.cloud.%s", ctx->manifest_path,
+		                              tmp_string());
+		if (manifest_put(cloud_manifest, ctx->cached_obj_hash,
+		                 ctx->included_files)) {
+			cloud_hook_manifest_file(cloud_manifest);
+		}
+		tmp_unlink(cloud_manifest);
+		free(cloud_manifest);
+	}
+
 	/* log the cache hit */
 	switch (mode) {
 	case FROMCACHE_DIRECT_MODE:
@@ -1557,6 +1733,12 @@ from_cache(enum fromcache_call_mode mode, bool put_object_in_manifest)
 		cloud_hook_record_result_type(RT_PREPROCESSOR_CACHE_HIT);
 		break;
 
+	case FROMCACHE_DEDUPLICATED_MODE:
+		cc_log("Succeeded getting result compiled by concurrent process");
+		stats_update(STATS_DEDUPLICATED);
+		cloud_hook_record_result_type(RT_PREPROCESSOR_CACHE_HIT);
+		break;
+
 	case FROMCACHE_COMPILED_MODE:
 		/* Stats already updated in to_cache(). */
 		break;
@@ -1566,6 +1748,135 @@ from_cache(enum fromcache_call_mode mode, bool put_object_in_manifest)
 	cloud_exit("success", 0);
 }
 
+/*
+ * Try to get the object found by the direct mode lookup from the cloud, so
+ * that the preprocessor needn't run. object_hash comes from the local manifest
+ * if it had an entry; otherwise the cloud's manifest for the direct mode hash
+ * is checked against the include files just as a local one would be. If we
+ * can return from the cloud then this function exits with the correct status
+ * code, otherwise it returns.
+ */
+static void
+from_cloud_direct(struct compile_context *ctx, struct file_hash *object_hash)
+{
+	char *cloud_manifest = NULL;
+	char *tmp_obj, *tmp_stderr;
+	struct stat st;
+	int status = 0;
+	size_t added_bytes = 0;
+	unsigned added_files = 0;
+
+	if (ctx->generating_dependencies || object_hash) {
+		/* The cloud keeps no dependency files, and we have our own
+		   manifest entry. */
+		cloud_manifest_cancel();
+	}
+	if (ctx->generating_dependencies) {
+		return;
+	}
+	if (conf->recache
+	    || str_eq(conf->cloud_mode, "offline")
+	    || str_eq(conf->cloud_mode, "local")) {
+		return;
+	}
+
+	if (!object_hash) {
+		if (create_parent_dirs(ctx->manifest_path) != 0) {
+			cloud_manifest_cancel();
+			return;
+		}
+		cloud_manifest = format("%s.tmp.cloud.%s", ctx->manifest_path,
+		                        tmp_string());
+		if (!cloud_manifest_get(cloud_manifest)) {
+			cc_log("No manifest in the cloud cache");
+			free(cloud_manifest);
+			return;
+		}
+		cc_log("Looking for object file hash in the cloud manifest");
+		object_hash = manifest_get(conf, cloud_manifest);
+		if (!object_hash) {
+			cc_log("Did not find object file hash in the cloud manifest");
+			tmp_unlink(cloud_manifest);
+			free(cloud_manifest);
+			return;
+		}
+		cc_log("Got object file hash from the cloud manifest");
+		update_cached_result(ctx, object_hash);
+	}
+
+	if (create_parent_dirs(ctx->cached_obj) != 0) {
+		fatal("Failed to create parent directory for %s: %s",
+		      ctx->cached_obj, strerror(errno));
+	}
+	tmp_obj = format("%s.tmp.%s", ctx->cached_obj, tmp_string());
+	tmp_stderr = format("%s.tmp.stderr.%s", ctx->cached_obj, tmp_string());
+
+	/* Failed compiles are left to the compiler to report. */
+	if (!cloud_cache_get(tmp_obj, tmp_stderr, &status) || status != 0
+	    || stat(tmp_obj, &st) != 0 || st.st_size == 0) {
+		cc_log("The object was not found in the cloud cache");
+		unlink(tmp_obj);
+		unlink(tmp_stderr);
+		goto out;
+	}
+	cc_log("Downloaded the object from the cloud cache");
+
+	if (stat(tmp_stderr, &st) == 0 && st.st_size > 0) {
+		if (move_uncompressed_file(
+			    tmp_stderr, ctx->cached_stderr,
+			    conf->compression ? conf->compression_level : 0) != 0) {
+			cc_log("Failed to move %s to %s: %s", tmp_stderr,
+			       ctx->cached_stderr, strerror(errno));
+			stats_update(STATS_ERROR);
+			failed(ctx);
+		}
+		cc_log("Stored in cache: %s", ctx->cached_stderr);
+		stat(ctx->cached_stderr, &st);
+		added_bytes += file_size(&st);
+		added_files += 1;
+	} else {
+		unlink(tmp_stderr);
+	}
+	if (move_uncompressed_file(
+		    tmp_obj, ctx->cached_obj,
+		    conf->compression ? conf->compression_level : 0) != 0) {
+		cc_log("Failed to move %s to %s: %s", tmp_obj, ctx->cached_obj,
+		       strerror(errno));
+		stats_update(STATS_ERROR);
+		failed(ctx);
+	}
+	cc_log("Stored in cache: %s", ctx->cached_obj);
+	stat(ctx->cached_obj, &st);
+	added_bytes += file_size(&st);
+	added_files += 1;
+
+	/* Remember the cloud's manifest entry, for a direct hit next time. */
+	if (cloud_manifest && !conf->read_only) {
+		size_t old_size = 0;
+		if (stat(ctx->manifest_path, &st) == 0) {
+			old_size = file_size(&st);
+		}
+		if (manifest_merge(ctx->manifest_path, cloud_manifest, object_hash)) {
+			cc_log("Added object file hash to %s", ctx->manifest_path);
+			stat(ctx->manifest_path, &st);
+			added_bytes += file_size(&st) - old_size;
+			added_files += old_size == 0 ? 1 : 0;
+		}
+	}
+
+	stats_update_size(STATS_CACHEHIT_CLOUD, added_bytes, added_files);
+	cloud_hook_record_result_type(RT_CLOUD_CACHE_HIT);
+	from_cache(ctx, FROMCACHE_COMPILED_MODE, false);
+
+out:
+	if (cloud_manifest) {
+		tmp_unlink(cloud_manifest);
+		free(cloud_manifest);
+	}
+	free(tmp_obj);
+	free(tmp_stderr);
+}
+
 /* find the real compiler. We just search the PATH to find a executable of the
    same name that isn't a link to ourselves */
 static void
@@ -1618,9 +1929,9 @@ is_precompiled_header(const char *path)
  * preprocessor and the real compiler. The preprocessor options don't include
  * -E; this is added later. Returns true on success, otherwise false.
  */
-bool
-cc_process_args(struct args *args, struct args **preprocessor_args,
-                struct args **compiler_args)
+static bool
+process_args(struct compile_context *ctx, struct args *args,
+             struct args **preprocessor_args, struct args **compiler_args)
 {
 	int i;
 	bool found_c_opt = false;
@@ -1750,14 +2061,14 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 				result = false;
 				goto out;
 			}
-			if (!input_file) {
+			if (!ctx->input_file) {
 				explicit_language = argv[i+1];
 			}
 			i++;
 			continue;
 		}
 		if (str_startswith(argv[i], "-x")) {
-			if (!input_file) {
+			if (!ctx->input_file) {
 				explicit_language = &argv[i][2];
 			}
 			continue;
@@ -1771,14 +2082,14 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 				result = false;
 				goto out;
 			}
-			output_obj = make_relative_path(x_strdup(argv[i+1]));
+			ctx->output_obj = make_relative_path(ctx, x_strdup(argv[i+1]));
 			i++;
 			continue;
 		}
 
 		/* alternate form of -o, with no space */
 		if (str_startswith(argv[i], "-o")) {
-			output_obj = make_relative_path(x_strdup(&argv[i][2]));
+			ctx->output_obj = make_relative_path(ctx, x_strdup(&argv[i][2]));
 			continue;
 		}
 
@@ -1806,7 +2117,7 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 		   behave differently with gcc -E, when the output
 		   file is not specified. */
 		if (str_eq(argv[i], "-MD") || str_eq(argv[i], "-MMD")) {
-			generating_dependencies = true;
+			ctx->generating_dependencies = true;
 			args_add(dep_args, argv[i]);
 			continue;
 		}
@@ -1814,7 +2125,7 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 			char *arg;
 			bool separate_argument = (strlen(argv[i]) == 3);
 			dependency_filename_specified = true;
-			free(output_dep);
+			free(ctx->output_dep);
 			if (separate_argument) {
 				/* -MF arg */
 				if (i >= argc - 1) {
@@ -1829,13 +2140,13 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 				/* -MFarg */
 				arg = &argv[i][3];
 			}
-			output_dep = make_relative_path(x_strdup(arg));
+			ctx->output_dep = make_relative_path(ctx, x_strdup(arg));
 			/* Keep the format of the args the same */
 			if (separate_argument) {
 				args_add(dep_args, "-MF");
-				args_add(dep_args, output_dep);
+				args_add(dep_args, ctx->output_dep);
 			} else {
-				char *option = format("-MF%s", output_dep);
+				char *option = format("-MF%s", ctx->output_dep);
 				args_add(dep_args, option);
 				free(option);
 			}
@@ -1853,7 +2164,7 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 					goto out;
 				}
 				args_add(dep_args, argv[i]);
-				relpath = make_relative_path(x_strdup(argv[i + 1]));
+				relpath = make_relative_path(ctx, x_strdup(argv[i + 1]));
 				args_add(dep_args, relpath);
 				free(relpath);
 				i++;
@@ -1861,7 +2172,7 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 				char *arg_opt;
 				char *option;
 				arg_opt = x_strndup(argv[i], 3);
-				relpath = make_relative_path(x_strdup(argv[i] + 3));
+				relpath = make_relative_path(ctx, x_strdup(argv[i] + 3));
 				option = format("%s%s", arg_opt, relpath);
 				args_add(dep_args, option);
 				free(arg_opt);
@@ -1871,7 +2182,7 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 			continue;
 		}
 		if (str_startswith(argv[i], "--sysroot=")) {
-			char *relpath = make_relative_path(x_strdup(argv[i] + 10));
+			char *relpath = make_relative_path(ctx, x_strdup(argv[i] + 10));
 			char *option = format("--sysroot=%s", relpath);
 			args_add(stripped_args, option);
 			free(relpath);
@@ -1885,21 +2196,21 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 				 * object file produced when compiling without ccache. */
 				cc_log("Too hard option -Wp,-P detected");
 				stats_update(STATS_UNSUPPORTED);
-				failed();
+				failed(ctx);
 			} else if (str_startswith(argv[i], "-Wp,-MD,")
 			           && !strchr(argv[i] + 8, ',')) {
-				generating_dependencies = true;
+				ctx->generating_dependencies = true;
 				dependency_filename_specified = true;
-				free(output_dep);
-				output_dep = make_relative_path(x_strdup(argv[i] + 8));
+				free(ctx->output_dep);
+				ctx->output_dep = make_relative_path(ctx, x_strdup(argv[i] + 8));
 				args_add(dep_args, argv[i]);
 				continue;
 			} else if (str_startswith(argv[i], "-Wp,-MMD,")
 			           && !strchr(argv[i] + 9, ',')) {
-				generating_dependencies = true;
+				ctx->generating_dependencies = true;
 				dependency_filename_specified = true;
-				free(output_dep);
-				output_dep = make_relative_path(x_strdup(argv[i] + 9));
+				free(ctx->output_dep);
+				ctx->output_dep = make_relative_path(ctx, x_strdup(argv[i] + 9));
 				args_add(dep_args, argv[i]);
 				continue;
 			} else if (conf->direct_mode) {
@@ -1951,11 +2262,11 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 
 			if (str_startswith(argv[i], "-fprofile-generate")
 			    || str_eq(argv[i], "-fprofile-arcs")) {
-				profile_generate = true;
+				ctx->profile_generate = true;
 				supported_profile_option = true;
 			} else if (str_startswith(argv[i], "-fprofile-use")
 			           || str_eq(argv[i], "-fbranch-probabilities")) {
-				profile_use = true;
+				ctx->profile_use = true;
 				supported_profile_option = true;
 			} else if (str_eq(argv[i], "-fprofile-dir")) {
 				supported_profile_option = true;
@@ -1969,13 +2280,13 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 				 * If the profile directory has already been set, give up... Hard to
 				 * know what the user means, and what the compiler will do.
 				 */
-				if (arg_profile_dir && profile_dir) {
+				if (arg_profile_dir && ctx->profile_dir) {
 					cc_log("Profile directory already set; giving up");
 					result = false;
 					goto out;
 				} else if (arg_profile_dir) {
-					cc_log("Setting profile directory to %s", profile_dir);
-					profile_dir = x_strdup(arg_profile_dir);
+					cc_log("Setting profile directory to %s", ctx->profile_dir);
+					ctx->profile_dir = x_strdup(arg_profile_dir);
 				}
 				continue;
 			}
@@ -2000,7 +2311,7 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 			}
 
 			args_add(stripped_args, argv[i]);
-			relpath = make_relative_path(x_strdup(argv[i+1]));
+			relpath = make_relative_path(ctx, x_strdup(argv[i+1]));
 			args_add(stripped_args, relpath);
 
 			/* Try to be smart about detecting precompiled headers */
@@ -2029,14 +2340,14 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 			}
 
 			if (pch_file) {
-				if (included_pch_file) {
+				if (ctx->included_pch_file) {
 					cc_log("Multiple precompiled headers used: %s and %s\n",
-					       included_pch_file, pch_file);
+					       ctx->included_pch_file, pch_file);
 					stats_update(STATS_ARGS);
 					result = false;
 					goto out;
 				}
-				included_pch_file = pch_file;
+				ctx->included_pch_file = pch_file;
 			}
 
 			free(relpath);
@@ -2048,7 +2359,7 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 		if (compopt_short(compopt_takes_path, argv[i])) {
 			char *relpath;
 			char *option;
-			relpath = make_relative_path(x_strdup(argv[i] + 2));
+			relpath = make_relative_path(ctx, x_strdup(argv[i] + 2));
 			option = format("-%c%s", argv[i][1], relpath);
 			args_add(stripped_args, option);
 			free(relpath);
@@ -2086,9 +2397,9 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 			continue;
 		}
 
-		if (input_file) {
+		if (ctx->input_file) {
 			if (language_for_file(argv[i])) {
-				cc_log("Multiple input files: %s and %s", input_file, argv[i]);
+				cc_log("Multiple input files: %s and %s", ctx->input_file, argv[i]);
 				stats_update(STATS_MULTIPLE);
 			} else if (!found_c_opt) {
 				cc_log("Called for link with %s", argv[i]);
@@ -2106,11 +2417,11 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 		}
 
 		/* Rewrite to relative to increase hit rate. */
-		input_file = make_relative_path(x_strdup(argv[i]));
-		cloud_hook_source_file(input_file, NULL);
+		ctx->input_file = make_relative_path(ctx, x_strdup(argv[i]));
+		cloud_hook_source_file(ctx->input_file, NULL);
 	}
 
-	if (!input_file) {
+	if (!ctx->input_file) {
 		cc_log("No input file found");
 		stats_update(STATS_NOINPUT);
 		result = false;
@@ -2118,7 +2429,7 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 	}
 
 	if (found_pch || found_fpch_preprocess) {
-		using_precompiled_header = true;
+		ctx->using_precompiled_header = true;
 		if (!(conf->sloppiness & SLOPPY_TIME_MACROS)) {
 			cc_log("You have to specify \"time_macros\" sloppiness when using"
 			       " precompiled headers to get direct hits");
@@ -2132,7 +2443,7 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 	if (explicit_language && str_eq(explicit_language, "none")) {
 		explicit_language = NULL;
 	}
-	file_language = language_for_file(input_file);
+	file_language = language_for_file(ctx->input_file);
 	if (explicit_language) {
 		if (!language_is_supported(explicit_language)) {
 			cc_log("Unsupported language: %s", explicit_language);
@@ -2145,17 +2456,17 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 		actual_language = file_language;
 	}
 
-	output_is_precompiled_header =
+	ctx->output_is_precompiled_header =
 		actual_language && strstr(actual_language, "-header") != NULL;
 
 	if (!found_c_opt) {
-		if (output_is_precompiled_header) {
+		if (ctx->output_is_precompiled_header) {
 			args_add(stripped_args, "-c");
 		} else {
 			cc_log("No -c option found");
 			/* I find that having a separate statistic for autoconf tests is useful,
 			   as they are the dominant form of "called for link" in many cases */
-			if (strstr(input_file, "conftest.")) {
+			if (strstr(ctx->input_file, "conftest.")) {
 				stats_update(STATS_CONFTEST);
 			} else {
 				stats_update(STATS_LINK);
@@ -2166,15 +2477,15 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 	}
 
 	if (!actual_language) {
-		cc_log("Unsupported source extension: %s", input_file);
+		cc_log("Unsupported source extension: %s", ctx->input_file);
 		stats_update(STATS_SOURCELANG);
 		result = false;
 		goto out;
 	}
 
-	direct_i_file = language_is_preprocessed(actual_language);
+	ctx->direct_i_file = language_is_preprocessed(actual_language);
 
-	if (output_is_precompiled_header) {
+	if (ctx->output_is_precompiled_header) {
 		/* It doesn't work to create the .gch from preprocessed source. */
 		cc_log("Creating precompiled header; not compiling preprocessed code");
 		conf->run_second_cpp = true;
@@ -2187,20 +2498,20 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 	}
 
 	/* don't try to second guess the compilers heuristics for stdout handling */
-	if (output_obj && str_eq(output_obj, "-")) {
+	if (ctx->output_obj && str_eq(ctx->output_obj, "-")) {
 		stats_update(STATS_OUTSTDOUT);
 		cc_log("Output file is -");
 		result = false;
 		goto out;
 	}
 
-	if (!output_obj) {
-		if (output_is_precompiled_header) {
-			output_obj = format("%s.gch", input_file);
+	if (!ctx->output_obj) {
+		if (ctx->output_is_precompiled_header) {
+			ctx->output_obj = format("%s.gch", ctx->input_file);
 		} else {
 			char *p;
-			output_obj = basename(input_file);
-			p = strrchr(output_obj, '.');
+			ctx->output_obj = basename(ctx->input_file);
+			p = strrchr(ctx->output_obj, '.');
 			if (!p || !p[1]) {
 				cc_log("Badly formed object filename");
 				stats_update(STATS_ARGS);
@@ -2212,13 +2523,13 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 		}
 	}
 
-	cloud_hook_object_path(output_obj);
+	cloud_hook_object_path(ctx->output_obj);
 
 	/* cope with -o /dev/null */
-	if (!str_eq(output_obj,"/dev/null")
-	    && stat(output_obj, &st) == 0
+	if (!str_eq(ctx->output_obj,"/dev/null")
+	    && stat(ctx->output_obj, &st) == 0
 	    && !S_ISREG(st.st_mode)) {
-		cc_log("Not a regular file: %s", output_obj);
+		cc_log("Not a regular file: %s", ctx->output_obj);
 		stats_update(STATS_DEVICE);
 		result = false;
 		goto out;
@@ -2246,22 +2557,22 @@ cc_process_args(struct args *args, struct args **preprocessor_args,
 	/*
 	 * Add flags for dependency generation only to the preprocessor command line.
 	 */
-	if (generating_dependencies) {
+	if (ctx->generating_dependencies) {
 		if (!dependency_filename_specified) {
 			char *default_depfile_name;
 			char *base_name;
 
-			base_name = remove_extension(output_obj);
+			base_name = remove_extension(ctx->output_obj);
 			default_depfile_name = format("%s.d", base_name);
 			free(base_name);
 			args_add(dep_args, "-MF");
 			args_add(dep_args, default_depfile_name);
-			output_dep = make_relative_path(x_strdup(default_depfile_name));
+			ctx->output_dep = make_relative_path(ctx, x_strdup(default_depfile_name));
 		}
 
 		if (!dependency_target_specified) {
 			args_add(dep_args, "-MQ");
-			args_add(dep_args, output_obj);
+			args_add(dep_args, ctx->output_obj);
 		}
 	}
 
@@ -2298,6 +2609,17 @@ out:
 	return result;
 }
 
+/* As process_args, on the thread's context for tests. */
+bool
+cc_process_args(struct args *args, struct args **preprocessor_args,
+                struct args **compiler_args)
+{
+	if (!test_context) {
+		test_context = x_calloc(1, sizeof(*test_context));
+	}
+	return process_args(test_context, args, preprocessor_args, compiler_args);
+}
+
 static void
 create_initial_config_file(struct conf *conf, const char *path)
 {
@@ -2354,6 +2676,8 @@ initialize(void)
 
 	conf_free(conf);
 	conf = conf_create();
+	free(temp_dir_path);
+	temp_dir_path = NULL;
 
 	p = getenv("CS_CONFIGPATH");
 	if (p) {
@@ -2409,48 +2733,72 @@ initialize(void)
 
 	exitfn_init();
 	exitfn_add_nullary(stats_flush);
-	exitfn_add_nullary(clean_up_tmp_files);
 
 	cc_log("=== CS %s STARTED =========================================",
 	       CS_VERSION);
 
-	if (conf->umask != UINT_MAX) {
+	/*
+	 * The umask is shared by every thread of the process, so compiles run
+	 * through ccache_compile leave it alone, and get_umask applies the
+	 * setting to the files they copy instead.
+	 */
+	if (conf->umask != UINT_MAX && !compiling_in_process) {
 		umask(conf->umask);
 	}
 
 	current_working_dir = get_cwd();
 }
 
-/* Reset the global state. Used by the test suite. */
-void
-cc_reset(void)
+/* Free a compile_context and everything it owns. */
+static void
+free_context(struct compile_context *ctx)
+{
+	free(ctx->input_file);
+	free(ctx->output_obj);
+	free(ctx->output_dep);
+	free(ctx->cached_obj_hash);
+	free(ctx->cached_obj);
+	free(ctx->cached_stderr);
+	free(ctx->inflight_obj);
+	free(ctx->cached_dep);
+	free(ctx->manifest_path);
+	if (ctx->included_files) {
+		hashtable_destroy(ctx->included_files, 1);
+	}
+	if (!ctx->direct_i_file) {
+		free(ctx->i_tmpfile);
+	}
+	free(ctx->cpp_stderr);
+	free(ctx->profile_dir);
+	free(ctx->included_pch_file);
+	args_free(ctx->preprocessor_args);
+	args_free(ctx->compiler_args);
+	free(ctx);
+}
+
+/* Free the thread's share of the global state. */
+static void
+free_globals(void)
 {
 	conf_free(conf); conf = NULL;
 	free(primary_config_path); primary_config_path = NULL;
 	free(secondary_config_path1); secondary_config_path1 = NULL;
 	free(secondary_config_path2); secondary_config_path2 = NULL;
 	free(current_working_dir); current_working_dir = NULL;
-	free(profile_dir); profile_dir = NULL;
-	free(included_pch_file); included_pch_file = NULL;
 	args_free(orig_args); orig_args = NULL;
-	free(input_file); input_file = NULL;
-	free(output_obj); output_obj = NULL;
-	free(output_dep); output_dep = NULL;
-	free(cached_obj_hash); cached_obj_hash = NULL;
-	free(cached_obj); cached_obj = NULL;
-	free(cached_stderr); cached_stderr = NULL;
-	free(cached_dep); cached_dep = NULL;
-	free(manifest_path); manifest_path = NULL;
-	time_of_compilation = 0;
-	if (included_files) {
-		hashtable_destroy(included_files, 1); included_files = NULL;
-	}
-	generating_dependencies = false;
-	i_tmpfile = NULL;
-	direct_i_file = false;
-	free(cpp_stderr); cpp_stderr = NULL;
 	free(stats_file); stats_file = NULL;
-	output_is_precompiled_header = false;
+	free(temp_dir_path); temp_dir_path = NULL;
+}
+
+/* Reset the global state. Used by the test suite. */
+void
+cc_reset(void)
+{
+	free_globals();
+	if (test_context) {
+		free_context(test_context);
+		test_context = NULL;
+	}
 
 	initialize();
 }
@@ -2458,7 +2806,7 @@ cc_reset(void)
 /* Make a copy of stderr that will not be cached, so things like
    distcc can send networking errors to it. */
 static void
-setup_uncached_err(void)
+setup_uncached_err(struct compile_context *ctx)
 {
 	char *buf;
 	int uncached_fd;
@@ -2466,7 +2814,7 @@ setup_uncached_err(void)
 	uncached_fd = dup(2);
 	if (uncached_fd == -1) {
 		cc_log("dup(2) failed: %s", strerror(errno));
-		failed();
+		failed(ctx);
 	}
 
 	/* leak a pointer to the environment */
@@ -2474,7 +2822,7 @@ setup_uncached_err(void)
 
 	if (putenv(buf) == -1) {
 		cc_log("putenv failed: %s", strerror(errno));
-		failed();
+		failed(ctx);
 	}
 }
 
@@ -2487,27 +2835,23 @@ configuration_logger(const char *descr, const char *origin, void *context)
 
 /* the main ccache driver function */
 static void
-ccache(int argc, char *argv[])
+ccache(struct compile_context *ctx, int argc, char *argv[])
 {
 	bool put_object_in_manifest = false;
 	struct file_hash *object_hash;
-	struct file_hash *object_hash_from_manifest = NULL;
+	struct file_hash object_hash_from_manifest;
+	bool found_in_manifest = false;
 	struct mdfour common_hash;
 	struct mdfour direct_hash;
 	struct mdfour cpp_hash;
 
-	/* Arguments (except -E) to send to the preprocessor. */
-	struct args *preprocessor_args;
-
-	/* Arguments to send to the real compiler. */
-	struct args *compiler_args;
-
 	cloud_hook_start_overall_timer();
 
 	cs_argv0 = argv[0];
 	orig_args = args_init(argc, argv);
 
 	initialize();
+	exitfn_add(clean_up_tmp_files, ctx);
 	cloud_initialize ();
 	find_compiler(argv);
 
@@ -2517,10 +2861,12 @@ ccache(int argc, char *argv[])
 
 	if (conf->disable) {
 		cc_log("cs is disabled");
-		failed();
+		failed(ctx);
 	}
 
-	setup_uncached_err();
+	if (!ctx->in_process) {
+		setup_uncached_err(ctx);
+	}
 
 	cc_log_argv("Command line: ", argv);
 	cc_log("Hostname: %s", get_hostname());
@@ -2532,33 +2878,35 @@ ccache(int argc, char *argv[])
 		conf->direct_mode = false;
 	}
 
-	if (!cc_process_args(orig_args, &preprocessor_args, &compiler_args)) {
-		failed();
+	if (!process_args(ctx, orig_args, &ctx->preprocessor_args,
+	                  &ctx->compiler_args)) {
+		failed(ctx);
 	}
 
-	cc_log("Source file: %s", input_file);
-	if (generating_dependencies) {
-		cc_log("Dependency file: %s", output_dep);
+	cc_log("Source file: %s", ctx->input_file);
+	if (ctx->generating_dependencies) {
+		cc_log("Dependency file: %s", ctx->output_dep);
 	}
-	cc_log("Object file: %s", output_obj);
+	cc_log("Object file: %s", ctx->output_obj);
 
 	hash_start(&common_hash);
-	calculate_common_hash(preprocessor_args, &common_hash);
+	calculate_common_hash(ctx, ctx->preprocessor_args, &common_hash);
 
 	/* try to find the hash using the manifest */
 	direct_hash = common_hash;
 	if (conf->direct_mode) {
 		cloud_hook_starting_direct_mode();
 		cc_log("Trying direct lookup");
-		object_hash = calculate_object_hash(preprocessor_args, &direct_hash, 1);
+		object_hash = calculate_object_hash(ctx, ctx->preprocessor_args,
+		                                    &direct_hash, 1);
 		if (object_hash) {
-			update_cached_result_globals(object_hash);
+			update_cached_result(ctx, object_hash);
 
 			/*
 			 * If we can return from cache at this point then do
 			 * so.
 			 */
-			from_cache(FROMCACHE_DIRECT_MODE, 0);
+			from_cache(ctx, FROMCACHE_DIRECT_MODE, 0);
 
 			/*
 			 * Wasn't able to return from cache at this point.
@@ -2567,11 +2915,15 @@ ccache(int argc, char *argv[])
 			 */
 			put_object_in_manifest = false;
 
-			object_hash_from_manifest = object_hash;
+			object_hash_from_manifest = *object_hash;
+			found_in_manifest = true;
 		} else {
 			/* Add object to manifest later. */
 			put_object_in_manifest = true;
 		}
+		if (conf->direct_mode && !conf->read_only) {
+			from_cloud_direct(ctx, object_hash);
+		}
 	}
 	cloud_hook_starting_preprocessor_mode();
 
@@ -2580,14 +2932,15 @@ ccache(int argc, char *argv[])
 	 * included_files.
 	 */
 	cpp_hash = common_hash;
-	object_hash = calculate_object_hash(preprocessor_args, &cpp_hash, 0);
+	object_hash = calculate_object_hash(ctx, ctx->preprocessor_args,
+	                                    &cpp_hash, 0);
 	if (!object_hash) {
 		fatal("internal error: object hash from cpp returned NULL");
 	}
-	update_cached_result_globals(object_hash);
+	update_cached_result(ctx, object_hash);
 
-	if (object_hash_from_manifest
-	    && !file_hashes_equal(object_hash_from_manifest, object_hash)) {
+	if (found_in_manifest
+	    && !file_hashes_equal(&object_hash_from_manifest, object_hash)) {
 		/*
 		 * The hash from manifest differs from the hash of the
 		 * preprocessor output. This could be because:
@@ -2606,32 +2959,37 @@ ccache(int argc, char *argv[])
 		cc_log("Hash from manifest doesn't match preprocessor output");
 		cc_log("Likely reason: different CS_BASEDIRs used");
 		cc_log("Removing manifest as a safety measure");
-		x_unlink(manifest_path);
+		x_unlink(ctx->manifest_path);
 
 		put_object_in_manifest = true;
 	}
 
 	/* if we can return from cache at this point then do */
-	from_cache(FROMCACHE_CPP_MODE, put_object_in_manifest);
+	from_cache(ctx, FROMCACHE_CPP_MODE, put_object_in_manifest);
 	cloud_hook_ending_preprocessor_mode();
 
 	if (conf->read_only) {
 		cc_log("Read-only mode; running real compiler");
-		failed();
+		failed(ctx);
+	}
+
+	if (wait_for_inflight_compile(ctx)) {
+		from_cache(ctx, FROMCACHE_DEDUPLICATED_MODE, put_object_in_manifest);
 	}
 
-	add_prefix(compiler_args);
+	add_prefix(ctx->compiler_args);
 
 	/* run real compiler, sending output to cache */
-	to_cache(compiler_args);
+	to_cache(ctx, ctx->compiler_args);
+	release_inflight_lock(ctx);
 
 	/* return from cache */
-	from_cache(FROMCACHE_COMPILED_MODE, put_object_in_manifest);
+	from_cache(ctx, FROMCACHE_COMPILED_MODE, put_object_in_manifest);
 
 	/* oh oh! */
 	cc_log("Secondary from_cache failed");
 	stats_update(STATS_ERROR);
-	failed();
+	failed(ctx);
 }
 
 static void
@@ -2651,13 +3009,16 @@ ccache_main_options(int argc, char *argv[])
 	enum longopts {
 		DAEMON,
 		FORCE_DAEMON,
-		DUMP_MANIFEST
+		DAEMON_STATS,
+		DUMP_MANIFEST,
+		SIMULATE_SMART
 	};
 	static const struct option options[] = {
 		{"cleanup",       no_argument,       0, 'c'},
 		{"clear",         no_argument,       0, 'C'},
 		{"daemon",        no_argument,       0, DAEMON},
 		{"force-daemon",  no_argument,       0, FORCE_DAEMON},
+		{"daemon-stats",  no_argument,       0, DAEMON_STATS},
 		{"dump-manifest", required_argument, 0, DUMP_MANIFEST},
 		{"help",          no_argument,       0, 'h'},
 		{"max-files",     required_argument, 0, 'F'},
@@ -2665,6 +3026,7 @@ ccache_main_options(int argc, char *argv[])
 		{"set-config",    required_argument, 0, 'o'},
 		{"print-config",  no_argument,       0, 'p'},
 		{"show-stats",    no_argument,       0, 's'},
+		{"simulate-smart", no_argument,      0, SIMULATE_SMART},
 		{"version",       no_argument,       0, 'V'},
 		{"zero-stats",    no_argument,       0, 'z'},
 		{0, 0, 0, 0}
@@ -2679,10 +3041,30 @@ ccache_main_options(int argc, char *argv[])
 			exit (daemon_main (c == FORCE_DAEMON));
 			break;
 
+		case DAEMON_STATS:
+			initialize();
+			exit(print_daemon_stats());
+
 		case DUMP_MANIFEST:
 			manifest_dump(optarg, stdout);
 			break;
 
+		case SIMULATE_SMART:
+			{
+				char *path;
+				FILE *log;
+				initialize();
+				path = format("%s/costs.log", conf->cache_dir);
+				log = fopen(path, "r");
+				if (!log) {
+					fatal("could not open %s: %s", path, strerror(errno));
+				}
+				costs_simulate(log, stdout);
+				fclose(log);
+				free(path);
+			}
+			break;
+
 		case 'c': /* --cleanup */
 			initialize();
 			cleanup_all(conf);
@@ -2803,6 +3185,51 @@ ccache_main(int argc, char *argv[])
 	}
 	free(program_name);
 
-	ccache(argc, argv);
+	ccache(x_calloc(1, sizeof(struct compile_context)), argc, argv);
 	return 1;
 }
+
+/*
+ * Run one compilation, as "cs ARGV..." would, but return its exit status
+ * instead of exiting. Several may run at once, on different threads of the
+ * same process; each thread then has its own configuration, statistics
+ * updates and log file handle. The compiler's output and any fallback
+ * compile go to our standard output and error, and neither the environment
+ * nor the umask is touched (so CS_* settings are shared by all threads,
+ * UNCACHED_ERR_FD isn't set, and the umask setting only applies to the files
+ * copied into and out of the cache). The "race" and "smart" cloud modes race
+ * the cloud cache against the compiler here too, from the calling thread (see
+ * cloud_race).
+ */
+int
+ccache_compile(int argc, char *argv[])
+{
+	struct compile_context *ctx = x_calloc(1, sizeof(*ctx));
+	jmp_buf return_point;
+	int status;
+
+	ctx->in_process = true;
+	compiling_in_process = true;
+	get_umask();
+	status = setjmp(return_point);
+	if (status == 0) {
+		exitfn_set_return_point(&return_point);
+		ccache(ctx, argc, argv);
+		/* Not reached: ccache always finishes with x_exit. */
+	}
+	exitfn_set_return_point(NULL);
+
+	free_context(ctx);
+	if (conf) {
+		if (cloud_offline_mode()) {
+			delete_stashed_files();
+		}
+		forget_stashed_files();
+	}
+	cloud_state_free();
+	tool_id_reset();
+	free_globals();
+	cc_log_reset();
+	tmp_string_reset();
+	return status - 1;
+}
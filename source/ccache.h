@@ -50,6 +50,10 @@ enum stats {
 	STATS_CANTUSEPCH = 27,
 	STATS_PREPROCESSING = 28,
 	STATS_CACHEHIT_CLOUD = 29,
+	STATS_DEDUPLICATED = 30,
+	STATS_RACE_CLOUD_WON = 31,
+	STATS_RACE_COMPILES = 32,
+	STATS_RACE_WASTED = 33,
 
 	STATS_END
 };
@@ -106,17 +110,24 @@ void cc_vlog(const char *format, va_list ap);
 void cc_log(const char *format, ...) ATTR_FORMAT(printf, 1, 2);
 void cc_bulklog(const char *format, ...) ATTR_FORMAT(printf, 1, 2);
 void cc_log_argv(const char *prefix, char **argv);
+void cc_log_reset(void);
 void fatal(const char *format, ...) ATTR_FORMAT(printf, 1, 2);
 void copy_fd(int fd_in, int fd_out);
 int copy_file(const char *src, const char *dest, int compress_level);
+int copy_fd_to_file(int fd_in, const char *src, const char *dest,
+                    int compress_level);
 int move_file(const char *src, const char *dest, int compress_level);
 int move_uncompressed_file(const char *src, const char *dest,
                            int compress_level);
 bool file_is_compressed(const char *filename);
 int create_dir(const char *dir);
 int create_parent_dirs(const char *path);
+#ifndef _WIN32
+mode_t get_umask(void);
+#endif
 const char *get_hostname(void);
 const char *tmp_string(void);
+void tmp_string_reset(void);
 char *format_hash_as_string(const unsigned char *hash, int size);
 int create_cachedirtag(const char *dir);
 char *format(const char *format, ...) ATTR_FORMAT(printf, 1, 2);
@@ -171,6 +182,7 @@ bool read_file_and_stash(const char *path, size_t size_hint, char **data,
                          size_t *size);
 bool hash_stashed_file(struct mdfour *md, const char *fname);
 void delete_stashed_files (void);
+void forget_stashed_files (void);
 
 /* ------------------------------------------------------------------------- */
 /* stats.c */
@@ -200,6 +212,8 @@ void exitfn_add_nullary(void (*function)(void));
 void exitfn_add(void (*function)(void *), void *context);
 void exitfn_reset(void);
 void exitfn_call(void);
+void exitfn_set_return_point(jmp_buf *point);
+void x_exit(int status) __attribute__((noreturn));
 
 /* ------------------------------------------------------------------------- */
 /* cleanup.c */
@@ -216,6 +230,9 @@ int execute_fd(char **argv, const char *path_stdout, int fd_stdout,
 int execute(char **argv,
             const char *path_stdout,
             const char *path_stderr);
+pid_t execute_async(char **argv, const char *path_stdout,
+                    const char *path_stderr, char **env_vars);
+bool execute_poll(pid_t pid, bool block, int *status);
 char *find_executable(const char *name, const char *exclude_name);
 void print_command(FILE *fp, char **argv);
 
@@ -223,17 +240,26 @@ void print_command(FILE *fp, char **argv);
 /* lockfile.c */
 
 bool lockfile_acquire(const char *path, unsigned staleness_limit);
+bool lockfile_wait(const char *path, unsigned timeout);
 void lockfile_release(const char *path);
 
 /* ------------------------------------------------------------------------- */
 /* ccache.c */
 
-extern struct args *orig_args;
-extern char *cs_argv0;
+extern THREAD_LOCAL struct conf *conf;
+extern THREAD_LOCAL char *primary_config_path;
+extern THREAD_LOCAL char *secondary_config_path1, *secondary_config_path2;
+extern THREAD_LOCAL char *current_working_dir;
+extern THREAD_LOCAL struct args *orig_args;
+extern THREAD_LOCAL char *cs_argv0;
+extern THREAD_LOCAL char *stats_file;
+extern unsigned lock_staleness_limit;
 
 bool cc_process_args(struct args *args, struct args **preprocessor_args,
                     struct args **compiler_args);
 void cc_reset(void);
+int ccache_main(int argc, char *argv[]);
+int ccache_compile(int argc, char *argv[]);
 bool is_precompiled_header(const char *path);
 char *get_path_in_cache(const char *name, const char *suffix);
 const char *temp_dir();
@@ -243,6 +269,7 @@ const char *temp_dir();
 
 void tool_id_calculate (const char *path, struct stat *st, bool rehash);
 const char *tool_id_get (void);
+void tool_id_reset (void);
 
 /* ------------------------------------------------------------------------- */
 
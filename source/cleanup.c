@@ -26,18 +26,18 @@
  */
 #define LIMIT_MULTIPLE 0.8
 
-static struct files {
+static THREAD_LOCAL struct files {
 	char *fname;
 	time_t mtime;
 	uint64_t size;
 } **files;
-static unsigned allocated; /* Size of the files array. */
-static unsigned num_files; /* Number of used entries in the files array. */
+static THREAD_LOCAL unsigned allocated; /* Size of the files array. */
+static THREAD_LOCAL unsigned num_files; /* Number of used entries in the files array. */
 
-static uint64_t cache_size;
-static size_t files_in_cache;
-static uint64_t cache_size_threshold;
-static size_t files_in_cache_threshold;
+static THREAD_LOCAL uint64_t cache_size;
+static THREAD_LOCAL size_t files_in_cache;
+static THREAD_LOCAL uint64_t cache_size_threshold;
+static THREAD_LOCAL size_t files_in_cache_threshold;
 
 /* File comparison function that orders files in mtime order, oldest first. */
 static int
@@ -0,0 +1,242 @@
+/* Copyright (c) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* cs-client: run a compile through a running cs daemon.
+
+   Usage: cs-client compiler [compiler options]
+
+   This is used just like cs, but it is small, and links nothing but the C
+   library: it sends its arguments, working directory, environment and
+   standard descriptors to the daemon for the cache (see "The compile
+   server" in daemon.c), which runs cs on its behalf, and then it exits
+   with cs's status.  That saves starting cs afresh for every compile.
+
+   If there is no daemon to talk to, it runs cs itself instead: the one
+   named by CS_BINARY, or else "cs" from the PATH.  It finds the daemon
+   through CS_CACHE_DIR, or CS_DIR, or ~/.cscache, so a cache directory
+   that is only set in a configuration file isn't seen.  */
+
+#include "config.h"
+
+#include <errno.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+/* This must match daemon.c.  */
+#define LOCAL_PROTOCOL_REVISION 2
+
+extern char **environ;
+
+static const char *
+cache_dir (void)
+{
+  static char buffer[4096];
+  const char *dir = getenv ("CS_CACHE_DIR"), *home;
+
+  if (!dir || !*dir)
+    dir = getenv ("CS_DIR");
+  if (dir && *dir)
+    return dir;
+
+  home = getenv ("HOME");
+  if (!home || !*home)
+    {
+      struct passwd *pw = getpwuid (getuid ());
+      if (!pw)
+	return NULL;
+      home = pw->pw_dir;
+    }
+  if (snprintf (buffer, sizeof (buffer), "%s/.cscache", home)
+      >= (int)sizeof (buffer))
+    return NULL;
+  return buffer;
+}
+
+/* Connect to the daemon, or return -1.  We go to the cache directory to
+   do so, because its full path may not fit in a socket address.  */
+static int
+connect_to_server (const char *cwd)
+{
+  struct sockaddr_un addr = {AF_UNIX, ""};
+  struct utsname uname_info;
+  const char *dir = cache_dir ();
+  int fd, ok;
+
+  if (!dir || uname (&uname_info) == -1
+      || snprintf (addr.sun_path, sizeof (addr.sun_path), "daemon.%d.%s.%d",
+                   (int)geteuid (), uname_info.nodename,
+                   LOCAL_PROTOCOL_REVISION) >= (int)sizeof (addr.sun_path))
+    return -1;
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+  ok = (chdir (dir) == 0
+        && connect (fd, (struct sockaddr *)&addr, sizeof (addr)) == 0);
+  if (chdir (cwd) == -1)
+    ok = 0;
+  if (!ok)
+    {
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+static int
+send_all (int fd, const char *data, size_t length)
+{
+  while (length)
+    {
+      ssize_t n = send (fd, data, length, MSG_NOSIGNAL);
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return 0;
+	}
+      data += n;
+      length -= n;
+    }
+  return 1;
+}
+
+static int
+recv_all (int fd, char *data, size_t length)
+{
+  while (length)
+    {
+      ssize_t n = recv (fd, data, length, 0);
+      if (n == -1 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return 0;
+      data += n;
+      length -= n;
+    }
+  return 1;
+}
+
+/* Append the nul-terminated STR to the request in BUF.  */
+static int
+append (char **buf, size_t *size, size_t *allocated, const char *str)
+{
+  size_t len = strlen (str) + 1;
+  if (*size + len > *allocated)
+    {
+      char *p;
+      *allocated = (*size + len) * 2;
+      p = realloc (*buf, *allocated);
+      if (!p)
+	return 0;
+      *buf = p;
+    }
+  memcpy (*buf + *size, str, len);
+  *size += len;
+  return 1;
+}
+
+/* Send the 'X' request.  Returns false if it didn't get through, in which
+   case the compile hasn't started.  */
+static int
+send_request (int fd, const char *cwd, char **argv)
+{
+  char *buf = NULL, header[5];
+  size_t size = 0, allocated = 0;
+  int ok = append (&buf, &size, &allocated, cwd), i;
+
+  for (i = 0; ok && argv[i]; i++)
+    ok = append (&buf, &size, &allocated, argv[i]);
+  ok = ok && append (&buf, &size, &allocated, "");
+  for (i = 0; ok && environ[i]; i++)
+    ok = append (&buf, &size, &allocated, environ[i]);
+
+  header[0] = 'X';
+  header[1] = size & 0xFF;
+  header[2] = (size & 0xFF00) >> 8;
+  header[3] = (size & 0xFF0000) >> 16;
+  header[4] = (size & 0xFF000000) >> 24;
+  ok = ok && send_all (fd, header, 5) && send_all (fd, buf, size);
+  free (buf);
+  if (!ok)
+    return 0;
+
+  /* Our standard descriptors travel with one more byte.  */
+  int fds[3] = {0, 1, 2};
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE (sizeof (fds))];
+  } control;
+  struct iovec iov = {"X", 1};
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.space;
+  msg.msg_controllen = sizeof (control.space);
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (fds));
+  memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+  ssize_t sent;
+  do
+    sent = sendmsg (fd, &msg, MSG_NOSIGNAL);
+  while (sent == -1 && errno == EINTR);
+  return sent == 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  char cwd[4096], reply[5];
+  const char *cs = getenv ("CS_BINARY");
+  int fd;
+
+  if (argc < 2 || argv[1][0] == '-')
+    {
+      fprintf (stderr, "Usage: cs-client compiler [compiler options]\n");
+      return 1;
+    }
+  if (!cs || !*cs)
+    cs = "cs";
+
+  /* The daemon runs "cs compiler ...", whatever it was started as.  */
+  argv[0] = "cs";
+  fd = getcwd (cwd, sizeof (cwd)) ? connect_to_server (cwd) : -1;
+  /* A daemon that exits, or turns us down, stops any compile it was
+     running for us, so we can always start again with cs.  */
+  if (fd != -1 && send_request (fd, cwd, argv)
+      && recv_all (fd, reply, 5) && reply[0] == 'X')
+    return ((reply[1] & 0xFF) | ((reply[2] & 0xFF) << 8)
+            | ((reply[3] & 0xFF) << 16) | ((reply[4] & 0xFF) << 24));
+  if (fd != -1)
+    close (fd);
+
+  argv[0] = (char *)cs;
+  execvp (cs, argv);
+  fprintf (stderr, "cs-client: cannot run %s: %s\n", cs, strerror (errno));
+  return 1;
+}
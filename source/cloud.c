@@ -24,12 +24,17 @@
 #include "daemon.h"
 #include "hashutil.h"
 #include "hashtable_itr.h"
+#include "hostinfo.h"
+#include "jsonstream.h"
+#include "spool.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/utsname.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/syscall.h>
 #include <json.h>
 #include <sys/time.h>
 
@@ -38,26 +43,29 @@
 #define DISABLE_FORK 0
 #endif
 
-extern struct conf *conf;
-
 /* Timing state.  */
 static void do_timer ();
-static enum timer_mode {
+static THREAD_LOCAL enum timer_mode {
   TIMER_NONE,
   TIMER_DIRECT_MODE,
   TIMER_PREPROCESSOR_MODE,
   TIMER_CLOUD_CACHE_GET,
   TIMER_COMPILER
 } timer_state = TIMER_NONE;
-static struct timeval timer_start;
-static struct timeval overall_start_time;
+static THREAD_LOCAL struct timeval timer_start;
+static THREAD_LOCAL struct timeval overall_start_time;
 
 /* Run-time constants.  */
-static char *user_key_header;
-static char *client_id_header = "none";
+static const char no_client_id_header[] = "none";
+static THREAD_LOCAL char *user_key_header;
+static THREAD_LOCAL char *client_id_header = (char *) no_client_id_header;
 
 /* Other static state. */
-static bool forked_already = false;
+static THREAD_LOCAL bool forked_already = false;
+static THREAD_LOCAL daemon_handle manifest_dh = -1;
+static THREAD_LOCAL daemon_handle get_dh = -1;
+static THREAD_LOCAL struct timeval manifest_deadline;
+static THREAD_LOCAL struct timeval get_deadline;
 
 struct cloud_file_list
 {
@@ -65,10 +73,8 @@ struct cloud_file_list
   struct file_hash hash;
 };
 
-/* Recorded program state, for transmission.
-   This data gets placed in a shared memory region (by cloud_initialize)
-   to allow data to be passed back into the parent process.  */
-static struct state {
+/* Recorded program state, for transmission.  */
+static THREAD_LOCAL struct state {
   const char *exit_reason;
   int exit_status;
   enum result_type result_type;
@@ -83,18 +89,17 @@ static struct state {
   struct timeval compile_duration;
   char *object_file_to_push;
   char *object_path;
+  char *object_hash;
   char *stderr_file_to_push;
+  char *manifest_file_to_push;
   char *cpp_hash;
+  char *manifest_key;
   struct cloud_file_list *source_files;
   struct cloud_file_list *include_files;
   int source_count;
   int include_count;
   const char *direct_mode_autodisabled;
-
-  /* Any strings allocated by a child process must be allocated in the shared
-     memory space. We'll keep a fixed amount handy here.  */
-  char *free;
-  char shared_heap[3000];
+  unsigned int expected_compile_time;
 } *state;
 
 static struct state initial_state = {
@@ -112,13 +117,17 @@ static struct state initial_state = {
   compile_duration: 	{0, 0},
   object_file_to_push: 	NULL,
   object_path:		NULL,
+  object_hash:		NULL,
   stderr_file_to_push: 	NULL,
+  manifest_file_to_push: NULL,
   cpp_hash: 		NULL,
+  manifest_key:		NULL,
   source_files:		NULL,
   include_files:	NULL,
   source_count:		0,
   include_count:	0,
-  NULL
+  direct_mode_autodisabled: NULL,
+  expected_compile_time: 0
 };
 
 static const char const *result_type_name_table[] = {
@@ -135,22 +144,6 @@ cloud_offline_mode (void)
   return strcmp (conf->cloud_mode, "offline") == 0;
 }
 
-/*static char *
-allocate_shared_mem (size_t len)
-{
-  char *result;
-
-  if (state->free + len >= (char *)state + sizeof(struct state))
-    {
-      errno = ENOMEM;
-      return NULL;
-    }
-
-  result = state->free;
-  state->free += len;
-  return result;
-}*/
-
 daemon_handle
 init_daemon_connection ()
 {
@@ -159,7 +152,8 @@ init_daemon_connection ()
   if (dh == -1)
     {
       cc_log("daemon connection failed; reverting to offline mode.");
-      conf->cloud_mode = "offline";
+      free (conf->cloud_mode);
+      conf->cloud_mode = x_strdup ("offline");
       return -1;
     }
 
@@ -187,560 +181,746 @@ compare_cfl (const void *a, const void *b)
   return strcmp (cfl_a[0]->path, cfl_b[0]->path);
 }
 
-/* Acquire and/or post statistical information to the server.
-   This runs in the background to prevent build delays.  */
+/* Return the hash of the content of the stashed file SF, in the form the
+   server files content by.  */
+static char *
+stashed_file_hash (struct stashed_file *sf)
+{
+  struct mdfour hash;
+
+  hash_start (&hash);
+  hash_buffer (&hash, sf->data, sf->size);
+  return hash_result (&hash);
+}
+
+/* Write the hash of each source file to W, as an object mapping each file
+   to its hash.  */
 static void
-post_results_to_cloud(void)
+write_source_list (struct json_writer *w)
 {
-  if (cloud_offline_mode())
+  int i;
+
+  jw_begin_object (w);
+  for (i = 0; i < state->source_count + state->include_count; i++)
     {
-      /* TODO: cache results for posting later?  */
-      delete_stashed_files ();
-      return;
+      struct cloud_file_list *cfl = i < state->source_count
+	? &state->source_files[i]
+	: &state->include_files[i - state->source_count];
+      char *sourcehash_str = format_hash_as_string(cfl->hash.hash,
+                                                   cfl->hash.size);
+      jw_key_string (w, cfl->path, sourcehash_str);
+      free (sourcehash_str);
     }
+  jw_end_object (w);
+}
 
-  /* Ensure that we actually have some results to post.  */
-  /* TODO post other data to the cloud???  */
-  if (!state->cpp_hash || state->exit_status == 9999999)
+/* Write the time TV to W as member KEY, a [seconds, microseconds] pair.  */
+static void
+write_duration (struct json_writer *w, const char *key,
+                const struct timeval *tv)
+{
+  jw_key (w, key);
+  jw_begin_array (w);
+  jw_int (w, tv->tv_sec);
+  jw_int (w, tv->tv_usec);
+  jw_end_array (w);
+}
+
+/* Describe the compile for the server, as the "data" of an upload, with
+   the hash of every source file if WITH_SOURCES.  The caller frees the
+   JSON text returned.  */
+static char *
+describe_results (bool with_sources)
+{
+  struct host_info host;
+  struct stashed_file *sf;
+  char *stderr_data, *host_path, *cwd;
+  struct json_writer w;
+  int i;
+
+  /* Collect the host data, which stays the same until a reboot.  */
+  host_path = format("%s/host", conf->cache_dir);
+  host_info_get (host_path, &host);
+  free (host_path);
+
+  /* First add the compile info.
+     I.e. everything needed to reproduce the build.  */
+  jw_init (&w);
+  jw_begin_object (&w);
+  jw_key_string (&w, "cpp_hash", state->cpp_hash);
+  jw_key_string (&w, "toolchain_id", tool_id_get());
+
+  /* Offer the manifest for the direct mode hash, if we have one.  The
+     server will ask for it by this key if it wants it.  */
+  if (state->manifest_file_to_push)
+    jw_key_string (&w, "manifest", state->manifest_key);
+
+  if (state->stderr_file_to_push
+      && (stderr_data = read_text_file(state->stderr_file_to_push, 0)))
     {
-      delete_stashed_files ();
-      return;
+      jw_key_string (&w, "stderr", stderr_data);
+      free (stderr_data);
+    }
+  else
+    jw_key_string (&w, "stderr", "");
+
+  jw_key_int (&w, "exit_status", state->exit_status);
+  jw_key_string (&w, "exit_reason", state->exit_reason);
+
+  /* The command line args are passed as an array.  */
+  jw_key (&w, "args");
+  jw_begin_array (&w);
+  for (i=0; orig_args->argv[i]; i++)
+    jw_string (&w, orig_args->argv[i]);
+  jw_end_array (&w);
+
+  cwd = get_cwd();
+  jw_key_string (&w, "cwd", cwd);
+  free (cwd);
+  jw_key_string (&w, "object_path", state->object_path);
+
+  /* Name the object by its content too.  The server may have it already,
+     from another compile, and then needn't be sent it again.  */
+  if (state->object_file_to_push
+      && (sf = find_stashed_file(state->object_path)))
+    {
+      free (state->object_hash);
+      state->object_hash = stashed_file_hash (sf);
+      jw_key_string (&w, "object_hash", state->object_hash);
     }
 
-  /* Stop all the timers.  */
-  do_timer (TIMER_NONE);
-  if (!forked_already)
-    cloud_hook_stop_overall_timer ();
+  /* Initially, we only pass the source_sig. This is a bandwidth saving
+     measure. The server will reject the data if it doesn't recognise the
+     signature, but this ought to be the rarer case.
+     The source files have to be sorted before we generate the signature,
+     or else there'll be more source sets than optimal.  */
+  struct cloud_file_list *sorted_cfl[state->source_count
+				     + state->include_count];
+  for (i = 0; i < state->source_count; i++)
+    {
+      struct cloud_file_list *cfl = &state->source_files[i];
+      if (cfl->hash.hash[0] == '\0' && cfl->hash.size == 0)
+	{
+	  struct mdfour hash;
+	  hash_start (&hash);
+	  hash_stashed_file (&hash, cfl->path);
+	  hash_result_as_bytes(&hash, cfl->hash.hash);
+	  cfl->hash.size = hash.totalN;
+	}
+      sorted_cfl[i] = cfl;
+    }
+  for (i = 0; i < state->include_count; i++)
+    {
+      struct cloud_file_list *cfl = &state->include_files[i];
+      if (cfl->hash.hash[0] == '\0' && cfl->hash.size == 0)
+	{
+	  struct mdfour hash;
+	  hash_start (&hash);
+	  hash_stashed_file (&hash, cfl->path);
+	  hash_result_as_bytes(&hash, cfl->hash.hash);
+	  cfl->hash.size = hash.totalN;
+	}
+      sorted_cfl[i + state->source_count] = cfl;
+    }
+  qsort (sorted_cfl, state->source_count + state->include_count,
+	 sizeof (sorted_cfl[0]), compare_cfl);
+  struct mdfour source_sig;
+  hash_start (&source_sig);
+  for (i = 0; i < state->source_count + state->include_count; i++)
+    {
+      char *sourcehash_str = format_hash_as_string(sorted_cfl[i]->hash.hash,
+						   sorted_cfl[i]->hash.size);
+      hash_delimiter (&source_sig, "-----");
+      hash_string (&source_sig, sorted_cfl[i]->path);
+      hash_delimiter (&source_sig, "=====");
+      hash_string (&source_sig, sourcehash_str);
+      free (sourcehash_str);
+    }
+  char *source_sig_str = hash_result (&source_sig);
+  jw_key_string (&w, "source_sig", source_sig_str);
+  free (source_sig_str);
+
+  /* Add timing data.  */
+  write_duration (&w, "overall_duration", &state->overall_duration);
+  if (state->direct_mode_tried)
+    write_duration (&w, "direct_mode_cache_duration",
+                    &state->direct_mode_duration);
+  if (state->preprocessor_mode_tried)
+    write_duration (&w, "preprocessor_mode_cache_duration",
+                    &state->preprocessor_mode_duration);
+  if (state->get_tried)
+    write_duration (&w, "get_duration", &state->get_duration);
+  if (state->compile_tried)
+    write_duration (&w, "compile_duration", &state->compile_duration);
+
+  /* Add the result type.  */
+  jw_key_string (&w, "type", result_type_name_table[state->result_type]);
+
+  /* Now add the client info.
+     This will go in the user's history and for data mining.  */
+  jw_key_string (&w, "uname_sysname", host.sysname);
+  jw_key_string (&w, "uname_release", host.release);
+  jw_key_string (&w, "uname_version", host.version);
+  jw_key_string (&w, "uname_machine", host.machine);
+  jw_key_string (&w, "cpu_model", host.cpu_model);
+  jw_key_int (&w, "cpu_core_count", host.cpu_core_count);
+  jw_key_int (&w, "cpu_thread_count", host.cpu_thread_count);
+  jw_key_string (&w, "mem", host.mem);
+  host_info_free (&host);
+
+  /* Add any interesting config settings.  */
+  jw_key (&w, "client_config");
+  jw_begin_object (&w);
+  jw_key_string (&w, "base_dir", conf->base_dir);
+  jw_key_string (&w, "compiler_check", conf->compiler_check);
+  jw_key_bool (&w, "compression", conf->compression);
+  jw_key_int (&w, "compression_level", conf->compression_level);
+  jw_key_bool (&w, "direct_mode", conf->direct_mode);
+  if (state->direct_mode_autodisabled)
+    jw_key_string (&w, "direct_mode_disabled_reason",
+                   state->direct_mode_autodisabled);
+  jw_key_string (&w, "extra_files_to_hash", conf->extra_files_to_hash);
+  jw_key_bool (&w, "hard_link", conf->hard_link);
+  jw_key_bool (&w, "hash_dir", conf->hash_dir);
+  jw_key_bool (&w, "read_only", conf->read_only);
+  jw_key_bool (&w, "recache", conf->recache);
+  jw_key_bool (&w, "run_second_cpp", conf->run_second_cpp);
+  jw_key_int (&w, "sloppiness", conf->sloppiness);
+  jw_key_bool (&w, "unify", conf->unify);
+  jw_key_string (&w, "cloud_mode", conf->cloud_mode);
+  jw_key_string (&w, "cs_version", CS_VERSION);
+  jw_end_object (&w);
+
+  /* Map each source file to its hash, for a server that doesn't
+     recognise the source signature.  */
+  if (with_sources)
+    {
+      jw_key (&w, "sources");
+      write_source_list (&w);
+    }
 
-  if (DISABLE_FORK || forked_already || fork() == 0)
+  jw_end_object (&w);
+  return jw_finish (&w);
+}
+
+/* Add the stashed file SF to W, in the array of files offered to the
+   daemon, to be sent as form field FIELD under the name NAME, or by its
+   content HASH if that isn't NULL.  */
+static void
+offer_file (struct json_writer *w, const char *field, const char *name,
+            const char *hash, struct stashed_file *sf)
+{
+  if (!sf)
+    return;
+  jw_begin_object (w);
+  jw_key_string (w, "field", field);
+  jw_key_string (w, "name", name);
+  if (hash)
+    jw_key_string (w, "hash", hash);
+  jw_key_string (w, "shm", sf->shm_name);
+  jw_key_int (w, "size", sizeof (*sf) + sf->size);
+  jw_end_object (w);
+}
+
+/* Describe the upload of the results described by DATA, with the stashed
+   files the server may ask for, as the daemon takes it.  The caller frees
+   the JSON text returned.  */
+static char *
+upload_job (const char *data)
+{
+  struct json_writer w;
+  int i;
+
+  jw_init (&w);
+  jw_begin_object (&w);
+  jw_key (&w, "data");
+  jw_raw (&w, data);
+  jw_key (&w, "sources");
+  write_source_list (&w);
+
+  jw_key (&w, "files");
+  jw_begin_array (&w);
+  if (state->manifest_file_to_push)
+    offer_file (&w, "manifest", state->manifest_key, NULL,
+                find_stashed_file(state->manifest_file_to_push));
+  if (state->object_file_to_push)
+    offer_file (&w, "object", state->object_path, state->object_hash,
+                find_stashed_file(state->object_path));
+  for (i = 0; i < state->source_count + state->include_count; i++)
     {
-      /* Post the results in the background.  */
-      daemon_handle dh;
-      struct utsname host_info;
-      char *url;
-      const char *post_data;
-      char *stderr_data;
-      json_object *jobj = json_object_new_object();
-      json_object *jarray, *jsubobj;
-      int i;
-      FILE *fd;
-      char *model_name = NULL;
-      int cpu_core_count = 0, cpu_thread_count = 0;
-      char *memsize = NULL;
+      struct cloud_file_list *cfl = i < state->source_count
+	? &state->source_files[i]
+	: &state->include_files[i - state->source_count];
+      char *hash = format_hash_as_string(cfl->hash.hash, cfl->hash.size);
+      offer_file (&w, "source", cfl->path, hash,
+                  find_stashed_file(cfl->path));
+      free (hash);
+    }
+  jw_end_array (&w);
+  jw_end_object (&w);
+  return jw_finish (&w);
+}
 
-      if (!DISABLE_FORK)
-	exitfn_reset();
+/* Hand the results described by DATA to the daemon, to upload with any of
+   the stashed files the server asks for.  Returns true if the daemon took
+   them, and with them the stashed files.  */
+static bool
+enqueue_results (const char *data)
+{
+  daemon_handle dh;
+  char *url, *job;
+  bool taken;
+
+  dh = init_daemon_connection ();
+  if (dh == -1)
+    return false;
+
+  url = format("https://%s/v1.0/cache/", conf->cloud_server);
+  set_daemon_url(dh, url);
+  free(url);
+
+  job = upload_job (data);
+  taken = enqueue_daemon_upload (dh, job);
+  free(job);
+  close_daemon(dh);
+
+  if (taken)
+    cc_log("Handed the results to the daemon to upload");
+  return taken;
+}
+
+/* Keep the results described by DATA, and copies of the stashed files, in
+   the result spool for the daemon to upload later.  */
+static void
+spool_results (const char *data)
+{
+  char *job = upload_job (data);
+  json_object *entry = json_tokener_parse (job), *headers;
+  char *url = format("https://%s/v1.0/cache/", conf->cloud_server);
+  char *dir = spool_directory ();
+
+  free(job);
+  headers = json_object_new_array();
+  json_object_array_add(headers, json_object_new_string(user_key_header));
+  json_object_array_add(headers, json_object_new_string(client_id_header));
+  json_object_object_add(entry, "url", json_object_new_string(url));
+  json_object_object_add(entry, "headers", headers);
+  if (spool_add (dir, entry))
+    cc_log("Spooled the results for the daemon to upload later");
+  json_object_put(entry);
+  free(dir);
+  free(url);
+}
+
+/* Return the path of the file to post as content HASH, or NULL if there is
+   none.  */
+static const char *
+content_path (const char *hash)
+{
+  const char *path = NULL;
+  int i;
+
+  if (state->object_hash && strcmp (state->object_hash, hash) == 0)
+    return state->object_path;
+  for (i = 0; !path && i < state->source_count + state->include_count; i++)
+    {
+      struct cloud_file_list *cfl = i < state->source_count
+	? &state->source_files[i]
+	: &state->include_files[i - state->source_count];
+      char *source_hash = format_hash_as_string(cfl->hash.hash,
+						cfl->hash.size);
+      if (strcmp (source_hash, hash) == 0)
+	path = cfl->path;
+      free (source_hash);
+    }
+  return path;
+}
+
+/* The reply of the server to posted results: its "result", and its
+   "data", which is either a message, or an array of names.  */
+struct post_reply
+{
+  char *result;
+  char *message;
+  char **names;
+  int count;
+  bool has_names;
+};
+
+static void
+free_post_reply (struct post_reply *reply)
+{
+  int i;
+
+  free (reply->result);
+  free (reply->message);
+  for (i = 0; i < reply->count; i++)
+    free (reply->names[i]);
+  free (reply->names);
+  memset (reply, 0, sizeof (*reply));
+}
 
-      if (strcmp (conf->cloud_mode, "race") == 0)
+/* Read the reply in the SIZE bytes at TEXT into REPLY, which the caller
+   frees either way.  Returns false if it isn't a JSON object.  */
+static bool
+parse_post_reply (const char *text, size_t size, struct post_reply *reply)
+{
+  struct json_reader r;
+  enum json_token token = JT_ERROR;
+  bool ok = false;
+
+  jr_init (&r, text, size);
+  if (jr_next (&r) == JT_BEGIN_OBJECT)
+    {
+      while ((token = jr_next (&r)) == JT_KEY)
 	{
-	  /* We ran the compiler in a race with the cloud cache. */
-	  if (!DISABLE_FORK && state->result_type == RT_LOCAL_COMPILE)
+	  bool result = str_eq (r.string, "result");
+	  bool data = str_eq (r.string, "data");
+
+	  token = jr_next (&r);
+	  if (result && token == JT_STRING)
 	    {
-	      /* The compiler won the race (or there was a cloud cache miss).
-	         Wait a few seconds for the GET request to complete so
-		 we can post both timings. */
-	      int retry;
-	      for (retry = 0; retry < 10 && !state->get_tried; retry++)
-		sleep(1);
+	      free (reply->result);
+	      reply->result = x_strdup (r.string);
 	    }
-	  else if (state->result_type == RT_CLOUD_CACHE_HIT)
-	    /* The cloud cache won the race. The compiler will already have
-	       been killed off, but it's possible it registered a time.
-	       We should ignore this as it may not be trust-worthy.  */
-	    state->compile_tried = false;
+	  else if (data && token == JT_STRING)
+	    {
+	      free (reply->message);
+	      reply->message = x_strdup (r.string);
+	    }
+	  else if (data && token == JT_BEGIN_ARRAY)
+	    {
+	      /* Anything but a string in the array is passed over.  */
+	      reply->has_names = true;
+	      while ((token = jr_next (&r)) != JT_END_ARRAY)
+		if (token == JT_STRING)
+		  {
+		    reply->names = x_realloc (reply->names,
+		                              (reply->count + 1)
+		                              * sizeof (*reply->names));
+		    reply->names[reply->count++] = x_strdup (r.string);
+		  }
+		else if (!jr_skip (&r, token))
+		  break;
+	      if (token != JT_END_ARRAY)
+		break;
+	    }
+	  else if (!jr_skip (&r, token))
+	    break;
 	}
+      ok = token == JT_END_OBJECT && jr_next (&r) == JT_END;
+    }
+  jr_free (&r);
+  return ok;
+}
 
-      /* Collect kernel data.  */
-      if (uname(&host_info) != 0)
-	{
-	  strcpy(host_info.sysname, "unknown");
-	  strcpy(host_info.nodename, "unknown");
-	  strcpy(host_info.release, "unknown");
-	  strcpy(host_info.version, "unknown");
-	  strcpy(host_info.machine, "unknown");
-	}
+/* Post the results described by DATA to the server ourselves, and any of
+   the stashed files it asks for.  */
+static void
+upload_results (const char *data)
+{
+  daemon_handle dh;
+  char *url, *resend = NULL;
+  const char *post_data = data;
+  struct post_reply reply;
+
+  cc_log("Sending usage data: %s", post_data);
+  memset (&reply, 0, sizeof (reply));
+
+  url = format("https://%s/v1.0/cache/", conf->cloud_server);
+
+  dh = init_daemon_connection ();
+
+  /* Loop at most twice, probably, but if the file cache should be cleaned
+     up while were here it could be more, in theory.
+     The first time around the loop we post no file attachments.
+     Then we post new ones as needed.
+     TODO: avoid infinite loops  */
+  while (1)
+    {
+      bool parsed = false;
+      const char *result;
+      bool http_error = false;
+
+      free_post_reply (&reply);
 
-      /* Collect CPU data.  */
-      fd = fopen("/proc/cpuinfo", "r");
-      if (fd)
+      set_daemon_url(dh, url);
+      add_daemon_form_data(dh, "data", post_data);
+
+      /* Do the network request.  */
+      request_daemon_response (dh);
+      while (1)
 	{
-	  while (!feof(fd))
+	  union daemon_responses *dr;
+	  switch (get_daemon_response(dh, &dr))
 	    {
-	      char buffer[400];
-	      char *retval = fgets (buffer, 400, fd);
-	      if (retval && str_startswith(buffer, "model name"))
+	    case D_REQUEST_FAILED:
+	      cc_log("Data could not be posted to %s", conf->cloud_server);
+	      goto fail;
+
+	    case D_RESPONSE_INCOMPLETE:
+	      cc_log("Received incomplete response from the server.");
+	      goto fail;
+
+	    case D_RESPONSE_COMPLETE:
+	      goto done;
+
+	    case D_HTTP_RESULT_CODE:
+	      if (dr->http_result_code != 200)
 		{
-		  cpu_thread_count++;
-		  if (!model_name)
-		    {
-		      char *tmp = strchr (buffer, ':');
-		      if (tmp && tmp[1] == ' ')
-			{
-			  strtok (buffer, "\r\n");
-			  model_name = x_strdup (tmp+2);
-			}
-		    }
+		  cc_log("Server returned error code: %d",
+			 dr->http_result_code);
+		  http_error = true;
 		}
-	      else
-		sscanf(buffer, "cpu cores : %d", &cpu_core_count);
-	    }
-	  fclose (fd);
-	}
-      if (!model_name)
-	model_name = "unknown";
+	      break;
 
-      /* Collect memory data.  */
-      fd = fopen("/proc/meminfo", "r");
-      if (fd)
-	{
-	  while (!feof(fd))
-	    {
-	      char buffer[400];
-	      char *retval = fgets(buffer, 400, fd);
-	      if (retval && str_startswith(buffer, "MemTotal:"))
+	    case D_BODY:
+	      if (parsed)
 		{
-		  char *tmp = buffer + strlen ("MemTotal:");
-		  tmp += strspn (tmp, " ");
-		  memsize = x_strndup (tmp, strspn (tmp, "0123456789"));
+		  /* Ignore unexpected data parts.  */
+		  cc_log("WARNING: received unexpected multipart response");
 		  break;
 		}
-	    }
-	  fclose (fd);
-	}
-      if (!memsize)
-	memsize = "unknown";
-      else if (memsize[0] == '\0')
-	{
-	  free (memsize);
-	  memsize = "unknown";
-	}
 
-      /* First add the compile info.
-         I.e. everything needed to reproduce the build.  */
-      json_object_object_add(jobj, "cpp_hash",
-                             json_object_new_string(state->cpp_hash));
-      json_object_object_add(jobj, "toolchain_id",
-                             json_object_new_string(tool_id_get()));
+	      if (http_error)
+		{
+		  cc_log("Server response: '%s'", dr->body.data);
+		  goto early_fail;
+		}
 
-      if (state->stderr_file_to_push
-	  && (stderr_data = read_text_file(state->stderr_file_to_push, 0)))
-	{
-	  json_object_object_add(jobj, "stderr",
-	                         json_object_new_string(stderr_data));
-	  free (stderr_data);
-	}
-      else
-	json_object_object_add(jobj, "stderr",
-	                       json_object_new_string(""));
-
-      json_object_object_add(jobj, "exit_status",
-                             json_object_new_int(state->exit_status));
-      json_object_object_add(jobj, "exit_reason",
-                             json_object_new_string(state->exit_reason));
-
-      /* The command line args are passed as an array.  */
-      jarray = json_object_new_array();
-      for (i=0; orig_args->argv[i]; i++)
-	json_object_array_add(jarray,
-	                      json_object_new_string(orig_args->argv[i]));
-      json_object_object_add(jobj, "args", jarray);
-
-      json_object_object_add(jobj, "cwd",
-                             json_object_new_string(get_cwd()));
-      json_object_object_add(jobj, "object_path",
-                             json_object_new_string(state->object_path));
-
-      /* Initially, we only pass the source_sig. This is a bandwidth saving
-         measure. The server will reject the data if it doesn't recognise the
-         signature, but this ought to be the rarer case.
-         The source files have to be sorted before we generate the signature,
-         or else there'll be more source sets than optimal.  */
-      struct cloud_file_list *sorted_cfl[state->source_count
-                                         + state->include_count];
-      for (i = 0; i < state->source_count; i++)
-	{
-	  struct cloud_file_list *cfl = &state->source_files[i];
-	  if (cfl->hash.hash[0] == '\0' && cfl->hash.size == 0)
-	    {
-	      struct mdfour hash;
-	      hash_start (&hash);
-	      hash_stashed_file (&hash, cfl->path);
-	      hash_result_as_bytes(&hash, cfl->hash.hash);
-	      cfl->hash.size = hash.totalN;
-	    }
-	  sorted_cfl[i] = cfl;
-	}
-      for (i = 0; i < state->include_count; i++)
-	{
-	  struct cloud_file_list *cfl = &state->include_files[i];
-	  if (cfl->hash.hash[0] == '\0' && cfl->hash.size == 0)
-	    {
-	      struct mdfour hash;
-	      hash_start (&hash);
-	      hash_stashed_file (&hash, cfl->path);
-	      hash_result_as_bytes(&hash, cfl->hash.hash);
-	      cfl->hash.size = hash.totalN;
+	      /* Parse the response.  */
+	      if (!parse_post_reply (dr->body.data, dr->body.datasize,
+	                             &reply))
+		{
+		  cc_log("Error: Could not parse server response as JSON.");
+		  goto early_fail;
+		}
+	      parsed = true;
+	      break;
+
+	    case D_ATTACHMENT:
+	      /* We're not expecting any! */
+	      cc_log("WARNING: received unexpected multipart response");
+	      cc_log("WARNING: deleting unexpected attachment");
+	      x_unlink (dr->attachment.tmp_filename);
+	      break;
+
+	    default:
+	      cc_log("WARNING: unknown error reading daemon response.");
+	      break;
 	    }
-	  sorted_cfl[i + state->source_count] = cfl;
-	}
-      qsort (sorted_cfl, state->source_count + state->include_count,
-             sizeof (sorted_cfl[0]), compare_cfl);
-      struct mdfour source_sig;
-      hash_start (&source_sig);
-      for (i = 0; i < state->source_count + state->include_count; i++)
-	{
-	  char *sourcehash_str = format_hash_as_string(sorted_cfl[i]->hash.hash,
-	                                               sorted_cfl[i]->hash.size);
-	  hash_delimiter (&source_sig, "-----");
-	  hash_string (&source_sig, sorted_cfl[i]->path);
-	  hash_delimiter (&source_sig, "=====");
-	  hash_string (&source_sig, sourcehash_str);
-	  free (sourcehash_str);
+	  free(dr);
 	}
-      char *source_sig_str = hash_result (&source_sig);
-      json_object_object_add (jobj, "source_sig",
-                              json_object_new_string (source_sig_str));
-      free (source_sig_str);
-
-      /* Add timing data.  */
-      jarray = json_object_new_array();
-      json_object_array_add(jarray,
-			    json_object_new_int(state->overall_duration.tv_sec));
-      json_object_array_add(jarray,
-			    json_object_new_int(state->overall_duration.tv_usec));
-      json_object_object_add(jobj, "overall_duration", jarray);
-      if (state->direct_mode_tried)
+
+    early_fail:
+      flush_daemon_response(dh);
+
+    fail:
+      break;
+
+    done:
+
+      result = reply.result;
+      if (!result)
 	{
-	  jarray = json_object_new_array();
-	  json_object_array_add(jarray,
-				json_object_new_int(state->direct_mode_duration.tv_sec));
-	  json_object_array_add(jarray,
-				json_object_new_int(state->direct_mode_duration.tv_usec));
-	  json_object_object_add(jobj, "direct_mode_cache_duration", jarray);
+	  cc_log("Error: Server response did not contain JSON field 'result'");
+	  break;
 	}
-      if (state->preprocessor_mode_tried)
+      else if (strcmp(result, "success") == 0)
 	{
-	  jarray = json_object_new_array();
-	  json_object_array_add(jarray,
-				json_object_new_int(state->preprocessor_mode_duration.tv_sec));
-	  json_object_array_add(jarray,
-				json_object_new_int(state->preprocessor_mode_duration.tv_usec));
-	  json_object_object_add(jobj, "preprocessor_mode_cache_duration", jarray);
+	  /* We're done.  */
+	  cc_log("Data posted to %s", conf->cloud_server);
+	  break;
 	}
-      if (state->get_tried)
+      else if (strcmp(result, "error") == 0)
 	{
-	  jarray = json_object_new_array();
-	  json_object_array_add(jarray,
-				json_object_new_int(state->get_duration.tv_sec));
-	  json_object_array_add(jarray,
-				json_object_new_int(state->get_duration.tv_usec));
-	  json_object_object_add(jobj, "get_duration", jarray);
+	  /* The server reports the request was malformed, somehow.
+	     The data should be a string error message.  */
+	  if (reply.message)
+	    cc_log("Server reports error: '%s'", reply.message);
+	  else
+	    cc_log("Server reports error (no message given)");
+	  break;
 	}
-      if (state->compile_tried)
+      else if (strcmp (result, "source list needed") == 0)
 	{
-	  jarray = json_object_new_array();
-	  json_object_array_add(jarray,
-				json_object_new_int(state->compile_duration.tv_sec));
-	  json_object_array_add(jarray,
-				json_object_new_int(state->compile_duration.tv_usec));
-	  json_object_object_add(jobj, "compile_duration", jarray);
+	  free (resend);
+	  post_data = resend = describe_results (true);
+	  cc_log("Resending with full source list: %s", post_data);
+	  continue;
 	}
-
-      /* Add the result type.  */
-      json_object_object_add(jobj, "type",
-                             json_object_new_string(
-				result_type_name_table[state->result_type]));
-
-      /* Now add the client info.
-         This will go in the user's history and for data mining.  */
-      json_object_object_add(jobj, "uname_sysname",
-                             json_object_new_string(host_info.sysname));
-      json_object_object_add(jobj, "uname_release",
-                             json_object_new_string(host_info.release));
-      json_object_object_add(jobj, "uname_version",
-                             json_object_new_string(host_info.version));
-      json_object_object_add(jobj, "uname_machine",
-                             json_object_new_string(host_info.machine));
-      json_object_object_add(jobj, "cpu_model",
-                             json_object_new_string(model_name));
-      json_object_object_add(jobj, "cpu_core_count",
-                             json_object_new_int(cpu_core_count));
-      json_object_object_add(jobj, "cpu_thread_count",
-                             json_object_new_int(cpu_thread_count));
-      json_object_object_add(jobj, "mem",
-                             json_object_new_string(memsize));
-
-      /* Add any interesting config settings.  */
-      jsubobj = json_object_new_object();
-      json_object_object_add(jsubobj, "base_dir",
-                             json_object_new_string(conf->base_dir));
-      json_object_object_add(jsubobj, "compiler_check",
-                             json_object_new_string(conf->compiler_check));
-      json_object_object_add(jsubobj, "compression",
-                             json_object_new_boolean(conf->compression));
-      json_object_object_add(jsubobj, "compression_level",
-                             json_object_new_int(conf->compression_level));
-      json_object_object_add(jsubobj, "direct_mode",
-                             json_object_new_boolean(conf->direct_mode));
-      if (state->direct_mode_autodisabled)
-	json_object_object_add(jsubobj, "direct_mode_disabled_reason",
-	                       json_object_new_string(state->direct_mode_autodisabled));
-      json_object_object_add(jsubobj, "extra_files_to_hash",
-                             json_object_new_string(conf->extra_files_to_hash));
-      json_object_object_add(jsubobj, "hard_link",
-                             json_object_new_boolean(conf->hard_link));
-      json_object_object_add(jsubobj, "hash_dir",
-                             json_object_new_boolean(conf->hash_dir));
-      json_object_object_add(jsubobj, "read_only",
-                             json_object_new_boolean(conf->read_only));
-      json_object_object_add(jsubobj, "recache",
-                             json_object_new_boolean(conf->recache));
-      json_object_object_add(jsubobj, "run_second_cpp",
-                             json_object_new_boolean(conf->run_second_cpp));
-      json_object_object_add(jsubobj, "sloppiness",
-                             json_object_new_int(conf->sloppiness));
-      json_object_object_add(jsubobj, "unify",
-                             json_object_new_boolean(conf->unify));
-      json_object_object_add(jsubobj, "cloud_mode",
-                             json_object_new_string(conf->cloud_mode));
-      json_object_object_add(jsubobj, "cs_version",
-                             json_object_new_string(CS_VERSION));
-      json_object_object_add(jobj, "client_config", jsubobj);
-
-      post_data = json_object_to_json_string(jobj);
-      cc_log("Sending usage data: %s", post_data);
-
-      url = format("https://%s/v1.0/cache/", conf->cloud_server);
-
-      dh = init_daemon_connection ();
-
-      /* Loop at most twice, probably, but if the file cache should be cleaned
-         up while were here it could be more, in theory.
-         The first time around the loop we post no file attachments.
-         Then we post new ones as needed.
-         TODO: avoid infinite loops  */
-      while (1)
+      else if (strcmp (result, "files needed") == 0)
 	{
-	  json_object *jresponse = NULL;
-	  json_object *value;
-	  const char *result = NULL;
-	  bool http_error = false;
+	  /* We need to upload files to the cache.  This means repeating
+	     the original request, so we reuse existing curl setup, but
+	     add the file uploads as attachments.  */
+	  int i, count;
 
-	  set_daemon_url(dh, url);
-	  add_daemon_form_data(dh, "data", post_data);
-
-	  /* Do the network request.  */
-	  request_daemon_response (dh);
-	  while (1)
-	    {
-	      union daemon_responses *dr;
-	      switch (get_daemon_response(dh, &dr))
-	        {
-	        case D_REQUEST_FAILED:
-	          cc_log("Data could not be posted to %s", conf->cloud_server);
-	          goto fail;
-
-	        case D_RESPONSE_INCOMPLETE:
-	          cc_log("Received incomplete response from the server.");
-	          goto fail;
-
-	        case D_RESPONSE_COMPLETE:
-	          goto done;
-
-	        case D_HTTP_RESULT_CODE:
-	          if (dr->http_result_code != 200)
-	            {
-	              cc_log("Server returned error code: %d",
-	                     dr->http_result_code);
-	              http_error = true;
-	            }
-	          break;
-
-	        case D_BODY:
-	          if (jresponse)
-	            {
-	              /* Ignore unexpected data parts.  */
-	              cc_log("WARNING: received unexpected multipart response");
-	              break;
-	            }
-
-	          if (http_error)
-	            {
-	              cc_log("Server response: '%s'", dr->body.data);
-	              goto early_fail;
-	            }
-
-		  /* Parse the response.  */
-		  jresponse = json_tokener_parse(dr->body.data);
-		  if (is_error(jresponse))
-		    {
-		      cc_log("Error: Could not parse server response as JSON.");
-		      goto early_fail;
-		    }
-		  break;
-
-	        case D_ATTACHMENT:
-	          /* We're not expecting any! */
-	          cc_log("WARNING: received unexpected multipart response");
-	          cc_log("WARNING: deleting unexpected attachment");
-	          x_unlink (dr->attachment.tmp_filename);
-	          break;
-
-	        default:
-	          cc_log("WARNING: unknown error reading daemon response.");
-	          break;
-	        }
-	      free(dr);
-	    }
-
-	early_fail:
-	  flush_daemon_response(dh);
-
-	fail:
-	  break;
-
-	done:
-
-          value = json_object_object_get(jresponse, "result");
-          if (value)
-            result = json_object_get_string(value);
-	  if (!result)
-	    {
-	      cc_log("Error: Server response did not contain JSON field 'result'");
-	      break;
-	    }
-	  else if (strcmp(result, "success") == 0)
+	  if (!reply.has_names)
 	    {
-	      /* We're done.  */
-	      cc_log("Data posted to %s", conf->cloud_server);
+	      cc_log("Error: Server requested file uploads, but the filenames were missing.");
 	      break;
 	    }
-	  else if (strcmp(result, "error") == 0)
-	    {
-	      /* The server reports the request was malformed, somehow.
-	         The data should be a string error message.  */
-	      json_object *data = json_object_object_get(jresponse, "data");
-	      if (data && json_object_is_type(data, json_type_string))
-		cc_log("Server reports error: '%s'",
-		       json_object_get_string(data));
-	      else
-		cc_log("Server reports error (no message given)");
-	      break;
-	    }
-	  else if (strcmp (result, "source list needed") == 0)
+
+	  cc_log("Server requests file uploads...");
+	  for (i = 0, count = 0; i < reply.count; i++)
 	    {
-	      /* The source files are passed as an array of json pairs.  */
-	      jsubobj = json_object_new_object();
-	      for (i = 0; i < state->source_count; i++)
-		{
-		  char *sourcehash_str;
-		  struct cloud_file_list *cfl = &state->source_files[i];
-		  sourcehash_str = format_hash_as_string(cfl->hash.hash,
-		                                         cfl->hash.size);
-		  json_object_object_add(jsubobj, cfl->path,
-		                         json_object_new_string(sourcehash_str));
-		  free (sourcehash_str);
-		}
-	      for (i = 0; i < state->include_count; i++)
+	      const char *filename = reply.names[i];
+	      struct stashed_file *sf;
+	      if (state->manifest_file_to_push
+		  && strcmp(filename, state->manifest_key) == 0)
 		{
-		  char *sourcehash_str;
-		  struct cloud_file_list *cfl = &state->include_files[i];
-		  sourcehash_str = format_hash_as_string(cfl->hash.hash,
-		                                         cfl->hash.size);
-		  json_object_object_add(jsubobj, cfl->path,
-		                         json_object_new_string(sourcehash_str));
-		  free (sourcehash_str);
+		  sf = find_stashed_file(state->manifest_file_to_push);
+		  if (!sf)
+		    {
+		      cc_log ("Error: the manifest is no longer available!");
+		      goto bailout;
+		    }
+		  add_daemon_form_attachment(dh, "manifest", sf, filename);
 		}
-	      json_object_object_add(jobj, "sources", jsubobj);
-	      post_data = json_object_to_json_string(jobj);
-	      cc_log("Resending with full source list: %s", post_data);
-	      continue;
-	    }
-	  else if (strcmp (result, "files needed") == 0)
-	    {
-	      /* We need to upload files to the cache.  This means repeating
-	         the original request, so we reuse existing curl setup, but
-	         add the file uploads as attachments.  */
-	      json_object *data = json_object_object_get(jresponse, "data");
-	      int i, len, count;
-
-	      if (!data || !json_object_is_type(data, json_type_array))
+	      else if (strcmp(filename, state->object_path) == 0)
 		{
-		  cc_log("Error: Server requested file uploads, but the filenames were missing.");
-		  break;
+		  if (!state->object_file_to_push)
+		    {
+		      cc_log ("Error: we don't have an object file to upload!");
+		      goto bailout;
+		    }
+		  sf = find_stashed_file(filename);
+		  add_daemon_form_attachment(dh, "object", sf, filename);
 		}
-
-	      cc_log("Server requests file uploads...");
-	      len = json_object_array_length(data);
-	      for (i = 0, count = 0; i < len; i++)
+	      else
 		{
-		  json_object *entry = json_object_array_get_idx(data, i);
-		  if (entry && json_object_is_type(entry, json_type_string))
+		  struct cloud_file_list *found = NULL;
+		  int n;
+
+		  /* Scan the files to make sure the server isn't
+		     requesting bogus files!  */
+		  for (n = 0; !found && n < state->source_count; n++)
+		    if (strcmp (state->source_files[n].path, filename) == 0)
+		      found = &state->source_files[n];
+		  for (n = 0; !found && n < state->include_count; n++)
+		    if (strcmp (state->include_files[n].path, filename) == 0)
+		      found = &state->include_files[n];
+
+		  if (!found)
 		    {
-		      const char *filename = json_object_get_string(entry);
-		      struct stashed_file *sf;
-		      if (strcmp(filename, state->object_path) == 0)
-			{
-			  if (!state->object_file_to_push)
-			    {
-			      cc_log ("Error: we don't have an object file to upload!");
-			      goto bailout;
-			    }
-			  sf = find_stashed_file(filename);
-			  add_daemon_form_attachment(dh, "object", sf, filename);
-			}
-		      else
-			{
-			  struct cloud_file_list *found = NULL;
-			  int n;
-
-			  /* Scan the files to make sure the server isn't
-			     requesting bogus files!  */
-			  for (n = 0; !found && n < state->source_count; n++)
-			    if (strcmp (state->source_files[n].path, filename) == 0)
-			      found = &state->source_files[n];
-			  for (n = 0; !found && n < state->include_count; n++)
-			    if (strcmp (state->include_files[n].path, filename) == 0)
-			      found = &state->include_files[n];
-
-			  if (!found)
-			    {
-			      cc_log ("Error: Server requested unexpected file '%s'; bailing out!",
-				      filename);
-			      goto bailout;
-			    }
-
-			  sf = find_stashed_file(filename);
-			  assert (sf);
-			  add_daemon_form_attachment(dh, "source", sf, filename);
-			}
-		      cc_log("...uploading file: '%s'", filename);
-		      count++;
+		      cc_log ("Error: Server requested unexpected file '%s'; bailing out!",
+			      filename);
+		      goto bailout;
 		    }
-		}
 
-	      if (count == 0)
-		{
-		  cc_log ("Error: no files to upload after all.");
-		  break;
+		  sf = find_stashed_file(filename);
+		  assert (sf);
+		  add_daemon_form_attachment(dh, "source", sf, filename);
 		}
-	      else
-		continue;
+	      cc_log("...uploading file: '%s'", filename);
+	      count++;
+	    }
+
+	  if (count == 0)
+	    {
+	      cc_log ("Error: no files to upload after all.");
+	      break;
 	    }
 	  else
+	    continue;
+	}
+      else if (strcmp (result, "content needed") == 0)
+	{
+	  /* The server files content by its hash, and wants only what it
+	     hasn't got, from this compile or any other.  */
+	  int i;
+
+	  if (reply.count == 0)
 	    {
-	      cc_log("Error posting data to %s; giving up.", conf->cloud_server);
+	      cc_log("Error: Server requested content, but the hashes were missing.");
 	      break;
 	    }
+
+	  cc_log("Server requests content uploads...");
+	  for (i = 0; i < reply.count; i++)
+	    {
+	      const char *hash = reply.names[i];
+	      const char *path = content_path (hash);
+	      struct stashed_file *sf = path ? find_stashed_file(path) : NULL;
+
+	      if (!sf)
+		{
+		  cc_log ("Error: Server requested unexpected content '%s'; bailing out!",
+			  hash ? hash : "");
+		  goto bailout;
+		}
+	      add_daemon_form_attachment(dh, "content", sf, hash);
+	      cc_log("...uploading the content of '%s'", path);
+	    }
+	  continue;
+	}
+      else
+	{
+	  cc_log("Error posting data to %s; giving up.", conf->cloud_server);
+	  break;
 	}
+    }
 
 bailout:
 
-      close_daemon(dh);
-      free((void*)post_data);
-      free((void*)url);
+  free_post_reply (&reply);
+  free(resend);
+  close_daemon(dh);
+  free(url);
+}
+
+/* Acquire and/or post statistical information to the server.
+   This is normally left to the daemon, but otherwise it runs in the
+   background to prevent build delays.  */
+static void
+post_results_to_cloud(void)
+{
+  char *data;
+
+  /* Nobody is waiting for the manifest any more.  */
+  cloud_manifest_cancel ();
+
+  /* Ensure that we actually have some results to post.  */
+  /* TODO post other data to the cloud???  */
+  if (!state->cpp_hash || state->exit_status == 9999999)
+    {
+      delete_stashed_files ();
+      return;
+    }
+
+  /* Stop all the timers.  */
+  do_timer (TIMER_NONE);
+  if (!forked_already)
+    cloud_hook_stop_overall_timer ();
+
+  data = describe_results (false);
+  if (!cloud_offline_mode() && enqueue_results (data))
+    {
+      /* The daemon deletes the stashed files when it is done.  */
+      forget_stashed_files ();
+      free (data);
+      return;
+    }
+
+  if (cloud_offline_mode())
+    {
+      /* The daemon has gone away, so nor can we reach the server.  */
+      spool_results (data);
+      delete_stashed_files ();
+      free (data);
+      return;
+    }
+
+  if (DISABLE_FORK || forked_already || fork() == 0)
+    {
+      /* Post the results in the background.  */
+      if (!DISABLE_FORK)
+	exitfn_reset();
+
+      upload_results (data);
 
-      /* Delete the shared memory files we created earlier.  */
+      /* Delete the stashed files we created earlier.  */
       // TODO Delete files on signal exit.
       delete_stashed_files ();
 
@@ -748,6 +928,7 @@ bailout:
       if (!DISABLE_FORK && !forked_already)
 	_exit(0);
     }
+  free (data);
 }
 
 /* Queue an object file for upload.  The actual push happens in
@@ -759,6 +940,7 @@ cloud_hook_object_file (const char *cache_file)
   if (cloud_offline_mode())
     return;
 
+  free (state->object_file_to_push);
   state->object_file_to_push = x_strdup (cache_file);
 }
 
@@ -771,35 +953,282 @@ cloud_hook_stderr_file (const char *cache_file)
   if (cloud_offline_mode())
     return;
 
+  free (state->stderr_file_to_push);
   state->stderr_file_to_push = x_strdup (cache_file);
 }
 
-/* Downloads the build results from the cloud cache, if available.
-   Saves the downloads in the given files and variable.
-   Returns true if successful and false otherwise.  */
+/* Queue a manifest for upload under the key given to cloud_manifest_request.
+   The file is read at once, so the caller can delete it.  */
+void
+cloud_hook_manifest_file (const char *manifest_file)
+{
+  char *data;
+  size_t size;
+
+  if (cloud_offline_mode() || !state->manifest_key)
+    return;
+
+  if (read_file_and_stash (manifest_file, 0, &data, &size))
+    state->manifest_file_to_push = x_strdup (manifest_file);
+}
+
+/* How long, in milliseconds, a GET may take before the client gives up
+   and compiles locally: cloud_deadline if set, or else twice what a
+   local compile is expected to take, going by this translation unit's
+   record or by the daemon's recent compiles, but at least a second.
+   Without either, there is a default of ten seconds.  The deadline is also
+   set on the request, and recorded in *WHEN, so that neither the daemon
+   nor the client waits any longer.  */
+static void
+request_deadline (daemon_handle dh, struct timeval *when)
+{
+  uint32_t get_time, compile_time;
+  unsigned int deadline = 10000;
+
+  if (conf->cloud_deadline > 0)
+    deadline = conf->cloud_deadline;
+  else
+    {
+      if (state->expected_compile_time)
+        deadline = 2 * state->expected_compile_time;
+      else if (query_daemon_pace (50, &get_time, &compile_time)
+               && compile_time != UINT32_MAX)
+        deadline = 2 * (compile_time / 1000);
+      if (deadline < 1000)
+        deadline = 1000;
+    }
+
+  set_daemon_deadline (dh, deadline);
+  gettimeofday (when, NULL);
+  when->tv_sec += deadline / 1000;
+  when->tv_usec += deadline % 1000 * 1000;
+  if (when->tv_usec >= 1000000)
+    {
+      when->tv_sec++;
+      when->tv_usec -= 1000000;
+    }
+}
+
+/* Wait for the daemon to answer on DH, until a second after DEADLINE.
+   The daemon ought to give up on time itself; the grace covers a busy
+   daemon.  Returns false if there is no answer by then.  */
+static bool
+answered_in_time (daemon_handle dh, const struct timeval *deadline)
+{
+  struct pollfd pfd;
+  struct timeval now, remaining;
+  int timeout, ready;
+
+  do
+    {
+      gettimeofday (&now, NULL);
+      timeout = 0;
+      if (timercmp (&now, deadline, <))
+        {
+          timersub (deadline, &now, &remaining);
+          timeout = remaining.tv_sec * 1000 + remaining.tv_usec / 1000;
+        }
+      pfd.fd = dh;
+      pfd.events = POLLIN;
+      ready = poll (&pfd, 1, timeout + 1000);
+    }
+  while (ready == -1 && errno == EINTR);
+  return ready != 0;
+}
+
+/* Ask the cloud for the manifest stored under KEY, the direct mode hash and
+   toolchain ID, but don't wait for the answer; cloud_manifest_get collects
+   it.  The request travels while the caller reads the local manifest, and
+   KEY is remembered for uploading a manifest later.  */
+void
+cloud_manifest_request (const char *key)
+{
+  char *url;
+
+  if (cloud_offline_mode())
+    return;
+
+  free (state->manifest_key);
+  state->manifest_key = x_strdup (key);
+
+  if (conf->recache || strcmp (conf->cloud_mode, "local") == 0)
+    return;
+
+  cloud_manifest_cancel ();
+  manifest_dh = init_daemon_connection ();
+  if (manifest_dh == -1)
+    return;
+
+  url = format ("https://%s/v1.0/manifest/%s", conf->cloud_server, key);
+  set_daemon_url (manifest_dh, url);
+  free (url);
+
+  request_deadline (manifest_dh, &manifest_deadline);
+  request_daemon_response (manifest_dh);
+}
+
+/* Collect the answer to cloud_manifest_request, saving the manifest as
+   MANIFEST_FILE.  Returns true if the cloud had one.  */
 bool
-cloud_cache_get (const char *object_file, const char *stderr_file,
-                 int *exit_status)
+cloud_manifest_get (const char *manifest_file)
+{
+  bool found = false, http_ok = false;
+
+  if (manifest_dh == -1)
+    return false;
+  if (!answered_in_time (manifest_dh, &manifest_deadline))
+    {
+      cc_log ("The cloud didn't send the manifest in time.");
+      cloud_manifest_cancel ();
+      return false;
+    }
+
+  while (1)
+    {
+      union daemon_responses *dr;
+      switch (get_daemon_response (manifest_dh, &dr))
+        {
+        case D_REQUEST_FAILED:
+        case D_RESPONSE_INCOMPLETE:
+          if (found)
+            tmp_unlink (manifest_file);
+          found = false;
+          goto done;
+
+        case D_RESPONSE_COMPLETE:
+          goto done;
+
+        case D_HTTP_RESULT_CODE:
+          http_ok = dr->http_result_code == 200;
+          if (!http_ok)
+            {
+              free (dr);
+              goto early_done;
+            }
+          break;
+
+        case D_BODY:
+          cc_log ("WARNING: Server returned unexpected data part");
+          break;
+
+        case D_ATTACHMENT:
+          if (http_ok && strstr (dr->attachment.headers, "?file=manifest"))
+            found = x_rename (dr->attachment.tmp_filename, manifest_file) == 0;
+          else
+            {
+              cc_log ("WARNING: server return unexpected attachment");
+              tmp_unlink (dr->attachment.tmp_filename);
+            }
+          break;
+
+        default:
+          cc_log ("WARNING: unknown error reading daemon response.");
+          break;
+        }
+      free (dr);
+    }
+
+early_done:
+  flush_daemon_response (manifest_dh);
+
+done:
+  cloud_manifest_cancel ();
+  return found;
+}
+
+/* Drop the manifest request, if the answer is no longer wanted.  */
+void
+cloud_manifest_cancel (void)
+{
+  if (manifest_dh == -1)
+    return;
+
+  close_daemon (manifest_dh);
+  manifest_dh = -1;
+}
+
+/* Ask the cloud cache for the build results, but don't wait for the
+   answer; cloud_cache_get collects it, or cloud_cache_cancel drops it.  */
+void
+cloud_cache_request (void)
 {
-  daemon_handle dh;
   char *url;
-  bool retval = false;
 
   if (cloud_offline_mode())
-   return 0;
+    return;
 
-  do_timer (TIMER_CLOUD_CACHE_GET);
+  cloud_cache_cancel ();
+  get_dh = init_daemon_connection();
+  if (get_dh == -1)
+    return;
 
   url = format("https://%s/v1.0/cache/%s-%s",
 	      conf->cloud_server, state->cpp_hash, tool_id_get());
+  set_daemon_url(get_dh, url);
+  free(url);
+
+  /* There's no point waiting for the cloud for much longer than a local
+     compile would take.  */
+  request_deadline (get_dh, &get_deadline);
+
+  request_daemon_response (get_dh);
+}
+
+/* Drop the cloud cache request, if the answer is no longer wanted.  The
+   daemon abandons the download, and whoever is waiting on the request
+   (perhaps another process) sees it fail.  */
+void
+cloud_cache_cancel (void)
+{
+  if (get_dh == -1)
+    return;
+
+  cancel_daemon_request (get_dh);
+  close_daemon (get_dh);
+  get_dh = -1;
+}
+
+/* Set *EXIT_STATUS to the "exit_status" of the cache hit described by the
+   SIZE bytes at TEXT.  Returns false if there is none.  */
+static bool
+find_exit_status (const char *text, size_t size, int *exit_status)
+{
+  struct json_reader r;
+  enum json_token token;
+  bool found = false;
+
+  jr_init (&r, text, size);
+  if (jr_next (&r) == JT_BEGIN_OBJECT)
+    while (!found && (token = jr_next (&r)) == JT_KEY)
+      {
+	bool wanted = str_eq (r.string, "exit_status");
+
+	token = jr_next (&r);
+	if (wanted && token == JT_NUMBER && r.integer)
+	  {
+	    *exit_status = r.number;
+	    found = true;
+	  }
+	else if (!jr_skip (&r, token))
+	  break;
+      }
+  jr_free (&r);
+  return found;
+}
+
+/* Read the answer to cloud_cache_request, and close the request.
+   Saves the downloads in the given files and variable.
+   Returns true if successful and false otherwise.  */
+static bool
+receive_cache_response (const char *object_file, const char *stderr_file,
+                        int *exit_status)
+{
+  bool retval = false;
 
-  dh = init_daemon_connection();
-  set_daemon_url(dh, url);
-  request_daemon_response (dh);
   while (1)
     {
       union daemon_responses *dr;
-      switch (get_daemon_response (dh, &dr))
+      switch (get_daemon_response (get_dh, &dr))
         {
         case D_REQUEST_FAILED:
         case D_RESPONSE_INCOMPLETE:
@@ -834,14 +1263,8 @@ cloud_cache_get (const char *object_file, const char *stderr_file,
           if (strstr (dr->body.headers, "?file=data"))
             {
               /* The data part contains JSON data.  */
-              json_object *data = json_tokener_parse (dr->body.data);
-              json_object *status = NULL;
-
-              if (!is_error(data))
-        	status = json_object_object_get (data, "exit_status");
-              if (status && json_object_is_type (status, json_type_int))
-        	*exit_status = json_object_get_int (status);
-              else
+              if (!find_exit_status (dr->body.data, dr->body.datasize,
+                                     exit_status))
         	{
         	  cc_log ("Warning: Server didn't return the compiler exit_status");
         	  *exit_status = 0;
@@ -872,22 +1295,232 @@ cloud_cache_get (const char *object_file, const char *stderr_file,
     }
 
 early_done:
-  flush_daemon_response (dh);
+  flush_daemon_response (get_dh);
 
 done:
-  free(url);
+  if (get_dh != -1)
+    close_daemon (get_dh);
+  get_dh = -1;
+  return retval;
+}
+
+/* Downloads the build results from the cloud cache, if available.
+   Saves the downloads in the given files and variable.
+   Returns true if successful and false otherwise.  */
+bool
+cloud_cache_get (const char *object_file, const char *stderr_file,
+                 int *exit_status)
+{
+  bool retval;
+
+  if (cloud_offline_mode())
+   return 0;
+
+  do_timer (TIMER_CLOUD_CACHE_GET);
+
+  if (get_dh == -1)
+    cloud_cache_request ();
+  if (get_dh != -1 && !answered_in_time (get_dh, &get_deadline))
+    {
+      cc_log ("The cloud cache didn't answer in time; compiling locally.");
+      cloud_cache_cancel ();
+      do_timer (TIMER_NONE);
+      return false;
+    }
+  retval = receive_cache_response (object_file, stderr_file, exit_status);
+
   do_timer (TIMER_NONE);
   return retval;
 }
 
-/* Return the saved exit_status.
-   When the GET request runs in a fork the parent process never sees the
-   exit_status, so this function can be used to pull it from the shared
-   memory; cloud_cache_get writes the exit status there for the purpose.  */
-int
-cloud_cache_exit_status (void)
+/* Return a descriptor that becomes readable when process PID exits, or -1
+   if the kernel can't provide one.  */
+static int
+open_pidfd (pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return syscall (SYS_pidfd_open, pid, 0);
+#else
+  (void) pid;
+  return -1;
+#endif
+}
+
+/* How long, in milliseconds, a hedged race gives the cloud cache before it
+   starts the compiler.  That is long enough for most GETs to have been
+   answered, judging by the daemon's recent ones (hedge_percentile, by
+   default 90), but no more than a fraction (hedge_fraction, by default
+   0.5) of a typical local compile, so that a miss costs little extra.
+   Without a history to go on there is no head start.  */
+static unsigned int
+hedge_delay (void)
+{
+  double fraction = conf->hedge_fraction;
+  uint32_t get_time, compile_time;
+  uint64_t delay;
+
+  if (!query_daemon_pace (conf->hedge_percentile, &get_time, &compile_time)
+      || get_time == UINT32_MAX)
+    return 0;
+  delay = get_time;
+  if (compile_time != UINT32_MAX && delay > fraction * compile_time)
+    delay = fraction * compile_time;
+  delay = (delay + 999) / 1000;
+  if (conf->cloud_deadline > 0 && delay > conf->cloud_deadline)
+    delay = conf->cloud_deadline;
+  return delay;
+}
+
+/* Record that the compiler ran for DURATION, and tell the daemon, for
+   the sake of hedge_delay.  */
+static void
+note_compile_time (const struct timeval *duration)
 {
-  return state->exit_status;
+  uint64_t microseconds = ((uint64_t)duration->tv_sec * 1000000
+                           + duration->tv_usec);
+
+  state->compile_tried = true;
+  state->compile_duration = *duration;
+  report_daemon_compile_time (microseconds > UINT32_MAX ? UINT32_MAX
+                              : microseconds);
+}
+
+/* Run the compiler ARGV, writing to PATH_STDOUT and PATH_STDERR, while
+   the cloud cache is asked for the same results, and take whichever comes
+   first.  The loser is stopped: a cloud download is cancelled, and the
+   compiler's process group is killed and reaped.  Returns true, with the
+   downloads saved in OBJECT_FILE and STDERR_FILE, if the cloud cache won;
+   *STATUS is then the exit status the cloud cache recorded, and the compiler
+   may never have started.  Otherwise *STATUS is the compiler's exit status.
+
+   If HEDGED, the compiler only starts if the cloud cache hasn't answered
+   within the head start given by hedge_delay, so that fast cloud hits
+   don't cost a compile.
+
+   This all happens in the calling process (or thread): the daemon socket
+   and the compiler's exit are watched in one poll loop.  */
+bool
+cloud_race (char **argv, const char *path_stdout, const char *path_stderr,
+            char **env_vars, const char *object_file,
+            const char *stderr_file, bool hedged, int *status)
+{
+  struct timeval start, compile_start, head_start, now, elapsed;
+  bool get_pending, from_cloud = false;
+  pid_t pid = -1;
+  int pidfd = -1, killed_status;
+  unsigned int delay = 0;
+
+  do_timer (TIMER_NONE);
+  gettimeofday (&start, NULL);
+  compile_start = start;
+  cloud_cache_request ();
+  get_pending = get_dh != -1;
+  if (hedged && get_pending)
+    {
+      delay = hedge_delay ();
+      cc_log ("Giving the cloud cache a %u ms head start", delay);
+    }
+  head_start.tv_sec = start.tv_sec + delay / 1000;
+  head_start.tv_usec = start.tv_usec + delay % 1000 * 1000;
+  if (head_start.tv_usec >= 1000000)
+    {
+      head_start.tv_sec++;
+      head_start.tv_usec -= 1000000;
+    }
+
+  while (1)
+    {
+      struct pollfd fds[2];
+      int nfds = 0, timeout;
+
+      gettimeofday (&now, NULL);
+      if (pid == -1 && (!get_pending || !timercmp (&now, &head_start, <)))
+	{
+	  if (get_pending && delay > 0)
+	    cc_log ("No answer from the cloud cache yet; starting the"
+	            " compiler.");
+	  pid = execute_async (argv, path_stdout, path_stderr, env_vars);
+	  pidfd = open_pidfd (pid);
+	  compile_start = now;
+	  stats_update (STATS_RACE_COMPILES);
+	}
+
+      if (get_pending)
+	{
+	  fds[nfds].fd = get_dh;
+	  fds[nfds].events = POLLIN;
+	  nfds++;
+	}
+      if (pidfd != -1)
+	{
+	  fds[nfds].fd = pidfd;
+	  fds[nfds].events = POLLIN;
+	  nfds++;
+	}
+
+      /* Wait out the head start, if the compiler is yet to start.
+         Without a pidfd, look for the compiler's exit now and then.  */
+      if (pid == -1)
+	{
+	  timersub (&head_start, &now, &elapsed);
+	  timeout = elapsed.tv_sec * 1000 + (elapsed.tv_usec + 999) / 1000;
+	}
+      else
+	timeout = pidfd != -1 ? -1 : 10;
+      if (poll (fds, nfds, timeout) == -1)
+	{
+	  if (errno != EINTR)
+	    fatal ("poll failed: %s", strerror (errno));
+	  continue;
+	}
+
+      if (get_pending && fds[0].revents)
+	{
+	  /* The daemon only starts answering when the whole response is in,
+	     so reading it won't hold up the compiler for long.  */
+	  get_pending = false;
+	  from_cloud = receive_cache_response (object_file, stderr_file,
+	                                       status);
+	  gettimeofday (&now, NULL);
+	  state->get_tried = true;
+	  timersub (&now, &start, &state->get_duration);
+	  if (from_cloud)
+	    {
+	      stats_update (STATS_RACE_CLOUD_WON);
+	      if (pid == -1)
+		{
+		  cc_log ("The cloud cache answered within its head start.");
+		  break;
+		}
+
+	      /* The compiler's time so far tells us nothing.  */
+	      cc_log ("The cloud cache won the race; stopping the compiler.");
+	      stats_update (STATS_RACE_WASTED);
+	      killpg (pid, SIGTERM);
+	      execute_poll (pid, true, &killed_status);
+	      break;
+	    }
+	  cc_log ("Cloud cache miss; waiting for the local compiler.");
+	  continue;
+	}
+
+      if (pid != -1 && execute_poll (pid, false, status))
+	{
+	  gettimeofday (&now, NULL);
+	  timersub (&now, &compile_start, &elapsed);
+	  note_compile_time (&elapsed);
+	  if (get_pending)
+	    {
+	      cc_log ("The local compiler won the race.");
+	      cloud_cache_cancel ();
+	    }
+	  break;
+	}
+    }
+
+  if (pidfd != -1)
+    close (pidfd);
+  return from_cloud;
 }
 
 /* Close any existing timer and start a new one.  */
@@ -918,8 +1551,7 @@ do_timer (enum timer_mode mode)
       state->get_duration = difference;
       break;
     case TIMER_COMPILER:
-      state->compile_tried = true;
-      state->compile_duration = difference;
+      note_compile_time (&difference);
       break;
     case TIMER_NONE:
     default:
@@ -940,6 +1572,10 @@ void
 cloud_hook_stop_overall_timer ()
 {
   struct timeval end_time;
+
+  if (cloud_offline_mode())
+    return;
+
   gettimeofday(&end_time, NULL);
   timersub (&end_time, &overall_start_time, &state->overall_duration);
 }
@@ -969,6 +1605,22 @@ cloud_hook_ending_compiler_execution ()
   do_timer (TIMER_NONE);
 }
 
+/* Fill in OBS with what this compile measured, for the cost database.
+   FROM_CLOUD says whether the cloud cache supplied the object.  */
+void
+cloud_observed_costs (bool from_cloud, struct cost_observation *obs)
+{
+  struct timeval *t;
+
+  t = &state->compile_duration;
+  obs->compile_time = (state->compile_tried
+                       ? t->tv_sec * 1000 + t->tv_usec / 1000 : -1);
+  t = &state->get_duration;
+  obs->get_time = state->get_tried ? t->tv_sec * 1000 + t->tv_usec / 1000 : -1;
+  obs->cloud_hit = state->get_tried ? from_cloud : -1;
+  obs->object_size = 0;
+}
+
 /* Record the cpp_hash string.  */
 void
 cloud_hook_cpp_hash(const char *cpp_hash)
@@ -976,6 +1628,7 @@ cloud_hook_cpp_hash(const char *cpp_hash)
   if (cloud_offline_mode())
     return;
 
+  free (state->cpp_hash);
   state->cpp_hash = x_strdup(cpp_hash);
 }
 
@@ -986,6 +1639,7 @@ cloud_hook_object_path(const char *object_path)
   if (cloud_offline_mode())
     return;
 
+  free (state->object_path);
   state->object_path = x_strdup(object_path);
 }
 
@@ -1022,15 +1676,12 @@ append_to_cloud_file_list(struct cloud_file_list **listptr, int *counterptr,
 }
 
 static void
-reset_cloud_file_list(struct cloud_file_list **listptr, int *counterptr)
+free_cloud_file_list(struct cloud_file_list **listptr, int *counterptr)
 {
   struct cloud_file_list *cfl;
   int count;
   int i;
 
-  if (cloud_offline_mode())
-    return;
-
   cfl = *listptr;
   count = *counterptr;
   for (i = 0; i < count; i++)
@@ -1043,6 +1694,15 @@ reset_cloud_file_list(struct cloud_file_list **listptr, int *counterptr)
   *counterptr = 0;
 }
 
+static void
+reset_cloud_file_list(struct cloud_file_list **listptr, int *counterptr)
+{
+  if (cloud_offline_mode())
+    return;
+
+  free_cloud_file_list (listptr, counterptr);
+}
+
 /* Record what top-level source files were built.  */
 void
 cloud_hook_source_file(const char *source_file, struct file_hash *hash)
@@ -1100,6 +1760,17 @@ cloud_hook_direct_mode_autodisabled (const char *reason)
   state->direct_mode_autodisabled = reason;
 }
 
+/* Note that a local compile is expected to take MILLISECONDS, for the sake
+   of request_deadline.  */
+void
+cloud_hook_expected_compile_time (unsigned int milliseconds)
+{
+  if (cloud_offline_mode())
+    return;
+
+  state->expected_compile_time = milliseconds;
+}
+
 void
 cloud_hook_record_result_type (enum result_type result_type)
 {
@@ -1119,17 +1790,15 @@ cloud_initialize(void)
   if (cloud_offline_mode())
     return 0;
 
-  state = mmap (NULL, sizeof(struct state), PROT_READ | PROT_WRITE,
-                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-  if (state == MAP_FAILED)
-    fatal ("Could not mmap memory: %s", strerror(errno));
+  cloud_state_free ();
+  state = x_malloc (sizeof(struct state));
   *state = initial_state;
-  state->free = state->shared_heap;
 
   if (strcmp (conf->cloud_user_key, "") == 0)
     {
       cc_log("No Cloud Sourcery Key is configured; reverting to offline mode.");
-      conf->cloud_mode = "offline";
+      free (conf->cloud_mode);
+      conf->cloud_mode = x_strdup ("offline");
       fprintf (stderr,
                "cs: error: No license key found.\n"
                "Need a key? Visit https://www.cloudsourcery.com/cs_keys\n"
@@ -1159,6 +1828,35 @@ cloud_initialize(void)
   return 1;
 }
 
+/* Free what cloud_initialize and the hooks recorded for this thread's
+   compile.  ccache_compile calls this once the compile is over, so a thread
+   that runs one compile after another doesn't leak.  */
+void
+cloud_state_free (void)
+{
+  free (user_key_header);
+  user_key_header = NULL;
+  if (client_id_header != no_client_id_header)
+    free (client_id_header);
+  client_id_header = (char *) no_client_id_header;
+  timer_state = TIMER_NONE;
+
+  if (!state)
+    return;
+
+  free (state->object_file_to_push);
+  free (state->object_path);
+  free (state->object_hash);
+  free (state->stderr_file_to_push);
+  free (state->manifest_file_to_push);
+  free (state->cpp_hash);
+  free (state->manifest_key);
+  free_cloud_file_list (&state->source_files, &state->source_count);
+  free_cloud_file_list (&state->include_files, &state->include_count);
+  free (state);
+  state = NULL;
+}
+
 /* Exit the program, successfully or otherwise.
    We can't implement this as an atexit function because we want to post
    the reason and status code to the cloud.  */
@@ -1173,5 +1871,5 @@ cloud_exit(const char *reason, int status)
 
   /* NOTE: The exit handler includes post_results_to_cloud.  */
 
-  exit(status);
+  x_exit(status);
 }
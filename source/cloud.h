@@ -1,12 +1,22 @@
 #include "hashutil.h"
+#include "costs.h"
 
 int cloud_initialize(void);
+void cloud_state_free(void);
 void cloud_exit(const char *reason, int status) __attribute__((noreturn));
 
 bool cloud_offline_mode ();
 bool cloud_cache_get (const char *object_file, const char *stderr_file,
                       int *exit_status);
-int cloud_cache_exit_status (void);
+void cloud_cache_request (void);
+void cloud_cache_cancel (void);
+bool cloud_race (char **argv, const char *path_stdout, const char *path_stderr,
+                 char **env_vars, const char *object_file,
+                 const char *stderr_file, bool hedged, int *status);
+void cloud_observed_costs (bool from_cloud, struct cost_observation *obs);
+void cloud_manifest_request (const char *key);
+bool cloud_manifest_get (const char *manifest_file);
+void cloud_manifest_cancel (void);
 
 void cloud_hook_start_overall_timer(void);
 void cloud_hook_stop_overall_timer(void);
@@ -23,7 +33,9 @@ void cloud_hook_preprocessed_file(const char *file);
 void cloud_hook_reset_includes(void);
 void cloud_hook_object_file (const char *cache_file);
 void cloud_hook_stderr_file (const char *cache_file);
+void cloud_hook_manifest_file (const char *manifest_file);
 void cloud_hook_direct_mode_autodisabled (const char *reason);
+void cloud_hook_expected_compile_time (unsigned int milliseconds);
 void cloud_hook_fork_successful (void);
 
 enum result_type {
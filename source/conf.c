@@ -53,6 +53,23 @@ parse_bool(const char *str, void *result, char **errmsg)
 	}
 }
 
+static bool
+parse_double(const char *str, void *result, char **errmsg)
+{
+	double *value = (double *)result;
+	double x;
+	char *endptr;
+	errno = 0;
+	x = strtod(str, &endptr);
+	if (errno == 0 && x >= 0 && *str != '\0' && *endptr == '\0') {
+		*value = x;
+		return true;
+	} else {
+		*errmsg = format("invalid non-negative number: \"%s\"", str);
+		return false;
+	}
+}
+
 static bool
 parse_env_string(const char *str, void *result, char **errmsg)
 {
@@ -181,6 +198,19 @@ verify_dir_levels(void *value, char **errmsg)
 	}
 }
 
+static bool
+verify_percentile(void *value, char **errmsg)
+{
+	unsigned *percentile = (unsigned *)value;
+	assert(percentile);
+	if (*percentile >= 1 && *percentile <= 100) {
+		return true;
+	} else {
+		*errmsg = format("percentile must be between 1 and 100");
+		return false;
+	}
+}
+
 #define ITEM(name, type) \
 	parse_##type, offsetof(struct conf, name), NULL
 #define ITEM_V(name, type, verification) \
@@ -319,6 +349,12 @@ conf_create(void)
 	conf->cloud_server = x_strdup("api.cloudsourcery.com");
 	conf->cloud_mode = x_strdup("smart");
 	conf->cloud_user_key = x_strdup("");
+	conf->cloud_deadline = 0;
+	conf->costs_log = false;
+	conf->hedge_fraction = 0.5;
+	conf->hedge_percentile = 90;
+	conf->inflight_timeout = 60;
+	conf->spool_size = (uint64_t)64 * 1000 * 1000;
 
 	conf->item_origins = x_malloc(CONFITEMS_TOTAL_KEYWORDS * sizeof(char *));
 	for (i = 0; i < CONFITEMS_TOTAL_KEYWORDS; ++i) {
@@ -343,6 +379,9 @@ conf_free(struct conf *conf)
 	free(conf->path);
 	free(conf->prefix_command);
 	free(conf->temporary_dir);
+	free(conf->cloud_server);
+	free(conf->cloud_mode);
+	free(conf->cloud_user_key);
 	free(conf->item_origins);
 	free(conf);
 }
@@ -618,11 +657,33 @@ conf_print_items(struct conf *conf,
 	reformat(&s, "cloud_server = %s", conf->cloud_server);
 	printer(s, conf->item_origins[find_conf("cloud_server")->number], context);
 
+	reformat(&s, "cloud_mode = %s", conf->cloud_mode);
+	printer(s, conf->item_origins[find_conf("cloud_mode")->number], context);
+
 	reformat(&s, "cloud_key = %s", conf->cloud_user_key);
 	printer(s, conf->item_origins[find_conf("cloud_key")->number], context);
 
-	reformat(&s, "cloud_mode = %s", conf->cloud_mode);
-	printer(s, conf->item_origins[find_conf("cloud_mode")->number], context);
+	reformat(&s, "cloud_deadline = %u", conf->cloud_deadline);
+	printer(s, conf->item_origins[find_conf("cloud_deadline")->number], context);
+
+	reformat(&s, "costs_log = %s", conf->costs_log ? "true" : "false");
+	printer(s, conf->item_origins[find_conf("costs_log")->number], context);
+
+	reformat(&s, "hedge_fraction = %g", conf->hedge_fraction);
+	printer(s, conf->item_origins[find_conf("hedge_fraction")->number], context);
+
+	reformat(&s, "hedge_percentile = %u", conf->hedge_percentile);
+	printer(s, conf->item_origins[find_conf("hedge_percentile")->number],
+	        context);
+
+	reformat(&s, "inflight_timeout = %u", conf->inflight_timeout);
+	printer(s, conf->item_origins[find_conf("inflight_timeout")->number],
+	        context);
+
+	s2 = format_parsable_size_with_suffix(conf->spool_size);
+	reformat(&s, "spool_size = %s", s2);
+	printer(s, conf->item_origins[find_conf("spool_size")->number], context);
+	free(s2);
 
 	free(s);
 	return true;
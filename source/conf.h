@@ -34,6 +34,12 @@ struct conf {
 	char *cloud_server;
 	char *cloud_mode;
 	char *cloud_user_key;
+	unsigned cloud_deadline;
+	bool costs_log;
+	double hedge_fraction;
+	unsigned hedge_percentile;
+	unsigned inflight_timeout;
+	uint64_t spool_size;
 
 	const char **item_origins;
 };
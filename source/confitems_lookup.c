@@ -31,7 +31,7 @@
 
 #line 8 "confitems.gperf"
 struct conf_item;
-/* maximum key range = 50, duplicates = 0 */
+/* maximum key range = 56, duplicates = 0 */
 
 #ifdef __GNUC__
 __inline
@@ -45,32 +45,32 @@ confitems_hash (register const char *str, register unsigned int len)
 {
   static const unsigned char asso_values[] =
     {
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 10, 20, 10,
-       0, 15, 55, 55, 13,  0, 55, 55,  0, 15,
-       5,  0,  0, 55, 25,  0,  0,  5, 55, 55,
-      20, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
-      55, 55, 55, 55, 55, 55
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64,  2, 20, 16,
+      25, 15, 64, 64, 13, 26, 64, 64, 13,  3,
+      10, 24,  2, 64, 31,  5, 22, 18, 64, 64,
+      12, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+      64, 64, 64, 64, 64, 64
     };
   return len + asso_values[(unsigned char)str[1]] + asso_values[(unsigned char)str[0]];
 }
@@ -86,90 +86,103 @@ confitems_get (register const char *str, register unsigned int len)
 {
   enum
     {
-      TOTAL_KEYWORDS = 29,
+      TOTAL_KEYWORDS = 35,
       MIN_WORD_LENGTH = 4,
       MAX_WORD_LENGTH = 19,
-      MIN_HASH_VALUE = 5,
-      MAX_HASH_VALUE = 54
+      MIN_HASH_VALUE = 8,
+      MAX_HASH_VALUE = 63
     };
 
   static const struct conf_item wordlist[] =
     {
       {"",0,NULL,0,NULL}, {"",0,NULL,0,NULL},
       {"",0,NULL,0,NULL}, {"",0,NULL,0,NULL},
-      {"",0,NULL,0,NULL},
-#line 32 "confitems.gperf"
-      {"stats",               22, ITEM(stats, bool)},
-      {"",0,NULL,0,NULL},
-#line 19 "confitems.gperf"
-      {"disable",              9, ITEM(disable, bool)},
-#line 23 "confitems.gperf"
-      {"log_file",            13, ITEM(log_file, env_string)},
-      {"",0,NULL,0,NULL},
-#line 31 "confitems.gperf"
-      {"sloppiness",          21, ITEM(sloppiness, sloppiness)},
-#line 18 "confitems.gperf"
-      {"direct_mode",          8, ITEM(direct_mode, bool)},
+      {"",0,NULL,0,NULL}, {"",0,NULL,0,NULL},
       {"",0,NULL,0,NULL}, {"",0,NULL,0,NULL},
 #line 26 "confitems.gperf"
       {"path",                16, ITEM(path, env_string)},
-#line 35 "confitems.gperf"
-      {"unify",               25, ITEM(unify, bool)},
       {"",0,NULL,0,NULL}, {"",0,NULL,0,NULL},
-#line 13 "confitems.gperf"
-      {"compiler",             3, ITEM(compiler, string)},
-#line 38 "confitems.gperf"
-      {"cloud_key",	     28, ITEM(cloud_user_key, env_string)},
-#line 37 "confitems.gperf"
-      {"cloud_mode",          27, ITEM(cloud_mode, env_string)},
-#line 15 "confitems.gperf"
-      {"compression",          5, ITEM(compression, bool)},
-#line 36 "confitems.gperf"
-      {"cloud_server",        26, ITEM(cloud_server, env_string)},
-#line 17 "confitems.gperf"
-      {"cpp_extension",        7, ITEM(cpp_extension, string)},
-#line 14 "confitems.gperf"
-      {"compiler_check",       4, ITEM(compiler_check, string)},
-#line 34 "confitems.gperf"
-      {"umask",               24, ITEM(umask, umask)},
-      {"",0,NULL,0,NULL},
-#line 16 "confitems.gperf"
-      {"compression_level",    6, ITEM(compression_level, unsigned)},
-#line 33 "confitems.gperf"
-      {"temporary_dir",       23, ITEM(temporary_dir, env_string)},
-#line 11 "confitems.gperf"
-      {"cache_dir",            1, ITEM(cache_dir, env_string)},
+      {"",0,NULL,0,NULL}, {"",0,NULL,0,NULL},
+#line 25 "confitems.gperf"
+      {"max_size",            15, ITEM(max_size, size)},
+#line 24 "confitems.gperf"
+      {"max_files",           14, ITEM(max_files, unsigned)},
+      {"",0,NULL,0,NULL}, {"",0,NULL,0,NULL},
+#line 44 "confitems.gperf"
+      {"spool_size",          34, ITEM(spool_size, size)},
+      {"",0,NULL,0,NULL}, {"",0,NULL,0,NULL},
+      {"",0,NULL,0,NULL}, {"",0,NULL,0,NULL},
       {"",0,NULL,0,NULL},
 #line 22 "confitems.gperf"
       {"hash_dir",            12, ITEM(hash_dir, bool)},
 #line 21 "confitems.gperf"
       {"hard_link",           11, ITEM(hard_link, bool)},
-#line 25 "confitems.gperf"
-      {"max_size",            15, ITEM(max_size, size)},
-#line 24 "confitems.gperf"
-      {"max_files",           14, ITEM(max_files, unsigned)},
       {"",0,NULL,0,NULL},
-#line 12 "confitems.gperf"
-      {"cache_dir_levels",     2, ITEM_V(cache_dir_levels, unsigned, dir_levels)},
+#line 34 "confitems.gperf"
+      {"umask",               24, ITEM(umask, umask)},
+#line 11 "confitems.gperf"
+      {"cache_dir",            1, ITEM(cache_dir, env_string)},
+#line 31 "confitems.gperf"
+      {"sloppiness",          21, ITEM(sloppiness, sloppiness)},
       {"",0,NULL,0,NULL},
 #line 10 "confitems.gperf"
       {"base_dir",             0, ITEM_V(base_dir, env_string, absolute_path)},
+#line 17 "confitems.gperf"
+      {"cpp_extension",        7, ITEM(cpp_extension, string)},
+#line 32 "confitems.gperf"
+      {"stats",               22, ITEM(stats, bool)},
+#line 35 "confitems.gperf"
+      {"unify",               25, ITEM(unify, bool)},
+#line 12 "confitems.gperf"
+      {"cache_dir_levels",     2, ITEM_V(cache_dir_levels, unsigned, dir_levels)},
+      {"",0,NULL,0,NULL}, {"",0,NULL,0,NULL},
+      {"",0,NULL,0,NULL},
+#line 38 "confitems.gperf"
+      {"cloud_key",	     28, ITEM(cloud_user_key, env_string)},
+#line 37 "confitems.gperf"
+      {"cloud_mode",          27, ITEM(cloud_mode, env_string)},
+      {"",0,NULL,0,NULL},
+#line 36 "confitems.gperf"
+      {"cloud_server",        26, ITEM(cloud_server, env_string)},
+#line 41 "confitems.gperf"
+      {"hedge_fraction",      31, ITEM(hedge_fraction, double)},
+#line 39 "confitems.gperf"
+      {"cloud_deadline",      29, ITEM(cloud_deadline, unsigned)},
+#line 42 "confitems.gperf"
+      {"hedge_percentile",    32, ITEM_V(hedge_percentile, unsigned, percentile)},
+#line 23 "confitems.gperf"
+      {"log_file",            13, ITEM(log_file, env_string)},
+#line 20 "confitems.gperf"
+      {"extra_files_to_hash", 10, ITEM(extra_files_to_hash, env_string)},
 #line 27 "confitems.gperf"
       {"prefix_command",      17, ITEM(prefix_command, env_string)},
-      {"",0,NULL,0,NULL}, {"",0,NULL,0,NULL},
-      {"",0,NULL,0,NULL}, {"",0,NULL,0,NULL},
-#line 30 "confitems.gperf"
-      {"run_second_cpp",      20, ITEM(run_second_cpp, bool)},
-      {"",0,NULL,0,NULL}, {"",0,NULL,0,NULL},
+#line 13 "confitems.gperf"
+      {"compiler",             3, ITEM(compiler, string)},
+#line 40 "confitems.gperf"
+      {"costs_log",           30, ITEM(costs_log, bool)},
+#line 33 "confitems.gperf"
+      {"temporary_dir",       23, ITEM(temporary_dir, env_string)},
+#line 15 "confitems.gperf"
+      {"compression",          5, ITEM(compression, bool)},
+#line 43 "confitems.gperf"
+      {"inflight_timeout",    33, ITEM(inflight_timeout, unsigned)},
 #line 29 "confitems.gperf"
       {"recache",             19, ITEM(recache, bool)},
-      {"",0,NULL,0,NULL},
+#line 14 "confitems.gperf"
+      {"compiler_check",       4, ITEM(compiler_check, string)},
 #line 28 "confitems.gperf"
       {"read_only",           18, ITEM(read_only, bool)},
+      {"",0,NULL,0,NULL},
+#line 16 "confitems.gperf"
+      {"compression_level",    6, ITEM(compression_level, unsigned)},
+#line 19 "confitems.gperf"
+      {"disable",              9, ITEM(disable, bool)},
       {"",0,NULL,0,NULL}, {"",0,NULL,0,NULL},
-      {"",0,NULL,0,NULL}, {"",0,NULL,0,NULL},
-#line 20 "confitems.gperf"
-      {"extra_files_to_hash", 10, ITEM(extra_files_to_hash, env_string)}
+      {"",0,NULL,0,NULL},
+#line 18 "confitems.gperf"
+      {"direct_mode",          8, ITEM(direct_mode, bool)},
+#line 30 "confitems.gperf"
+      {"run_second_cpp",      20, ITEM(run_second_cpp, bool)}
     };
 
   if (len <= MAX_WORD_LENGTH && len >= MIN_WORD_LENGTH)
@@ -186,4 +199,4 @@ confitems_get (register const char *str, register unsigned int len)
     }
   return 0;
 }
-static const size_t CONFITEMS_TOTAL_KEYWORDS = 29;
+static const size_t CONFITEMS_TOTAL_KEYWORDS = 35;
@@ -0,0 +1,535 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The compile-cost database, which the "smart" cloud mode uses to choose, for
+ * each translation unit, between compiling locally, asking the cloud cache
+ * and racing the two.
+ *
+ * The database is one file in the cache directory: a header and then
+ * COSTS_SLOTS fixed-size records, each keyed by a hash of a translation unit.
+ * A key may sit in any of the PROBE slots from the one its hash picks, and
+ * displaces the least recently used record there when they are all taken,
+ * so the file never grows and a lookup is a single read. An update locks
+ * just the PROBE records it reads and rewrites, with a byte-range lock on
+ * the file, so that concurrent compiles only wait for each other when their
+ * keys share slots; lookups take no lock, and at worst see a stale record.
+ * (Starting a database afresh locks all of it.)
+ *
+ * A compile may also append a line to a log, under a lock on the log,
+ * recording what was known beforehand, what was done and what it cost, so
+ * that costs_simulate can replay the log against each policy.
+ */
+
+#include "ccache.h"
+#include "costs.h"
+
+#define HEADER "cs costs 2\n"
+#define PROBE 8
+
+/* The log is started afresh, keeping one old copy, once it is this big. */
+#define LOG_LIMIT (1024 * 1024)
+
+static const char *const choice_names[] = {"local", "remote", "race"};
+
+const char *
+costs_choice_name(enum cost_choice choice)
+{
+	return choice_names[choice];
+}
+
+static off_t
+slot_offset(size_t slot)
+{
+	return sizeof(HEADER) + slot * sizeof(struct cost_record);
+}
+
+static size_t
+first_slot(const uint8_t *key)
+{
+	uint32_t h = key[0] | key[1] << 8 | key[2] << 16 | (uint32_t)key[3] << 24;
+	return h % (COSTS_SLOTS - PROBE + 1);
+}
+
+/*
+ * Take (type F_WRLCK) or drop (F_UNLCK) a lock on len bytes of fd from
+ * start, or to the end of the file if len is 0, waiting for any conflicting
+ * lock. Where they are available, the locks belong to the open file instead
+ * of the process, so that they also keep the threads of one process apart.
+ * Returns false on error.
+ */
+static bool
+lock_range(int fd, short type, off_t start, off_t len)
+{
+#ifdef _WIN32
+	(void)fd;
+	(void)type;
+	(void)start;
+	(void)len;
+	return true;
+#else
+	struct flock fl;
+	int ret;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = len;
+#ifdef F_OFD_SETLKW
+	do {
+		ret = fcntl(fd, F_OFD_SETLKW, &fl);
+	} while (ret == -1 && errno == EINTR);
+	if (ret == 0 || errno != EINVAL) {
+		return ret == 0;
+	}
+	/* An older kernel. */
+#endif
+	do {
+		ret = fcntl(fd, F_SETLKW, &fl);
+	} while (ret == -1 && errno == EINTR);
+	return ret == 0;
+#endif
+}
+
+/*
+ * Read the PROBE records where key may be. Returns false if fd isn't a cost
+ * database.
+ */
+static bool
+read_window(int fd, const uint8_t *key, struct cost_record *window)
+{
+	char header[sizeof(HEADER)];
+	size_t size = PROBE * sizeof(*window);
+
+	return pread(fd, header, sizeof(header), 0) == sizeof(header)
+	       && memcmp(header, HEADER, sizeof(header)) == 0
+	       && pread(fd, window, size, slot_offset(first_slot(key)))
+	          == (ssize_t)size;
+}
+
+/*
+ * Look up the record for key in the database at path. Returns false if there
+ * is none.
+ */
+bool
+costs_lookup(const char *path, const uint8_t *key, struct cost_record *record)
+{
+	struct cost_record window[PROBE];
+	bool found = false;
+	int fd, i;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		return false;
+	}
+	if (read_window(fd, key, window)) {
+		for (i = 0; i < PROBE; i++) {
+			if (window[i].last_used != 0
+			    && memcmp(window[i].key, key, sizeof(window[i].key)) == 0) {
+				*record = window[i];
+				found = true;
+				break;
+			}
+		}
+	}
+	close(fd);
+	return found;
+}
+
+/* Fold a new measurement into a smoothed time, which is zero if unknown. */
+static uint32_t
+smooth(uint32_t old, int32_t value)
+{
+	uint32_t new = value > 0 ? (uint32_t)value : 1;
+	return old ? ((uint64_t)old * 3 + new) / 4 : new;
+}
+
+/* Add what one compile found out to a record. */
+void
+costs_observe(struct cost_record *record, const struct cost_observation *obs)
+{
+	if (obs->compile_time >= 0) {
+		record->compile_time = smooth(record->compile_time, obs->compile_time);
+	}
+	if (obs->cloud_hit >= 0) {
+		if (record->cloud_tries == UINT16_MAX) {
+			record->cloud_tries /= 2;
+			record->cloud_hits /= 2;
+		}
+		record->cloud_tries++;
+		if (obs->cloud_hit) {
+			record->cloud_hits++;
+		}
+		if (obs->get_time >= 0) {
+			uint32_t *time = obs->cloud_hit ? &record->hit_time : &record->miss_time;
+			*time = smooth(*time, obs->get_time);
+		}
+		record->cloud_skips = 0;
+	} else if (record->cloud_skips < UINT32_MAX) {
+		record->cloud_skips++;
+	}
+	if (obs->object_size) {
+		record->object_size = obs->object_size;
+	}
+}
+
+/*
+ * Make the file open as fd, which is at path, an empty cost database, unless
+ * someone else has just done so. Returns false on error.
+ */
+static bool
+create_database(const char *path, int fd)
+{
+	char header[sizeof(HEADER)];
+	bool ok = true;
+
+	if (!lock_range(fd, F_WRLCK, 0, 0)) {
+		cc_log("Failed to lock %s: %s", path, strerror(errno));
+		return false;
+	}
+	if ((pread(fd, header, sizeof(header), 0) != sizeof(header)
+	     || memcmp(header, HEADER, sizeof(header)) != 0)
+	    && (ftruncate(fd, 0) != 0
+	        || pwrite(fd, HEADER, sizeof(HEADER), 0) != sizeof(HEADER)
+	        || ftruncate(fd, slot_offset(COSTS_SLOTS)) != 0)) {
+		cc_log("Failed to create %s: %s", path, strerror(errno));
+		ok = false;
+	}
+	lock_range(fd, F_UNLCK, 0, 0);
+	return ok;
+}
+
+/*
+ * Add what one compile found out to the record for key in the database open
+ * as fd, which is at path, with the records where it may be locked. Returns
+ * false if the database couldn't be written.
+ */
+static bool
+update_record(const char *path, int fd, const uint8_t *key,
+              const struct cost_observation *obs)
+{
+	struct cost_record window[PROBE];
+	off_t start = slot_offset(first_slot(key));
+	int i, slot = -1;
+	bool ok = false;
+
+	if (!lock_range(fd, F_WRLCK, start, sizeof(window))) {
+		cc_log("Failed to lock %s: %s", path, strerror(errno));
+		return false;
+	}
+	if (!read_window(fd, key, window)) {
+		/* New, or not ours: start again, which needs the whole file. */
+		lock_range(fd, F_UNLCK, start, sizeof(window));
+		if (!create_database(path, fd)) {
+			return false;
+		}
+		if (!lock_range(fd, F_WRLCK, start, sizeof(window))) {
+			cc_log("Failed to lock %s: %s", path, strerror(errno));
+			return false;
+		}
+		if (!read_window(fd, key, window)) {
+			cc_log("Failed to read %s", path);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < PROBE; i++) {
+		if (window[i].last_used != 0
+		    && memcmp(window[i].key, key, sizeof(window[i].key)) == 0) {
+			slot = i;
+			break;
+		}
+		if (slot == -1 || window[i].last_used < window[slot].last_used) {
+			slot = i;
+		}
+	}
+	if (memcmp(window[slot].key, key, sizeof(window[slot].key)) != 0
+	    || window[slot].last_used == 0) {
+		memset(&window[slot], 0, sizeof(window[slot]));
+		memcpy(window[slot].key, key, sizeof(window[slot].key));
+	}
+	costs_observe(&window[slot], obs);
+	window[slot].last_used = time(NULL);
+	ok = pwrite(fd, &window[slot], sizeof(window[slot]),
+	            slot_offset(first_slot(key) + slot))
+	     == sizeof(window[slot]);
+	if (!ok) {
+		cc_log("Failed to write %s: %s", path, strerror(errno));
+	}
+
+out:
+	lock_range(fd, F_UNLCK, start, sizeof(window));
+	return ok;
+}
+
+/*
+ * Append a line for entry and obs to the log at path, with the log locked,
+ * first moving it aside if it has grown too big.
+ */
+static void
+append_log(const char *path, const struct cost_log_entry *entry,
+           const struct cost_observation *obs)
+{
+	static const struct cost_record none;
+	const struct cost_record *record = entry->record ? entry->record : &none;
+	struct stat st, path_st;
+	char *line, *old;
+	int fd;
+
+	line = format("%s %.2f %d %u %u %u %u %u %d %d %d %u\n",
+	              entry->mode, entry->load, entry->ncpus,
+	              record->compile_time, record->hit_time, record->miss_time,
+	              record->cloud_tries, record->cloud_hits,
+	              obs->compile_time, obs->get_time, obs->cloud_hit,
+	              obs->object_size);
+	while (true) {
+		fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_BINARY, 0666);
+		if (fd == -1) {
+			cc_log("Failed to open %s: %s", path, strerror(errno));
+			goto out;
+		}
+		if (!lock_range(fd, F_WRLCK, 0, 0)) {
+			cc_log("Failed to lock %s: %s", path, strerror(errno));
+			close(fd);
+			goto out;
+		}
+		/* Whoever held the lock may have moved the log aside. */
+		if (fstat(fd, &st) != 0 || stat(path, &path_st) != 0
+		    || st.st_dev != path_st.st_dev
+		    || st.st_ino != path_st.st_ino) {
+			close(fd);
+			continue;
+		}
+		if (st.st_size <= LOG_LIMIT) {
+			break;
+		}
+		old = format("%s.old", path);
+		x_rename(path, old);
+		free(old);
+		close(fd);
+	}
+	if (write(fd, line, strlen(line)) != (ssize_t)strlen(line)) {
+		cc_log("Failed to write %s: %s", path, strerror(errno));
+	}
+	close(fd);
+
+out:
+	free(line);
+}
+
+/*
+ * Add what one compile found out to the records for each of the nkeys keys
+ * in the database at path, creating either as needed, and if log isn't NULL,
+ * append a line recording the compile to the log, path with ".log" added.
+ */
+void
+costs_update(const char *path, const uint8_t *const *keys, int nkeys,
+             const struct cost_observation *obs,
+             const struct cost_log_entry *log)
+{
+	int fd, i;
+
+	fd = open(path, O_RDWR | O_CREAT | O_BINARY, 0666);
+	if (fd == -1) {
+		cc_log("Failed to open %s: %s", path, strerror(errno));
+	} else {
+		for (i = 0; i < nkeys; i++) {
+			if (!update_record(path, fd, keys[i], obs)) {
+				break;
+			}
+		}
+		close(fd);
+	}
+	if (log) {
+		char *log_path = format("%s.log", path);
+		append_log(log_path, log, obs);
+		free(log_path);
+	}
+}
+
+/*
+ * The expected latency and CPU time of doing choice for a translation unit
+ * that takes compile to build locally, where the cloud cache takes hit to
+ * answer a hit and miss to answer a miss, and hits with probability p.
+ */
+static void
+expected_cost(enum cost_choice choice, double compile, double hit, double miss,
+              double p, double *latency, double *cpu)
+{
+	double first = hit < compile ? hit : compile;
+
+	switch (choice) {
+	case COST_LOCAL:
+	default:
+		*latency = *cpu = compile;
+		break;
+	case COST_REMOTE:
+		*latency = p * hit + (1 - p) * (miss + compile);
+		*cpu = (1 - p) * compile;
+		break;
+	case COST_RACE:
+		/* The compiler runs until the cloud hits, or to the end. */
+		*latency = *cpu = p * first + (1 - p) * compile;
+		break;
+	}
+}
+
+/* The fraction of the machine that is busy, judging by the load average. */
+static double
+busyness(double load, int ncpus)
+{
+	double busy = load / (ncpus > 0 ? ncpus : 1);
+	return busy < 0 ? 0 : busy > 1 ? 1 : busy;
+}
+
+static enum cost_choice
+cheapest(double compile, double hit, double miss, double p, double busy)
+{
+	enum cost_choice choice, best = COST_LOCAL;
+	double best_cost = 0;
+
+	for (choice = COST_LOCAL; choice <= COST_RACE; choice++) {
+		double latency, cpu, cost;
+		expected_cost(choice, compile, hit, miss, p, &latency, &cpu);
+		cost = (1 - busy) * latency + busy * cpu;
+		if (choice == COST_LOCAL || cost < best_cost) {
+			best = choice;
+			best_cost = cost;
+		}
+	}
+	return best;
+}
+
+/*
+ * Choose what to do about a compile, given its record (or NULL if there is
+ * none), the load average and the number of CPUs.
+ *
+ * An idle machine should just get the answer soonest, but on a busy one a
+ * compile holds up the others, and what matters is the CPU time it takes.
+ * So the choice minimizes a mix of the two, weighted by how busy the machine
+ * is. The cloud's hit rate is estimated from its answers, starting from even
+ * odds. Until the cloud cache has answered for this translation unit, the
+ * choice falls back to racing when the load average is below 2.
+ *
+ * Compiling locally teaches us nothing about the cloud, so once that is the
+ * choice it would stick even if the network got faster. Every
+ * COSTS_EXPLORE_EVERY'th compile without an answer from the cloud races it
+ * instead, which costs no more than compiling alone, to measure it again.
+ */
+enum cost_choice
+costs_choose(const struct cost_record *record, double load, int ncpus)
+{
+	enum cost_choice choice;
+	double p;
+	uint32_t hit, miss;
+
+	if (!record || (!record->hit_time && !record->miss_time)) {
+		return load < 2 ? COST_RACE : COST_REMOTE;
+	}
+	if (!record->compile_time) {
+		/* The cloud has always had it. */
+		return COST_REMOTE;
+	}
+	p = (record->cloud_hits + 1.0) / (record->cloud_tries + 2.0);
+	hit = record->hit_time ? record->hit_time : record->miss_time;
+	miss = record->miss_time ? record->miss_time : record->hit_time;
+	choice = cheapest(record->compile_time, hit, miss, p,
+	                  busyness(load, ncpus));
+	if (choice == COST_LOCAL
+	    && record->cloud_skips + 1 >= COSTS_EXPLORE_EVERY) {
+		return COST_RACE;
+	}
+	return choice;
+}
+
+/*
+ * Replay a log written by costs_update, and print to out the total latency
+ * and CPU time that each policy would have cost: what was recorded, always
+ * compiling locally, always asking the cloud first, always racing, and what
+ * costs_choose picks. What a compile didn't measure (such as the compile time
+ * of a cloud hit) is taken from its record; compiles whose record doesn't
+ * say either are left out. Returns the number of compiles replayed.
+ */
+int
+costs_simulate(FILE *log, FILE *out)
+{
+	static const char *const policies[] = {
+		"recorded", "local", "remote", "race", "smart"
+	};
+	double latency_total[5] = {0}, cpu_total[5] = {0};
+	char line[256], mode[16];
+	int total = 0, used = 0, i;
+
+	while (fgets(line, sizeof(line), log)) {
+		struct cost_record record;
+		struct cost_observation obs;
+		unsigned tries, hits;
+		double load, compile, hit, miss, p;
+		int ncpus;
+		enum cost_choice choices[5];
+
+		memset(&record, 0, sizeof(record));
+		if (sscanf(line, "%15s %lf %d %u %u %u %u %u %d %d %d %u",
+		           mode, &load, &ncpus, &record.compile_time,
+		           &record.hit_time, &record.miss_time, &tries, &hits,
+		           &obs.compile_time, &obs.get_time, &obs.cloud_hit,
+		           &obs.object_size) != 12) {
+			continue;
+		}
+		record.cloud_tries = tries;
+		record.cloud_hits = hits;
+		total++;
+
+		compile = (obs.compile_time >= 0
+		           ? obs.compile_time : (double)record.compile_time);
+		if (obs.cloud_hit >= 0 && obs.get_time >= 0) {
+			p = obs.cloud_hit;
+			hit = miss = obs.get_time;
+		} else {
+			p = (record.cloud_hits + 1.0) / (record.cloud_tries + 2.0);
+			hit = record.hit_time ? record.hit_time : record.miss_time;
+			miss = record.miss_time ? record.miss_time : record.hit_time;
+		}
+		if (compile <= 0 || (hit <= 0 && miss <= 0)) {
+			continue;
+		}
+		used++;
+
+		choices[0] = (str_eq(mode, "local") ? COST_LOCAL
+		              : str_eq(mode, "remote") ? COST_REMOTE : COST_RACE);
+		choices[1] = COST_LOCAL;
+		choices[2] = COST_REMOTE;
+		choices[3] = COST_RACE;
+		choices[4] = costs_choose(&record, load, ncpus);
+		for (i = 0; i < 5; i++) {
+			double latency, cpu;
+			expected_cost(choices[i], compile, hit, miss, p, &latency, &cpu);
+			latency_total[i] += latency;
+			cpu_total[i] += cpu;
+		}
+	}
+
+	fprintf(out, "Replayed %d of %d recorded compiles\n", used, total);
+	fprintf(out, "%-10s %12s %12s\n", "policy", "latency", "CPU time");
+	for (i = 0; i < 5; i++) {
+		fprintf(out, "%-10s %10.3f s %10.3f s\n", policies[i],
+		        latency_total[i] / 1000, cpu_total[i] / 1000);
+	}
+	return used;
+}
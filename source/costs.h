@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef COSTS_H
+#define COSTS_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/* The number of records in a cost database. */
+#define COSTS_SLOTS 4096
+
+/*
+ * How often a translation unit that is best compiled locally races the cloud
+ * cache anyway, to see whether that has changed.
+ */
+#define COSTS_EXPLORE_EVERY 16
+
+/*
+ * What past compiles of one translation unit cost. Times are smoothed over
+ * the compiles, in milliseconds, and zero if never measured.
+ */
+struct cost_record {
+	uint8_t key[16];
+	uint32_t compile_time; /* running the compiler locally */
+	uint32_t hit_time;     /* a cloud cache GET that found the object */
+	uint32_t miss_time;    /* a cloud cache GET that didn't */
+	uint32_t object_size;  /* the last object, in bytes */
+	uint32_t cloud_skips;  /* compiles since the cloud cache last answered */
+	uint16_t cloud_tries;  /* cloud cache GETs that were answered */
+	uint16_t cloud_hits;
+	uint32_t last_used;    /* a time(), for choosing a record to replace */
+};
+
+/*
+ * What one compile found out. Times are in milliseconds, or -1 if not
+ * measured; cloud_hit is -1 if the cloud cache didn't answer.
+ */
+struct cost_observation {
+	int32_t compile_time;
+	int32_t get_time;
+	int cloud_hit;
+	uint32_t object_size;
+};
+
+/*
+ * How a compile was done, for the log: by mode ("local", "remote", "race" or
+ * "hedged"), under the given load, and what its record (or NULL) said
+ * beforehand.
+ */
+struct cost_log_entry {
+	const char *mode;
+	double load;
+	int ncpus;
+	const struct cost_record *record;
+};
+
+/* How to go about a compile that missed the local cache. */
+enum cost_choice {
+	COST_LOCAL,  /* only run the compiler */
+	COST_REMOTE, /* ask the cloud cache, and compile if it misses */
+	COST_RACE    /* do both at once */
+};
+
+const char *costs_choice_name(enum cost_choice choice);
+bool costs_lookup(const char *path, const uint8_t *key,
+                  struct cost_record *record);
+void costs_update(const char *path, const uint8_t *const *keys, int nkeys,
+                  const struct cost_observation *obs,
+                  const struct cost_log_entry *log);
+void costs_observe(struct cost_record *record,
+                   const struct cost_observation *obs);
+enum cost_choice costs_choose(const struct cost_record *record, double load,
+                              int ncpus);
+int costs_simulate(FILE *log, FILE *out);
+
+#endif
@@ -38,12 +38,34 @@
    using non-blocking I/O and 'select'. The Internet communications use
    Libcurl's 'multi' interface to maintain a pool of connections. The size
    of the pool is scaled automatically according to the size of the local
-   backlog. */
+   backlog.
+
+   Recent GET responses are also remembered in memory, so that repeated
+   queries for the same object need not reach the server at all.
+
+   Queued requests are scheduled so that cache lookups, which hold up
+   builds, are not stuck behind uploads of results.
+
+   Some questions need no network at all: the daemon also opens files in
+   the local cache for clients, and remembers the identities of the
+   toolchains they use, so that each compile doesn't have to work them
+   out again.
+
+   Clients hand over the results of their compiles, too, and the daemon
+   uploads them while the clients go on to other work.
+
+   Finally, the daemon can run whole compiles for a minimal client, cs-client,
+   which saves the cost of starting cs for each one.  */
 
 #include "ccache.h"
 #include "daemon.h"
 #include "conf.h"
-extern struct conf *conf;
+#include "encoding.h"
+#include "hashtable.h"
+#include "hashutil.h"
+#include "histogram.h"
+#include "multipart.h"
+#include "spool.h"
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -55,6 +77,7 @@ extern struct conf *conf;
 #include <sys/time.h>
 #include <pwd.h>
 #include <sys/utsname.h>
+#include <json.h>
 
 //#define DISABLE_DAEMON 1
 //#define DEBUG 1
@@ -66,7 +89,10 @@ extern struct conf *conf;
 #define DEBUG 0
 #endif
 
-#define LOCAL_PROTOCOL_REVISION 1
+#define LOCAL_PROTOCOL_REVISION 2
+
+/* The most files one 'L' command may ask for.  */
+#define MAX_LOOKUP_FILES 16
 
 struct local_connection_state
 {
@@ -83,12 +109,35 @@ struct local_connection_state
     size_t length;
     struct mmap *next;
   } *mmaps;
+  struct form_stream {
+    struct encoder *encoder;
+    struct form_stream *next;
+  } *streams;                  /* Encoded parts, read as they are sent.  */
 
   struct timeval request_time;
+  unsigned int deadline_ms;    /* From the 'T' command, or zero.  */
+  struct timeval deadline;     /* When a GET stops being useful.  */
+  size_t upload_size;
+
+  char *cache_key;
+  char request_code;
+
+  /* An 'X' command: the request, until the descriptors arrive, and then
+     the process running it.  */
+  char *serve_request;
+  size_t serve_request_size;
+  pid_t serve_pid;
 
   struct internet_connection_state *iconn;
   struct server_response *response;
 
+  /* For a request sending uploads taken over from clients, with no client
+     of its own: the uploads, and whether they went to the batch endpoint.
+     See "Result uploads".  */
+  struct upload **batch;
+  int batch_size;
+  bool batched;
+
   enum {
     STATE_RECV_INIT,
     STATE_RECV_SIZE,
@@ -100,6 +149,15 @@ struct local_connection_state
     STATE_RECV_ATTACHMENT_FILE,
     STATE_RECV_ATTACHMENT_FILENAME,
     STATE_RECV_ATTACHMENT_COMPLETE,
+    STATE_RECV_DEADLINE,
+    STATE_RECV_PACE,
+    STATE_RECV_COMPILE_TIME,
+    STATE_RECV_LOOKUP,
+    STATE_RECV_TOOLCHAIN,
+    STATE_RECV_SERVE,
+    STATE_RECV_SERVE_FDS,
+    STATE_RECV_UPLOAD,
+    STATE_SERVING,
     STATE_WAITING,
     STATE_INPROGRESS,
     STATE_SEND_INIT,
@@ -126,6 +184,13 @@ struct job_queue {
   struct job_queue *next;
 };
 
+/* The queued and running jobs of one kind.  */
+struct job_class {
+  struct job_queue *first, *last;
+  int waiting;
+  int active;
+};
+
 struct internet_connection_state
 {
   CURL *curl_handle;
@@ -135,9 +200,14 @@ struct internet_connection_state
   bool active;
   struct server_response *response;
   struct local_connection_state *lconn;
+  char *cache_key;
+  bool post;
 
   struct timeval request_time;
 
+  /* The request headers of a resumed GET, with its If-Range.  */
+  struct curl_slist *resume_headers;
+
   struct internet_connection_state *next;
 };
 
@@ -150,19 +220,16 @@ static int master_socket = -1;
 static char *master_socket_path = NULL;
 int nfds = 0;
 static struct local_connection_state *local = NULL, *last_local = NULL;
-static struct job_queue *job_queue = NULL;
-static struct job_queue *last_queued_get = NULL, *last_queued_post = NULL;
+static struct job_class get_jobs, post_jobs;
 static int active_clients = 0;
 static int waiting_jobs = 0;
 static unsigned int client_counter = 0;
 static unsigned int get_request_counter = 0;
 static unsigned int post_request_counter = 0;
-static double lowest_get_response_time = 0;
-static double highest_get_response_time = 0;
-static double lowest_post_response_time = 0;
-static double highest_post_response_time = 0;
-static double average_get_response_time = 0;
-static double average_post_response_time = 0;
+static unsigned int cancelled_request_counter = 0;
+static int peak_waiting_jobs = 0;
+static uint64_t bytes_from_clients = 0;
+static uint64_t bytes_to_clients = 0;
 
 /* Internet (cURL) global state.  */
 CURLM *multi_handle = NULL;
@@ -170,12 +237,82 @@ static struct internet_connection_state *internet = NULL;
 static int active_internet_connection_count = 0;
 static int internet_pool_count = 0;
 static unsigned int internet_request_counter = 0;
-static double lowest_internet_get_response_time = 0;
-static double highest_internet_get_response_time = 0;
-static double lowest_internet_post_response_time = 0;
-static double highest_internet_post_response_time = 0;
-static double average_internet_get_response_time = 0;
-static double average_internet_post_response_time = 0;
+static int peak_active_internet_connections = 0;
+static double busy_connection_seconds = 0;
+static struct timeval pool_usage_mark;
+static uint64_t bytes_downloaded = 0;
+static uint64_t bytes_uploaded = 0;
+static bool use_http2 = false;
+static unsigned int http2_transfers = 0;
+static const char *ca_bundle = NULL;
+/* Makes the names of concurrent downloads unique within the process.  */
+static unsigned int download_counter = 0;
+
+/* Content encodings.
+
+   Each request offers the server the encodings in CS_DAEMON_ENCODINGS
+   (default "zstd, gzip", or just "gzip" without libzstd) in its
+   Accept-Encoding header.  The server may then send any part in one of
+   them, naming it in the part's Content-Encoding header, and the part is
+   decoded as it arrives, straight into its file.  The server names the
+   encodings it takes for uploads in the Accept-Encoding header of its
+   responses (RFC 7694), and from then on attachments of ENCODE_MIN_SIZE
+   bytes or more go in the first of ours that it takes, at compression
+   level CS_DAEMON_ENCODING_LEVEL (default 1).  They are encoded as curl
+   sends them, so there's never an encoded copy of the whole.  */
+#define ENCODE_MIN_SIZE 4096
+
+static enum encoding encodings[ENCODING_COUNT];
+static int encoding_count = 0;
+static char *accept_encoding = NULL;
+static int encoding_level = 1;
+static struct curl_slist *encoding_headers[ENCODING_COUNT];
+static bool server_accepts[ENCODING_COUNT];
+static unsigned int encoded_parts_sent = 0;
+static uint64_t encoded_raw_bytes_sent = 0, encoded_bytes_sent = 0;
+static unsigned int encoded_parts_received = 0;
+static uint64_t encoded_raw_bytes_received = 0, encoded_bytes_received = 0;
+
+/* Resumed downloads.
+
+   A GET cut off part way through a 200 response, by a reset connection or
+   a timeout, is taken up where it stopped with a Range request on a fresh
+   connection, if the server said it takes byte ranges and gave the
+   response an ETag.  The ETag goes in If-Range, so that the server sends
+   the whole response again if it has changed since.  Nothing received is
+   thrown away: the multipart parser, and any decoder and attachment file
+   of the part it was in, carry on where they were.  A GET is resumed at
+   most CS_DAEMON_RESUME_ATTEMPTS times (default 3), and never after its
+   deadline has passed.
+
+   The server may give the hash of an attachment's content, in the form
+   it files content by, in the part's Content-Hash header.  The attachment
+   is checked against that before it is accepted, whether the GET was
+   resumed or not, and one that doesn't match fails the GET.  */
+static int resume_attempts = 3;
+static unsigned int resumed_downloads = 0;
+static uint64_t resumed_bytes_kept = 0;
+static unsigned int content_hash_mismatches = 0;
+
+/* Latency statistics, in microseconds.  The "queue" time is spent waiting
+   for a free internet connection, the "internet" time is spent talking to
+   the server, and the "overall" time runs from the client's request to the
+   end of the daemon's reply.  */
+static struct histogram get_queue_times, get_internet_times, get_overall_times;
+static struct histogram post_queue_times, post_internet_times,
+                        post_overall_times;
+static struct timeval daemon_start_time, stats_reset_time;
+
+/* The most recent GET response times and local compile times, in
+   microseconds, for the 'P' command.  Unlike the histograms, these forget
+   old samples, so they follow a change of network or machine load.  */
+#define RECENT_SAMPLES 64
+struct recent_samples
+{
+  uint32_t value[RECENT_SAMPLES];
+  unsigned int count;
+};
+static struct recent_samples recent_get_times, recent_compile_times;
 
 static struct internet_connection_state *init_new_easy_handle(void);
 static int set_url(struct local_connection_state *conn, char *url);
@@ -190,6 +327,10 @@ static int get_response(struct local_connection_state *conn,
                         union daemon_responses **dr_ptr);
 static void setup_internet_request (struct internet_connection_state *iconn,
                                     struct local_connection_state *lconn);
+static char *json_string_field (const char *data, const char *field);
+static void close_local_connection (struct local_connection_state *conn);
+static void release_internet_connection (struct internet_connection_state *iconn);
+static void cancel_job (struct local_connection_state *conn);
 
 #define FREE(PTR) do {free(PTR); PTR = NULL;} while (0)
 
@@ -265,14 +406,11 @@ launch_daemon (void)
   return 0;
 }
 
-daemon_handle
-connect_to_daemon (void)
+/* Connect to the daemon for this cache.  If none is running, and LAUNCH is
+   true, start a new one and wait for it.  Returns zero on failure.  */
+static daemon_handle
+open_daemon_socket (bool launch)
 {
-  if (DISABLE_DAEMON)
-    {
-      local = x_calloc (1, sizeof (*local));
-      return init_new_easy_handle () != NULL;
-    }
   struct timeval starttime, endtime, timediff;
   gettimeofday(&starttime, NULL);
 
@@ -286,18 +424,38 @@ connect_to_daemon (void)
   // Build the socket name
   struct sockaddr_un addr = {AF_UNIX, ""};
   char *host_name = get_host_name ();
-  char *socket_path = format ("daemon.%d.%s.%d", geteuid (), host_name,
+  char *socket_name = format ("daemon.%d.%s.%d", geteuid (), host_name,
                               LOCAL_PROTOCOL_REVISION);
-  strcpy (addr.sun_path, socket_path);
-  free (socket_path);
+  char *socket_path = format ("%s/%s", conf->cache_dir, socket_name);
   free (host_name);
 
-  char *cwd = get_working_directory ();
-  if (chdir (conf->cache_dir) == -1
-      || connect (newfd, &addr, sizeof(addr)) == -1)
+  /* Use the full path if it fits.  Otherwise we must go to the cache
+     directory to connect, which changes the directory of every thread
+     (see ccache_compile).  */
+  char *cwd = NULL;
+  bool ok = true;
+  if (strlen (socket_path) < sizeof (addr.sun_path))
+    strcpy (addr.sun_path, socket_path);
+  else
+    {
+      strcpy (addr.sun_path, socket_name);
+      cwd = get_working_directory ();
+      ok = chdir (conf->cache_dir) == 0;
+    }
+  free (socket_name);
+
+  if (!ok || connect (newfd, &addr, sizeof(addr)) == -1)
     {
-      cc_log ("Couldn't connect to %s/%s: %s", conf->cache_dir, addr.sun_path,
-              strerror (errno));
+      cc_log ("Couldn't connect to %s: %s", socket_path, strerror (errno));
+      if (!launch)
+	{
+	  close (newfd);
+	  if (cwd && chdir (cwd) == -1)
+	    { /* Silence warning */ }
+	  free (cwd);
+	  free (socket_path);
+	  return 0;
+	}
 
       /* Launch a new daemon.  */
       cc_log ("Attempting to launch a fresh daemon");
@@ -320,15 +478,17 @@ connect_to_daemon (void)
 	  cc_log ("Could not connect to daemon after 2 seconds: %s",
 	          strerror (errno));
 	  close (newfd);
-	  if (chdir (cwd) == -1)
+	  if (cwd && chdir (cwd) == -1)
 	    { /* Silence warning */ }
 	  free (cwd);
+	  free (socket_path);
 	  return 0;
 	}
     }
-  if (chdir (cwd) == -1)
+  if (cwd && chdir (cwd) == -1)
     { /* Silence warning */ }
   free (cwd);
+  free (socket_path);
 
   gettimeofday(&endtime, NULL);
   timersub(&endtime, &starttime, &timediff);
@@ -338,6 +498,21 @@ connect_to_daemon (void)
   return newfd;
 }
 
+daemon_handle
+connect_to_daemon (void)
+{
+  if (DISABLE_DAEMON)
+    {
+      local = x_calloc (1, sizeof (*local));
+      return init_new_easy_handle () != NULL;
+    }
+
+  /* open_daemon_socket returns zero on failure, but zero is a good
+     descriptor to callers, who look for -1.  */
+  daemon_handle dh = open_daemon_socket (true);
+  return dh > 0 ? dh : -1;
+}
+
 void
 close_daemon (daemon_handle dh)
 {
@@ -512,6 +687,329 @@ add_daemon_form_attachment (daemon_handle dh, const char *name,
       && send_all (dh, buffer4, 4);
 }
 
+/* Give the next GET a deadline, MILLISECONDS after it is requested, after
+   which the answer is no longer wanted.  */
+int
+set_daemon_deadline (daemon_handle dh, unsigned int milliseconds)
+{
+  if (DISABLE_DAEMON)
+    {
+      struct timeval now, budget = {milliseconds / 1000,
+                                    milliseconds % 1000 * 1000};
+      gettimeofday (&now, NULL);
+      local->deadline_ms = milliseconds;
+      timeradd (&now, &budget, &local->deadline);
+      return 1;
+    }
+
+  if (dh == -1)
+    return 0;
+
+  char buffer[5];
+  buffer[0] = 'T';
+  buffer[1] = milliseconds & 0xFF;
+  buffer[2] = (milliseconds & 0xFF00) >> 8;
+  buffer[3] = (milliseconds & 0xFF0000) >> 16;
+  buffer[4] = (milliseconds & 0xFF000000) >> 24;
+
+  if (DEBUG)
+    cc_log ("client sending 'T'");
+  return send_all (dh, buffer, 5);
+}
+
+/* The connection used for the requests below, which only ever talk to a
+   daemon that is already running.  Once one fails, we stop trying.  */
+static THREAD_LOCAL daemon_handle lookup_dh = -1;
+static THREAD_LOCAL bool lookup_unavailable = false;
+
+static daemon_handle
+lookup_connection (void)
+{
+  if (DISABLE_DAEMON || lookup_unavailable)
+    return -1;
+  if (lookup_dh == -1)
+    {
+      lookup_dh = open_daemon_socket (false);
+      if (lookup_dh <= 0)
+	{
+	  lookup_dh = -1;
+	  lookup_unavailable = true;
+	}
+    }
+  return lookup_dh;
+}
+
+static void
+drop_lookup_connection (void)
+{
+  if (lookup_dh != -1)
+    close (lookup_dh);
+  lookup_dh = -1;
+  lookup_unavailable = true;
+}
+
+/* Have the daemon open the cache files PATHS[0..N-1] for reading.  FDS[i]
+   receives a descriptor, or -1 if the file isn't in the cache.  Returns
+   false, having opened nothing, if the daemon can't answer (none is
+   running, or a path is outside the cache); the caller must then look in
+   the file system itself.  This never launches a daemon.  */
+bool
+lookup_daemon_files (int n, const char *const *paths, int *fds)
+{
+  daemon_handle dh;
+  size_t prefix = strlen (conf->cache_dir);
+  char *names = NULL;
+  size_t size = 0;
+  int i;
+
+  if (DISABLE_DAEMON || lookup_unavailable || n < 1 || n > MAX_LOOKUP_FILES)
+    return false;
+
+  /* The daemon may spell the cache directory differently, so send the
+     paths relative to it.  */
+  for (i = 0; i < n; i++)
+    {
+      size_t len;
+      if (strncmp (paths[i], conf->cache_dir, prefix) != 0
+          || paths[i][prefix] != '/')
+	{
+	  free (names);
+	  return false;
+	}
+      len = strlen (paths[i] + prefix + 1) + 1;
+      names = x_realloc (names, size + len);
+      memcpy (names + size, paths[i] + prefix + 1, len);
+      size += len;
+    }
+
+  dh = lookup_connection ();
+  if (dh == -1)
+    {
+      free (names);
+      return false;
+    }
+
+  char buffer[5];
+  buffer[0] = 'L';
+  buffer[1] = size & 0xFF;
+  buffer[2] = (size & 0xFF00) >> 8;
+  buffer[3] = (size & 0xFF0000) >> 16;
+  buffer[4] = (size & 0xFF000000) >> 24;
+  if (DEBUG)
+    cc_log ("client sending 'L'");
+  bool ok = send_all (dh, buffer, 5) && send_all (dh, names, size);
+  free (names);
+
+  /* The descriptors arrive with the first byte of the reply.  */
+  char reply[2 + MAX_LOOKUP_FILES];
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE (MAX_LOOKUP_FILES * sizeof (int))];
+  } control;
+  struct iovec iov = {reply, 2 + n};
+  struct msghdr msg;
+  int received[MAX_LOOKUP_FILES], nreceived = 0;
+  ssize_t got = -1;
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.space;
+  msg.msg_controllen = sizeof (control.space);
+  if (ok)
+    {
+      do
+	got = recvmsg (dh, &msg, MSG_CMSG_CLOEXEC);
+      while (got == -1 && errno == EINTR);
+    }
+  if (got > 0)
+    {
+      struct cmsghdr *cmsg;
+      for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+	if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+	  {
+	    nreceived = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+	    memcpy (received, CMSG_DATA (cmsg), nreceived * sizeof (int));
+	  }
+      ok = recv_all (dh, reply + got, 2 + n - got);
+    }
+  else
+    ok = false;
+
+  int found = 0;
+  if (ok && reply[0] == 'L' && reply[1] == n)
+    for (i = 0; i < n; i++)
+      fds[i] = (reply[2 + i] == 'Y' && found < nreceived
+                ? received[found++] : -1);
+  if (!ok || reply[0] != 'L' || reply[1] != n || found != nreceived)
+    {
+      cc_log ("Cache lookup through the daemon failed; using the file system");
+      for (i = 0; i < nreceived; i++)
+	close (received[i]);
+      drop_lookup_connection ();
+      return false;
+    }
+  return true;
+}
+
+/* Open the cache files PATHS[0..N-1] for reading, through the daemon if one
+   is running, and directly otherwise.  FDS[i] is -1 for a missing file.  */
+void
+open_cache_files (int n, const char *const *paths, int *fds)
+{
+  int i;
+
+  if (lookup_daemon_files (n, paths, fds))
+    return;
+  for (i = 0; i < n; i++)
+    fds[i] = open (paths[i], O_RDONLY | O_BINARY);
+}
+
+/* Send an 'I' command carrying the N strings STRINGS.  */
+static bool
+send_toolchain_message (daemon_handle dh, int n, const char *const *strings)
+{
+  size_t size = 0;
+  int i;
+
+  for (i = 0; i < n; i++)
+    size += strlen (strings[i]) + 1;
+
+  char buffer[5];
+  buffer[0] = 'I';
+  buffer[1] = size & 0xFF;
+  buffer[2] = (size & 0xFF00) >> 8;
+  buffer[3] = (size & 0xFF0000) >> 16;
+  buffer[4] = (size & 0xFF000000) >> 24;
+  if (DEBUG)
+    cc_log ("client sending 'I'");
+  if (!send_all (dh, buffer, 5))
+    return false;
+  for (i = 0; i < n; i++)
+    if (!send_all (dh, strings[i], strlen (strings[i]) + 1))
+      return false;
+  return true;
+}
+
+/* Ask a running daemon for the identity of the toolchain with the given
+   KEY (see tool_id.c).  Returns a new string, or NULL if the daemon
+   doesn't know it, or there is no daemon.  This never launches a
+   daemon.  */
+char *
+query_daemon_tool_id (const char *key)
+{
+  daemon_handle dh = lookup_connection ();
+  unsigned char reply[2];
+  char *id;
+
+  if (dh == -1)
+    return NULL;
+  if (!send_toolchain_message (dh, 1, &key)
+      || !recv_all (dh, (char *)reply, 2)
+      || reply[0] != 'I')
+    {
+      cc_log ("Toolchain query to the daemon failed");
+      drop_lookup_connection ();
+      return NULL;
+    }
+  if (reply[1] == 0)
+    return NULL;
+
+  id = x_malloc (reply[1] + 1);
+  if (!recv_all (dh, id, reply[1]))
+    {
+      free (id);
+      drop_lookup_connection ();
+      return NULL;
+    }
+  id[reply[1]] = '\0';
+  return id;
+}
+
+/* Tell a running daemon that KEY identifies toolchain ID, which is made of
+   the N files at PATHS, so that it can answer query_daemon_tool_id for
+   as long as none of them changes.  STATS holds the stat data that each
+   file was identified with, as "DEV INO SIZE MTIME CTIME".  */
+void
+register_daemon_tool_id (const char *key, const char *id, int n,
+                         const char *const *paths, const char *const *stats)
+{
+  daemon_handle dh = lookup_connection ();
+  const char **strings;
+  int i;
+
+  if (dh == -1 || n < 1)
+    return;
+
+  strings = x_malloc ((2 * n + 2) * sizeof (*strings));
+  strings[0] = key;
+  strings[1] = id;
+  for (i = 0; i < n; i++)
+    {
+      strings[2 + 2 * i] = paths[i];
+      strings[3 + 2 * i] = stats[i];
+    }
+  if (!send_toolchain_message (dh, 2 * n + 2, strings))
+    drop_lookup_connection ();
+  free (strings);
+}
+
+/* Send the command CODE with VALUE in its size field.  */
+static bool
+send_value_message (daemon_handle dh, char code, uint32_t value)
+{
+  char buffer[5];
+  buffer[0] = code;
+  buffer[1] = value & 0xFF;
+  buffer[2] = (value & 0xFF00) >> 8;
+  buffer[3] = (value & 0xFF0000) >> 16;
+  buffer[4] = (value & 0xFF000000) >> 24;
+  if (DEBUG)
+    cc_log ("client sending '%c'", code);
+  return send_all (dh, buffer, 5);
+}
+
+/* Ask a running daemon for the PERCENTILE'th percentile of its recent GET
+   response times, and the median of the compile times reported to it,
+   in microseconds.  Either is UINT32_MAX if the daemon has no samples.
+   Returns false if there is no daemon to ask.  This never launches a
+   daemon.  */
+bool
+query_daemon_pace (unsigned int percentile, uint32_t *get_time,
+                   uint32_t *compile_time)
+{
+  daemon_handle dh = lookup_connection ();
+  unsigned char reply[9];
+  int i;
+
+  if (dh == -1)
+    return false;
+  if (!send_value_message (dh, 'P', percentile)
+      || !recv_all (dh, (char *)reply, sizeof (reply))
+      || reply[0] != 'P')
+    {
+      cc_log ("Pace query to the daemon failed");
+      drop_lookup_connection ();
+      return false;
+    }
+  *get_time = *compile_time = 0;
+  for (i = 3; i >= 0; i--)
+    {
+      *get_time = (*get_time << 8) | reply[1 + i];
+      *compile_time = (*compile_time << 8) | reply[5 + i];
+    }
+  return true;
+}
+
+/* Tell a running daemon that a local compile took MICROSECONDS.  */
+void
+report_daemon_compile_time (uint32_t microseconds)
+{
+  daemon_handle dh = lookup_connection ();
+
+  if (dh != -1 && !send_value_message (dh, 'C', microseconds))
+    drop_lookup_connection ();
+}
+
 int
 request_daemon_response (daemon_handle dh)
 {
@@ -535,6 +1033,42 @@ request_daemon_response (daemon_handle dh)
   return send_all (dh, "R", 1);
 }
 
+/* Tell the daemon that the answer to the request on DH is no longer wanted.
+   The daemon abandons the transfer and frees its connection; anyone still
+   waiting on DH will see the request fail.  */
+void
+cancel_daemon_request (daemon_handle dh)
+{
+  if (DISABLE_DAEMON || dh == -1)
+    return;
+
+  if (DEBUG)
+    cc_log ("client sending 'K'");
+  send_all (dh, "K", 1);
+}
+
+/* Hand the results of a compile, described by the JSON text JOB (see
+   accept_upload), to the daemon on DH to upload, and with them the shared
+   memory objects JOB names.  Returns true if the daemon took them, after
+   which they are the daemon's to delete.  */
+bool
+enqueue_daemon_upload (daemon_handle dh, const char *job)
+{
+  char reply;
+
+  if (DISABLE_DAEMON || dh == -1)
+    return false;
+
+  if (!send_value_message (dh, 'Q', strlen (job))
+      || !send_all (dh, job, strlen (job))
+      || !recv_all (dh, &reply, 1))
+    {
+      cc_log ("Could not hand the upload to the daemon");
+      return false;
+    }
+  return reply == 'Q';
+}
+
 enum daemon_response_codes
 get_daemon_response (daemon_handle dh, union daemon_responses **dr_ptr)
 {
@@ -690,6 +1224,238 @@ flush_daemon_response (daemon_handle dh)
     }
 }
 
+/* Print the heading for the latency table.  */
+static void
+print_latency_header (FILE *f)
+{
+  fprintf (f, "latency (ms)      count      p50      p90      p99"
+              "     p999      max\n");
+}
+
+/* Print one row of the latency table, given times in microseconds.  */
+static void
+print_latency_row (FILE *f, const char *name, uint64_t count, uint64_t p50,
+                   uint64_t p90, uint64_t p99, uint64_t p999, uint64_t max)
+{
+  fprintf (f, "%-14s %8" PRIu64 " %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+           name, count, p50 / 1000.0, p90 / 1000.0, p99 / 1000.0,
+           p999 / 1000.0, max / 1000.0);
+}
+
+static void
+print_latency_histogram (FILE *f, const char *name, const struct histogram *h)
+{
+  print_latency_row (f, name, h->count, histogram_percentile (h, 50),
+                     histogram_percentile (h, 90), histogram_percentile (h, 99),
+                     histogram_percentile (h, 99.9), h->max);
+}
+
+/* Look up KEY in the JSON object OBJ, which may be NULL.  */
+static json_object *
+json_get (json_object *obj, const char *key)
+{
+  return obj ? json_object_object_get (obj, key) : NULL;
+}
+
+static uint64_t
+json_get_uint (json_object *obj, const char *key)
+{
+  json_object *value = json_get (obj, key);
+  return value ? json_object_get_int64 (value) : 0;
+}
+
+static void
+print_latency_json (FILE *f, const char *name, json_object *h)
+{
+  print_latency_row (f, name, json_get_uint (h, "count"),
+                     json_get_uint (h, "p50"), json_get_uint (h, "p90"),
+                     json_get_uint (h, "p99"), json_get_uint (h, "p999"),
+                     json_get_uint (h, "max"));
+}
+
+/* Ask the running daemon, if any, for its statistics, and print a summary
+   on stdout.  Returns an exit status.  */
+int
+print_daemon_stats (void)
+{
+  daemon_handle dh;
+  union daemon_responses *dr;
+  char *data = NULL;
+  int code = 0;
+  bool done = false;
+  json_object *stats, *obj, *latency;
+
+  if (DISABLE_DAEMON)
+    {
+      fprintf (stderr, "cs: the daemon is disabled in this build\n");
+      return 1;
+    }
+
+  dh = open_daemon_socket (false);
+  if (dh <= 0)
+    {
+      fprintf (stderr, "cs: no daemon is running for %s\n", conf->cache_dir);
+      return 1;
+    }
+
+  if (DEBUG)
+    cc_log ("client sending 'S'");
+  if (send_all (dh, "S", 1))
+    while (!done)
+      switch (get_daemon_response (dh, &dr))
+	{
+	case D_HTTP_RESULT_CODE:
+	  code = dr->http_result_code;
+	  free (dr);
+	  break;
+	case D_BODY:
+	  free (data);
+	  data = dr->body.data;
+	  free (dr->body.headers);
+	  free (dr);
+	  break;
+	case D_ATTACHMENT:
+	  free (dr->attachment.headers);
+	  free (dr->attachment.filename);
+	  free (dr->attachment.tmp_filename);
+	  free (dr);
+	  break;
+	default:
+	  done = true;
+	  break;
+	}
+  close_daemon (dh);
+
+  stats = (code == 200 && data) ? json_tokener_parse (data) : NULL;
+  free (data);
+  if (is_error (stats))
+    {
+      fprintf (stderr, "cs: could not read the daemon statistics\n");
+      return 1;
+    }
+
+  printf ("daemon pid                %" PRIu64 "\n",
+          json_get_uint (stats, "pid"));
+  printf ("seconds since reset       %.0f\n",
+          json_object_get_double (json_get (stats, "interval")));
+  obj = json_get (stats, "clients");
+  printf ("client connections        %" PRIu64 " (%" PRIu64 " connected)\n",
+          json_get_uint (obj, "total"), json_get_uint (obj, "connected"));
+  obj = json_get (stats, "queue");
+  printf ("queued jobs               %" PRIu64 " (peak %" PRIu64 ")\n",
+          json_get_uint (obj, "waiting"), json_get_uint (obj, "peak"));
+  json_object *class = json_get (obj, "get");
+  printf ("  GET                     %" PRIu64 " queued, %" PRIu64
+          " running, oldest %.3fs, %" PRIu64 " missed deadline\n",
+          json_get_uint (class, "waiting"), json_get_uint (class, "active"),
+          json_object_get_double (json_get (class, "oldest")),
+          json_get_uint (class, "expired"));
+  class = json_get (obj, "post");
+  printf ("  POST                    %" PRIu64 " queued, %" PRIu64
+          " running, oldest %.3fs, %" PRIu64 " sent after aging\n",
+          json_get_uint (class, "waiting"), json_get_uint (class, "active"),
+          json_object_get_double (json_get (class, "oldest")),
+          json_get_uint (class, "aged"));
+  obj = json_get (stats, "pool");
+  printf ("server connections        %" PRIu64 " (%" PRIu64 " in use, peak %"
+          PRIu64 ", %.1f%% utilized)\n",
+          json_get_uint (obj, "size"), json_get_uint (obj, "active"),
+          json_get_uint (obj, "peak"),
+          100 * json_object_get_double (json_get (obj, "utilization")));
+  printf ("transport                 %s (%" PRIu64 " transfers over HTTP/2)\n",
+          json_object_get_boolean (json_get (obj, "http2"))
+          ? "HTTP/2 multiplexed" : "HTTP/1.1",
+          json_get_uint (obj, "http2_transfers"));
+  obj = json_get (stats, "requests");
+  printf ("completed requests        GET %" PRIu64 ", POST %" PRIu64 "\n",
+          json_get_uint (obj, "get"), json_get_uint (obj, "post"));
+  printf ("cancelled requests        %" PRIu64 "\n",
+          json_get_uint (obj, "cancelled"));
+  obj = json_get (stats, "breaker");
+  printf ("circuit breaker           %s (%" PRIu64 " trips, %" PRIu64
+          " GETs refused)\n",
+          json_object_get_boolean (json_get (obj, "open")) ? "open" : "closed",
+          json_get_uint (obj, "trips"), json_get_uint (obj, "refused"));
+  obj = json_get (stats, "uploads");
+  printf ("result uploads            %" PRIu64 " done, %" PRIu64 " failed, %"
+          PRIu64 " pending\n",
+          json_get_uint (obj, "done"), json_get_uint (obj, "failed"),
+          json_get_uint (obj, "pending"));
+  printf ("upload batches            %" PRIu64 ", carrying %" PRIu64
+          " uploads (%" PRIu64 " retried)\n",
+          json_get_uint (obj, "batches"), json_get_uint (obj, "batched"),
+          json_get_uint (obj, "retried"));
+  printf ("upload content            %" PRIu64 " files sent, %" PRIu64
+          " shared\n",
+          json_get_uint (obj, "content_sent"),
+          json_get_uint (obj, "content_shared"));
+  obj = json_get (stats, "spool");
+  printf ("result spool              %" PRIu64 " spooled, %" PRIu64
+          " replayed (%" PRIu64 " in progress)\n",
+          json_get_uint (obj, "spooled"), json_get_uint (obj, "replayed"),
+          json_get_uint (obj, "replaying"));
+  obj = json_get (stats, "encoding");
+  printf ("encoded uploads           %" PRIu64 " parts, %" PRIu64
+          " bytes sent as %" PRIu64 " (%s)\n",
+          json_get_uint (obj, "sent"), json_get_uint (obj, "sent_raw"),
+          json_get_uint (obj, "sent_encoded"),
+          json_get (obj, "upload")
+          ? json_object_get_string (json_get (obj, "upload")) : "identity");
+  printf ("encoded downloads         %" PRIu64 " parts, %" PRIu64
+          " bytes received as %" PRIu64 "\n",
+          json_get_uint (obj, "received"), json_get_uint (obj, "received_raw"),
+          json_get_uint (obj, "received_encoded"));
+  obj = json_get (stats, "resume");
+  printf ("resumed downloads         %" PRIu64 ", %" PRIu64
+          " bytes kept; %" PRIu64 " failed their hash\n",
+          json_get_uint (obj, "resumed"), json_get_uint (obj, "bytes_kept"),
+          json_get_uint (obj, "hash_mismatches"));
+  obj = json_get (stats, "bytes");
+  printf ("bytes downloaded          %" PRIu64 "\n",
+          json_get_uint (obj, "downloaded"));
+  printf ("bytes uploaded            %" PRIu64 "\n",
+          json_get_uint (obj, "uploaded"));
+  printf ("bytes from/to clients     %" PRIu64 " / %" PRIu64 "\n",
+          json_get_uint (obj, "from_clients"),
+          json_get_uint (obj, "to_clients"));
+  obj = json_get (stats, "response_cache");
+  printf ("response cache            %" PRIu64 " entries, %" PRIu64
+          " bytes\n",
+          json_get_uint (obj, "entries"), json_get_uint (obj, "size"));
+  printf ("response cache hits       %" PRIu64 " (+%" PRIu64
+          " negative), %" PRIu64 " misses\n",
+          json_get_uint (obj, "hits"), json_get_uint (obj, "negative_hits"),
+          json_get_uint (obj, "misses"));
+  obj = json_get (stats, "lookups");
+  printf ("cache lookups             %" PRIu64 " files (%" PRIu64
+          " found)\n",
+          json_get_uint (obj, "files"), json_get_uint (obj, "found"));
+  obj = json_get (stats, "toolchains");
+  printf ("toolchain identities      %" PRIu64 " known, %" PRIu64
+          " queries (%" PRIu64 " answered, %" PRIu64 " changed)\n",
+          json_get_uint (obj, "entries"), json_get_uint (obj, "queries"),
+          json_get_uint (obj, "hits"), json_get_uint (obj, "stale"));
+  obj = json_get (stats, "server");
+  printf ("compile server            %" PRIu64 " compiles (%" PRIu64
+          " running)\n",
+          json_get_uint (obj, "compiles"), json_get_uint (obj, "running"));
+  printf ("\n");
+
+  latency = json_get (stats, "latency");
+  print_latency_header (stdout);
+  obj = json_get (latency, "get");
+  print_latency_json (stdout, "GET queue", json_get (obj, "queue"));
+  print_latency_json (stdout, "GET internet", json_get (obj, "internet"));
+  print_latency_json (stdout, "GET overall", json_get (obj, "overall"));
+  obj = json_get (latency, "post");
+  print_latency_json (stdout, "POST queue", json_get (obj, "queue"));
+  print_latency_json (stdout, "POST internet", json_get (obj, "internet"));
+  print_latency_json (stdout, "POST overall", json_get (obj, "overall"));
+
+  json_object_put (stats);
+  return 0;
+}
+
 /* -----------------------------------------------------------------------*/
 /* These functions are only used in the daemon process
    (unless DISABLE_DAEMON is set at build time).  */
@@ -698,6 +1464,8 @@ static size_t receive_cloud_response_headers (char *data, size_t blocksize,
                                               size_t nblocks, void *userdata);
 static size_t receive_cloud_response (char *netdata, size_t blocksize,
                                       size_t nblocks, void *userdata);
+static size_t read_form_stream (char *buffer, size_t blocksize,
+                                size_t nblocks, void *userdata);
 
 /* Warning, MIN evaluates X and Y twice.
    This is for convenience only.  */
@@ -716,27 +1484,36 @@ struct server_response
     size_t headersize;
     char *type;
     char *data;
-    size_t datasize;
+    size_t datasize, allocated;
     char *filename, *tmp_filename;
     FILE *fd;
+    struct decoder *decoder;   /* For a part sent encoded.  */
+    char *content_hash;        /* What the server says the content is.  */
+    struct mdfour hash;        /* What it is, so far.  */
     struct response_part *next;
   } *parts;
   struct response_part *last;
-  char *data_stash;
-  size_t data_stash_size;
+  struct multipart_parser *parser;
+
+  /* For resuming the GET, if it is cut off.  See "Resumed downloads".  */
+  size_t received;             /* Bytes of the body so far.  */
+  char *etag;
+  bool accepts_ranges;
+  bool encoded;                /* The body as a whole was encoded.  */
+  bool resuming;               /* The request asked for the rest.  */
+  int resumes;
 };
 
-/* Destruct server response data.  */
+/* Free what server response RESPONSE holds, but not RESPONSE itself.  */
 static void
-free_server_response (struct server_response *response)
+clear_server_response (struct server_response *response)
 {
   struct response_part *part, *nextpart;
 
-  if (!response)
-    return;
-
   free (response->type);
+  free (response->etag);
   free (response->boundary);
+  multipart_free (response->parser);
 
   for (part = response->parts; part; part = nextpart)
     {
@@ -745,13 +1522,42 @@ free_server_response (struct server_response *response)
       free (part->type);
       free (part->filename);
       free (part->tmp_filename);
+      if (part->fd)
+	fclose (part->fd);
+      decoder_free (part->decoder);
+      free (part->content_hash);
       nextpart = part->next;
       free (part);
     }
+}
+
+/* Destruct server response data.  */
+static void
+free_server_response (struct server_response *response)
+{
+  if (!response)
+    return;
 
+  clear_server_response (response);
   free (response);
 }
 
+/* Start RESPONSE again, for a resumed GET that is being sent the whole
+   body afresh.  */
+static void
+restart_server_response (struct server_response *response)
+{
+  struct response_part *part;
+  int resumes = response->resumes;
+
+  for (part = response->parts; part; part = part->next)
+    if (part->tmp_filename)
+      unlink (part->tmp_filename);
+  clear_server_response (response);
+  memset (response, 0, sizeof (*response));
+  response->resumes = resumes;
+}
+
 /* Wrapper for curl_easy_setopt.
    Returns zero on failure, and writes the reason to the log.  */
 static int
@@ -823,6 +1629,11 @@ init_new_easy_handle (void)
 		     (void*) receive_cloud_response);
   x_curl_easy_setopt(new_connection, CURLOPT_HEADERFUNCTION,
 		     (void*) receive_cloud_response_headers);
+  x_curl_easy_setopt(new_connection, CURLOPT_READFUNCTION,
+		     (void*) read_form_stream);
+  if (accept_encoding)
+    x_curl_easy_setopt(new_connection, CURLOPT_ACCEPT_ENCODING,
+                       accept_encoding);
 
   /* Set timeout to 10 minutes. This is primarily to prevent the background
        POST task from sitting around forever in the case of a network or server
@@ -830,6 +1641,24 @@ init_new_easy_handle (void)
        slow connections.  */
   x_curl_easy_setopt(new_connection, CURLOPT_TIMEOUT, (void*)(long)600);
 
+  /* Pin the protocol, so that a libcurl that prefers HTTP/2 by default
+     doesn't open a connection per transfer when we didn't ask for it.  */
+#if LIBCURL_VERSION_NUM >= 0x072f00
+  if (use_http2)
+    {
+      x_curl_easy_setopt(new_connection, CURLOPT_HTTP_VERSION,
+                         (void*)(long)CURL_HTTP_VERSION_2TLS);
+      /* Wait for an existing connection to say whether it can multiplex,
+         rather than opening a new one.  */
+      x_curl_easy_setopt(new_connection, CURLOPT_PIPEWAIT, (void*)(long)1);
+    }
+  else
+#endif
+    x_curl_easy_setopt(new_connection, CURLOPT_HTTP_VERSION,
+                       (void*)(long)CURL_HTTP_VERSION_1_1);
+  if (ca_bundle)
+    x_curl_easy_setopt(new_connection, CURLOPT_CAINFO, (char *)ca_bundle);
+
   /* Add an x-cs-user-agent header. Libcurl will set the regular user-agent.  */
   str = format ("cs/%s (" __DATE__ " " __TIME__ ") %s", CS_VERSION, curl_version());
   x_curl_easy_setopt(new_connection, CURLOPT_USERAGENT, str);
@@ -887,10 +1716,74 @@ add_form_data (struct local_connection_state *conn,
                   CURLFORM_COPYNAME, name,
                   CURLFORM_COPYCONTENTS, data,
                   CURLFORM_END);
+  conn->upload_size += strlen (data);
+
+  /* Uploads name the object they refer to in the "data" field.  Remember
+     which it is so that the response cache can drop its copy.  */
+  if (strcmp (name, "data") == 0)
+    {
+      char *cpp_hash = json_string_field (data, "cpp_hash");
+      char *toolchain_id = json_string_field (data, "toolchain_id");
+      if (cpp_hash && toolchain_id)
+	{
+	  free (conn->cache_key);
+	  conn->cache_key = format ("%s-%s", cpp_hash, toolchain_id);
+	}
+      free (cpp_hash);
+      free (toolchain_id);
+    }
   return 1;
 }
 
-static int
+/* Return the encoding to send uploads in: the first of ours that the
+   server takes.  */
+static enum encoding
+upload_encoding (void)
+{
+  int i;
+
+  for (i = 0; i < encoding_count; i++)
+    if (server_accepts[encodings[i]])
+      return encodings[i];
+  return ENCODING_IDENTITY;
+}
+
+/* Add the SIZE bytes at DATA, which stay put until the form is cleaned up,
+   to the form of CONN as field NAME under the name FILENAME, to be encoded
+   as curl sends them.  Returns false if they're not worth encoding, or
+   the server takes no encoding we have.  */
+static bool
+add_encoded_part (struct local_connection_state *conn, const char *name,
+                  const char *filename, const char *data, size_t size)
+{
+  enum encoding encoding = upload_encoding ();
+  struct form_stream *stream;
+  struct encoder *encoder;
+
+  if (encoding == ENCODING_IDENTITY || size < ENCODE_MIN_SIZE
+      || !(encoder = encoder_new (encoding, encoding_level, data, size)))
+    return false;
+
+  stream = x_malloc (sizeof (*stream));
+  stream->encoder = encoder;
+  stream->next = conn->streams;
+  conn->streams = stream;
+
+  /* The encoded size isn't known until it's sent, so curl sends it
+     chunked.  */
+  reset_response(conn);
+  x_curl_formadd(conn,
+                 CURLFORM_COPYNAME, name,
+                 CURLFORM_STREAM, stream,
+                 CURLFORM_FILENAME, filename,
+                 CURLFORM_CONTENTHEADER, encoding_headers[encoding],
+                 CURLFORM_END);
+  encoded_parts_sent++;
+  encoded_raw_bytes_sent += size;
+  return true;
+}
+
+static int
 add_form_attachment (struct local_connection_state *conn, const char *name,
                      const char *shared_name, size_t size, const char *filename)
 {
@@ -909,25 +1802,85 @@ add_form_attachment (struct local_connection_state *conn, const char *name,
   conn->mmaps = map;
 
   // Add the attachment to the cURL form
-  reset_response(conn);
-  x_curl_formadd(conn,
-                 CURLFORM_COPYNAME, name,
-                 CURLFORM_BUFFER, filename,
-                 CURLFORM_BUFFERPTR, sf->data,
-                 CURLFORM_BUFFERLENGTH, sf->size,
-                 CURLFORM_END);
+  if (!add_encoded_part (conn, name, filename, sf->data, sf->size))
+    {
+      reset_response(conn);
+      x_curl_formadd(conn,
+                     CURLFORM_COPYNAME, name,
+                     CURLFORM_BUFFER, filename,
+                     CURLFORM_BUFFERPTR, sf->data,
+                     CURLFORM_BUFFERLENGTH, sf->size,
+                     CURLFORM_END);
+    }
+  conn->upload_size += sf->size;
   if (DEBUG)
     cc_log ("[%u:%u] Added attachment: [%s] %s", conn->client_number,
             conn->job_number, name, filename);
   return 1;
 }
 
+/* Attach the file at PATH to the form of CONN, as field NAME under the
+   name FILENAME.  Returns 0 if there is no such file.  */
+static int
+add_form_file (struct local_connection_state *conn, const char *name,
+               const char *path, const char *filename)
+{
+  struct stat st;
+  void *data = MAP_FAILED;
+  int fd;
+
+  if (stat (path, &st) != 0)
+    return 0;
+
+  /* To be encoded, the file is mapped like a stashed file.  */
+  if (upload_encoding () != ENCODING_IDENTITY
+      && st.st_size >= ENCODE_MIN_SIZE
+      && (fd = open (path, O_RDONLY | O_BINARY)) != -1)
+    {
+      data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      close (fd);
+    }
+  if (data != MAP_FAILED)
+    {
+      struct mmap *map = x_malloc (sizeof (*map));
+      map->addr = data;
+      map->length = st.st_size;
+      map->next = conn->mmaps;
+      conn->mmaps = map;
+    }
+
+  if (data == MAP_FAILED
+      || !add_encoded_part (conn, name, filename, data, st.st_size))
+    {
+      reset_response(conn);
+      x_curl_formadd(conn,
+                     CURLFORM_COPYNAME, name,
+                     CURLFORM_FILE, path,
+                     CURLFORM_FILENAME, filename,
+                     CURLFORM_END);
+    }
+  conn->upload_size += st.st_size;
+  if (DEBUG)
+    cc_log ("[%u:%u] Added file: [%s] %s", conn->client_number,
+            conn->job_number, name, filename);
+  return 1;
+}
+
 static void
 cleanup_form (struct local_connection_state *conn)
 {
   if (conn->post)
     curl_formfree (conn->post);
   conn->post = conn->last = NULL;
+  conn->upload_size = 0;
+
+  while (conn->streams)
+    {
+      struct form_stream *stream = conn->streams;
+      conn->streams = stream->next;
+      encoder_free (stream->encoder);
+      free (stream);
+    }
 
   while (conn->mmaps)
     {
@@ -938,6 +1891,24 @@ cleanup_form (struct local_connection_state *conn)
     }
 }
 
+/* The call-back function for CURLOPT_READFUNCTION, which curl calls for
+   the next of an encoded part of a form as it sends it.  */
+static size_t
+read_form_stream (char *buffer, size_t blocksize, size_t nblocks,
+                  void *userdata)
+{
+  struct form_stream *stream = (struct form_stream *)userdata;
+  long size = encoder_read (stream->encoder, buffer, blocksize * nblocks);
+
+  if (size < 0)
+    {
+      cc_log ("Error: could not encode an upload");
+      return CURL_READFUNC_ABORT;
+    }
+  encoded_bytes_sent += size;
+  return size;
+}
+
 /* This function returns a single aspect of the response message each time
    it is called.
    The data is placed in DR_PTR, and the caller should keep calling until
@@ -1014,6 +1985,357 @@ get_response (struct local_connection_state *conn,
   return retval;
 }
 
+/* Response cache.
+
+   Complete GET responses that are small enough, and "404" misses, are kept
+   in memory for a while so that repeated queries for the same object
+   (several build variants compiling the same file, a rebuild after a failed
+   link, etc.) can be answered without a round-trip to the server.
+
+   Entries are keyed on the final URL component, "<cpp_hash>-<toolchain_id>",
+   and are forgotten as soon as the daemon sees a POST for the same key, so
+   a negative entry never hides a freshly uploaded result.  The least
+   recently used entries are evicted when the memory budget is exceeded.
+
+   The cache is tuned through the environment of the daemon:
+     CS_DAEMON_CACHE_SIZE       memory budget (default 64Mi, 0 disables)
+     CS_DAEMON_CACHE_ENTRY_MAX  largest response kept (default 1Mi)
+     CS_DAEMON_CACHE_TTL        seconds to keep a hit (default 600)
+     CS_DAEMON_MISS_TTL         seconds to keep a miss (default 10)  */
+
+struct cached_part
+{
+  char *headers;
+  size_t headersize;
+  char *data;
+  size_t datasize;
+  char *filename;		/* Non-NULL for attachments.  */
+  struct cached_part *next;
+};
+
+struct cached_response
+{
+  char *key;
+  int code;
+  time_t expires;
+  size_t size;
+  struct cached_part *parts;
+  struct cached_response *prev, *next;	/* Most recently used first.  */
+};
+
+static struct hashtable *response_cache = NULL;
+static struct cached_response *lru_first = NULL, *lru_last = NULL;
+static size_t response_cache_size = 0;
+static uint64_t response_cache_limit = 64 * 1024 * 1024;
+static uint64_t response_cache_entry_limit = 1024 * 1024;
+static time_t response_cache_hit_ttl = 600;
+static time_t response_cache_miss_ttl = 10;
+static unsigned int cache_hit_counter = 0;
+static unsigned int cache_negative_hit_counter = 0;
+static unsigned int cache_miss_counter = 0;
+static unsigned int cache_store_counter = 0;
+static unsigned int cache_eviction_counter = 0;
+static unsigned int cache_invalidation_counter = 0;
+
+/* Return the cache key for URL, or NULL if URL does not name a cache
+   object.  The caller should free the result.  */
+static char *
+cache_key_from_url (const char *url)
+{
+  const char *key = url ? strstr (url, "/v1.0/cache/") : NULL;
+
+  if (!key)
+    return NULL;
+  key += strlen ("/v1.0/cache/");
+  if (*key == '\0' || strpbrk (key, "/?#"))
+    return NULL;
+  return x_strdup (key);
+}
+
+/* Find the string value of FIELD in the JSON text DATA.
+   This is not a JSON parser; it only copes with the plain, unescaped,
+   strings that the client uses for hashes.  */
+static char *
+json_string_field (const char *data, const char *field)
+{
+  char *pattern = format ("\"%s\"", field);
+  const char *value = strstr (data, pattern);
+  const char *end;
+
+  if (value)
+    value += strlen (pattern);
+  free (pattern);
+  if (!value)
+    return NULL;
+
+  while (isspace (*value))
+    value++;
+  if (*value++ != ':')
+    return NULL;
+  while (isspace (*value))
+    value++;
+  if (*value++ != '"')
+    return NULL;
+  end = strchr (value, '"');
+  if (!end || end == value)
+    return NULL;
+  return x_strndup (value, end - value);
+}
+
+static void
+free_cached_response (struct cached_response *entry)
+{
+  struct cached_part *part, *nextpart;
+
+  for (part = entry->parts; part; part = nextpart)
+    {
+      free (part->headers);
+      free (part->data);
+      free (part->filename);
+      nextpart = part->next;
+      free (part);
+    }
+  free (entry->key);
+  free (entry);
+}
+
+static void
+lru_unlink (struct cached_response *entry)
+{
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    lru_first = entry->next;
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    lru_last = entry->prev;
+  entry->prev = entry->next = NULL;
+}
+
+static void
+lru_push_front (struct cached_response *entry)
+{
+  entry->prev = NULL;
+  entry->next = lru_first;
+  if (lru_first)
+    lru_first->prev = entry;
+  else
+    lru_last = entry;
+  lru_first = entry;
+}
+
+/* Remove ENTRY from the cache, and free it.  */
+static void
+uncache_response (struct cached_response *entry)
+{
+  hashtable_remove (response_cache, entry->key);
+  lru_unlink (entry);
+  response_cache_size -= entry->size;
+  free_cached_response (entry);
+}
+
+/* Forget anything we know about KEY.  */
+static void
+invalidate_cached_response (const char *key)
+{
+  struct cached_response *entry;
+
+  if (!response_cache || !key)
+    return;
+
+  entry = hashtable_search (response_cache, (void *)key);
+  if (entry)
+    {
+      cc_log ("Response cache: invalidated %s", key);
+      uncache_response (entry);
+      cache_invalidation_counter++;
+    }
+}
+
+/* Copy a completed GET RESPONSE for KEY into the cache, if it is worth
+   keeping.  Attachments are read back from their temporary files, so this
+   must be called before the files are handed to the client.  */
+static void
+cache_response (const char *key, struct server_response *response)
+{
+  struct cached_response *entry, *old;
+  struct response_part *part;
+  struct cached_part **tail;
+
+  if (!response_cache || !key || !response || !response->complete
+      || (response->code != 200 && response->code != 404))
+    return;
+
+  entry = x_calloc (1, sizeof (*entry));
+  entry->key = x_strdup (key);
+  entry->code = response->code;
+  entry->size = sizeof (*entry) + strlen (key) + 1;
+  tail = &entry->parts;
+
+  for (part = response->parts; part; part = part->next)
+    {
+      struct cached_part *cp;
+      struct stat st;
+
+      if (!part->data && !part->filename)
+	continue;
+
+      cp = x_calloc (1, sizeof (*cp));
+      *tail = cp;
+      tail = &cp->next;
+
+      if (part->headers)
+	{
+	  cp->headers = x_malloc (part->headersize + 1);
+	  memcpy (cp->headers, part->headers, part->headersize);
+	  cp->headers[part->headersize] = '\0';
+	  cp->headersize = part->headersize;
+	}
+
+      if (part->filename)
+	{
+	  cp->filename = x_strdup (part->filename);
+	  if (stat (part->tmp_filename, &st) != 0
+	      || entry->size + (uint64_t)st.st_size
+	         > response_cache_entry_limit
+	      || !read_file (part->tmp_filename, st.st_size,
+	                     &cp->data, &cp->datasize))
+	    goto reject;
+	}
+      else
+	{
+	  cp->data = x_malloc (part->datasize + 1);
+	  memcpy (cp->data, part->data, part->datasize);
+	  cp->data[part->datasize] = '\0';
+	  cp->datasize = part->datasize;
+	}
+
+      entry->size += sizeof (*cp) + cp->headersize + cp->datasize;
+      if (entry->size > response_cache_entry_limit)
+	goto reject;
+    }
+
+  entry->expires = time (NULL) + (entry->code == 200
+                                  ? response_cache_hit_ttl
+                                  : response_cache_miss_ttl);
+
+  old = hashtable_search (response_cache, entry->key);
+  if (old)
+    uncache_response (old);
+  hashtable_insert (response_cache, x_strdup (entry->key), entry);
+  lru_push_front (entry);
+  response_cache_size += entry->size;
+  cache_store_counter++;
+  cc_log ("Response cache: stored %s (HTTP %d, %zu bytes)",
+          entry->key, entry->code, entry->size);
+
+  /* Keep within budget.  */
+  while (response_cache_size > response_cache_limit && lru_last != entry)
+    {
+      cc_log ("Response cache: evicted %s", lru_last->key);
+      uncache_response (lru_last);
+      cache_eviction_counter++;
+    }
+  return;
+
+reject:
+  cc_log ("Response cache: %s is too large to cache", key);
+  free_cached_response (entry);
+}
+
+/* Build a new server response from the cache entry for KEY.
+   Attachments are written to new temporary files, just as if they had
+   been downloaded.  Returns NULL if there is no usable entry.  */
+static struct server_response *
+cached_server_response (const char *key)
+{
+  struct cached_response *entry;
+  struct cached_part *cp;
+  struct server_response *response;
+
+  if (!response_cache || !key)
+    return NULL;
+
+  entry = hashtable_search (response_cache, (void *)key);
+  if (entry && entry->expires <= time (NULL))
+    {
+      uncache_response (entry);
+      entry = NULL;
+    }
+  if (!entry)
+    {
+      cache_miss_counter++;
+      return NULL;
+    }
+
+  response = x_calloc (1, sizeof (*response));
+  response->code = entry->code;
+  response->complete = true;
+
+  for (cp = entry->parts; cp; cp = cp->next)
+    {
+      struct response_part *part = x_calloc (1, sizeof (*part));
+      if (response->last)
+	response->last->next = part;
+      else
+	response->parts = part;
+      response->last = part;
+
+      if (cp->headers)
+	{
+	  part->headers = x_malloc (cp->headersize + 1);
+	  memcpy (part->headers, cp->headers, cp->headersize);
+	  part->headers[cp->headersize] = '\0';
+	  part->headersize = cp->headersize;
+	}
+
+      if (cp->filename)
+	{
+	  const char *basename = strrchr (cp->filename, '/');
+	  FILE *f;
+	  bool ok;
+
+	  basename = basename ? basename + 1 : cp->filename;
+	  part->filename = x_strdup (cp->filename);
+	  part->tmp_filename = format ("%s/download.%s.%s.%u", temp_dir (),
+	                               basename, tmp_string (),
+	                               download_counter++);
+	  f = fopen (part->tmp_filename, "wb");
+	  ok = f && (cp->datasize == 0
+	             || fwrite (cp->data, cp->datasize, 1, f) == 1);
+	  if (f && fclose (f) != 0)
+	    ok = false;
+	  if (!ok)
+	    {
+	      cc_log ("Response cache: could not write %s: %s",
+	              part->tmp_filename, strerror (errno));
+	      for (part = response->parts; part; part = part->next)
+		if (part->tmp_filename)
+		  unlink (part->tmp_filename);
+	      free_server_response (response);
+	      cache_miss_counter++;
+	      return NULL;
+	    }
+	}
+      else
+	{
+	  part->data = x_malloc (cp->datasize + 1);
+	  memcpy (part->data, cp->data, cp->datasize);
+	  part->data[cp->datasize] = '\0';
+	  part->datasize = cp->datasize;
+	}
+    }
+
+  lru_unlink (entry);
+  lru_push_front (entry);
+  if (entry->code == 200)
+    cache_hit_counter++;
+  else
+    cache_negative_hit_counter++;
+  return response;
+}
+
 /* The call-back function for CURLOPT_HEADERFUNCTION.  */
 static size_t
 receive_cloud_response_headers (char *data, size_t blocksize,
@@ -1021,15 +2343,27 @@ receive_cloud_response_headers (char *data, size_t blocksize,
 {
   struct server_response *response = (struct server_response *)userdata;
   size_t size = blocksize * nblocks;
+  int code;
 
-  if (size < 13)
+  bytes_downloaded += size;
+  if (size < 12)
     /* The data is too short to be anything interesting,
        and we mustn't read past the end.  */
     ;
-  else if (sscanf (data, "HTTP/1.1 %d", &response->code) == 1)
-    ;
-  else if (strncmp (data, "Content-Type: ",
-                    MIN(size, strlen ("Content-Type: "))) == 0)
+  /* The status line is "HTTP/1.1 200 OK" or just "HTTP/2 200", and
+     HTTP/2 header names arrive in lower case.  */
+  else if (sscanf (data, "HTTP/%*s %d", &code) == 1)
+    {
+      /* A resumed GET gets the rest of the body in a 206, or, if the
+         entity has changed, the whole of it in a 200.  */
+      if (response->resuming && code == 206)
+	code = 200;
+      else if (response->resuming)
+	restart_server_response (response);
+      response->code = code;
+    }
+  else if (strncasecmp (data, "Content-Type: ",
+                        MIN(size, strlen ("Content-Type: "))) == 0)
     {
       /* We support two content type formats:
          1. A plain "<mime-type>", or
@@ -1058,391 +2392,2466 @@ receive_cloud_response_headers (char *data, size_t blocksize,
 	      end = memchr (data, '"', len);
 	      if (end)
 		{
-		  size_t b_len =  (end - data) + 4;
 		  free (response->boundary);
-		  response->boundary = x_malloc (b_len + 1);
-		  response->boundary[0] = '\r';
-		  response->boundary[1] = '\n';
-		  response->boundary[2] = '-';
-		  response->boundary[3] = '-';
-		  strncpy (response->boundary + 4, data, end - data);
-		  response->boundary[b_len] = '\0';
+		  response->boundary = x_strndup (data, end - data);
 		}
 	    }
 	}
     }
-  else if (sscanf (data, "Content-Length: %zu", &response->size) == 1)
+  else if (strncasecmp (data, "Content-Length: ",
+                        strlen ("Content-Length: ")) == 0)
+    {
+      /* That of a resumed GET is only the length of the rest.  */
+      if (!response->resuming)
+	sscanf (data + strlen ("Content-Length: "), "%zu", &response->size);
+    }
+  else if (strncasecmp (data, "Content-Range: ",
+                        strlen ("Content-Range: ")) == 0)
+    {
+      size_t start;
+
+      /* The rest must start where the body was cut off.  */
+      if (response->resuming
+	  && (sscanf (data + strlen ("Content-Range: "), "bytes %zu-",
+	              &start) != 1
+	      || start != response->received))
+	{
+	  cc_log ("Error: the server resumed a download at the wrong place");
+	  return 0;
+	}
+    }
+  else if (strncasecmp (data, "ETag: ", strlen ("ETag: ")) == 0)
+    {
+      free (response->etag);
+      response->etag = x_strndup (data + strlen ("ETag: "),
+                                  size - strlen ("ETag: "));
+      strtok (response->etag, "\r\n");
+    }
+  else if (strncasecmp (data, "Accept-Ranges: bytes",
+                        strlen ("Accept-Ranges: bytes")) == 0)
+    response->accepts_ranges = true;
+  else if (strncasecmp (data, "Content-Encoding: ",
+                        strlen ("Content-Encoding: ")) == 0)
+    /* Ranges would be of the encoded body, which curl doesn't keep.  */
+    response->encoded = true;
+  else if (strncasecmp (data, "Accept-Encoding:",
+                        strlen ("Accept-Encoding:")) == 0)
     {
+      /* The encodings the server takes for uploads.  */
+      const char *end = data + size;
+      enum encoding encoding;
+
+      memset (server_accepts, 0, sizeof (server_accepts));
+      data += strlen ("Accept-Encoding:");
+      while (data < end)
+	{
+	  size_t len;
+
+	  data += strspn (data, " \t,");
+	  len = strcspn (data, " \t,;\r\n");
+	  if (data + len > end)
+	    len = end - data;
+	  if (encoding_parse (data, len, &encoding))
+	    server_accepts[encoding] = true;
+	  data += len;
+	  data += strcspn (data, ",\r\n");
+	  if (data < end && *data != ',')
+	    break;
+	}
     }
 
   return size;
 }
 
-/* The call-back function for CURL_WRITE_FUNCTION.
-   This should be called *again* after curl_easy_perform* has returned
-   with DATA=NULL, BLOCKSIZE=0, NBLOCKS=0 to flush the buffer.  */
-static size_t
-receive_cloud_response (char *netdata, size_t blocksize, size_t nblocks,
-                        void *userdata)
+/* Append SIZE bytes of DATA to PART, either in memory or in the
+   attachment file.  */
+static int
+store_part_data (void *userdata, const char *data, size_t size)
+{
+  struct response_part *part = (struct response_part *)userdata;
+
+  if (part->decoder)
+    encoded_raw_bytes_received += size;
+  if (part->content_hash)
+    hash_buffer (&part->hash, data, size);
+  if (part->fd)
+    {
+      /* Write the data to file.  */
+      if (!fwrite (data, size, 1, part->fd))
+	fatal ("Error fwrite failed!");
+      return 1;
+    }
+
+  /* Store the data in a memory buffer.  */
+  if (part->datasize + size + 1 /* nul-terminator */ > part->allocated)
+    {
+      part->allocated = 2 * (part->datasize + size + 1);
+      part->data = x_realloc (part->data, part->allocated);
+    }
+  memcpy (part->data + part->datasize, data, size);
+  part->datasize += size;
+  part->data[part->datasize] = '\0';
+  return 1;
+}
+
+/* Append SIZE bytes of DATA to the current part of RESPONSE, decoding
+   them first if it was sent encoded.  */
+static int
+append_response_data (void *userdata, const char *data, size_t size)
 {
-  char *data = netdata;
   struct server_response *response = (struct server_response *)userdata;
-  size_t orig_size = blocksize * nblocks;
-  size_t size = orig_size;
   struct response_part *part = response->last;
-  size_t boundary_len = response->boundary ? strlen (response->boundary) : 0;
-  char * must_free_data = NULL;
-
-  /* If the end of the data has already been seen,
-     we just ignore any more data.  */
-  if (response->complete)
-    return orig_size;
-
-  /* This buffer is used to stash the tail of the data if the end boundary is
-     *not* found.  This means we can be sure we don't miss it if it gets
-     cut in half by chance.  */
-  if (response->data_stash)
-    {
-      char *new_data = x_malloc (size + response->data_stash_size);
-      memcpy (new_data, response->data_stash, response->data_stash_size);
-      if (data)
-	memcpy (new_data + response->data_stash_size, data, size);
-      data = new_data;
-      size += response->data_stash_size;
-      free (response->data_stash);
-      response->data_stash = NULL;
-      response->data_stash_size = 0;
-      must_free_data = data;
-    }
-
-  /* if we were called with no data, and there was no stash to clean up,
-     then there's nothing to do.  */
-  if (!data)
-    return 0;
 
-  if (!part)
+  if (!part->decoder)
+    return store_part_data (part, data, size);
+  encoded_bytes_received += size;
+  if (!decoder_feed (part->decoder, data, size))
     {
-      /* Even non-multipart messages have one part.  */
-      part = x_calloc (1, sizeof(struct response_part));
-      response->parts = response->last = part;
+      cc_log ("Error: could not decode a part from the server");
+      return 0;
     }
+  return 1;
+}
+
+/* The multipart parser call-back for the start of a new part.  Attachments
+   are written directly to a temporary file.  */
+static int
+begin_response_part (void *userdata, const char *part_headers,
+                     size_t headersize)
+{
+  struct server_response *response = (struct server_response *)userdata;
+  struct response_part *part = x_calloc (1, sizeof (struct response_part));
+  enum encoding encoding = ENCODING_IDENTITY;
+  char *headers;
+
+  response->last->next = part;
+  response->last = part;
 
-  while (size > boundary_len
-	 || (netdata == NULL && size > 0))
+  if (headersize == 0)
     {
-      char *begin = data;
-      char *end;
-      bool end_of_part_found = false;
+      /* Zero-length headers are legal.  We just record the data.  */
+      part->data = x_strdup ("");
+      return 1;
+    }
 
-      /* Find how much of the data is in the current part.  */
-      if (response->boundary)
+  part->headers = x_strndup (part_headers, headersize);
+  part->headersize = headersize;
+
+  /* Parse the headers.  */
+  headers = part->headers;
+  while (1)
+    {
+      char *linefeed = strchrnul (headers, '\n');
+      char *lineend = linefeed > headers && linefeed[-1] == '\r'
+		      ? linefeed - 1: linefeed;
+      if (str_startswith (headers, "Content-Type: "))
+	{
+	  /* Extract the MIME type.  */
+	  headers += strlen ("Content-Type: ");
+	  free (part->type);
+	  part->type = x_strndup (headers, lineend - headers);
+	}
+      else if (str_startswith (headers, "Content-Disposition: "))
 	{
-	  end = memmem (data, size, response->boundary, boundary_len);
-	  if (!end)
+	  /* Extract the attachment filename, if any.  */
+	  headers += strlen ("Content-Disposition: ");
+	  if (str_startswith (headers, "attachment; filename="))
 	    {
-	      if (netdata == NULL)
-		end = data + size;
-	      else
-		/* Ensure that the boundary wasn't chopped in two.  */
-		end = data + size - boundary_len;
+	      char *nameend;
+	      const char *basename, *tmp_file;
+
+	      headers += strlen ("attachment; filename=");
+	      nameend = strchr (headers, ';');
+	      if (!nameend || nameend > lineend)
+		nameend = lineend;
+
+	      free(part->filename);
+	      part->filename = x_strndup (headers, nameend - headers);
+
+	      /* We write attachments directly to file.  */
+	      basename = strrchr (part->filename, '/');
+	      if (!basename)
+		basename = part->filename;
+
+	      tmp_file = tmp_string ();
+
+	      free (part->tmp_filename);
+	      part->tmp_filename = format ("%s/download.%s.%s.%u", temp_dir(),
+	                                   basename, tmp_file,
+	                                   download_counter++);
+	      part->fd = fopen (part->tmp_filename, "wb");
+	      /* The temporary directory may not exist yet in a new cache.  */
+	      if (!part->fd && errno == ENOENT
+		  && create_parent_dirs (part->tmp_filename) == 0)
+		part->fd = fopen (part->tmp_filename, "wb");
+	      if (!part->fd)
+		fatal ("Could not open file %s for writing.",
+		       part->tmp_filename);
+	    }
+	}
+      else if (str_startswith (headers, "Content-Hash: "))
+	{
+	  headers += strlen ("Content-Hash: ");
+	  free (part->content_hash);
+	  part->content_hash = x_strndup (headers, lineend - headers);
+	  hash_start (&part->hash);
+	}
+      else if (str_startswith (headers, "Content-Encoding: "))
+	{
+	  headers += strlen ("Content-Encoding: ");
+	  if (!encoding_parse (headers, lineend - headers, &encoding))
+	    {
+	      cc_log ("Error: the server sent a part in encoding '%.*s'",
+	              (int)(lineend - headers), headers);
+	      return 0;
 	    }
-	  else
-	    end_of_part_found = true;
 	}
+      if (linefeed[0] == '\0')
+	break;
       else
-	end = data + size;
+	headers = linefeed + 1;
+    }
 
-      /* Read the part headers, if we haven't already.
-         Single-part messages and part-zero of multipart messages
-         do not have headers.  */
-      if (part != response->parts && !part->fd && !part->data)
+  if (encoding != ENCODING_IDENTITY)
+    {
+      part->decoder = decoder_new (encoding, store_part_data, part);
+      if (!part->decoder)
 	{
-	  bool header_complete = false;
+	  cc_log ("Error: the server sent a part in %s, which we can't decode",
+	          encoding_name (encoding));
+	  return 0;
+	}
+      encoded_parts_received++;
+    }
+  return 1;
+}
 
-	  /* Keep reading lines until there are two EOLNs in a row.  */
-	  while (data < end)
-	    {
-	      char *line = data;
-	      int line_length;
-	      char *eoln = memmem (line, end - line, "\r\n", 2);
+/* The multipart parser call-back for the end of a part.  */
+static int
+end_response_part (void *userdata)
+{
+  struct server_response *response = (struct server_response *)userdata;
+  struct response_part *part = response->last;
+  int ok = 1;
 
-	      if (eoln)
-		data = eoln + 2;
-	      else
-		break;
+  if (part->decoder)
+    {
+      ok = decoder_finish (part->decoder);
+      if (!ok)
+	cc_log ("Error: an encoded part from the server was cut short");
+      decoder_free (part->decoder);
+      part->decoder = NULL;
+    }
 
-	      line_length = data - line;
+  /* Close the completed part's file, if any.  */
+  if (part->fd)
+    {
+      fclose (part->fd);
+      part->fd = NULL;
+    }
 
-	      /* If the line consists only of CRLF then we've read the whole
-	         header already.  */
-	      if (line_length == 2)
-		{
-		  header_complete = true;
-		  break;
-		}
-	      else
-		{
-		  part->headers = x_realloc (part->headers,
-					     part->headersize + line_length
-					     + 1 /* nul-terminator */);
-		  memcpy (part->headers + part->headersize, line, line_length);
-		  part->headersize += line_length;
-		  part->headers[part->headersize] = '\0';
-		}
-	    }
+  if (ok && part->content_hash)
+    {
+      char *hash = hash_result (&part->hash);
 
-	  if (header_complete && part->headers)
-	    {
-	      /* We've read all the headers into a string.
-	         Now parse them.  */
-	      char *headers = part->headers;
-	      while (1)
-		{
-		  char *linefeed = strchrnul (headers, '\n');
-		  char *lineend = linefeed > headers && linefeed[-1] == '\r'
-				  ? linefeed - 1: linefeed;
-		  if (str_startswith (headers, "Content-Type: "))
-		    {
-		      /* Extract the MIME type.  */
-		      headers += strlen ("Content-Type: ");
-		      free (part->type);
-		      part->type = x_strndup (headers, lineend - headers);
-		    }
-		  else if (str_startswith (headers, "Content-Disposition: "))
-		    {
-		      /* Extract the attachment filename, if any.  */
-		      headers += strlen ("Content-Disposition: ");
-		      if (str_startswith (headers, "attachment; filename="))
-			{
-			  char *nameend;
-			  const char *basename, *tmp_file;
-
-			  headers += strlen ("attachment; filename=");
-			  nameend = strchr (headers, ';');
-			  if (!nameend || nameend > lineend)
-			    nameend = lineend;
-
-			  free(part->filename);
-			  part->filename = x_strndup (headers,
-			                              nameend - headers);
-
-			  /* We write attachments directly to file.  */
-			  basename = strrchr (part->filename, '/');
-			  if (!basename)
-			    basename = part->filename;
-
-			  tmp_file = tmp_string ();
-
-			  free (part->tmp_filename);
-			  part->tmp_filename = format ("%s/download.%s.%s",
-			                               temp_dir(),
-			                               basename, tmp_file);
-			  part->fd = fopen (part->tmp_filename, "wb");
-			  if (!part->fd)
-			    fatal ("Could not open file %s for writing.",
-			           part->tmp_filename);
-			}
-		    }
-		  if (linefeed[0] == '\0')
-		    break;
-		  else
-		    headers = linefeed + 1;
-		}
-	    }
-	  else if (header_complete)
-	    /* Zero-length headers are legal.  We just record the data.  */
-	    part->data = x_strdup ("");
-	  else
-	    {
-	      /* Incomplete headers.  Wait for more data.  */
-	      size -= data - begin;
-	      break;
-	    }
+      if (!str_eq (hash, part->content_hash))
+	{
+	  cc_log ("Error: %s from the server is %s, not %s",
+	          part->filename ? part->filename : "a part", hash,
+	          part->content_hash);
+	  content_hash_mismatches++;
+	  if (part->tmp_filename)
+	    unlink (part->tmp_filename);
+	  ok = 0;
+	}
+      free (hash);
+    }
+  return ok;
+}
+
+static const struct multipart_callbacks response_part_callbacks =
+{
+  begin_response_part,
+  append_response_data,
+  end_response_part
+};
+
+/* The call-back function for CURL_WRITE_FUNCTION.
+   This should be called *again* after curl_easy_perform* has returned
+   with DATA=NULL, BLOCKSIZE=0, NBLOCKS=0 to flush the parser.
+
+   Multipart messages are passed through a streaming parser, which writes
+   attachments straight to file as the data arrives.  */
+static size_t
+receive_cloud_response (char *data, size_t blocksize, size_t nblocks,
+                        void *userdata)
+{
+  struct server_response *response = (struct server_response *)userdata;
+  size_t size = blocksize * nblocks;
+
+  bytes_downloaded += size;
+  response->received += size;
+
+  /* If the end of the data has already been seen,
+     we just ignore any more data.  */
+  if (response->complete)
+    return size;
+
+  /* if we were called with no data, and there is no parser to flush,
+     then there's nothing to do.  */
+  if (!data && !response->parser)
+    return 0;
+
+  if (!response->parts)
+    {
+      /* Even non-multipart messages have one part.  */
+      response->parts = response->last =
+	x_calloc (1, sizeof (struct response_part));
+      if (response->boundary)
+	response->parser = multipart_new (response->boundary,
+	                                  &response_part_callbacks, response);
+    }
+
+  if (response->parser)
+    {
+      int ok = (data ? multipart_feed (response->parser, data, size)
+                : multipart_finish (response->parser));
+      if (multipart_complete (response->parser))
+	response->complete = true;
+      if (!ok)
+	/* Returning a short count makes libcurl abandon the transfer.  */
+	return 0;
+    }
+  else
+    {
+      append_response_data (response, data, size);
+
+      /* Single-part responses are complete if they are the right
+         length.  */
+      if (response->last->datasize == response->size)
+	response->complete = true;
+    }
+
+  return size;
+}
+
+/* Return the time since START in microseconds.  */
+static uint64_t
+microseconds_since (const struct timeval *start)
+{
+  struct timeval tv, diff;
+  gettimeofday (&tv, NULL);
+  timersub (&tv, start, &diff);
+  return (uint64_t)diff.tv_sec * 1000000 + diff.tv_usec;
+}
+
+/* Cache lookups.
+
+   Clients may ask the daemon to open files in the cache directory for them
+   (the 'L' command).  The daemon keeps no index of the cache: it opens each
+   file when asked, one after another in its main loop, and passes the
+   descriptors back, so this saves the client no file system work.  */
+
+static unsigned int lookup_counter = 0;
+static unsigned int lookup_found_counter = 0;
+
+/* Open NAME, a path relative to the cache directory.  Returns a read-only
+   descriptor, or -1 if there is no such file.  */
+static int
+lookup_open (const char *name)
+{
+  char *path;
+  int fd;
+
+  lookup_counter++;
+  if (name[0] == '/' || strstr (name, ".."))
+    return -1;
+
+  path = format ("%s/%s", conf->cache_dir, name);
+  fd = open (path, O_RDONLY | O_BINARY);
+  free (path);
+  if (fd != -1)
+    lookup_found_counter++;
+  return fd;
+}
+
+/* Answer an 'L' command.  NAMES holds SIZE bytes of nul-separated paths,
+   relative to the cache directory.  The reply is 'L', the number of files,
+   and a 'Y' or 'N' for each, with the descriptors of the 'Y' files passed
+   alongside.  Returns false if the reply couldn't be sent.  */
+static bool
+answer_lookup (struct local_connection_state *conn, const char *names,
+               size_t size)
+{
+  char reply[2 + MAX_LOOKUP_FILES];
+  int fds[MAX_LOOKUP_FILES];
+  int n = 0, nfds_found = 0, i;
+  const char *name = names;
+
+  while (name < names + size && n < MAX_LOOKUP_FILES)
+    {
+      int fd = lookup_open (name);
+      reply[2 + n++] = fd == -1 ? 'N' : 'Y';
+      if (fd != -1)
+	fds[nfds_found++] = fd;
+      name += strlen (name) + 1;
+    }
+  reply[0] = 'L';
+  reply[1] = n;
+
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE (sizeof (fds))];
+  } control;
+  struct iovec iov = {reply, 2 + n};
+  struct msghdr msg;
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (nfds_found)
+    {
+      msg.msg_control = control.space;
+      msg.msg_controllen = CMSG_SPACE (nfds_found * sizeof (int));
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN (nfds_found * sizeof (int));
+      memcpy (CMSG_DATA (cmsg), fds, nfds_found * sizeof (int));
+    }
+
+  /* The reply is tiny, so it fits the socket buffer of a client that is
+     waiting for it; if it doesn't, the client has misbehaved.  */
+  ssize_t sent = sendmsg (conn->fd, &msg, 0);
+  for (i = 0; i < nfds_found; i++)
+    close (fds[i]);
+  if (sent != 2 + n)
+    {
+      cc_log ("[%u] Error: could not send lookup reply: %s",
+              conn->client_number, sent == -1 ? strerror (errno) : "short");
+      return false;
+    }
+  bytes_to_clients += sent;
+  return true;
+}
+
+/* Toolchain identities.
+
+   Working out the identity of a toolchain (see tool_id.c) means reading
+   the .tool_id file or, with CS_COMPILERCHECK=content, hashing every binary
+   in it, on each compile.  A client that has done that tells the daemon the
+   result with the 'I' command: the key it derived from the compiler's path
+   and stat data, the identity, and the paths of the tools it hashed, each
+   with the stat data it found the tool with.  Later clients send just the
+   key, and get the identity back.
+
+   The daemon stats the tools every so often, and forgets a toolchain as
+   soon as any of its files differs from what the client saw (or has
+   gone): the next client then does the work itself, and tells the daemon
+   again.  Since the stat data comes from the client, a tool that changed
+   after it was hashed, but before it was registered, is noticed too.  A
+   file can't be rewritten without changing its ctime, so in content mode
+   an unchanged stat vouches for the contents as well as a rehash would.
+
+   The table is tuned through the environment of the daemon:
+     CS_DAEMON_TOOL_RECHECK  seconds between stats of the tools (default 2)  */
+
+#define MAX_TOOLCHAINS 64
+
+struct toolchain_file
+{
+  char *path;
+  struct stat st;
+};
+
+struct toolchain
+{
+  char *key;
+  char *id;
+  int nfiles;
+  struct toolchain_file *files;
+
+  struct toolchain *next;
+};
+
+static struct toolchain *toolchains = NULL;
+static int toolchain_count = 0;
+static time_t tool_recheck = 2;
+static time_t toolchains_checked = 0;
+static unsigned int tool_query_counter = 0;
+static unsigned int tool_hit_counter = 0;
+static unsigned int tool_stale_counter = 0;
+
+static bool
+same_file_stat (const struct stat *a, const struct stat *b)
+{
+  return (a->st_dev == b->st_dev && a->st_ino == b->st_ino
+          && a->st_size == b->st_size && a->st_mtime == b->st_mtime
+          && a->st_ctime == b->st_ctime);
+}
+
+static void
+free_toolchain (struct toolchain *tc)
+{
+  int i;
+
+  for (i = 0; i < tc->nfiles; i++)
+    free (tc->files[i].path);
+  free (tc->files);
+  free (tc->key);
+  free (tc->id);
+  free (tc);
+}
+
+/* Drop every toolchain with a file that has changed since it was
+   registered.  This is rate-limited by CS_DAEMON_TOOL_RECHECK.  */
+static void
+revalidate_toolchains (void)
+{
+  struct toolchain **ptr = &toolchains;
+  time_t now = time (NULL);
+
+  if (!toolchains || now - toolchains_checked < tool_recheck)
+    return;
+  toolchains_checked = now;
+
+  while (*ptr)
+    {
+      struct toolchain *tc = *ptr;
+      struct stat st;
+      int i;
+
+      for (i = 0; i < tc->nfiles; i++)
+	if (stat (tc->files[i].path, &st) != 0
+	    || !same_file_stat (&st, &tc->files[i].st))
+	  break;
+      if (i < tc->nfiles)
+	{
+	  cc_log ("Toolchain %s changed (%s); forgetting it", tc->id,
+	          tc->files[i].path);
+	  tool_stale_counter++;
+	  *ptr = tc->next;
+	  toolchain_count--;
+	  free_toolchain (tc);
+	}
+      else
+	ptr = &tc->next;
+    }
+}
+
+/* Parse the stat data STR sent by a client (see register_daemon_tool_id)
+   into ST.  Returns false if it is malformed.  */
+static bool
+parse_tool_stat (const char *str, struct stat *st)
+{
+  unsigned long long dev, ino;
+  long long size, mtime, ctime;
+  char end;
+
+  if (sscanf (str, "%llu %llu %lld %lld %lld%c", &dev, &ino, &size, &mtime,
+              &ctime, &end) != 5)
+    return false;
+  memset (st, 0, sizeof (*st));
+  st->st_dev = dev;
+  st->st_ino = ino;
+  st->st_size = size;
+  st->st_mtime = mtime;
+  st->st_ctime = ctime;
+  return true;
+}
+
+/* Remember that KEY identifies toolchain ID, made of NFILES files.  FILES
+   holds the path of each, followed by its stat data (nul-separated).  */
+static void
+register_toolchain (const char *key, const char *id, const char *files,
+                    int nfiles)
+{
+  struct toolchain *tc, **ptr;
+  int i;
+
+  for (ptr = &toolchains; *ptr; ptr = &(*ptr)->next)
+    if (strcmp ((*ptr)->key, key) == 0)
+      {
+	tc = *ptr;
+	*ptr = tc->next;
+	toolchain_count--;
+	free_toolchain (tc);
+	break;
+      }
+
+  tc = x_calloc (1, sizeof (*tc));
+  tc->files = x_calloc (nfiles, sizeof (*tc->files));
+  for (i = 0; i < nfiles; i++)
+    {
+      const char *path = files, *stat_data = path + strlen (path) + 1;
+
+      files = stat_data + strlen (stat_data) + 1;
+
+      /* A tool that can't be watched can't be vouched for.  */
+      if (path[0] != '/' || !parse_tool_stat (stat_data, &tc->files[i].st))
+	{
+	  tc->nfiles = i;
+	  free_toolchain (tc);
+	  return;
+	}
+      tc->files[i].path = x_strdup (path);
+    }
+  tc->nfiles = nfiles;
+  tc->key = x_strdup (key);
+  tc->id = x_strdup (id);
+
+  /* The newest goes first; there are only ever a few.  */
+  tc->next = toolchains;
+  toolchains = tc;
+  if (++toolchain_count > MAX_TOOLCHAINS)
+    {
+      for (ptr = &toolchains; (*ptr)->next; ptr = &(*ptr)->next)
+	;
+      free_toolchain (*ptr);
+      *ptr = NULL;
+      toolchain_count--;
+    }
+  cc_log ("Registered toolchain %s (%d files)", id, nfiles);
+}
+
+/* Answer an 'I' command.  DATA holds SIZE bytes of nul-separated strings:
+   a key on its own is a query, and is answered with 'I', the length of the
+   identity and the identity itself (length zero if it is unknown); a key,
+   an identity and a list of paths, each followed by its stat data,
+   registers a toolchain, and gets no reply.  Returns false if the request
+   is malformed or the reply couldn't be sent.  */
+static bool
+answer_toolchain (struct local_connection_state *conn, const char *data,
+                  size_t size)
+{
+  const char *key = data, *end = data + size, *str;
+  int nstrings = 0;
+
+  if (size == 0 || data[size - 1] != '\0')
+    return false;
+  for (str = data; str < end; str += strlen (str) + 1)
+    nstrings++;
+
+  if (nstrings > 2)
+    {
+      const char *id = key + strlen (key) + 1;
+      if (nstrings % 2 != 0)
+	return false;
+      register_toolchain (key, id, id + strlen (id) + 1, (nstrings - 2) / 2);
+      return true;
+    }
+  if (nstrings != 1)
+    return false;
+
+  struct toolchain *tc;
+  char reply[2 + 256];
+  size_t len = 0;
+
+  tool_query_counter++;
+  for (tc = toolchains; tc; tc = tc->next)
+    if (strcmp (tc->key, key) == 0)
+      {
+	len = strlen (tc->id);
+	if (len > 255)
+	  len = 0;
+	else
+	  tool_hit_counter++;
+	memcpy (reply + 2, tc->id, len);
+	break;
+      }
+  reply[0] = 'I';
+  reply[1] = len;
+
+  /* As with lookups, the client is waiting, so the reply fits.  */
+  ssize_t sent = send (conn->fd, reply, 2 + len, 0);
+  if (sent != (ssize_t)(2 + len))
+    {
+      cc_log ("[%u] Error: could not send toolchain reply: %s",
+              conn->client_number, sent == -1 ? strerror (errno) : "short");
+      return false;
+    }
+  bytes_to_clients += sent;
+  return true;
+}
+
+/* Add VALUE to SAMPLES, displacing the oldest once it is full.  */
+static void
+record_recent (struct recent_samples *samples, uint32_t value)
+{
+  samples->value[samples->count++ % RECENT_SAMPLES] = value;
+}
+
+static int
+compare_uint32 (const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Return the PERCENTILE'th percentile of SAMPLES, or UINT32_MAX if there
+   are none.  */
+static uint32_t
+recent_percentile (const struct recent_samples *samples,
+                   unsigned int percentile)
+{
+  uint32_t sorted[RECENT_SAMPLES];
+  unsigned int n = (samples->count < RECENT_SAMPLES
+                    ? samples->count : RECENT_SAMPLES);
+  unsigned int i;
+
+  if (n == 0)
+    return UINT32_MAX;
+  memcpy (sorted, samples->value, n * sizeof (*sorted));
+  qsort (sorted, n, sizeof (*sorted), compare_uint32);
+  i = (n * percentile + 99) / 100;
+  return sorted[i > 0 ? i - 1 : 0];
+}
+
+/* Answer a 'P' command, which asks how long to give the cloud before
+   compiling locally (see cloud_race).  The reply is 'P', then the
+   PERCENTILE'th percentile of the recent GET response times, then the
+   median of the recent compile times that clients reported with the 'C'
+   command; both are 32-bit little-endian microseconds, and all ones if
+   there are no samples yet.  Returns false if the reply couldn't be
+   sent.  */
+static bool
+answer_pace (struct local_connection_state *conn, unsigned int percentile)
+{
+  uint32_t get = recent_percentile (&recent_get_times,
+                                    percentile > 100 ? 100 : percentile);
+  uint32_t compile = recent_percentile (&recent_compile_times, 50);
+  char reply[9];
+  int i;
+
+  reply[0] = 'P';
+  for (i = 0; i < 4; i++)
+    {
+      reply[1 + i] = (get >> (8 * i)) & 0xFF;
+      reply[5 + i] = (compile >> (8 * i)) & 0xFF;
+    }
+
+  /* As with lookups, the client is waiting, so the reply fits.  */
+  ssize_t sent = send (conn->fd, reply, sizeof (reply), 0);
+  if (sent != (ssize_t)sizeof (reply))
+    {
+      cc_log ("[%u] Error: could not send pace reply: %s",
+              conn->client_number, sent == -1 ? strerror (errno) : "short");
+      return false;
+    }
+  bytes_to_clients += sent;
+  return true;
+}
+
+/* The compile server.
+
+   Much of the time taken by a cache hit goes on starting cs: loading it
+   and its libraries, reading the configuration, and finding the compiler.
+   The daemon has been started already, so with the 'X' command a client
+   (see client.c) can have it run a whole cs invocation instead.  The
+   client sends its working directory, its arguments, an empty string and
+   its environment, all nul-terminated, and then one more byte carrying its
+   standard input, output and error.  The daemon forks a child that adopts
+   all of these and carries on as cs would have done, while the daemon
+   goes back to its other clients.  When the child exits, the client gets
+   'X' and the exit status, in four bytes, as the shell would report it.
+
+   Only the user running the daemon may do this: anyone else who can reach
+   the socket in a shared cache directory would otherwise get to run
+   programs as that user.  */
+
+/* Written to when a child exits, to wake the main loop.  */
+static int child_pipe[2] = {-1, -1};
+
+static unsigned int serve_counter = 0;
+static int serving_count = 0;
+
+/* Compiles stopped because their client went away, still to be reaped.  */
+static pid_t *abandoned_compiles = NULL;
+static int abandoned_count = 0;
+
+static void
+sigchld_handler (int num __attribute__((unused)))
+{
+  int saved_errno = errno;
+  /* If the pipe is full, the main loop is going to wake anyway.  */
+  if (write (child_pipe[1], "", 1) == -1)
+    { /* Silence warnings */ }
+  errno = saved_errno;
+}
+
+static void
+setup_compile_server (void)
+{
+  int i;
+
+  if (pipe (child_pipe) == -1)
+    {
+      cc_log ("WARNING: no compile server: %s", strerror (errno));
+      child_pipe[0] = child_pipe[1] = -1;
+      return;
+    }
+  for (i = 0; i < 2; i++)
+    {
+      fcntl (child_pipe[i], F_SETFL, O_NONBLOCK);
+      fcntl (child_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+  FD_SET (child_pipe[0], &open_local_fds[FD_READ]);
+  if (child_pipe[0] >= nfds)
+    nfds = child_pipe[0] + 1;
+  signal (SIGCHLD, sigchld_handler);
+}
+
+/* Is the client on CONN running as the same user as the daemon?  */
+static bool
+client_is_owner (struct local_connection_state *conn)
+{
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof (cred);
+  return (getsockopt (conn->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0
+          && cred.uid == geteuid ());
+#else
+  (void)conn;
+  return false;
+#endif
+}
+
+/* Receive the client's standard descriptors, which come with a single
+   byte.  Returns 1 and fills FDS when they have arrived, 0 if the read
+   would block, and -1 if the client has broken the protocol or gone.  */
+static int
+recv_serve_fds (struct local_connection_state *conn, int fds[3])
+{
+  char byte;
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE (3 * sizeof (int))];
+  } control;
+  struct iovec iov = {&byte, 1};
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  int received[3], nreceived = 0, i;
+  ssize_t got;
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.space;
+  msg.msg_controllen = sizeof (control.space);
+  got = recvmsg (conn->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+  if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return 0;
+  if (got != 1)
+    return -1;
+  bytes_from_clients++;
+
+  for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      {
+	nreceived = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+	memcpy (received, CMSG_DATA (cmsg), nreceived * sizeof (int));
+      }
+  if (nreceived != 3 || (msg.msg_flags & MSG_CTRUNC))
+    {
+      for (i = 0; i < nreceived; i++)
+	close (received[i]);
+      return -1;
+    }
+  memcpy (fds, received, sizeof (received));
+  return 1;
+}
+
+/* In a child, close every descriptor from LOWEST up.  Libraries such as
+   libcurl open descriptors of their own, so those the main loop knows of
+   aren't all there are.  */
+static void
+close_descriptors_from (int lowest)
+{
+  DIR *dir = opendir ("/proc/self/fd");
+  long fd, max;
+
+  if (dir)
+    {
+      struct dirent *de;
+      while ((de = readdir (dir)))
+	{
+	  fd = atol (de->d_name);
+	  if (fd >= lowest && fd != dirfd (dir))
+	    close (fd);
+	}
+      closedir (dir);
+      return;
+    }
+
+  max = sysconf (_SC_OPEN_MAX);
+  if (max < 0)
+    max = 1024;
+  for (fd = lowest; fd < max; fd++)
+    close (fd);
+}
+
+/* In the child: drop everything that belongs to the daemon, become the
+   client's process, and run cs.  Never returns.  */
+static void
+run_served_compile (const char *cwd, int argc, char **argv, char **envp,
+                    int fds[3])
+{
+  extern char **environ;
+  int fd, i;
+
+  /* Our own process group, so that the compiler can be stopped with us.  */
+  setpgid (0, 0);
+  exitfn_reset ();
+  signal (SIGINT, SIG_DFL);
+  signal (SIGTERM, SIG_DFL);
+  signal (SIGPIPE, SIG_DFL);
+  signal (SIGUSR1, SIG_DFL);
+  signal (SIGUSR2, SIG_DFL);
+  signal (SIGCHLD, SIG_DFL);
+  cc_log_reset ();
+
+  /* The descriptors may have arrived as 0, 1 or 2, if the daemon has
+     none of its own, so move them out of the way first.  */
+  for (i = 0; i < 3; i++)
+    {
+      fd = fcntl (fds[i], F_DUPFD, 3);
+      if (fd == -1)
+	_exit (1);
+      close (fds[i]);
+      fds[i] = fd;
+    }
+  for (i = 0; i < 3; i++)
+    if (dup2 (fds[i], i) == -1)
+      _exit (1);
+  for (i = 0; i < 3; i++)
+    close (fds[i]);
+  close_descriptors_from (3);
+
+  if (chdir (cwd) == -1)
+    {
+      fprintf (stderr, "%s: %s: %s\n", MYNAME, cwd, strerror (errno));
+      _exit (1);
+    }
+  environ = envp;
+
+  exit (ccache_main (argc, argv));
+}
+
+/* Fork a child to run the compile that CONN has asked for, with the
+   descriptors FDS, which are closed here.  Returns false if the request
+   is malformed or the fork fails.  */
+static bool
+start_served_compile (struct local_connection_state *conn, int fds[3])
+{
+  char *data = conn->serve_request, *end = data + conn->serve_request_size;
+  char *str, *cwd = data, **argv, **envp;
+  int argc = 0, nenv = 0, i;
+  bool in_env = false;
+  pid_t pid = -1;
+
+  if (conn->serve_request_size == 0 || end[-1] != '\0')
+    goto out;
+  for (str = data + strlen (cwd) + 1; str < end; str += strlen (str) + 1)
+    if (in_env)
+      nenv++;
+    else if (*str)
+      argc++;
+    else
+      in_env = true;
+  if (!in_env || argc < 2)
+    goto out;
+
+  argv = x_malloc ((argc + 1) * sizeof (char *));
+  envp = x_malloc ((nenv + 1) * sizeof (char *));
+  str = data + strlen (cwd) + 1;
+  for (i = 0; i < argc; i++, str += strlen (str) + 1)
+    argv[i] = str;
+  argv[argc] = NULL;
+  str++;
+  for (i = 0; i < nenv; i++, str += strlen (str) + 1)
+    envp[i] = str;
+  envp[nenv] = NULL;
+
+  /* Don't let the child inherit anything still in our buffers.  */
+  fflush (NULL);
+  pid = fork ();
+  if (pid == 0)
+    run_served_compile (cwd, argc, argv, envp, fds);
+  if (pid > 0)
+    setpgid (pid, pid);
+  free (argv);
+  free (envp);
+
+  if (pid == -1)
+    cc_log ("[%u:%u] Error: could not fork a compile: %s",
+            conn->client_number, conn->job_number, strerror (errno));
+  else
+    {
+      cc_log ("[%u:%u] compile running in pid %d", conn->client_number,
+              conn->job_number, (int)pid);
+      conn->serve_pid = pid;
+      serving_count++;
+      serve_counter++;
+    }
+
+out:
+  for (i = 0; i < 3; i++)
+    close (fds[i]);
+  FREE (conn->serve_request);
+  return pid > 0;
+}
+
+/* Collect the compiles that have finished, and tell their clients.  Only
+   our own children are waited for: the daemon has others, which are
+   reaped by whoever started them.  */
+static void
+reap_served_compiles (void)
+{
+  struct local_connection_state *conn, *next;
+  char reply[5];
+  int status, code, i;
+
+  while (read (child_pipe[0], reply, sizeof (reply)) > 0)
+    ;
+
+  for (i = 0; i < abandoned_count; )
+    if (waitpid (abandoned_compiles[i], &status, WNOHANG) != 0)
+      abandoned_compiles[i] = abandoned_compiles[--abandoned_count];
+    else
+      i++;
+
+  for (conn = local; conn; conn = next)
+    {
+      next = conn->next;
+      if (!conn->serve_pid
+	  || waitpid (conn->serve_pid, &status, WNOHANG) != conn->serve_pid)
+	continue;
+
+      conn->serve_pid = 0;
+      serving_count--;
+      code = WIFEXITED (status) ? WEXITSTATUS (status)
+                                : 128 + WTERMSIG (status);
+      cc_log ("[%u:%u] compile finished with status %d",
+              conn->client_number, conn->job_number, code);
+      reply[0] = 'X';
+      reply[1] = code & 0xFF;
+      reply[2] = (code & 0xFF00) >> 8;
+      reply[3] = (code & 0xFF0000) >> 16;
+      reply[4] = (code & 0xFF000000) >> 24;
+
+      /* The client is waiting for just this, so it fits.  */
+      ssize_t sent = send (conn->fd, reply, sizeof (reply), 0);
+      if (sent != sizeof (reply))
+	{
+	  cc_log ("[%u] Error: could not send compile status: %s",
+	          conn->client_number,
+	          sent == -1 ? strerror (errno) : "short");
+	  close_local_connection (conn);
+	  continue;
+	}
+      bytes_to_clients += sent;
+      conn->job_number++;
+      conn->dfa_state = STATE_RECV_INIT;
+    }
+}
+
+/* Job scheduling.
+
+   Jobs wait in one FIFO queue per class.  GETs are on the critical path of
+   a build, so they always go first, and part of the internet connection
+   pool is kept free for them; POSTs may only occupy the rest.  Uploads are
+   also paced by a token bucket, so that a burst of results from a finished
+   build can't saturate the network link, but a POST that has waited too
+   long is sent regardless, so that uploads can't starve.
+
+   A client may give a GET a deadline, in milliseconds, with the 'T'
+   command, usually its guess at how long a local compile would take.  A
+   GET still queued at its deadline fails at once, so that the client can
+   get on with compiling, and one already running is cut short by a
+   transfer timeout.
+
+   The scheduler is tuned through the environment of the daemon:
+     CS_DAEMON_GET_RESERVE    connections kept for GETs (default pool/4)
+     CS_DAEMON_POST_RATE      upload bytes per second (default 0, no limit)
+     CS_DAEMON_POST_BURST     size of the token bucket (default 4Mi)
+     CS_DAEMON_POST_MAX_WAIT  seconds before a POST goes anyway (default 30)  */
+
+static int get_reserve = -1;
+static uint64_t post_rate = 0;
+static double post_burst = 4 * 1024 * 1024;
+static double post_tokens = 4 * 1024 * 1024;
+static struct timeval post_tokens_time;
+static uint64_t post_max_wait = 30 * 1000000;
+static unsigned int get_expired_counter = 0;
+static unsigned int post_aged_counter = 0;
+
+/* The circuit breaker.
+
+   When the link to the server degrades, every GET would wait out its
+   deadline before its client gave up and compiled locally.  So once
+   CS_DAEMON_BREAKER_TRIP GETs in a row (default 3) have timed out or
+   failed to connect, the breaker opens, and GETs fail at once, as if the
+   daemon were offline.  Answers from the response cache are still given,
+   and POSTs, which nobody waits for, carry on as usual.  While clients
+   are connected, the daemon retries the GET that tripped the breaker every
+   CS_DAEMON_BREAKER_PROBE seconds (default 10), and the first that gets
+   an answer in time closes the breaker again.  */
+
+static unsigned int breaker_threshold = 3;
+static uint64_t breaker_interval = 10 * 1000000;
+static unsigned int breaker_failures = 0;
+static bool breaker_open = false;
+static bool breaker_probing = false;
+static struct timeval breaker_next_probe;
+static char *breaker_probe_url = NULL;
+static unsigned int breaker_probe_timeout = 0;
+static unsigned int breaker_trip_counter = 0;
+static unsigned int breaker_refused_counter = 0;
+
+/* Add a new job to the end of its class's queue.  */
+static void
+queue_new_job (struct local_connection_state *conn)
+{
+  struct job_class *class = conn->post ? &post_jobs : &get_jobs;
+  struct job_queue *new_jq = x_malloc (sizeof (*new_jq));
+  new_jq->conn = conn;
+  new_jq->next = NULL;
+
+  if (class->last)
+    class->last->next = new_jq;
+  else
+    class->first = new_jq;
+  class->last = new_jq;
+  class->waiting++;
+  waiting_jobs++;
+  if (waiting_jobs > peak_waiting_jobs)
+    peak_waiting_jobs = waiting_jobs;
+}
+
+/* Remove the job at *PTR, which follows PREV, from CLASS's queue.  */
+static struct local_connection_state *
+unlink_job (struct job_class *class, struct job_queue **ptr,
+            struct job_queue *prev)
+{
+  struct job_queue *job = *ptr;
+  struct local_connection_state *conn = job->conn;
+
+  *ptr = job->next;
+  if (class->last == job)
+    class->last = prev;
+  class->waiting--;
+  waiting_jobs--;
+  free (job);
+  return conn;
+}
+
+/* Remove a job from the queue. Presumably the client has died.  */
+static void
+dequeue_job (struct local_connection_state *conn)
+{
+  struct job_class *class = conn->post ? &post_jobs : &get_jobs;
+  struct job_queue **ptr, *prev = NULL;
+
+  for (ptr = &class->first; *ptr; prev = *ptr, ptr = &(*ptr)->next)
+    if ((*ptr)->conn == conn)
+      {
+	unlink_job (class, ptr, prev);
+	break;
+      }
+}
+
+/* Fail any queued GETs whose deadline has passed.  */
+static void
+expire_jobs (void)
+{
+  struct job_queue **ptr = &get_jobs.first, *prev = NULL;
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  while (*ptr)
+    {
+      struct local_connection_state *conn = (*ptr)->conn;
+
+      if (!timerisset (&conn->deadline) || timercmp (&now, &conn->deadline, <))
+	{
+	  prev = *ptr;
+	  ptr = &(*ptr)->next;
+	  continue;
+	}
+
+      unlink_job (&get_jobs, ptr, prev);
+      get_expired_counter++;
+      cc_log ("[%u:%u] job missed its deadline while queued",
+              conn->client_number, conn->job_number);
+      histogram_record (&get_queue_times,
+                        microseconds_since (&conn->request_time));
+
+      /* With no response, the client is told the request failed.  */
+      FD_SET (conn->fd, &open_local_fds[FD_WRITE]);
+      conn->dfa_state = STATE_SEND_INIT;
+    }
+}
+
+/* Top up the upload token bucket for the time since it was last filled.  */
+static void
+refill_post_tokens (void)
+{
+  if (post_rate)
+    {
+      post_tokens += (post_rate * microseconds_since (&post_tokens_time)
+                      / 1000000.0);
+      if (post_tokens > post_burst)
+	post_tokens = post_burst;
+    }
+  gettimeofday (&post_tokens_time, NULL);
+}
+
+/* Return how many upload tokens the first queued POST needs before it may
+   start.  Uploads larger than the bucket need only a full bucket.  */
+static double
+post_tokens_needed (void)
+{
+  double size = post_jobs.first ? post_jobs.first->conn->upload_size : 0;
+  return size < post_burst ? size : post_burst;
+}
+
+/* Decide which queued job should have the next free internet connection,
+   and remove it from its queue.  Returns NULL if nothing may start now.  */
+static struct local_connection_state *
+pop_queued_job (void)
+{
+  struct local_connection_state *conn = NULL;
+  bool aged = false;
+
+  refill_post_tokens ();
+  if (post_jobs.first)
+    aged = (microseconds_since (&post_jobs.first->conn->request_time)
+            >= post_max_wait);
+
+  if (get_jobs.first && !aged)
+    conn = unlink_job (&get_jobs, &get_jobs.first, NULL);
+  else if (post_jobs.first
+           && (aged
+               || (post_jobs.active < internet_pool_count - get_reserve
+                   && (!post_rate || post_tokens >= post_tokens_needed ()))))
+    {
+      conn = unlink_job (&post_jobs, &post_jobs.first, NULL);
+      if (post_rate)
+	post_tokens -= conn->upload_size;
+      if (aged)
+	post_aged_counter++;
+    }
+
+  return conn;
+}
+
+/* Return how long, in seconds, the oldest job in CLASS has been queued.  */
+static double
+oldest_wait (const struct job_class *class)
+{
+  return (class->first
+          ? microseconds_since (&class->first->conn->request_time) / 1000000.0
+          : 0.0);
+}
+
+/* Return how many microseconds may pass before the scheduler has something
+   new to do for the jobs still queued: a deadline passes, a POST ages, or
+   the token bucket refills.  Returns zero if nothing is pending.  */
+static uint64_t
+scheduler_wait (void)
+{
+  uint64_t wait = 0;
+  struct job_queue *job;
+  struct timeval now, diff;
+
+  gettimeofday (&now, NULL);
+  for (job = get_jobs.first; job; job = job->next)
+    if (timerisset (&job->conn->deadline))
+      {
+	uint64_t until = 1;
+	if (timercmp (&now, &job->conn->deadline, <))
+	  {
+	    timersub (&job->conn->deadline, &now, &diff);
+	    until = diff.tv_sec * (uint64_t)1000000 + diff.tv_usec;
+	  }
+	if (!wait || until < wait)
+	  wait = until;
+      }
+
+  if (post_jobs.first)
+    {
+      uint64_t waited = microseconds_since (&post_jobs.first->conn->request_time);
+      uint64_t until = waited < post_max_wait ? post_max_wait - waited : 1;
+      if (post_rate && post_tokens < post_tokens_needed ())
+	{
+	  uint64_t refill = 1 + (uint64_t)((post_tokens_needed () - post_tokens)
+	                                   * 1000000 / post_rate);
+	  if (refill < until)
+	    until = refill;
 	}
+      if (!wait || until < wait)
+	wait = until;
+    }
+
+  return wait;
+}
+
+/* Accumulate the time the internet connections have spent busy.
+   This must be called before the number of active connections changes.  */
+static void
+account_pool_usage (void)
+{
+  struct timeval tv, diff;
+  gettimeofday (&tv, NULL);
+  timersub (&tv, &pool_usage_mark, &diff);
+  busy_connection_seconds += (active_internet_connection_count
+                              * (diff.tv_sec + diff.tv_usec / 1000000.0));
+  pool_usage_mark = tv;
+}
+
+/* Result uploads.
+
+   A client needn't wait for the results of its compile to be uploaded:
+   with the 'Q' command, it hands them to the daemon and exits.  The
+   payload is a JSON object.  Its "data" describes the compile, and is
+   POSTed to the URL the client set, with the client's headers; "sources"
+   maps each source file to its hash, for a server that doesn't recognise
+   the source signature; and "files" lists the stashed files the server may
+   ask for, each with the form "field" to send it as, its "name", and its
+   shared memory object ("shm") and mapping "size".  From then on the
+   daemon owns those shared memory objects, and holds the conversation
+   with the server that the client used to.
+
+   The object and source files are offered with the "hash" of their
+   content too, which the "data" and "sources" tell the server, and the
+   server may answer "content needed" with the hashes of those it hasn't
+   got, rather than "files needed" with their names.  Content goes as
+   form fields named "content", with its hash as the file name, and as the
+   server files it by its hash, one copy serves every upload with that
+   content.  So the daemon sends each only once: an upload needing content
+   that another is sending waits for that request to be answered, and
+   then leaves it out, as it does any the server has taken lately.
+
+   Uploads ready for their next request are sent in batches, as one POST
+   to the batch endpoint, "<URL>batch", of those with the same URL and
+   headers, but for the client's session ID.  Its form field "batch" is a
+   JSON array with a {"session": <ID>, "data": <data>} for each upload,
+   and any files the server asked for are attached as "<index>.<field>".
+   The server answers with a "results" array, holding for each upload what
+   the ordinary endpoint would have said.  A batch goes when it holds
+   CS_DAEMON_BATCH_COUNT uploads (default 64) or CS_DAEMON_BATCH_BYTES
+   (default 4Mi), or when its oldest upload has waited
+   CS_DAEMON_BATCH_DELAY milliseconds (default 100).  A lone upload goes
+   to the ordinary endpoint, and so do all of them if the server has no
+   batch endpoint.  An upload that the server didn't answer, or asked to
+   "retry", is tried again, up to MAX_UPLOAD_TRIES times, but the rest of
+   its batch is not.
+
+   An upload that the server never answers, or that comes while the
+   circuit breaker is open, is written to the result spool (see spool.c)
+   rather than lost, and so are those still pending when the daemon exits.
+   Clients that can't reach the daemon spool their results too.  The
+   daemon replays the spool a batch at a time, oldest first, when no GETs
+   are waiting, so that compiles aren't held up.  It moves on to the next
+   batch as soon as one is done, but after an upload from the spool goes
+   unanswered again, or if the spool is empty, it waits
+   CS_DAEMON_SPOOL_RETRY seconds (default 30) before looking again.
+
+   Each request is sent by a local connection state with no client, which
+   goes through the scheduler as a POST.  */
+
+/* The most requests one upload may take, in case the server keeps asking
+   for more, and the most times one request is tried.  */
+#define MAX_UPLOAD_ROUNDS 4
+#define MAX_UPLOAD_TRIES 3
+
+/* The most content hashes to remember the server having taken.  */
+#define SENT_CONTENT_LIMIT 4096
+
+struct upload
+{
+  unsigned int client_number, job_number;
+  char *url;
+  struct curl_slist *header_list;
+  json_object *job;        /* What the client handed over.  */
+  json_object *attach;     /* The files for the next request, or NULL.  */
+  size_t size;             /* The bytes in the next request.  */
+  int rounds, tries;
+  bool lost;               /* A file it offered has gone.  */
+  json_object *needed;     /* The content the server last asked for.  */
+  bool waiting;            /* For content another upload is sending.  */
+  bool shared;             /* It left out content sent by another.  */
+  char *spooled;           /* The spool entry it came from, or NULL.  */
+  struct timeval ready_time;
+  struct upload *next;     /* All uploads.  */
+  struct upload *next_ready;
+};
+
+static struct upload *uploads = NULL;
+static struct upload *ready_uploads = NULL, *last_ready_upload = NULL;
+static int pending_uploads = 0;
+static int ready_upload_count = 0;
+static size_t ready_upload_bytes = 0;
+static bool batch_endpoint_missing = false;
+
+static unsigned int batch_count_limit = 64;
+static uint64_t batch_bytes_limit = 4 * 1024 * 1024;
+static uint64_t batch_delay = 100 * 1000;
+
+static unsigned int upload_counter = 0;
+static unsigned int upload_failed_counter = 0;
+static unsigned int upload_retry_counter = 0;
+static unsigned int batch_counter = 0;
+static unsigned int batched_upload_counter = 0;
+
+/* The content that uploads are sending, each to its upload, and that the
+   server has lately taken.  */
+static struct hashtable *sending_content = NULL;
+static struct hashtable *sent_content = NULL;
+static bool content_released = false;
+static unsigned int content_sent_counter = 0;
+static unsigned int content_shared_counter = 0;
+
+enum upload_outcome
+{
+  UPLOAD_DONE,
+  UPLOAD_FAILED,
+  UPLOAD_SPOOLED           /* Left for later, in the spool.  */
+};
+
+static char *spool_dir = NULL;
+static int replaying_uploads = 0;
+static bool replay_unanswered = false;
+static struct timeval next_replay;
+static uint64_t spool_retry = 30 * 1000000;
+static time_t spool_trimmed = 0;
+static unsigned int spooled_counter = 0;
+static unsigned int replayed_counter = 0;
 
-      /* If we get here, and we haven't run out of data, then the part headers
-         have been read, and a file descriptor will have been opened if
-         the part contains an attachment.  */
+/* Delete the shared memory objects offered by the upload JOB.  */
+static void
+unlink_offered_files (json_object *job)
+{
+  json_object *files = json_get (job, "files");
+  int i, len;
+
+  if (!files || !json_object_is_type (files, json_type_array))
+    return;
+  len = json_object_array_length (files);
+  for (i = 0; i < len; i++)
+    {
+      json_object *shm = json_get (json_object_array_get_idx (files, i),
+                                   "shm");
+      if (shm)
+	shm_unlink (json_object_get_string (shm));
+    }
+}
+
+/* Return the file offered by the upload UP with content HASH, or NULL.  */
+static json_object *
+find_offered_content (struct upload *up, const char *hash)
+{
+  json_object *files = json_get (up->job, "files");
+  int i, len;
+
+  if (!files || !json_object_is_type (files, json_type_array))
+    return NULL;
+  len = json_object_array_length (files);
+  for (i = 0; i < len; i++)
+    {
+      json_object *file = json_object_array_get_idx (files, i);
+      json_object *file_hash = json_get (file, "hash");
+
+      if (file_hash && strcmp (json_object_get_string (file_hash), hash) == 0)
+	return file;
+    }
+  return NULL;
+}
+
+/* Return the upload sending content HASH, or NULL.  */
+static struct upload *
+content_sender (const char *hash)
+{
+  return (sending_content
+          ? hashtable_search (sending_content, (void *)hash) : NULL);
+}
+
+/* Attach to the upload UP the content the server last asked it for, but
+   for any the server has lately taken.  If another upload is sending some
+   of it, attach nothing, and leave UP waiting for that.  Returns false if
+   the server asked for anything not offered.  */
+static bool
+plan_needed_content (struct upload *up)
+{
+  int i, len = json_object_array_length (up->needed);
+  struct upload *sender;
+
+  for (i = 0; i < len; i++)
+    {
+      const char *hash
+        = json_object_get_string (json_object_array_get_idx (up->needed, i));
 
-      if (data != end)
+      if (!hash || !find_offered_content (up, hash))
 	{
-	  /* Read the rest of the part.  */
-	  if (part->fd)
-	    {
-	      /* Write the data to file.  */
-	      if (!fwrite (data, end-data, 1, part->fd))
-		fatal ("Error fwrite failed!");
-	    }
-	  else
-	    {
-	      /* Store the data in a memory buffer.  */
-	      part->data = x_realloc (part->data,
-				      part->datasize + (end - data)
-				      + 1 /* nul-terminator */);
-	      memcpy (part->data + part->datasize, data, end - data);
-	      part->datasize += end - data;
-	      part->data[part->datasize] = '\0';
-	    }
+	  cc_log ("[%u:%u] Error: the server requested unexpected content '%s'",
+	          up->client_number, up->job_number, hash ? hash : "");
+	  return false;
+	}
+      sender = content_sender (hash);
+      if (sender && sender != up)
+	{
+	  up->waiting = true;
+	  return true;
+	}
+    }
+
+  if (!sending_content)
+    sending_content = create_hashtable (64, hash_from_string, strings_equal);
+  up->attach = json_object_new_array ();
+  up->shared = false;
+  for (i = 0; i < len; i++)
+    {
+      const char *hash
+        = json_object_get_string (json_object_array_get_idx (up->needed, i));
+      json_object *file = find_offered_content (up, hash), *content;
+
+      if (content_sender (hash) == up)
+	continue;
+      if (sent_content && hashtable_search (sent_content, (void *)hash))
+	{
+	  up->shared = true;
+	  content_shared_counter++;
+	  continue;
 	}
 
-      size -= end - begin;
-      data = end;
+      content = json_object_new_object ();
+      json_object_object_add (content, "field",
+                              json_object_new_string ("content"));
+      json_object_object_add (content, "name", json_object_new_string (hash));
+      if (json_get (file, "shm"))
+	json_object_object_add (content, "shm",
+	                        json_object_get (json_get (file, "shm")));
+      if (json_get (file, "size"))
+	json_object_object_add (content, "size",
+	                        json_object_get (json_get (file, "size")));
+      if (json_get (file, "blob"))
+	json_object_object_add (content, "blob",
+	                        json_object_get (json_get (file, "blob")));
+      json_object_array_add (up->attach, content);
+      hashtable_insert (sending_content, x_strdup (hash), up);
+      content_sent_counter++;
+    }
+  return true;
+}
+
+/* Let go of the content the upload UP was sending, which the server has
+   taken if DELIVERED.  Uploads waiting for it go on at the next
+   dispatch.  */
+static void
+release_content (struct upload *up, bool delivered)
+{
+  int i, len = up->attach ? json_object_array_length (up->attach) : 0;
 
-      /* If we get here, and we haven't run out of data, then there are
-         more parts we can continue reading.  */
+  for (i = 0; i < len; i++)
+    {
+      json_object *file = json_object_array_get_idx (up->attach, i);
+      const char *hash = json_object_get_string (json_get (file, "name"));
 
-      if (end_of_part_found)
+      if (strcmp (json_object_get_string (json_get (file, "field")),
+                  "content") != 0)
+	continue;
+      if (content_sender (hash) == up)
 	{
-	  /* The rest of the boundary line is ignored.  If we don't have
-	     all of it then we'll need to stash the data and read more.  */
-	  char *next_line = memmem (data+boundary_len, size-boundary_len,
-	                            "\r\n", 2);
-	  if (!next_line)
-	    {
-	      if (!netdata)
-		next_line = data + size;
-	      else
-		/* No line terminator.  Wait for more data.  */
-	        break;
-	    }
-	  else
-	    /* Skip to next line.  */
-	    next_line += 2;
+	  hashtable_remove (sending_content, (void *)hash);
+	  content_released = true;
+	}
+      if (!delivered)
+	continue;
+      if (sent_content && hashtable_count (sent_content) >= SENT_CONTENT_LIMIT)
+	{
+	  hashtable_destroy (sent_content, 1);
+	  sent_content = NULL;
+	}
+      if (!sent_content)
+	sent_content = create_hashtable (64, hash_from_string, strings_equal);
+      if (!hashtable_search (sent_content, (void *)hash))
+	hashtable_insert (sent_content, x_strdup (hash), x_strdup (""));
+    }
+}
 
-	  /* Close the completed part's file, if any.  */
-	  if (part->fd)
-	    {
-	      fclose (part->fd);
-	      part->fd = NULL;
-	    }
+/* Forget that the server has taken the content in HASHES, which it has
+   asked for again.  */
+static void
+forget_sent_content (json_object *hashes)
+{
+  int i, len = json_object_array_length (hashes);
+
+  for (i = 0; sent_content && i < len; i++)
+    {
+      const char *hash
+        = json_object_get_string (json_object_array_get_idx (hashes, i));
+      if (hash && hashtable_search (sent_content, (void *)hash))
+	free (hashtable_remove (sent_content, (void *)hash));
+    }
+}
+
+/* Write the upload UP, taken over from a client, to the result spool.
+   Returns false if it couldn't be.  */
+static bool
+spool_upload (struct upload *up)
+{
+  json_object *entry = json_object_new_object ();
+  json_object *headers = json_object_new_array ();
+  struct curl_slist *header;
+  bool ok;
+
+  for (header = up->header_list; header; header = header->next)
+    json_object_array_add (headers, json_object_new_string (header->data));
+  json_object_object_add (entry, "url", json_object_new_string (up->url));
+  json_object_object_add (entry, "headers", headers);
+  json_object_object_add (entry, "data",
+                          json_object_get (json_get (up->job, "data")));
+  json_object_object_add (entry, "sources",
+                          json_object_get (json_get (up->job, "sources")));
+  json_object_object_add (entry, "files",
+                          json_object_get (json_get (up->job, "files")));
+  ok = spool_add (spool_dir, entry);
+  json_object_put (entry);
+  return ok;
+}
+
+/* Trim the result spool to its limit.  */
+static void
+trim_spool (void)
+{
+  spool_trim (spool_dir, conf->spool_size);
+  spool_trimmed = time (NULL);
+}
+
+/* Note that the replay of a spooled upload has ended with OUTCOME.  */
+static void
+replay_finished (enum upload_outcome outcome)
+{
+  if (outcome == UPLOAD_SPOOLED)
+    replay_unanswered = true;
+  else if (outcome == UPLOAD_DONE)
+    replayed_counter++;
+
+  if (--replaying_uploads == 0)
+    {
+      /* Carry on with the next batch, unless the server is still away.  */
+      gettimeofday (&next_replay, NULL);
+      if (replay_unanswered)
+	next_replay.tv_sec += spool_retry / 1000000;
+      replay_unanswered = false;
+
+      /* Drop the blobs that the replayed entries no longer need.  */
+      trim_spool ();
+    }
+}
+
+/* Forget the upload UP, which has ended with OUTCOME.  */
+static void
+finish_upload (struct upload *up, enum upload_outcome outcome)
+{
+  static const char *const outcomes[] = {"done", "abandoned", "spooled"};
+  struct upload **ptr;
+
+  for (ptr = &uploads; *ptr; ptr = &(*ptr)->next)
+    if (*ptr == up)
+      {
+	*ptr = up->next;
+	break;
+      }
+  pending_uploads--;
+
+  if (up->spooled)
+    {
+      /* An upload from the spool that failed is no use there either.  */
+      if (outcome != UPLOAD_SPOOLED)
+	spool_remove (up->spooled);
+      replay_finished (outcome);
+      free (up->spooled);
+    }
+  else if (outcome == UPLOAD_SPOOLED)
+    {
+      if (spool_upload (up))
+	{
+	  spooled_counter++;
+
+	  /* The server is away, so don't replay this straight back.  */
+	  gettimeofday (&next_replay, NULL);
+	  next_replay.tv_sec += spool_retry / 1000000;
+
+	  /* While the server stays away nothing is replayed, and so nothing
+	     trims the spool.  Trim it here, but not for every upload, since
+	     that goes through the whole spool.  */
+	  if (time (NULL) - spool_trimmed >= (time_t)(spool_retry / 1000000))
+	    trim_spool ();
+	}
+      else
+	outcome = UPLOAD_FAILED;
+    }
+
+  if (outcome == UPLOAD_DONE)
+    upload_counter++;
+  else if (outcome == UPLOAD_FAILED)
+    upload_failed_counter++;
+  cc_log ("[%u:%u] upload %s; %d uploads remain", up->client_number,
+          up->job_number, outcomes[outcome], pending_uploads);
+
+  unlink_offered_files (up->job);
+  json_object_put (up->job);
+  if (up->attach)
+    {
+      release_content (up, false);
+      json_object_put (up->attach);
+    }
+  if (up->needed)
+    json_object_put (up->needed);
+  if (up->header_list)
+    curl_slist_free_all (up->header_list);
+  free (up->url);
+  free (up);
+}
+
+/* Queue the upload UP to go in the next batch.  */
+static void
+make_upload_ready (struct upload *up)
+{
+  int i, len;
+
+  up->size = strlen (json_object_to_json_string (json_get (up->job,
+                                                           "data")));
+  len = up->attach ? json_object_array_length (up->attach) : 0;
+  for (i = 0; i < len; i++)
+    up->size += json_get_uint (json_object_array_get_idx (up->attach, i),
+                               "size");
+
+  gettimeofday (&up->ready_time, NULL);
+  up->next_ready = NULL;
+  if (last_ready_upload)
+    last_ready_upload->next_ready = up;
+  else
+    ready_uploads = up;
+  last_ready_upload = up;
+  ready_upload_count++;
+  ready_upload_bytes += up->size;
+}
+
+/* Take over the upload described by JOB from the client on CONN, which
+   has set the URL and headers for it.  Returns false if JOB is not one.  */
+static bool
+accept_upload (struct local_connection_state *conn, const char *job)
+{
+  struct upload *up;
+  json_object *parsed = json_tokener_parse (job);
+
+  if (is_error (parsed) || !conn->url
+      || !json_object_is_type (json_get (parsed, "data"), json_type_object))
+    {
+      cc_log ("[%u:%u] Error: malformed upload", conn->client_number,
+              conn->job_number);
+      if (!is_error (parsed))
+	json_object_put (parsed);
+      return false;
+    }
+
+  up = x_calloc (1, sizeof (*up));
+  up->client_number = conn->client_number;
+  up->job_number = conn->job_number;
+  up->url = conn->url;
+  conn->url = NULL;
+  up->header_list = conn->header_list;
+  conn->header_list = NULL;
+  up->job = parsed;
+  up->next = uploads;
+  uploads = up;
+  pending_uploads++;
+  cc_log ("[%u:%u] took over an upload; %d uploads pending",
+          up->client_number, up->job_number, pending_uploads);
+  make_upload_ready (up);
+  return true;
+}
+
+/* Tell the client on CONN whether its upload was taken over, with 'Q' if
+   OK and 'F' if not.  Returns false if the client can't be told.  */
+static bool
+answer_upload (struct local_connection_state *conn, bool ok)
+{
+  char reply = ok ? 'Q' : 'F';
+
+  /* As with lookups, the client is waiting, so the reply fits.  */
+  if (send (conn->fd, &reply, 1, 0) != 1)
+    {
+      cc_log ("[%u] Error: could not send upload reply: %s",
+              conn->client_number, strerror (errno));
+      return false;
+    }
+  bytes_to_clients++;
+  return true;
+}
+
+/* Look up the files named in REQUESTED among those offered by the upload
+   UP, for its next request.  Returns false if the server asked for
+   anything not offered, or for nothing.  */
+static bool
+find_requested_files (struct upload *up, json_object *requested)
+{
+  json_object *files = json_get (up->job, "files");
+  int i, j, len, nfiles;
+
+  if (!requested || !json_object_is_type (requested, json_type_array)
+      || !files || !json_object_is_type (files, json_type_array))
+    return false;
+
+  up->attach = json_object_new_array ();
+  len = json_object_array_length (requested);
+  nfiles = json_object_array_length (files);
+  for (i = 0; i < len; i++)
+    {
+      const char *name
+        = json_object_get_string (json_object_array_get_idx (requested, i));
+      json_object *file = NULL;
+
+      for (j = 0; name && j < nfiles; j++)
+	{
+	  file = json_object_array_get_idx (files, j);
+	  if (strcmp (json_object_get_string (json_get (file, "name")),
+	              name) == 0)
+	    break;
+	  file = NULL;
+	}
+      if (!file)
+	{
+	  cc_log ("[%u:%u] Error: the server requested unexpected file '%s'",
+	          up->client_number, up->job_number, name ? name : "");
+	  return false;
+	}
+      json_object_array_add (up->attach, json_object_get (file));
+    }
+  return len > 0;
+}
+
+/* Carry on with the upload UP, now that the server has answered its last
+   request with REPLY, or NULL if the answer was lost.  */
+static void
+upload_answered (struct upload *up, json_object *reply)
+{
+  json_object *data = json_get (up->job, "data");
+  const char *result = NULL;
+
+  if (up->lost)
+    {
+      cc_log ("[%u:%u] Error: a file offered for an upload has gone",
+              up->client_number, up->job_number);
+      finish_upload (up, UPLOAD_FAILED);
+      return;
+    }
+
+  if (reply && json_get (reply, "result"))
+    result = json_object_get_string (json_get (reply, "result"));
+  if ((!result || strcmp (result, "retry") == 0)
+      && ++up->tries < MAX_UPLOAD_TRIES)
+    {
+      /* Send the same again.  */
+      upload_retry_counter++;
+      make_upload_ready (up);
+      return;
+    }
+
+  if (up->attach)
+    {
+      release_content (up, result && strcmp (result, "retry") != 0);
+      json_object_put (up->attach);
+      up->attach = NULL;
+    }
+  if (!result || strcmp (result, "retry") == 0)
+    {
+      cc_log ("[%u:%u] Error: no result from the server for an upload",
+              up->client_number, up->job_number);
+      finish_upload (up, UPLOAD_SPOOLED);
+      return;
+    }
+  else if (strcmp (result, "success") == 0)
+    {
+      finish_upload (up, UPLOAD_DONE);
+      return;
+    }
+  else if (++up->rounds >= MAX_UPLOAD_ROUNDS)
+    cc_log ("[%u:%u] Error: the server still wants more after %d requests",
+            up->client_number, up->job_number, up->rounds);
+  else if (strcmp (result, "source list needed") == 0)
+    {
+      json_object_object_add (data, "sources",
+                              json_object_get (json_get (up->job,
+                                                         "sources")));
+      up->tries = 0;
+      make_upload_ready (up);
+      return;
+    }
+  else if (strcmp (result, "files needed") == 0)
+    {
+      if (find_requested_files (up, json_get (reply, "data")))
+	{
+	  up->tries = 0;
+	  make_upload_ready (up);
+	  return;
+	}
+    }
+  else if (strcmp (result, "content needed") == 0)
+    {
+      json_object *needed = json_get (reply, "data");
 
-	  if (next_line > data + boundary_len
-	      && str_startswith (data + boundary_len, "--"))
+      if (needed && json_object_is_type (needed, json_type_array)
+	  && json_object_array_length (needed) > 0)
+	{
+	  if (up->needed)
+	    json_object_put (up->needed);
+	  up->needed = json_object_get (needed);
+
+	  /* What it left out last time didn't reach the server after all.  */
+	  if (up->shared)
+	    forget_sent_content (up->needed);
+	  if (plan_needed_content (up))
 	    {
-	      /* We have a final boundary line, ending with '--'.
-	         There are no more parts. Any more data is junk.  */
-	      response->complete = true;
-	      break;
+	      up->tries = 0;
+	      if (!up->waiting)
+		make_upload_ready (up);
+	      return;
 	    }
-	  else
-	    {
-	      /* Begin reading a new part.  */
-	      part->next = x_calloc (1, sizeof(struct response_part));
-	      response->last = part->next;
-	      part = part->next;
+	}
+      else
+	cc_log ("[%u:%u] Error: the server asked for content, but not which",
+	        up->client_number, up->job_number);
+    }
+  else
+    cc_log ("[%u:%u] Error: the server reported '%s' for an upload: %s",
+            up->client_number, up->job_number, result,
+            json_get (reply, "data")
+            ? json_object_get_string (json_get (reply, "data")) : "");
+  finish_upload (up, UPLOAD_FAILED);
+}
+
+/* The header with which each client names its session.  */
+#define SESSION_HEADER "X-CLIENT-SESSION-ID:"
+
+static bool
+is_session_header (const struct curl_slist *header)
+{
+  return strncasecmp (header->data, SESSION_HEADER,
+                      strlen (SESSION_HEADER)) == 0;
+}
+
+/* Return the session ID among the headers in LIST, or "none".  */
+static const char *
+session_id (const struct curl_slist *list)
+{
+  for (; list; list = list->next)
+    if (is_session_header (list))
+      {
+	const char *id = list->data + strlen (SESSION_HEADER);
+	return id + strspn (id, " ");
+      }
+  return "none";
+}
+
+/* Return true if the header lists A and B are the same, but for the
+   session ID.  */
+static bool
+same_headers (const struct curl_slist *a, const struct curl_slist *b)
+{
+  while (a || b)
+    {
+      if (a && is_session_header (a))
+	a = a->next;
+      else if (b && is_session_header (b))
+	b = b->next;
+      else if (!a || !b || strcmp (a->data, b->data) != 0)
+	return false;
+      else
+	{
+	  a = a->next;
+	  b = b->next;
+	}
+    }
+  return true;
+}
+
+/* Attach the files for the next request of the upload UP to the form of
+   CONN, naming each field with PREFIX.  */
+static void
+attach_upload_files (struct local_connection_state *conn, struct upload *up,
+                     const char *prefix)
+{
+  int i, len = up->attach ? json_object_array_length (up->attach) : 0;
+
+  for (i = 0; !up->lost && i < len; i++)
+    {
+      json_object *file = json_object_array_get_idx (up->attach, i);
+      const char *name = json_object_get_string (json_get (file, "name"));
+      const char *kind = json_object_get_string (json_get (file, "field"));
+
+      /* Content belongs to no one upload of a batch.  */
+      char *field = format ("%s%s",
+                            strcmp (kind, "content") == 0 ? "" : prefix, kind);
+
+      /* Uploads from the spool have their files there.  */
+      if (json_get (file, "blob"))
+	{
+	  char *path = spool_blob_path (spool_dir,
+	                                json_object_get_string
+	                                  (json_get (file, "blob")));
+	  up->lost = !add_form_file (conn, field, path, name);
+	  free (path);
+	}
+      else
+	up->lost = !add_form_attachment (conn, field,
+	                                 json_object_get_string
+	                                   (json_get (file, "shm")),
+	                                 json_get_uint (file, "size"), name);
+      free (field);
+    }
+}
+
+/* Forget what the response cache knows about the object the upload UP
+   describes, which is about to change.  */
+static void
+invalidate_upload (struct upload *up)
+{
+  const char *data = json_object_to_json_string (json_get (up->job, "data"));
+  char *cpp_hash = json_string_field (data, "cpp_hash");
+  char *toolchain_id = json_string_field (data, "toolchain_id");
+
+  if (cpp_hash && toolchain_id)
+    {
+      char *key = format ("%s-%s", cpp_hash, toolchain_id);
+      invalidate_cached_response (key);
+      free (key);
+    }
+  free (cpp_hash);
+  free (toolchain_id);
+}
+
+/* Send the oldest ready upload, with as many of the others going to the
+   same place as the limits allow.  */
+static void
+send_upload_batch (void)
+{
+  struct upload *first = ready_uploads, *up, **ptr;
+  struct upload **batch;
+  struct local_connection_state *conn;
+  int count = 0, i;
+  size_t bytes = 0;
+  char *json = NULL, *prefix;
+
+  batch = x_malloc (ready_upload_count * sizeof (*batch));
+
+  /* Take what fits from the queue, and leave the rest in order.  */
+  ptr = &ready_uploads;
+  last_ready_upload = NULL;
+  while ((up = *ptr))
+    {
+      if (count == 0
+	  || (!batch_endpoint_missing
+	      && count < (int)batch_count_limit
+	      && bytes + up->size <= batch_bytes_limit
+	      && strcmp (up->url, first->url) == 0
+	      && same_headers (up->header_list, first->header_list)))
+	{
+	  batch[count++] = up;
+	  bytes += up->size;
+	  *ptr = up->next_ready;
+	  ready_upload_count--;
+	  ready_upload_bytes -= up->size;
+	}
+      else
+	{
+	  last_ready_upload = up;
+	  ptr = &up->next_ready;
+	}
+    }
+
+  conn = x_calloc (1, sizeof (*conn));
+  conn->fd = -1;
+  conn->client_number = first->client_number;
+  conn->job_number = first->job_number;
+  conn->batch = batch;
+  conn->batch_size = count;
+
+  if (count == 1)
+    {
+      /* The headers belong to the upload.  */
+      conn->header_list = first->header_list;
+      conn->url = x_strdup (first->url);
+      add_form_data (conn, "data",
+                     json_object_to_json_string (json_get (first->job,
+                                                           "data")));
+      attach_upload_files (conn, first, "");
+    }
+  else
+    {
+      const struct curl_slist *header;
+
+      for (header = first->header_list; header; header = header->next)
+	if (!is_session_header (header))
+	  conn->header_list = curl_slist_append (conn->header_list,
+	                                         header->data);
+      conn->url = format ("%sbatch", first->url);
+      conn->batched = true;
+      batch_counter++;
+      batched_upload_counter += count;
+      for (i = 0; i < count; i++)
+	{
+	  json_object *item = json_object_new_object ();
+
+	  json_object_object_add (item, "session",
+	                          json_object_new_string
+	                            (session_id (batch[i]->header_list)));
+	  json_object_object_add (item, "data",
+	                          json_object_get (json_get (batch[i]->job,
+	                                                     "data")));
+	  reformat (&json, "%s%s%s", json ? json : "", i ? ", " : "[",
+	            json_object_to_json_string (item));
+	  json_object_put (item);
+	  prefix = format ("%d.", i);
+	  attach_upload_files (conn, batch[i], prefix);
+	  free (prefix);
+	  invalidate_upload (batch[i]);
+	}
+      reformat (&json, "%s]", json);
+      add_form_data (conn, "batch", json);
+      free (json);
+    }
+
+  cc_log ("[%u:%u] sending %d upload%s, %zu bytes", conn->client_number,
+          conn->job_number, count, count == 1 ? "" : "s", bytes);
+  conn->request_code = 'R';
+  gettimeofday (&conn->request_time, NULL);
+  invalidate_cached_response (conn->cache_key);
+  conn->dfa_state = STATE_WAITING;
+  queue_new_job (conn);
+}
+
+/* Return how many microseconds there are until the oldest ready upload
+   must go, one if it is overdue, or zero if there is none.  */
+static uint64_t
+upload_wait (void)
+{
+  uint64_t waited;
+
+  if (!ready_uploads)
+    return 0;
+  waited = microseconds_since (&ready_uploads->ready_time);
+  return waited < batch_delay ? batch_delay - waited : 1;
+}
+
+/* Send batches of ready uploads while there are enough to fill one, or
+   while the oldest has waited long enough.  */
+static void
+dispatch_uploads (void)
+{
+  struct upload *up, *next;
 
-	      size -= next_line - data;
-	      data = next_line;
-	    }
+  /* Carry on with the uploads waiting for content that is now sent.  */
+  if (content_released)
+    {
+      content_released = false;
+      for (up = uploads; up; up = next)
+	{
+	  next = up->next;
+	  if (!up->waiting)
+	    continue;
+	  up->waiting = false;
+	  if (!plan_needed_content (up))
+	    finish_upload (up, UPLOAD_FAILED);
+	  else if (!up->waiting)
+	    make_upload_ready (up);
 	}
     }
 
-  if (size > 0 && !response->complete)
+  /* While the server can't be reached, keep them for later.  */
+  while (breaker_open && ready_uploads)
     {
-      /* Stash the remainder for next time.
-         This only happens to avoid losing a boundary.  */
-      response->data_stash = x_malloc (size);
-      response->data_stash_size = size;
-      memcpy (response->data_stash, data, size);
+      up = ready_uploads;
+      ready_uploads = up->next_ready;
+      if (!ready_uploads)
+	last_ready_upload = NULL;
+      ready_upload_count--;
+      ready_upload_bytes -= up->size;
+      finish_upload (up, UPLOAD_SPOOLED);
     }
 
-  /* Multipart responses are completed by a final binary, which is checked
-     above, but single-part responses are complete if they are the right
-     length.  */
-  if (!response->boundary && part->datasize == response->size)
-    response->complete = true;
-
-  if (must_free_data)
-    free (must_free_data);
-  return orig_size;
+  while (ready_uploads
+         && (ready_upload_count >= (int)batch_count_limit
+             || ready_upload_bytes >= batch_bytes_limit
+             || upload_wait () == 1))
+    send_upload_batch ();
 }
 
-/* Add a new job into the queue. GET requests are inserted before POST
-   requests.  */
+/* Take up the oldest entries in the result spool, as many as fit in a
+   batch, if the last lot is done with and it's time.  */
 static void
-queue_new_job (struct local_connection_state *conn)
+replay_spool (void)
 {
-  struct job_queue *insert_after;
-  struct job_queue *new_jq = x_malloc (sizeof (*new_jq));
-  new_jq->conn = conn;
+  struct timeval now;
+  char **paths;
+  int count, i, taken = 0;
 
-  if (conn->post)
+  if (replaying_uploads || breaker_open || get_jobs.waiting)
+    return;
+  gettimeofday (&now, NULL);
+  if (timercmp (&now, &next_replay, <))
+    return;
+
+  count = spool_list (spool_dir, &paths);
+  for (i = 0; i < count; i++)
     {
-      insert_after = last_queued_post;
-      last_queued_post = new_jq;
+      json_object *entry, *headers;
+      struct upload *up;
+      int j, len;
+
+      if (taken >= (int)batch_count_limit
+	  || !(entry = spool_read (paths[i])))
+	{
+	  free (paths[i]);
+	  continue;
+	}
+
+      up = x_calloc (1, sizeof (*up));
+      up->url = x_strdup (json_object_get_string (json_get (entry, "url")));
+      headers = json_get (entry, "headers");
+      len = headers && json_object_is_type (headers, json_type_array)
+            ? json_object_array_length (headers) : 0;
+      for (j = 0; j < len; j++)
+	up->header_list
+	  = curl_slist_append (up->header_list,
+	                       json_object_get_string
+	                         (json_object_array_get_idx (headers, j)));
+      up->job = entry;
+      up->spooled = paths[i];
+      up->next = uploads;
+      uploads = up;
+      pending_uploads++;
+      replaying_uploads++;
+      make_upload_ready (up);
+      taken++;
     }
+  free (paths);
+
+  if (taken)
+    cc_log ("Replaying %d of %d spooled uploads", taken, count);
   else
     {
-      insert_after = last_queued_get;
-      if (last_queued_post == last_queued_get)
-	last_queued_post = new_jq;
-      last_queued_get = new_jq;
+      next_replay = now;
+      next_replay.tv_sec += spool_retry / 1000000;
     }
+}
 
-  if (!insert_after)
+/* Hand the answers in RESPONSE to the uploads sent by CONN, which is then
+   freed, along with RESPONSE.  */
+static void
+upload_batch_answered (struct local_connection_state *conn,
+                       struct server_response *response)
+{
+  json_object *reply = NULL, *results;
+  struct response_part *part;
+  int i, len = 0;
+
+  if (response->complete && response->code == 200)
+    for (part = response->parts; part && !reply; part = part->next)
+      if (part->data)
+	reply = json_tokener_parse (part->data);
+  if (is_error (reply))
+    reply = NULL;
+
+  if (conn->batched && (response->code == 404 || response->code == 405))
     {
-      new_jq->next = job_queue;
-      job_queue = new_jq;
+      /* Send them one at a time, without counting this against them.  */
+      cc_log ("The server has no batch endpoint; uploading singly");
+      batch_endpoint_missing = true;
+      for (i = 0; i < conn->batch_size; i++)
+	make_upload_ready (conn->batch[i]);
     }
+  else if (!conn->batched)
+    upload_answered (conn->batch[0], reply);
   else
     {
-      new_jq->next = insert_after->next;
-      insert_after->next = new_jq;
+      results = json_get (reply, "results");
+      if (results && json_object_is_type (results, json_type_array))
+	len = json_object_array_length (results);
+      for (i = 0; i < conn->batch_size; i++)
+	{
+	  invalidate_upload (conn->batch[i]);
+	  upload_answered (conn->batch[i],
+	                   i < len ? json_object_array_get_idx (results, i)
+	                           : NULL);
+	}
     }
-}
 
-/* Remove and return the first connection in the job_queue. */
-static struct local_connection_state *
-pop_queued_job ()
-{
-  struct local_connection_state *result = NULL;
-  struct job_queue *job = job_queue;
-
-  if (job)
-    {
-      result = job->conn;
-      job_queue = job->next;
-
-      cc_log ("pop: job = %p, jq = %p, lg = %p, lp = %p", job, job_queue, last_queued_get, last_queued_post);
-      if (job == last_queued_get)
-	last_queued_get = NULL;
-      if (job == last_queued_post)
-	last_queued_post = NULL;
-
-      struct job_queue *tmp;
-      int found = 0;
-      for (tmp = job_queue; tmp; tmp = tmp->next)
-	if (tmp == last_queued_get)
-	  found = 1;
-      if (last_queued_get)
-	assert(found);
-      if (!job_queue)
-	assert (!last_queued_get && !last_queued_post);
-
-      free (job);
-    }
+  if (reply)
+    json_object_put (reply);
+  for (part = response->parts; part; part = part->next)
+    if (part->tmp_filename)
+      unlink (part->tmp_filename);
+  free_server_response (response);
 
-  return result;
+  if (conn->batched && conn->header_list)
+    curl_slist_free_all (conn->header_list);
+  conn->header_list = NULL;
+  cleanup_form (conn);
+  free (conn->batch);
+  free (conn->url);
+  free (conn->cache_key);
+  free (conn);
 }
 
-/* Remove a job from the queue. Presumably the client has died.  */
+/* Append the JSON representation of histogram H to *JSON.  Only the
+   non-empty buckets are listed, as [lowest value, count] pairs.  */
 static void
-dequeue_job (struct local_connection_state *conn)
+append_histogram_json (char **json, const char *name,
+                       const struct histogram *h)
 {
-  struct job_queue **ptr, *prev = NULL;
-
-  for (ptr = &job_queue; *ptr; ptr = &(*ptr)->next)
-    if ((*ptr)->conn == conn)
+  size_t i;
+  const char *separator = "";
+
+  reformat (json, "%s\"%s\": {\"count\": %" PRIu64 ", \"min\": %" PRIu64
+            ", \"mean\": %" PRIu64 ", \"max\": %" PRIu64
+            ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+            ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64 ", \"buckets\": [",
+            *json, name, h->count, h->min, histogram_mean (h), h->max,
+            histogram_percentile (h, 50), histogram_percentile (h, 90),
+            histogram_percentile (h, 99), histogram_percentile (h, 99.9));
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    if (h->buckets[i])
       {
-	if (last_queued_get == *ptr)
-	  last_queued_get = prev;
-	if (last_queued_post == *ptr)
-	  last_queued_post = prev;
-        *ptr = (*ptr)->next;
-        break;
+	reformat (json, "%s%s[%" PRIu64 ", %" PRIu64 "]", *json, separator,
+	          histogram_bucket_low (i), h->buckets[i]);
+	separator = ", ";
       }
-    else
-      prev = *ptr;
+  reformat (json, "%s]}", *json);
+}
+
+/* Describe the state of the daemon as a JSON object.
+   Times are in seconds, except the latencies, which are in microseconds.  */
+static char *
+stats_json (void)
+{
+  double interval = microseconds_since (&stats_reset_time) / 1000000.0;
+  char *json;
+
+  account_pool_usage ();
+  json = format ("{\"pid\": %d, \"uptime\": %.3f, \"interval\": %.3f, "
+                 "\"clients\": {\"total\": %u, \"connected\": %d}, "
+                 "\"queue\": {\"waiting\": %d, \"peak\": %d, "
+                 "\"get\": {\"waiting\": %d, \"active\": %d, "
+                 "\"oldest\": %.3f, \"reserved\": %d, \"expired\": %u}, "
+                 "\"post\": {\"waiting\": %d, \"active\": %d, "
+                 "\"oldest\": %.3f, \"aged\": %u, \"rate\": %" PRIu64
+                 ", \"tokens\": %.0f}}, "
+                 "\"pool\": {\"size\": %d, \"active\": %d, \"peak\": %d, "
+                 "\"utilization\": %.4f, \"http2\": %s, "
+                 "\"http2_transfers\": %u}, "
+                 "\"requests\": {\"get\": %u, \"post\": %u, "
+                 "\"cancelled\": %u}, "
+                 "\"breaker\": {\"open\": %s, \"failures\": %u, "
+                 "\"trips\": %u, \"refused\": %u}, "
+                 "\"uploads\": {\"pending\": %d, \"done\": %u, "
+                 "\"failed\": %u, \"retried\": %u, \"batches\": %u, "
+                 "\"batched\": %u, \"content_sent\": %u, "
+                 "\"content_shared\": %u}, "
+                 "\"spool\": {\"spooled\": %u, \"replayed\": %u, "
+                 "\"replaying\": %d}, "
+                 "\"encoding\": {\"upload\": \"%s\", \"sent\": %u, "
+                 "\"sent_raw\": %" PRIu64 ", \"sent_encoded\": %" PRIu64
+                 ", \"received\": %u, \"received_raw\": %" PRIu64
+                 ", \"received_encoded\": %" PRIu64 "}, "
+                 "\"resume\": {\"resumed\": %u, \"bytes_kept\": %" PRIu64
+                 ", \"hash_mismatches\": %u}, "
+                 "\"bytes\": {\"from_clients\": %" PRIu64
+                 ", \"to_clients\": %" PRIu64 ", \"downloaded\": %" PRIu64
+                 ", \"uploaded\": %" PRIu64 "}, "
+                 "\"response_cache\": {\"entries\": %u, \"size\": %zu, "
+                 "\"limit\": %" PRIu64 ", \"hits\": %u, \"negative_hits\": %u, "
+                 "\"misses\": %u, \"stored\": %u, \"evicted\": %u, "
+                 "\"invalidated\": %u}, "
+                 "\"lookups\": {\"files\": %u, \"found\": %u}, "
+                 "\"toolchains\": {\"entries\": %d, \"queries\": %u, "
+                 "\"hits\": %u, \"stale\": %u}, "
+                 "\"server\": {\"compiles\": %u, \"running\": %d}, "
+                 "\"latency\": {\"get\": {",
+                 (int)getpid (),
+                 microseconds_since (&daemon_start_time) / 1000000.0,
+                 interval,
+                 client_counter, active_clients,
+                 waiting_jobs, peak_waiting_jobs,
+                 get_jobs.waiting, get_jobs.active, oldest_wait (&get_jobs),
+                 get_reserve, get_expired_counter,
+                 post_jobs.waiting, post_jobs.active, oldest_wait (&post_jobs),
+                 post_aged_counter, post_rate, post_tokens,
+                 internet_pool_count, active_internet_connection_count,
+                 peak_active_internet_connections,
+                 (interval > 0 && internet_pool_count > 0
+                  ? busy_connection_seconds / (interval * internet_pool_count)
+                  : 0.0),
+                 use_http2 ? "true" : "false", http2_transfers,
+                 get_request_counter, post_request_counter,
+                 cancelled_request_counter,
+                 breaker_open ? "true" : "false", breaker_failures,
+                 breaker_trip_counter, breaker_refused_counter,
+                 pending_uploads, upload_counter, upload_failed_counter,
+                 upload_retry_counter, batch_counter, batched_upload_counter,
+                 content_sent_counter, content_shared_counter,
+                 spooled_counter, replayed_counter, replaying_uploads,
+                 encoding_name (upload_encoding ()), encoded_parts_sent,
+                 encoded_raw_bytes_sent, encoded_bytes_sent,
+                 encoded_parts_received, encoded_raw_bytes_received,
+                 encoded_bytes_received,
+                 resumed_downloads, resumed_bytes_kept,
+                 content_hash_mismatches,
+                 bytes_from_clients, bytes_to_clients, bytes_downloaded,
+                 bytes_uploaded,
+                 response_cache ? hashtable_count (response_cache) : 0,
+                 response_cache_size, response_cache_limit,
+                 cache_hit_counter, cache_negative_hit_counter,
+                 cache_miss_counter, cache_store_counter,
+                 cache_eviction_counter, cache_invalidation_counter,
+                 lookup_counter, lookup_found_counter,
+                 toolchain_count, tool_query_counter, tool_hit_counter,
+                 tool_stale_counter, serve_counter, serving_count);
+  append_histogram_json (&json, "queue", &get_queue_times);
+  reformat (&json, "%s, ", json);
+  append_histogram_json (&json, "internet", &get_internet_times);
+  reformat (&json, "%s, ", json);
+  append_histogram_json (&json, "overall", &get_overall_times);
+  reformat (&json, "%s}, \"post\": {", json);
+  append_histogram_json (&json, "queue", &post_queue_times);
+  reformat (&json, "%s, ", json);
+  append_histogram_json (&json, "internet", &post_internet_times);
+  reformat (&json, "%s, ", json);
+  append_histogram_json (&json, "overall", &post_overall_times);
+  reformat (&json, "%s}}}", json);
+  return json;
+}
+
+/* Wrap the daemon statistics up as if they were a server response, so
+   that the usual machinery can send them to the client.  */
+static struct server_response *
+stats_response (void)
+{
+  struct server_response *response = x_calloc (1, sizeof (*response));
+  struct response_part *part = x_calloc (1, sizeof (*part));
+
+  part->headers = x_strdup ("Content-Type: application/json\r\n");
+  part->headersize = strlen (part->headers);
+  part->type = x_strdup ("application/json");
+  part->data = stats_json ();
+  part->datasize = strlen (part->data);
+
+  response->code = 200;
+  response->complete = true;
+  response->type = x_strdup ("application/json");
+  response->parts = response->last = part;
+  return response;
 }
 
 /* This function is only called when things get bad!
@@ -1549,15 +4958,20 @@ close_local_connection (struct local_connection_state *conn)
   FD_CLR (conn->fd, &open_local_fds[FD_WRITE]);
   close (conn->fd);
 
-  /* Clean up program state.  */
-  if (conn->dfa_state == STATE_WAITING)
+  /* Clean up program state.  Nobody will read the answer to a request
+     still queued or under way, so don't spend the bandwidth on it.  */
+  cancel_job (conn);
+  if (conn->serve_pid)
     {
-      dequeue_job (conn);
-      waiting_jobs--;
+      /* Nobody is waiting for the compile any more.  */
+      kill (-conn->serve_pid, SIGTERM);
+      serving_count--;
+      abandoned_compiles = x_realloc (abandoned_compiles,
+                                      (abandoned_count + 1)
+                                      * sizeof (*abandoned_compiles));
+      abandoned_compiles[abandoned_count++] = conn->serve_pid;
     }
   active_clients--;
-  if (conn->iconn)
-    conn->iconn->lconn = NULL;
 
   cc_log ("%d client connections remain", active_clients);
 
@@ -1568,10 +4982,14 @@ close_local_connection (struct local_connection_state *conn)
   if (conn->response)
     free_server_response (conn->response);
   free (conn->url);
+  free (conn->cache_key);
+  free (conn->serve_request);
+  /* A packet being sent may be current_data itself.  */
+  if (conn->send_buffer != conn->current_data)
+    free (conn->send_buffer);
   free (conn->current_data);
   free (conn->stashed_string[0]);
   free (conn->stashed_string[1]);
-  free (conn->send_buffer);
   free (conn->dr);
   free (conn);
 }
@@ -1618,6 +5036,7 @@ recv_all_nonblock (struct local_connection_state *conn, size_t initial_size)
 
     default:
       /* Data received */
+      bytes_from_clients += recv_size;
       conn->current_offset += recv_size;
       conn->current_size -= recv_size;
       break;
@@ -1660,6 +5079,7 @@ send_all_nonblock (struct local_connection_state *conn,
       return 0;
     }
 
+  bytes_to_clients += sent_size;
   conn->current_offset += sent_size;
   conn->current_size -= sent_size;
 
@@ -1705,6 +5125,36 @@ do_local_comms (struct local_connection_state *conn)
 	    case 'A':
 	      conn->dfa_next_state = STATE_RECV_ATTACHMENT_NAME;
 	      break;
+	    case 'T':
+	      /* The deadline travels in the size field itself.  */
+	      conn->dfa_next_state = STATE_RECV_DEADLINE;
+	      break;
+	    case 'P':
+	      /* So do the percentile here, and the compile time below.  */
+	      conn->dfa_next_state = STATE_RECV_PACE;
+	      break;
+	    case 'C':
+	      conn->dfa_next_state = STATE_RECV_COMPILE_TIME;
+	      break;
+	    case 'L':
+	      conn->dfa_next_state = STATE_RECV_LOOKUP;
+	      break;
+	    case 'Q':
+	      conn->dfa_next_state = STATE_RECV_UPLOAD;
+	      break;
+	    case 'I':
+	      conn->dfa_next_state = STATE_RECV_TOOLCHAIN;
+	      break;
+	    case 'X':
+	      if (child_pipe[0] == -1 || !client_is_owner (conn))
+		{
+		  cc_log ("[%u:%u] Refusing to run a compile for this client",
+		          conn->client_number, conn->job_number);
+		  close_local_connection (conn);
+		  return;
+		}
+	      conn->dfa_next_state = STATE_RECV_SERVE;
+	      break;
 	    case 'R':
 	      if (!conn->url)
 		{
@@ -1717,12 +5167,63 @@ do_local_comms (struct local_connection_state *conn)
 
 	      cc_log ("[%u:%u] job ready", conn->client_number,
 	              conn->job_number);
+	      conn->request_code = 'R';
+	      gettimeofday (&conn->request_time, NULL);
+	      timerclear (&conn->deadline);
+	      if (conn->deadline_ms && !conn->post)
+		{
+		  struct timeval budget = {conn->deadline_ms / 1000,
+		                           conn->deadline_ms % 1000 * 1000};
+		  timeradd (&conn->request_time, &budget, &conn->deadline);
+		}
+
+	      /* Answer repeated queries from memory, if we can.  An upload
+	         makes anything we know about its object stale.  */
+	      if (conn->post)
+		invalidate_cached_response (conn->cache_key);
+	      else
+		{
+		  free (conn->cache_key);
+		  conn->cache_key = cache_key_from_url (conn->url);
+		  conn->response = cached_server_response (conn->cache_key);
+		  if (conn->response)
+		    {
+		      cc_log ("[%u:%u] job served from the response cache",
+		              conn->client_number, conn->job_number);
+		      FD_SET (conn->fd, &open_local_fds[FD_WRITE]);
+		      conn->dfa_state = STATE_SEND_INIT;
+		      break;
+		    }
+		}
+
+	      if (!conn->post && breaker_open)
+		{
+		  /* With no response, the client is told the request
+		     failed.  */
+		  cc_log ("[%u:%u] the circuit breaker is open; failing the job",
+		          conn->client_number, conn->job_number);
+		  breaker_refused_counter++;
+		  FD_SET (conn->fd, &open_local_fds[FD_WRITE]);
+		  conn->dfa_state = STATE_SEND_INIT;
+		  break;
+		}
 
 	      /* Add this to the queue of things to do ... */
 	      conn->dfa_state = STATE_WAITING;
-	      gettimeofday (&conn->request_time, NULL);
 	      queue_new_job (conn);
-	      waiting_jobs++;
+	      break;
+	    case 'K':
+	      /* A cancel that crossed with the end of its response; there is
+	         nothing left to stop.  */
+	      conn->dfa_state = STATE_RECV_INIT;
+	      break;
+	    case 'S':
+	      /* The client wants our statistics.  This never touches the
+	         internet, so reply immediately.  */
+	      conn->request_code = 'S';
+	      conn->response = stats_response ();
+	      FD_SET (conn->fd, &open_local_fds[FD_WRITE]);
+	      conn->dfa_state = STATE_SEND_INIT;
 	      break;
 	    default:
 	      cc_log ("[%u:%u] Daemon received unexpected code 0x%02x",
@@ -1747,6 +5248,25 @@ do_local_comms (struct local_connection_state *conn)
 	  conn->dfa_state = conn->dfa_next_state;
 	  break;
 
+	case STATE_RECV_DEADLINE:
+	  conn->deadline_ms = conn->current_size;
+	  conn->dfa_state = STATE_RECV_INIT;
+	  break;
+
+	case STATE_RECV_PACE:
+	  if (!answer_pace (conn, conn->current_size))
+	    {
+	      close_local_connection (conn);
+	      return;
+	    }
+	  conn->dfa_state = STATE_RECV_INIT;
+	  break;
+
+	case STATE_RECV_COMPILE_TIME:
+	  record_recent (&recent_compile_times, conn->current_size);
+	  conn->dfa_state = STATE_RECV_INIT;
+	  break;
+
 	case STATE_RECV_URL:
 	case STATE_RECV_HEADER:
 	case STATE_RECV_FORM_NAME:
@@ -1754,6 +5274,10 @@ do_local_comms (struct local_connection_state *conn)
 	case STATE_RECV_ATTACHMENT_NAME:
 	case STATE_RECV_ATTACHMENT_FILE:
 	case STATE_RECV_ATTACHMENT_FILENAME:
+	case STATE_RECV_LOOKUP:
+	case STATE_RECV_TOOLCHAIN:
+	case STATE_RECV_SERVE:
+	case STATE_RECV_UPLOAD:
 	  // Receive and stash a known amount of data.
 	  if (!recv_all_nonblock (conn, conn->current_size))
 	    return;
@@ -1796,6 +5320,43 @@ do_local_comms (struct local_connection_state *conn)
 	      conn->dfa_state = STATE_RECV_SIZE;
 	      conn->dfa_next_state = STATE_RECV_ATTACHMENT_COMPLETE;
 	      break;
+	    case STATE_RECV_LOOKUP:
+	      /* Lookups don't touch the internet, so answer right away.  */
+	      if (!answer_lookup (conn, conn->current_data,
+	                          conn->current_offset))
+		{
+		  close_local_connection (conn);
+		  return;
+		}
+	      FREE (conn->current_data);
+	      conn->dfa_state = STATE_RECV_INIT;
+	      break;
+	    case STATE_RECV_TOOLCHAIN:
+	      if (!answer_toolchain (conn, conn->current_data,
+	                             conn->current_offset))
+		{
+		  close_local_connection (conn);
+		  return;
+		}
+	      FREE (conn->current_data);
+	      conn->dfa_state = STATE_RECV_INIT;
+	      break;
+	    case STATE_RECV_SERVE:
+	      conn->serve_request = conn->current_data;
+	      conn->serve_request_size = conn->current_offset;
+	      conn->dfa_state = STATE_RECV_SERVE_FDS;
+	      break;
+	    case STATE_RECV_UPLOAD:
+	      /* The client exits as soon as it hears the upload is ours.  */
+	      if (!answer_upload (conn, accept_upload (conn,
+	                                               conn->current_data)))
+		{
+		  close_local_connection (conn);
+		  return;
+		}
+	      FREE (conn->current_data);
+	      conn->dfa_state = STATE_RECV_INIT;
+	      break;
 	    default:
 	      cc_log ("[%u:%u] Error: Broken state machine!",
 	              conn->client_number, conn->job_number);
@@ -1815,15 +5376,61 @@ do_local_comms (struct local_connection_state *conn)
 	  conn->dfa_state = STATE_RECV_INIT;
 	  break;
 
+	case STATE_RECV_SERVE_FDS:
+	  {
+	    int fds[3];
+	    switch (recv_serve_fds (conn, fds))
+	      {
+	      case 0:
+		return;
+	      case 1:
+		if (start_served_compile (conn, fds))
+		  break;
+		/* Fall through.  */
+	      default:
+		close_local_connection (conn);
+		return;
+	      }
+	    conn->dfa_state = STATE_SERVING;
+	  }
+	  return;
+
+	case STATE_SERVING:
+	  /* The client has nothing to say until its compile is done, so it
+	     must have gone away.  reap_served_compiles() will move us on.  */
+	  cc_log ("[%u:%u] client left during its compile",
+	          conn->client_number, conn->job_number);
+	  close_local_connection (conn);
+	  return;
+
 	case STATE_WAITING:
 	case STATE_INPROGRESS:
-	  /* We're waiting on an Internet connection.
-	     We should never get here but it's harmless.
+	  /* We're waiting on an Internet connection, so the only thing the
+	     client may say is that it no longer wants the answer.
 
-	     handle_completed_internet_connections() will change the
-	     state to STATE_SEND_INIT and add the socket to FD_WRITE
+	     Otherwise handle_completed_internet_connections() will change
+	     the state to STATE_SEND_INIT and add the socket to FD_WRITE
 	     when the time comes. */
-	  return;
+	  if (!recv_all_nonblock (conn, 1))
+	    return;
+	  if (conn->current_data[0] != 'K')
+	    {
+	      cc_log ("[%u:%u] Daemon received unexpected code 0x%02x",
+	              conn->client_number, conn->job_number,
+	              conn->current_data[0]);
+	      close_local_connection (conn);
+	      return;
+	    }
+	  FREE (conn->current_data);
+	  cc_log ("[%u:%u] job cancelled by the client",
+	          conn->client_number, conn->job_number);
+	  cancel_job (conn);
+
+	  /* With no response, anyone still listening is told the request
+	     failed.  */
+	  FD_SET (conn->fd, &open_local_fds[FD_WRITE]);
+	  conn->dfa_state = STATE_SEND_INIT;
+	  break;
 
 	case STATE_SEND_INIT:
 	  if (!conn->send_buffer)
@@ -1952,41 +5559,25 @@ do_local_comms (struct local_connection_state *conn)
 	  cc_log ("[%u:%u] job complete.", conn->client_number,
 	          conn->job_number);
 
-	  /* Calculate the response times.
-	     The counters here include incomplete requests,
-	     but it probably doesn't matter.  */
-	  struct timeval tv, diff;
-	  gettimeofday (&tv, NULL);
-	  timersub (&tv, &conn->request_time, &diff);
-	  double time = diff.tv_sec + diff.tv_usec / 1000000.0;
-	  if (conn->post)
+	  /* Record the response time.  This includes incomplete
+	     requests, but it probably doesn't matter.  */
+	  if (conn->request_code == 'R')
 	    {
-	      if (lowest_post_response_time == 0
-		  || lowest_post_response_time > time)
-		lowest_post_response_time = time;
-	      if (highest_post_response_time < time)
-		highest_post_response_time = time;
-	      average_post_response_time =
-		((((post_request_counter-1) * average_post_response_time)
-		  + time)
-		 / post_request_counter);
-	    }
-	  else
-	    {
-	      if (lowest_get_response_time == 0
-		  || lowest_get_response_time > time)
-		lowest_get_response_time = time;
-	      if (highest_get_response_time < time)
-		highest_get_response_time = time;
-	      average_get_response_time =
-		((((get_request_counter-1) * average_get_response_time)
-		  + time)
-		 / get_request_counter);
+	      uint64_t elapsed = microseconds_since (&conn->request_time);
+	      histogram_record (conn->post ? &post_overall_times
+	                                   : &get_overall_times, elapsed);
+	      if (!conn->post)
+		record_recent (&recent_get_times,
+		               elapsed > UINT32_MAX ? UINT32_MAX : elapsed);
 	    }
 
 	  /* Remove all the old state from this connection,
 	     but keep it open so the client can reuse it.  */
 	  FREE (conn->url);
+	  FREE (conn->cache_key);
+	  conn->request_code = 0;
+	  conn->deadline_ms = 0;
+	  timerclear (&conn->deadline);
 	  cleanup_form (conn);
 	  free_server_response (conn->response);
 	  conn->response = NULL;
@@ -2000,6 +5591,9 @@ do_local_comms (struct local_connection_state *conn)
     }
 }
 
+static void set_request_timeout (struct internet_connection_state *iconn,
+                                 struct local_connection_state *lconn);
+
 static void
 setup_internet_request (struct internet_connection_state *iconn,
                         struct local_connection_state *lconn)
@@ -2013,6 +5607,28 @@ setup_internet_request (struct internet_connection_state *iconn,
   iconn->response = calloc (1, sizeof(*iconn->response));
   x_curl_easy_setopt(iconn, CURLOPT_HEADERDATA, iconn->response);
   x_curl_easy_setopt(iconn, CURLOPT_WRITEDATA, iconn->response);
+  set_request_timeout (iconn, lconn);
+}
+
+/* Give the request of LCONN on ICONN its timeout.  */
+static void
+set_request_timeout (struct internet_connection_state *iconn,
+                     struct local_connection_state *lconn)
+{
+  /* A GET with a deadline is abandoned when it passes.  */
+  long timeout_ms = 600 * 1000;
+  if (!lconn->post && timerisset (&lconn->deadline))
+    {
+      struct timeval now, remaining;
+      gettimeofday (&now, NULL);
+      timeout_ms = 1;
+      if (timercmp (&now, &lconn->deadline, <))
+	{
+	  timersub (&lconn->deadline, &now, &remaining);
+	  timeout_ms += remaining.tv_sec * 1000 + remaining.tv_usec / 1000;
+	}
+    }
+  x_curl_easy_setopt(iconn, CURLOPT_TIMEOUT_MS, (void *)timeout_ms);
 }
 
 /* Match waiting local connections to free internet connections, set up the
@@ -2023,11 +5639,14 @@ dispatch_jobs (void)
   struct local_connection_state *lconn;
   struct internet_connection_state *iconn;
 
+  expire_jobs ();
   while (waiting_jobs
          && active_internet_connection_count < internet_pool_count)
     {
       /* Find waiting local connection.  */
       lconn = pop_queued_job ();
+      if (!lconn)
+	break;
 
       /* Find inactive internet connection. */
       for (iconn = internet; iconn; iconn = iconn->next)
@@ -2037,12 +5656,22 @@ dispatch_jobs (void)
       /* Update both connection states.  */
       lconn->iconn = iconn;
       iconn->lconn = lconn;
+      iconn->cache_key = lconn->cache_key ? x_strdup (lconn->cache_key) : NULL;
+      iconn->post = lconn->post != NULL;
       iconn->active = true;
+      if (iconn->post)
+	post_jobs.active++;
+      else
+	get_jobs.active++;
+      histogram_record (iconn->post ? &post_queue_times : &get_queue_times,
+                        microseconds_since (&lconn->request_time));
+      account_pool_usage ();
       active_internet_connection_count++;
+      if (active_internet_connection_count > peak_active_internet_connections)
+	peak_active_internet_connections = active_internet_connection_count;
       internet_request_counter++;
       gettimeofday (&iconn->request_time, NULL);
       lconn->dfa_state = STATE_INPROGRESS;
-      waiting_jobs--;
 
       setup_internet_request (iconn, lconn);
 
@@ -2057,6 +5686,230 @@ dispatch_jobs (void)
   cc_log ("daemon has %d jobs left waiting", waiting_jobs);
 }
 
+/* Detach ICONN from its client, and return it to the pool.  */
+static void
+release_internet_connection (struct internet_connection_state *iconn)
+{
+  if (iconn->lconn)
+    iconn->lconn->iconn = NULL;
+  FREE (iconn->cache_key);
+  iconn->lconn = NULL;
+  iconn->active = false;
+  if (iconn->post)
+    post_jobs.active--;
+  else
+    get_jobs.active--;
+  curl_multi_remove_handle (multi_handle, iconn->curl_handle);
+  if (iconn->resume_headers)
+    {
+      x_curl_easy_setopt (iconn, CURLOPT_RANGE, NULL);
+      x_curl_easy_setopt (iconn, CURLOPT_FRESH_CONNECT, (void *)(long)0);
+      curl_slist_free_all (iconn->resume_headers);
+      iconn->resume_headers = NULL;
+    }
+  account_pool_usage ();
+  active_internet_connection_count--;
+}
+
+/* Take up the GET on ICONN, which RESULT cut off, where it stopped, if it
+   can be.  Returns true if it was resumed.  See "Resumed downloads".  */
+static bool
+resume_download (struct internet_connection_state *iconn, CURLcode result)
+{
+  struct local_connection_state *lconn = iconn->lconn;
+  struct server_response *response = iconn->response;
+  const struct curl_slist *header;
+  struct timeval now;
+  char *line;
+
+  if (result != CURLE_RECV_ERROR && result != CURLE_PARTIAL_FILE
+      && result != CURLE_GOT_NOTHING && result != CURLE_OPERATION_TIMEDOUT)
+    return false;
+  if (response->code != 200 || response->complete || response->received == 0
+      || !response->accepts_ranges || !response->etag || response->encoded
+      || response->resumes >= resume_attempts)
+    return false;
+  gettimeofday (&now, NULL);
+  if (timerisset (&lconn->deadline) && !timercmp (&now, &lconn->deadline, <))
+    return false;
+
+  cc_log ("[%u:%u]<%u> resuming a download cut off after %zu bytes: %s",
+          lconn->client_number, lconn->job_number, iconn->connection_number,
+          response->received, iconn->curl_error_buffer);
+  curl_multi_remove_handle (multi_handle, iconn->curl_handle);
+  response->resumes++;
+  response->resuming = true;
+  resumed_downloads++;
+  resumed_bytes_kept += response->received;
+
+  curl_slist_free_all (iconn->resume_headers);
+  iconn->resume_headers = NULL;
+  for (header = lconn->header_list; header; header = header->next)
+    iconn->resume_headers = curl_slist_append (iconn->resume_headers,
+                                               header->data);
+  line = format ("If-Range: %s", response->etag);
+  iconn->resume_headers = curl_slist_append (iconn->resume_headers, line);
+  free (line);
+  line = format ("%zu-", response->received);
+  x_curl_easy_setopt (iconn, CURLOPT_RANGE, line);
+  free (line);
+  x_curl_easy_setopt (iconn, CURLOPT_HTTPHEADER, iconn->resume_headers);
+  x_curl_easy_setopt (iconn, CURLOPT_FRESH_CONNECT, (void *)(long)1);
+  set_request_timeout (iconn, lconn);
+  curl_multi_add_handle (multi_handle, iconn->curl_handle);
+  return true;
+}
+
+/* Forget the request of CONN, whether it is still queued or already talking
+   to the server.  A transfer under way is abandoned, and whatever it had
+   downloaded so far is thrown away.  */
+static void
+cancel_job (struct local_connection_state *conn)
+{
+  struct internet_connection_state *iconn = conn->iconn;
+  struct response_part *part;
+
+  /* The time it was given is no measure of how long it would have taken.  */
+  conn->request_code = 'K';
+  if (conn->dfa_state == STATE_WAITING)
+    {
+      dequeue_job (conn);
+      cancelled_request_counter++;
+      return;
+    }
+  if (!iconn)
+    return;
+
+  cc_log ("[%u:%u]<%u> abandoning internet request",
+          conn->client_number, conn->job_number, iconn->connection_number);
+  cancelled_request_counter++;
+  if (iconn->response)
+    {
+      /* Close any attachment still being written.  */
+      receive_cloud_response (NULL, 0, 0, iconn->response);
+      for (part = iconn->response->parts; part; part = part->next)
+	if (part->tmp_filename)
+	  unlink (part->tmp_filename);
+      free_server_response (iconn->response);
+      iconn->response = NULL;
+    }
+  release_internet_connection (iconn);
+}
+
+/* Note the outcome RESULT of a GET of URL, which had a deadline of
+   DEADLINE_MS, for the circuit breaker.  */
+static void
+breaker_note_get (CURLcode result, const char *url, unsigned int deadline_ms)
+{
+  if (result == CURLE_OK)
+    {
+      breaker_failures = 0;
+      return;
+    }
+  if (result != CURLE_OPERATION_TIMEDOUT && result != CURLE_COULDNT_CONNECT
+      && result != CURLE_COULDNT_RESOLVE_HOST)
+    return;
+  if (++breaker_failures < breaker_threshold || breaker_open)
+    return;
+
+  cc_log ("%u GETs in a row failed; opening the circuit breaker",
+          breaker_failures);
+  breaker_open = true;
+  breaker_trip_counter++;
+  free (breaker_probe_url);
+  breaker_probe_url = x_strdup (url);
+  breaker_probe_timeout = deadline_ms ? deadline_ms : 5000;
+  gettimeofday (&breaker_next_probe, NULL);
+  breaker_next_probe.tv_sec += breaker_interval / 1000000;
+}
+
+/* Return how many microseconds there are until the circuit breaker should
+   probe the server, or zero if it isn't waiting to.  */
+static uint64_t
+breaker_wait (void)
+{
+  struct timeval now, diff;
+
+  if (!breaker_open || breaker_probing || !local)
+    return 0;
+  gettimeofday (&now, NULL);
+  if (!timercmp (&now, &breaker_next_probe, <))
+    return 1;
+  timersub (&breaker_next_probe, &now, &diff);
+  return diff.tv_sec * (uint64_t)1000000 + diff.tv_usec;
+}
+
+/* Start a probe of the server on a free internet connection, if the
+   circuit breaker is due one.  A probe is a connection with no client.  */
+static void
+start_breaker_probe (void)
+{
+  struct internet_connection_state *iconn;
+  struct timeval now;
+
+  if (!breaker_open || breaker_probing || !local
+      || active_internet_connection_count >= internet_pool_count)
+    return;
+  gettimeofday (&now, NULL);
+  if (timercmp (&now, &breaker_next_probe, <))
+    return;
+
+  for (iconn = internet; iconn; iconn = iconn->next)
+    if (!iconn->active)
+      break;
+  iconn->lconn = NULL;
+  iconn->post = false;
+  iconn->active = true;
+  get_jobs.active++;
+  account_pool_usage ();
+  active_internet_connection_count++;
+  gettimeofday (&iconn->request_time, NULL);
+
+  x_curl_easy_setopt (iconn, CURLOPT_URL, breaker_probe_url);
+  x_curl_easy_setopt (iconn, CURLOPT_HTTPHEADER, NULL);
+  x_curl_easy_setopt (iconn, CURLOPT_HTTPGET, (void *)1);
+  iconn->response = calloc (1, sizeof (*iconn->response));
+  x_curl_easy_setopt (iconn, CURLOPT_HEADERDATA, iconn->response);
+  x_curl_easy_setopt (iconn, CURLOPT_WRITEDATA, iconn->response);
+  x_curl_easy_setopt (iconn, CURLOPT_TIMEOUT_MS,
+                      (void *)(long)breaker_probe_timeout);
+  curl_multi_add_handle (multi_handle, iconn->curl_handle);
+  breaker_probing = true;
+  cc_log ("<%u> probing the server: %s", iconn->connection_number,
+          breaker_probe_url);
+}
+
+/* Close the circuit breaker if its probe on ICONN got an answer, and
+   return the connection to the pool.  */
+static void
+finish_breaker_probe (struct internet_connection_state *iconn,
+                      CURLcode result)
+{
+  struct response_part *part;
+
+  for (part = iconn->response->parts; part; part = part->next)
+    if (part->tmp_filename)
+      unlink (part->tmp_filename);
+  free_server_response (iconn->response);
+  iconn->response = NULL;
+  release_internet_connection (iconn);
+  breaker_probing = false;
+
+  if (result == CURLE_OK)
+    {
+      cc_log ("The server answered; closing the circuit breaker");
+      breaker_open = false;
+      breaker_failures = 0;
+    }
+  else
+    {
+      cc_log ("The server is still not answering: %s",
+              curl_easy_strerror (result));
+      gettimeofday (&breaker_next_probe, NULL);
+      breaker_next_probe.tv_sec += breaker_interval / 1000000;
+    }
+}
+
 /* For each completed curl handle, update our program state, and
    trigger do_local_comms to return the data to the client.  */
 static void
@@ -2079,17 +5932,54 @@ handle_completed_internet_connections (void)
 	    if (iconn->curl_handle == eh)
 	      break;
 
+	  /* A download cut off part way may be taken up again, keeping
+	     what it has.  */
+	  if (iconn->lconn && !iconn->post && !iconn->lconn->batch
+	      && resume_download (iconn, msg->data.result))
+	    continue;
+
 	  /* Clear any stashed data and close open files in the
 	     reader function.  */
 	  receive_cloud_response (NULL, 0, 0, iconn->response);
 
 	  if (!iconn->lconn)
 	    {
-	      /* The client died while we were working.  */
-	      // TODO clean up attachments?
-	      cc_log ("<%u> internet request completed, but client already died",
-	              iconn->connection_number);
-	      goto reset_iconn;
+	      finish_breaker_probe (iconn, msg->data.result);
+	      continue;
+	    }
+
+	  /* Record the response time.  The counters here include incomplete
+	     requests, but it probably doesn't matter.  */
+	  double uploaded = 0;
+	  histogram_record (iconn->post ? &post_internet_times
+	                                : &get_internet_times,
+	                    microseconds_since (&iconn->request_time));
+	  if (iconn->post)
+	    post_request_counter++;
+	  else
+	    {
+	      get_request_counter++;
+	      breaker_note_get (msg->data.result, iconn->lconn->url,
+	                        iconn->lconn->deadline_ms);
+	    }
+	  if (curl_easy_getinfo (eh, CURLINFO_SIZE_UPLOAD, &uploaded)
+	      == CURLE_OK)
+	    bytes_uploaded += uploaded;
+#if LIBCURL_VERSION_NUM >= 0x073200
+	  long version = 0;
+	  if (curl_easy_getinfo (eh, CURLINFO_HTTP_VERSION, &version)
+	      == CURLE_OK && version == CURL_HTTP_VERSION_2_0)
+	    http2_transfers++;
+#endif
+
+	  /* Keep a copy of what we fetched, and forget what we knew about
+	     anything just uploaded.  */
+	  if (msg->data.result == CURLE_OK)
+	    {
+	      if (iconn->post)
+		invalidate_cached_response (iconn->cache_key);
+	      else
+		cache_response (iconn->cache_key, iconn->response);
 	    }
 
 	  if (msg->data.result == CURLE_OK)
@@ -2104,38 +5994,20 @@ handle_completed_internet_connections (void)
 	            iconn->connection_number,
 	            iconn->curl_error_buffer);
 
-	  /* Calculate the response times.
-	     The counters here include incomplete requests,
-	     but it probably doesn't matter.  */
-	  struct timeval tv, diff;
-	  gettimeofday (&tv, NULL);
-	  timersub (&tv, &iconn->request_time, &diff);
-	  double time = diff.tv_sec + diff.tv_usec / 1000000.0;
-	  if (iconn->lconn->post)
-	    {
-	      if (lowest_internet_post_response_time == 0
-		  || lowest_internet_post_response_time > time)
-		lowest_internet_post_response_time = time;
-	      if (highest_internet_post_response_time < time)
-		highest_internet_post_response_time = time;
-	      average_internet_post_response_time =
-		(((post_request_counter * average_internet_post_response_time)
-		  + time)
-		 / (post_request_counter + 1));
-	      post_request_counter++;
-	    }
-	  else
+	  /* Uploads with no client carry on by themselves.  */
+	  if (iconn->lconn->batch)
 	    {
-	      if (lowest_internet_get_response_time == 0
-		  || lowest_internet_get_response_time > time)
-		lowest_internet_get_response_time = time;
-	      if (highest_internet_get_response_time < time)
-		highest_internet_get_response_time = time;
-	      average_internet_get_response_time =
-		(((get_request_counter * average_internet_get_response_time)
-		  + time)
-		 / (get_request_counter + 1));
-	      get_request_counter++;
+	      struct local_connection_state *sender = iconn->lconn;
+	      struct server_response *response = iconn->response;
+
+	      histogram_record (&post_overall_times,
+	                        microseconds_since (&sender->request_time));
+	      if (msg->data.result != CURLE_OK)
+		response->complete = false;
+	      iconn->response = NULL;
+	      release_internet_connection (iconn);
+	      upload_batch_answered (sender, response);
+	      continue;
 	    }
 
 	  /* Pass the response data to the local connection state. */
@@ -2143,14 +6015,9 @@ handle_completed_internet_connections (void)
 	  FD_SET (iconn->lconn->fd, &open_local_fds[FD_WRITE]);
 	  iconn->lconn->dfa_state = STATE_SEND_INIT;
 
-	  /* Reset this curl connection state, and return it to the pool.  */
-	  iconn->lconn->iconn = NULL;
-	reset_iconn:
+	  /* Return this curl connection to the pool.  */
 	  iconn->response = NULL;
-	  iconn->lconn = NULL;
-	  iconn->active = false;
-	  curl_multi_remove_handle (multi_handle, eh);
-	  active_internet_connection_count--;
+	  release_internet_connection (iconn);
 	}
       else
 	cc_log ("WARNING: curl_multi_info_read did something unexpected!");
@@ -2161,8 +6028,24 @@ handle_completed_internet_connections (void)
 static void
 exit_handler (void)
 {
+  struct local_connection_state *conn;
+  struct upload *up;
+
   unlink (master_socket_path);
 
+  /* The clients of compiles still running will do them again.  */
+  for (conn = local; conn; conn = conn->next)
+    if (conn->serve_pid)
+      kill (-conn->serve_pid, SIGTERM);
+
+  /* Keep results not yet uploaded for later, but out of shared memory.  */
+  for (up = uploads; up; up = up->next)
+    {
+      if (!up->spooled)
+	spool_upload (up);
+      unlink_offered_files (up->job);
+    }
+
   cc_log ("Daemon Exiting (pid %d)", getpid());
 }
 
@@ -2189,10 +6072,12 @@ sigusr1_handler (int num __attribute__((unused)))
            client_counter, active_clients);
   fprintf (stderr, "server connections: %d (%d currently in use)\n",
            internet_pool_count, active_internet_connection_count);
+  fprintf (stderr, "transport: %s (%u transfers over HTTP/2)\n",
+           use_http2 ? "HTTP/2 multiplexed" : "HTTP/1.1", http2_transfers);
 
   struct local_connection_state *lconn;
   int awaiting_input = 0, receiving_input = 0, queued = 0,
-      awaiting_server = 0, sending_response = 0;
+      awaiting_server = 0, sending_response = 0, compiling = 0;
 
   for (lconn = local; lconn; lconn = lconn->next)
     switch (lconn->dfa_state)
@@ -2210,8 +6095,19 @@ sigusr1_handler (int num __attribute__((unused)))
       case STATE_RECV_ATTACHMENT_FILE:
       case STATE_RECV_ATTACHMENT_FILENAME:
       case STATE_RECV_ATTACHMENT_COMPLETE:
+      case STATE_RECV_DEADLINE:
+      case STATE_RECV_PACE:
+      case STATE_RECV_COMPILE_TIME:
+      case STATE_RECV_LOOKUP:
+      case STATE_RECV_TOOLCHAIN:
+      case STATE_RECV_SERVE:
+      case STATE_RECV_SERVE_FDS:
+      case STATE_RECV_UPLOAD:
 	receiving_input++;
 	break;
+      case STATE_SERVING:
+	compiling++;
+	break;
       case STATE_WAITING:
 	queued++;
 	break;
@@ -2230,26 +6126,67 @@ sigusr1_handler (int num __attribute__((unused)))
       }
 
   fprintf (stderr, "local connection states:\n");
-  fprintf (stderr, "idle=%d receiving=%d queued=%d internet=%d sending=%d\n",
-           awaiting_input, receiving_input, queued, awaiting_server,
-           sending_response);
-  fprintf (stderr, "completed requests: GET=%u POST=%u\n",
-           get_request_counter, post_request_counter);
-  fprintf (stderr, "response times:  low   average   high\n");
-  fprintf (stderr, "GET (internet)  %lf %lf %lf\n",
-           lowest_internet_get_response_time,
-           average_internet_get_response_time,
-           highest_internet_get_response_time);
-  fprintf (stderr, "GET (overall)   %lf %lf %lf\n",
-           lowest_get_response_time, average_get_response_time,
-           highest_get_response_time);
-  fprintf (stderr, "POST (internet) %lf %lf %lf\n",
-           lowest_internet_post_response_time,
-           average_internet_post_response_time,
-           highest_internet_post_response_time);
-  fprintf (stderr, "POST (overall)  %lf %lf %lf\n",
-           lowest_post_response_time, average_post_response_time,
-           highest_post_response_time);
+  fprintf (stderr, "idle=%d receiving=%d queued=%d internet=%d sending=%d"
+           " compiling=%d\n", awaiting_input, receiving_input, queued,
+           awaiting_server, sending_response, compiling);
+  fprintf (stderr, "completed requests: GET=%u POST=%u (%u cancelled)\n",
+           get_request_counter, post_request_counter,
+           cancelled_request_counter);
+  fprintf (stderr, "circuit breaker: %s (%u trips, %u GETs refused)\n",
+           breaker_open ? "open" : "closed", breaker_trip_counter,
+           breaker_refused_counter);
+  fprintf (stderr, "result uploads: %u done, %u failed, %d pending\n",
+           upload_counter, upload_failed_counter, pending_uploads);
+  fprintf (stderr, "upload batches: %u, carrying %u uploads (%u retried)\n",
+           batch_counter, batched_upload_counter, upload_retry_counter);
+  fprintf (stderr, "upload content: %u files sent, %u shared\n",
+           content_sent_counter, content_shared_counter);
+  fprintf (stderr, "result spool: %u spooled, %u replayed (%d in progress)\n",
+           spooled_counter, replayed_counter, replaying_uploads);
+  fprintf (stderr, "encoded uploads: %u parts, %" PRIu64 " bytes sent as %"
+           PRIu64 " (%s)\n", encoded_parts_sent, encoded_raw_bytes_sent,
+           encoded_bytes_sent, encoding_name (upload_encoding ()));
+  fprintf (stderr, "encoded downloads: %u parts, %" PRIu64
+           " bytes received as %" PRIu64 "\n", encoded_parts_received,
+           encoded_raw_bytes_received, encoded_bytes_received);
+  fprintf (stderr, "resumed downloads: %u, %" PRIu64 " bytes kept; %u failed"
+           " their hash\n", resumed_downloads, resumed_bytes_kept,
+           content_hash_mismatches);
+  fprintf (stderr, "peak queue depth: %d, peak connections in use: %d\n",
+           peak_waiting_jobs, peak_active_internet_connections);
+  fprintf (stderr, "queued GETs: %d (%d running, oldest %.3fs,"
+           " %u missed deadline)\n", get_jobs.waiting, get_jobs.active,
+           oldest_wait (&get_jobs), get_expired_counter);
+  fprintf (stderr, "queued POSTs: %d (%d running, oldest %.3fs,"
+           " %u sent after aging, %.0f upload tokens)\n", post_jobs.waiting,
+           post_jobs.active, oldest_wait (&post_jobs), post_aged_counter,
+           post_tokens);
+  fprintf (stderr, "bytes: from clients=%" PRIu64 " to clients=%" PRIu64
+           " downloaded=%" PRIu64 " uploaded=%" PRIu64 "\n",
+           bytes_from_clients, bytes_to_clients, bytes_downloaded,
+           bytes_uploaded);
+  print_latency_header (stderr);
+  print_latency_histogram (stderr, "GET queue", &get_queue_times);
+  print_latency_histogram (stderr, "GET internet", &get_internet_times);
+  print_latency_histogram (stderr, "GET overall", &get_overall_times);
+  print_latency_histogram (stderr, "POST queue", &post_queue_times);
+  print_latency_histogram (stderr, "POST internet", &post_internet_times);
+  print_latency_histogram (stderr, "POST overall", &post_overall_times);
+  fprintf (stderr, "response cache: %u entries, %zu of %llu bytes\n",
+           response_cache ? hashtable_count (response_cache) : 0,
+           response_cache_size, (unsigned long long)response_cache_limit);
+  fprintf (stderr, "response cache: hits=%u negative=%u misses=%u"
+           " stored=%u evicted=%u invalidated=%u\n",
+           cache_hit_counter, cache_negative_hit_counter, cache_miss_counter,
+           cache_store_counter, cache_eviction_counter,
+           cache_invalidation_counter);
+  fprintf (stderr, "cache lookups: files=%u found=%u\n",
+           lookup_counter, lookup_found_counter);
+  fprintf (stderr, "toolchains: %d known, queries=%u hits=%u stale=%u\n",
+           toolchain_count, tool_query_counter, tool_hit_counter,
+           tool_stale_counter);
+  fprintf (stderr, "compile server: %u compiles (%d running)\n",
+           serve_counter, serving_count);
 }
 
 static void
@@ -2257,24 +6194,108 @@ sigusr2_handler (int num __attribute__((unused)))
 {
   get_request_counter = 0;
   post_request_counter = 0;
-  lowest_get_response_time = 0;
-  lowest_internet_get_response_time = 0;
-  lowest_post_response_time = 0;
-  lowest_internet_post_response_time = 0;
-  average_get_response_time = 0;
-  average_internet_get_response_time = 0;
-  average_post_response_time = 0;
-  average_internet_post_response_time = 0;
-  highest_get_response_time = 0;
-  highest_internet_get_response_time = 0;
-  highest_post_response_time = 0;
-  highest_internet_post_response_time = 0;
+  cancelled_request_counter = 0;
+  breaker_trip_counter = 0;
+  breaker_refused_counter = 0;
+  upload_counter = 0;
+  upload_failed_counter = 0;
+  upload_retry_counter = 0;
+  batch_counter = 0;
+  batched_upload_counter = 0;
+  content_sent_counter = 0;
+  content_shared_counter = 0;
+  spooled_counter = 0;
+  replayed_counter = 0;
+  encoded_parts_sent = 0;
+  encoded_raw_bytes_sent = 0;
+  encoded_bytes_sent = 0;
+  encoded_parts_received = 0;
+  encoded_raw_bytes_received = 0;
+  encoded_bytes_received = 0;
+  resumed_downloads = 0;
+  resumed_bytes_kept = 0;
+  content_hash_mismatches = 0;
+  peak_waiting_jobs = waiting_jobs;
+  peak_active_internet_connections = active_internet_connection_count;
+  bytes_from_clients = 0;
+  bytes_to_clients = 0;
+  bytes_downloaded = 0;
+  bytes_uploaded = 0;
+  http2_transfers = 0;
+  busy_connection_seconds = 0;
+  gettimeofday (&stats_reset_time, NULL);
+  pool_usage_mark = stats_reset_time;
+  histogram_reset (&get_queue_times);
+  histogram_reset (&get_internet_times);
+  histogram_reset (&get_overall_times);
+  histogram_reset (&post_queue_times);
+  histogram_reset (&post_internet_times);
+  histogram_reset (&post_overall_times);
+  cache_hit_counter = 0;
+  cache_negative_hit_counter = 0;
+  cache_miss_counter = 0;
+  cache_store_counter = 0;
+  cache_eviction_counter = 0;
+  cache_invalidation_counter = 0;
+  get_expired_counter = 0;
+  post_aged_counter = 0;
+  lookup_counter = 0;
+  lookup_found_counter = 0;
+  tool_query_counter = 0;
+  tool_hit_counter = 0;
+  tool_stale_counter = 0;
+  serve_counter = 0;
+}
+
+/* Choose the encodings to use with the server from the comma-separated
+   LIST, in order of preference, or the default if it is NULL.  */
+static void
+setup_encodings (const char *list)
+{
+  enum encoding encoding;
+  int i;
+
+  if (!list)
+    list = "zstd, gzip";
+  while (*list)
+    {
+      size_t len;
+
+      list += strspn (list, " ,");
+      len = strcspn (list, " ,");
+      if (len == 0)
+	break;
+      if (!encoding_parse (list, len, &encoding))
+	cc_log ("Unknown encoding in CS_DAEMON_ENCODINGS: %.*s",
+	        (int)len, list);
+      else if (encoding != ENCODING_IDENTITY && encoding_supported (encoding))
+	{
+	  for (i = 0; i < encoding_count && encodings[i] != encoding; i++)
+	    ;
+	  if (i == encoding_count)
+	    encodings[encoding_count++] = encoding;
+	}
+      list += len;
+    }
+
+  for (i = 0; i < encoding_count; i++)
+    {
+      char *header = format ("Content-Encoding: %s",
+                             encoding_name (encodings[i]));
+      reformat (&accept_encoding, "%s%s%s",
+                accept_encoding ? accept_encoding : "", i ? ", " : "",
+                encoding_name (encodings[i]));
+      encoding_headers[encodings[i]] = curl_slist_append (NULL, header);
+      free (header);
+    }
 }
 
 int
 daemon_main (bool force)
 {
   cc_log ("Daemon Started on pid %d", getpid());
+  gettimeofday (&daemon_start_time, NULL);
+  stats_reset_time = pool_usage_mark = daemon_start_time;
 
   /* First thing to do: create the Unix Domain Socket.
      If that doesn't work then another process probably got there first. */
@@ -2343,10 +6364,38 @@ daemon_main (bool force)
   FD_SET (master_socket, &open_local_fds[FD_READ]);
   cc_log ("Listening on socket at %s", master_socket_path);
 
-  char *conn_count_s = getenv ("CS_DAEMON_CONNECTIONS");
-  int conn_count = conn_count_s ? atoi (conn_count_s) : 8;
+  /* Second, we initialize Libcurl.
+
+     By default each transfer gets its own HTTP/1.1 connection, so the
+     number of easy handles (8) caps the number of requests in flight.
+     With CS_DAEMON_HTTP2 set, the transfers are instead multiplexed as
+     streams over a few HTTP/2 connections, and the easy handles are cheap,
+     so there are more of them.  A server that doesn't offer HTTP/2 during
+     the TLS handshake still gets HTTP/1.1.
+       CS_DAEMON_CONNECTIONS     transfers in flight (default 8, or 64)
+       CS_DAEMON_HTTP2           non-zero to multiplex over HTTP/2
+       CS_DAEMON_HTTP2_CONNECTIONS  connections per host (default 1)
+       CS_DAEMON_HTTP2_STREAMS   streams per connection (default 100)
+       CS_DAEMON_CA_BUNDLE       CA certificates to verify the server  */
+  char *env;
+  if ((env = getenv ("CS_DAEMON_HTTP2")))
+    use_http2 = atoi (env) != 0;
+#if LIBCURL_VERSION_NUM < 0x072f00
+  if (use_http2)
+    {
+      cc_log ("WARNING: libcurl is too old for HTTP/2; using HTTP/1.1");
+      use_http2 = false;
+    }
+#endif
+  ca_bundle = getenv ("CS_DAEMON_CA_BUNDLE");
+  setup_encodings (getenv ("CS_DAEMON_ENCODINGS"));
+  if ((env = getenv ("CS_DAEMON_ENCODING_LEVEL")) && atoi (env) > 0)
+    encoding_level = atoi (env);
+  if ((env = getenv ("CS_DAEMON_RESUME_ATTEMPTS")))
+    resume_attempts = atoi (env);
 
-  /* Second, we initialize Libcurl (8 connections).  */
+  char *conn_count_s = getenv ("CS_DAEMON_CONNECTIONS");
+  int conn_count = conn_count_s ? atoi (conn_count_s) : use_http2 ? 64 : 8;
   int i;
   for (i = 0; i < conn_count; i++)
     if (init_new_easy_handle() == NULL)
@@ -2355,6 +6404,71 @@ daemon_main (bool force)
 	exit (1);
       }
   multi_handle = curl_multi_init();
+#if LIBCURL_VERSION_NUM >= 0x072f00
+  if (use_http2)
+    {
+      env = getenv ("CS_DAEMON_HTTP2_CONNECTIONS");
+      long host_connections = env ? atol (env) : 1;
+      curl_multi_setopt (multi_handle, CURLMOPT_PIPELINING,
+                         (long)CURLPIPE_MULTIPLEX);
+      curl_multi_setopt (multi_handle, CURLMOPT_MAX_HOST_CONNECTIONS,
+                         host_connections);
+#if LIBCURL_VERSION_NUM >= 0x074300
+      env = getenv ("CS_DAEMON_HTTP2_STREAMS");
+      curl_multi_setopt (multi_handle, CURLMOPT_MAX_CONCURRENT_STREAMS,
+                         env ? atol (env) : 100L);
+#endif
+      cc_log ("Multiplexing %d transfers over %ld HTTP/2 connection(s)",
+              conn_count, host_connections);
+    }
+#endif
+
+  /* Third, set up the response cache.  A size of zero disables it.  */
+  uint64_t size;
+  if ((env = getenv ("CS_DAEMON_CACHE_SIZE"))
+      && parse_size_with_suffix (env, &size))
+    response_cache_limit = size;
+  if ((env = getenv ("CS_DAEMON_CACHE_ENTRY_MAX"))
+      && parse_size_with_suffix (env, &size))
+    response_cache_entry_limit = size;
+  if ((env = getenv ("CS_DAEMON_CACHE_TTL")))
+    response_cache_hit_ttl = atoi (env);
+  if ((env = getenv ("CS_DAEMON_MISS_TTL")))
+    response_cache_miss_ttl = atoi (env);
+  if (response_cache_limit > 0)
+    response_cache = create_hashtable (256, hash_from_string, strings_equal);
+
+  /* Fourth, the toolchain table.  */
+  if ((env = getenv ("CS_DAEMON_TOOL_RECHECK")))
+    tool_recheck = atoi (env);
+
+  /* Fifth, configure the job scheduler.  */
+  if ((env = getenv ("CS_DAEMON_GET_RESERVE")))
+    get_reserve = atoi (env);
+  if (get_reserve < 0 || get_reserve >= internet_pool_count)
+    get_reserve = internet_pool_count / 4;
+  if ((env = getenv ("CS_DAEMON_POST_RATE")))
+    parse_size_with_suffix (env, &post_rate);
+  if ((env = getenv ("CS_DAEMON_POST_BURST"))
+      && parse_size_with_suffix (env, &size))
+    post_burst = size;
+  post_tokens = post_burst;
+  gettimeofday (&post_tokens_time, NULL);
+  if ((env = getenv ("CS_DAEMON_POST_MAX_WAIT")))
+    post_max_wait = atoi (env) * (uint64_t)1000000;
+  if ((env = getenv ("CS_DAEMON_BREAKER_TRIP")) && atoi (env) > 0)
+    breaker_threshold = atoi (env);
+  if ((env = getenv ("CS_DAEMON_BREAKER_PROBE")) && atoi (env) > 0)
+    breaker_interval = atoi (env) * (uint64_t)1000000;
+  if ((env = getenv ("CS_DAEMON_BATCH_COUNT")) && atoi (env) > 0)
+    batch_count_limit = atoi (env);
+  if ((env = getenv ("CS_DAEMON_BATCH_BYTES")))
+    parse_size_with_suffix (env, &batch_bytes_limit);
+  if ((env = getenv ("CS_DAEMON_BATCH_DELAY")))
+    batch_delay = atoi (env) * (uint64_t)1000;
+  if ((env = getenv ("CS_DAEMON_SPOOL_RETRY")) && atoi (env) > 0)
+    spool_retry = atoi (env) * (uint64_t)1000000;
+  spool_dir = spool_directory ();
 
   /* Register an exit handler to clean up the socket. */
   exitfn_add_nullary(exit_handler);
@@ -2363,6 +6477,7 @@ daemon_main (bool force)
   signal (SIGPIPE, SIG_IGN);
   signal (SIGUSR1, sigusr1_handler);
   signal (SIGUSR2, sigusr2_handler);
+  setup_compile_server ();
 
   /* Main program loop.  */
   while (1)
@@ -2383,20 +6498,40 @@ daemon_main (bool force)
           if (curl_nfds > nfds)
             nfds = curl_nfds;
 	}
+      uint64_t wait = waiting_jobs ? scheduler_wait () : 0;
+      uint64_t probe_wait = breaker_wait ();
+      if (probe_wait && (!wait || probe_wait < wait))
+	wait = probe_wait;
+      uint64_t batch_wait = upload_wait ();
+      if (batch_wait && (!wait || batch_wait < wait))
+	wait = batch_wait;
+      if (wait && wait < timeout.tv_sec * (uint64_t)1000000 + timeout.tv_usec)
+	{
+	  timeout.tv_sec = wait / 1000000;
+	  timeout.tv_usec = wait % 1000000;
+	}
       int fds = select (nfds, &readfds, &writefds, &exceptfds, &timeout);
+      if (fds == -1 && errno == EINTR)
+	continue;
 
       if (fds == 0 && active_internet_connection_count == 0
-	  && local == NULL)
+	  && local == NULL && pending_uploads == 0)
 	{
 	  /* Timeout.  */
 	  cc_log ("No daemon activity for 10 minutes.");
 	  break;
 	}
 
+      /* Do this before answering anyone, so that a changed toolchain is
+         never vouched for.  */
+      revalidate_toolchains ();
+
       if (fds)
 	{
 	  if (master_socket != -1 && FD_ISSET(master_socket, &readfds))
 	    accept_local_connections ();
+	  if (child_pipe[0] != -1 && FD_ISSET(child_pipe[0], &readfds))
+	    reap_served_compiles ();
 
 	  /* Step through all the sockets with data, and handle whatever
 	     needs doing.  */
@@ -2418,9 +6553,11 @@ daemon_main (bool force)
 	    }
 	}
 
-      if (waiting_jobs
-	  && active_internet_connection_count < internet_pool_count)
+      replay_spool ();
+      dispatch_uploads ();
+      if (waiting_jobs)
 	dispatch_jobs ();
+      start_breaker_probe ();
 
       if (active_internet_connection_count > 0)
 	{
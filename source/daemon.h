@@ -4,6 +4,7 @@ int launch_daemon (void);
 int daemon_main (bool force);
 daemon_handle connect_to_daemon (void);
 void close_daemon (daemon_handle dh);
+int print_daemon_stats (void);
 
 int set_daemon_url (daemon_handle dh, char *url);
 int add_daemon_header (daemon_handle dh, const char *header);
@@ -12,6 +13,16 @@ int add_daemon_form_data (daemon_handle dh, const char *name,
                           const char *data);
 int add_daemon_form_attachment (daemon_handle dh, const char *name,
                                 struct stashed_file *sf, const char *filename);
+int set_daemon_deadline (daemon_handle dh, unsigned int milliseconds);
+bool lookup_daemon_files (int n, const char *const *paths, int *fds);
+void open_cache_files (int n, const char *const *paths, int *fds);
+char *query_daemon_tool_id (const char *key);
+void register_daemon_tool_id (const char *key, const char *id, int n,
+                              const char *const *paths,
+                              const char *const *stats);
+bool query_daemon_pace (unsigned int percentile, uint32_t *get_time,
+                        uint32_t *compile_time);
+void report_daemon_compile_time (uint32_t microseconds);
 
 enum daemon_response_codes
 {
@@ -48,6 +59,8 @@ union daemon_responses
 };
 
 int request_daemon_response (daemon_handle dh);
+void cancel_daemon_request (daemon_handle dh);
+bool enqueue_daemon_upload (daemon_handle dh, const char *job);
 enum daemon_response_codes get_daemon_response (daemon_handle dh,
                                                 union daemon_responses **dr_ptr);
 void flush_daemon_response (daemon_handle dh);
@@ -0,0 +1,360 @@
+/* Copyright (c) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Streaming coders for the content encodings of parts sent to and from the
+   server: "gzip", with zlib, and "zstd", if cs was built with libzstd.
+
+   A decoder is fed the encoded data in blocks of any size, as they arrive,
+   and passes what it decodes on to its output call-back, a window at a
+   time, so that a download can be decoded straight into its file.
+
+   An encoder reads from data that is already in memory, such as a stashed
+   file, and encodes as much as its caller asks for at a time, so that an
+   upload can be encoded as curl sends it, with no copy of the whole.  */
+
+#include "ccache.h"
+#include "encoding.h"
+
+#include <zlib.h>
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+/* Warning, MIN evaluates X and Y twice.  */
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+
+/* The size of the window a decoder decodes into.  */
+#define DECODE_WINDOW (64 * 1024)
+
+static const char *const encoding_names[ENCODING_COUNT] =
+{
+  "identity", "gzip", "zstd"
+};
+
+const char *
+encoding_name (enum encoding encoding)
+{
+  return encoding_names[encoding];
+}
+
+/* Set *ENCODING to the one named by the LEN bytes at NAME, ignoring case.
+   Returns false if there is no such encoding.  */
+bool
+encoding_parse (const char *name, size_t len, enum encoding *encoding)
+{
+  int i;
+
+  for (i = 0; i < ENCODING_COUNT; i++)
+    if (len == strlen (encoding_names[i])
+        && strncasecmp (name, encoding_names[i], len) == 0)
+      {
+	*encoding = i;
+	return true;
+      }
+  if (len == strlen ("x-gzip") && strncasecmp (name, "x-gzip", len) == 0)
+    {
+      *encoding = ENCODING_GZIP;
+      return true;
+    }
+  return false;
+}
+
+/* Return true if ENCODING can be decoded and encoded.  */
+bool
+encoding_supported (enum encoding encoding)
+{
+#ifndef HAVE_LIBZSTD
+  if (encoding == ENCODING_ZSTD)
+    return false;
+#endif
+  return encoding < ENCODING_COUNT;
+}
+
+struct decoder
+{
+  enum encoding encoding;
+  decoder_output output;
+  void *userdata;
+  bool ended;              /* The end of the stream has been seen.  */
+  z_stream z;
+#ifdef HAVE_LIBZSTD
+  ZSTD_DStream *zstd;
+  size_t zstd_hint;        /* Zero once a frame is complete.  */
+#endif
+  char window[DECODE_WINDOW];
+};
+
+/* Return a decoder for ENCODING, which passes what it decodes to OUTPUT
+   with USERDATA, or NULL if ENCODING isn't supported.  */
+struct decoder *
+decoder_new (enum encoding encoding, decoder_output output, void *userdata)
+{
+  struct decoder *decoder;
+
+  if (!encoding_supported (encoding))
+    return NULL;
+  decoder = x_calloc (1, sizeof (*decoder));
+  decoder->encoding = encoding;
+  decoder->output = output;
+  decoder->userdata = userdata;
+  switch (encoding)
+    {
+    case ENCODING_GZIP:
+      /* Add 16 to the window bits for a gzip header and trailer.  */
+      if (inflateInit2 (&decoder->z, 16 + MAX_WBITS) != Z_OK)
+	{
+	  free (decoder);
+	  return NULL;
+	}
+      break;
+#ifdef HAVE_LIBZSTD
+    case ENCODING_ZSTD:
+      decoder->zstd = ZSTD_createDStream ();
+      decoder->zstd_hint = ZSTD_initDStream (decoder->zstd);
+      break;
+#endif
+    default:
+      break;
+    }
+  return decoder;
+}
+
+static int
+feed_gzip (struct decoder *decoder, const char *data, size_t size)
+{
+  decoder->z.next_in = (Bytef *)data;
+  decoder->z.avail_in = size;
+
+  /* Carry on while there is input, or the window filled up.  */
+  do
+    {
+      int ret;
+
+      if (decoder->ended)
+	/* Nothing may follow the stream.  */
+	return decoder->z.avail_in == 0;
+      decoder->z.next_out = (Bytef *)decoder->window;
+      decoder->z.avail_out = DECODE_WINDOW;
+      ret = inflate (&decoder->z, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END)
+	decoder->ended = true;
+      else if (ret != Z_OK && ret != Z_BUF_ERROR)
+	return 0;
+      if (DECODE_WINDOW > decoder->z.avail_out
+	  && !decoder->output (decoder->userdata, decoder->window,
+	                       DECODE_WINDOW - decoder->z.avail_out))
+	return 0;
+    }
+  while (decoder->z.avail_in > 0 || decoder->z.avail_out == 0);
+  return 1;
+}
+
+#ifdef HAVE_LIBZSTD
+static int
+feed_zstd (struct decoder *decoder, const char *data, size_t size)
+{
+  ZSTD_inBuffer in = {data, size, 0};
+  ZSTD_outBuffer out;
+
+  /* Carry on while there is input, or the window filled up.  */
+  do
+    {
+      out.dst = decoder->window;
+      out.size = DECODE_WINDOW;
+      out.pos = 0;
+      decoder->zstd_hint = ZSTD_decompressStream (decoder->zstd, &out, &in);
+      if (ZSTD_isError (decoder->zstd_hint))
+	return 0;
+      if (out.pos > 0
+	  && !decoder->output (decoder->userdata, decoder->window, out.pos))
+	return 0;
+    }
+  while (in.pos < in.size || out.pos == out.size);
+  return 1;
+}
+#endif
+
+/* Decode the SIZE bytes at DATA, the next of the stream.  Returns zero if
+   they aren't of the encoding, or the output call-back aborted.  */
+int
+decoder_feed (struct decoder *decoder, const char *data, size_t size)
+{
+  switch (decoder->encoding)
+    {
+    case ENCODING_GZIP:
+      return feed_gzip (decoder, data, size);
+#ifdef HAVE_LIBZSTD
+    case ENCODING_ZSTD:
+      return feed_zstd (decoder, data, size);
+#endif
+    default:
+      return size == 0 || decoder->output (decoder->userdata, data, size);
+    }
+}
+
+/* Returns zero if the stream ended early.  */
+int
+decoder_finish (struct decoder *decoder)
+{
+  switch (decoder->encoding)
+    {
+    case ENCODING_GZIP:
+      return decoder->ended;
+#ifdef HAVE_LIBZSTD
+    case ENCODING_ZSTD:
+      return decoder->zstd_hint == 0;
+#endif
+    default:
+      return 1;
+    }
+}
+
+void
+decoder_free (struct decoder *decoder)
+{
+  if (!decoder)
+    return;
+  if (decoder->encoding == ENCODING_GZIP)
+    inflateEnd (&decoder->z);
+#ifdef HAVE_LIBZSTD
+  if (decoder->zstd)
+    ZSTD_freeDStream (decoder->zstd);
+#endif
+  free (decoder);
+}
+
+struct encoder
+{
+  enum encoding encoding;
+  const char *data;
+  size_t size, offset;
+  bool ended;
+  z_stream z;
+#ifdef HAVE_LIBZSTD
+  ZSTD_CStream *zstd;
+#endif
+};
+
+/* Return an encoder for ENCODING, at compression LEVEL, of the SIZE bytes
+   at DATA, which must stay put until it is freed.  Returns NULL if
+   ENCODING isn't supported.  */
+struct encoder *
+encoder_new (enum encoding encoding, int level, const char *data,
+             size_t size)
+{
+  struct encoder *encoder;
+
+  if (!encoding_supported (encoding))
+    return NULL;
+  encoder = x_calloc (1, sizeof (*encoder));
+  encoder->encoding = encoding;
+  encoder->data = data;
+  encoder->size = size;
+  switch (encoding)
+    {
+    case ENCODING_GZIP:
+      if (deflateInit2 (&encoder->z, level, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                        Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+	  free (encoder);
+	  return NULL;
+	}
+      encoder->z.next_in = (Bytef *)data;
+      encoder->z.avail_in = size;
+      break;
+#ifdef HAVE_LIBZSTD
+    case ENCODING_ZSTD:
+      encoder->zstd = ZSTD_createCStream ();
+      ZSTD_CCtx_setParameter (encoder->zstd, ZSTD_c_compressionLevel, level);
+      ZSTD_CCtx_setPledgedSrcSize (encoder->zstd, size);
+      break;
+#endif
+    default:
+      break;
+    }
+  return encoder;
+}
+
+/* Put up to SIZE more bytes of the encoded data in BUFFER.  Returns how
+   many, which is zero only at the end, or -1 on error.  */
+long
+encoder_read (struct encoder *encoder, char *buffer, size_t size)
+{
+  if (encoder->ended || size == 0)
+    return 0;
+  switch (encoder->encoding)
+    {
+    case ENCODING_GZIP:
+      {
+	int ret;
+
+	/* The input is all there, so it may as well be finished.  */
+	encoder->z.next_out = (Bytef *)buffer;
+	encoder->z.avail_out = size;
+	ret = deflate (&encoder->z, Z_FINISH);
+	if (ret == Z_STREAM_END)
+	  encoder->ended = true;
+	else if (ret != Z_OK || encoder->z.avail_out == size)
+	  return -1;
+	return size - encoder->z.avail_out;
+      }
+#ifdef HAVE_LIBZSTD
+    case ENCODING_ZSTD:
+      {
+	ZSTD_inBuffer in = {encoder->data, encoder->size, encoder->offset};
+	ZSTD_outBuffer out = {buffer, size, 0};
+	size_t remaining;
+
+	do
+	  {
+	    remaining = ZSTD_compressStream2 (encoder->zstd, &out, &in,
+	                                      ZSTD_e_end);
+	    if (ZSTD_isError (remaining))
+	      return -1;
+	  }
+	while (remaining != 0 && out.pos < out.size);
+	encoder->offset = in.pos;
+	if (remaining == 0)
+	  encoder->ended = true;
+	return out.pos;
+      }
+#endif
+    default:
+      {
+	size_t n = MIN (size, encoder->size - encoder->offset);
+
+	memcpy (buffer, encoder->data + encoder->offset, n);
+	encoder->offset += n;
+	encoder->ended = encoder->offset == encoder->size;
+	return n;
+      }
+    }
+}
+
+void
+encoder_free (struct encoder *encoder)
+{
+  if (!encoder)
+    return;
+  if (encoder->encoding == ENCODING_GZIP)
+    deflateEnd (&encoder->z);
+#ifdef HAVE_LIBZSTD
+  if (encoder->zstd)
+    ZSTD_freeCStream (encoder->zstd);
+#endif
+  free (encoder);
+}
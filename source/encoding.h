@@ -0,0 +1,55 @@
+/* Copyright (c) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The content encodings of parts sent to and from the server.  */
+enum encoding
+{
+  ENCODING_IDENTITY,
+  ENCODING_GZIP,
+  ENCODING_ZSTD,
+  ENCODING_COUNT
+};
+
+const char *encoding_name (enum encoding encoding);
+bool encoding_parse (const char *name, size_t len, enum encoding *encoding);
+bool encoding_supported (enum encoding encoding);
+
+/* Where a decoder puts what it decodes.  Returns zero to abort.  */
+typedef int (*decoder_output) (void *userdata, const char *data, size_t size);
+
+struct decoder;
+
+struct decoder *decoder_new (enum encoding encoding, decoder_output output,
+                             void *userdata);
+int decoder_feed (struct decoder *decoder, const char *data, size_t size);
+int decoder_finish (struct decoder *decoder);
+void decoder_free (struct decoder *decoder);
+
+struct encoder;
+
+struct encoder *encoder_new (enum encoding encoding, int level,
+                             const char *data, size_t size);
+long encoder_read (struct encoder *encoder, char *buffer, size_t size);
+void encoder_free (struct encoder *encoder);
+
+#endif
@@ -31,7 +31,7 @@
 
 #line 9 "envtoconfitems.gperf"
 struct env_to_conf_item;
-/* maximum key range = 42, duplicates = 0 */
+/* maximum key range = 46, duplicates = 0 */
 
 #ifdef __GNUC__
 __inline
@@ -45,32 +45,32 @@ envtoconfitems_hash (register const char *str, register unsigned int len)
 {
   static const unsigned char asso_values[] =
     {
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 30,  0,  0,  0,
-       5, 44, 25, 44,  5,  0,  0, 10, 30, 10,
-       5, 15, 20,  0, 10,  0, 44, 44, 44, 44,
-      15, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44, 44, 44, 44,
-      44, 44, 44, 44, 44, 44, 44
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58,  5, 10, 25, 13,
+      13, 58, 19, 15, 26, 24,  3, 11, 10, 31,
+      11,  3, 15,  3, 32,  5, 58, 58, 58, 58,
+      13, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+      58, 58, 58, 58, 58, 58, 58
     };
   register int hval = len;
 
@@ -100,81 +100,94 @@ envtoconfitems_get (register const char *str, register unsigned int len)
 {
   enum
     {
-      TOTAL_KEYWORDS = 29,
+      TOTAL_KEYWORDS = 35,
       MIN_WORD_LENGTH = 2,
-      MAX_WORD_LENGTH = 13,
-      MIN_HASH_VALUE = 2,
-      MAX_HASH_VALUE = 43
+      MAX_WORD_LENGTH = 16,
+      MIN_HASH_VALUE = 12,
+      MAX_HASH_VALUE = 57
     };
 
   static const struct env_to_conf_item wordlist[] =
     {
-      {"",""}, {"",""},
+      {"",""}, {"",""}, {"",""}, {"",""}, {"",""}, {"",""},
+      {"",""}, {"",""}, {"",""}, {"",""}, {"",""}, {"",""},
 #line 12 "envtoconfitems.gperf"
       {"CC", "compiler"},
-#line 39 "envtoconfitems.gperf"
-      {"KEY", "cloud_key"},
-#line 16 "envtoconfitems.gperf"
-      {"CPP2", "run_second_cpp"},
 #line 35 "envtoconfitems.gperf"
       {"UMASK", "umask"},
-#line 18 "envtoconfitems.gperf"
-      {"DIRECT", "direct_mode"},
-#line 19 "envtoconfitems.gperf"
-      {"DISABLE", "disable"},
-#line 14 "envtoconfitems.gperf"
-      {"COMPRESS", "compression"},
+#line 16 "envtoconfitems.gperf"
+      {"CPP2", "run_second_cpp"},
 #line 28 "envtoconfitems.gperf"
       {"PATH", "path"},
-#line 38 "envtoconfitems.gperf"
-      {"CLOUD_MODE", "cloud_mode"},
+#line 32 "envtoconfitems.gperf"
+      {"SLOPPINESS", "sloppiness"},
+      {"",""}, {"",""}, {"",""}, {"",""},
+#line 14 "envtoconfitems.gperf"
+      {"COMPRESS", "compression"},
 #line 37 "envtoconfitems.gperf"
       {"SERVER", "cloud_server"},
-#line 24 "envtoconfitems.gperf"
-      {"LOGFILE", "log_file"},
+#line 36 "envtoconfitems.gperf"
+      {"UNIFY", "unify"},
+#line 45 "envtoconfitems.gperf"
+      {"SPOOL_SIZE", "spool_size"},
+#line 11 "envtoconfitems.gperf"
+      {"BASEDIR", "base_dir"},
 #line 15 "envtoconfitems.gperf"
       {"COMPRESSLEVEL", "compression_level"},
+#line 39 "envtoconfitems.gperf"
+      {"KEY", "cloud_key"},
+#line 21 "envtoconfitems.gperf"
+      {"EXTRAFILES", "extra_files_to_hash"},
+      {"",""},
+#line 27 "envtoconfitems.gperf"
+      {"NLEVELS", "cache_dir_levels"},
+      {"",""},
 #line 17 "envtoconfitems.gperf"
       {"CACHE_DIR", "cache_dir"},
+#line 38 "envtoconfitems.gperf"
+      {"CLOUD_MODE", "cloud_mode"},
+#line 30 "envtoconfitems.gperf"
+      {"READONLY", "read_only"},
+      {"",""},
+#line 24 "envtoconfitems.gperf"
+      {"LOGFILE", "log_file"},
+#line 40 "envtoconfitems.gperf"
+      {"CLOUD_DEADLINE", "cloud_deadline"},
+#line 22 "envtoconfitems.gperf"
+      {"HARDLINK", "hard_link"},
+#line 23 "envtoconfitems.gperf"
+      {"HASHDIR", "hash_dir"},
 #line 33 "envtoconfitems.gperf"
       {"STATS", "stats"},
+      {"",""},
+#line 19 "envtoconfitems.gperf"
+      {"DISABLE", "disable"},
 #line 29 "envtoconfitems.gperf"
       {"PREFIX", "prefix_command"},
-#line 34 "envtoconfitems.gperf"
-      {"TEMPDIR", "temporary_dir"},
-#line 13 "envtoconfitems.gperf"
-      {"COMPILERCHECK", "compiler_check"},
-#line 20 "envtoconfitems.gperf"
-      {"EXTENSION", "cpp_extension"},
-#line 36 "envtoconfitems.gperf"
-      {"UNIFY", "unify"},
-      {"",""},
 #line 26 "envtoconfitems.gperf"
       {"MAXSIZE", "max_size"},
 #line 25 "envtoconfitems.gperf"
       {"MAXFILES", "max_files"},
-      {"",""},
-#line 32 "envtoconfitems.gperf"
-      {"SLOPPINESS", "sloppiness"},
-      {"",""},
+#line 42 "envtoconfitems.gperf"
+      {"HEDGE_FRACTION", "hedge_fraction"},
 #line 31 "envtoconfitems.gperf"
       {"RECACHE", "recache"},
-      {"",""}, {"",""}, {"",""}, {"",""},
-#line 23 "envtoconfitems.gperf"
-      {"HASHDIR", "hash_dir"},
-#line 30 "envtoconfitems.gperf"
-      {"READONLY", "read_only"},
-      {"",""}, {"",""}, {"",""},
-#line 11 "envtoconfitems.gperf"
-      {"BASEDIR", "base_dir"},
-      {"",""}, {"",""},
-#line 21 "envtoconfitems.gperf"
-      {"EXTRAFILES", "extra_files_to_hash"},
+#line 43 "envtoconfitems.gperf"
+      {"HEDGE_PERCENTILE", "hedge_percentile"},
+#line 13 "envtoconfitems.gperf"
+      {"COMPILERCHECK", "compiler_check"},
       {"",""},
-#line 27 "envtoconfitems.gperf"
-      {"NLEVELS", "cache_dir_levels"},
-#line 22 "envtoconfitems.gperf"
-      {"HARDLINK", "hard_link"}
+#line 41 "envtoconfitems.gperf"
+      {"COSTS_LOG", "costs_log"},
+#line 34 "envtoconfitems.gperf"
+      {"TEMPDIR", "temporary_dir"},
+#line 20 "envtoconfitems.gperf"
+      {"EXTENSION", "cpp_extension"},
+      {"",""}, {"",""},
+#line 18 "envtoconfitems.gperf"
+      {"DIRECT", "direct_mode"},
+#line 44 "envtoconfitems.gperf"
+      {"INFLIGHT_TIMEOUT", "inflight_timeout"}
     };
 
   if (len <= MAX_WORD_LENGTH && len >= MIN_WORD_LENGTH)
@@ -191,4 +204,4 @@ envtoconfitems_get (register const char *str, register unsigned int len)
     }
   return 0;
 }
-static const size_t ENVTOCONFITEMS_TOTAL_KEYWORDS = 29;
+static const size_t ENVTOCONFITEMS_TOTAL_KEYWORDS = 35;
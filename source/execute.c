@@ -20,8 +20,6 @@
 
 #include "ccache.h"
 
-extern struct conf *conf;
-
 static char *
 find_executable_in_path(const char *name, const char *exclude_name, char *path);
 
@@ -172,19 +170,24 @@ win32execute(char *path, char **argv, int doreturn,
 #else
 
 /*
-  execute a compiler backend, capturing all output to the given paths
-  the full path to the compiler to run is in argv[0]
+  start a compiler backend, capturing all output to the given paths, and
+  return its pid. If own_group is true, the child leads a new process
+  group, so that it can be stopped along with any children of its own.
 */
-int
-execute_fd(char **argv, const char *path_stdout, int fd_stdout, const char *path_stderr, int fd_stderr, char **env_vars)
+static pid_t
+spawn_fd(char **argv, const char *path_stdout, int fd_stdout,
+         const char *path_stderr, int fd_stderr, char **env_vars,
+         bool own_group)
 {
 	pid_t pid;
-	int status;
 
 	pid = fork();
 	if (pid == -1) fatal("Failed to fork: %s", strerror(errno));
 
 	if (pid == 0) {
+		if (own_group) {
+			setpgid(0, 0);
+		}
 		if (path_stdout) {
                         tmp_unlink(path_stdout);
                         fd_stdout = open(path_stdout, O_WRONLY|O_CREAT|O_TRUNC|O_EXCL|O_BINARY, 0666);
@@ -203,25 +206,37 @@ execute_fd(char **argv, const char *path_stdout, int fd_stdout, const char *path
                 }
 		dup2(fd_stderr, 2);
 
-		close(fd_stdout);
-		if (fd_stderr != fd_stdout)
+		if (fd_stdout > 2)
+		  close(fd_stdout);
+		if (fd_stderr > 2 && fd_stderr != fd_stdout)
 		  close(fd_stderr);
 
+		/* A NAME=VALUE entry sets a variable; a bare NAME unsets it.  */
 		if (env_vars)
 		  {
 		    int i;
 		    for (i = 0; env_vars[i]; i++)
-		      putenv(env_vars[i]);
+		      if (strchr(env_vars[i], '='))
+			putenv(env_vars[i]);
+		      else
+			x_unsetenv(env_vars[i]);
 		  }
 
 		cc_log_argv("Executing ", argv);
 		exit(execv(argv[0], argv));
 	}
 
-	if (waitpid(pid, &status, 0) != pid) {
-		fatal("waitpid failed: %s", strerror(errno));
+	if (own_group) {
+		/* Also here, in case we want to signal the group before the child
+		   has got round to it. */
+		setpgid(pid, pid);
 	}
+	return pid;
+}
 
+static int
+exit_code(int status)
+{
 	if (WEXITSTATUS(status) == 0 && WIFSIGNALED(status)) {
 		return -1;
 	}
@@ -229,6 +244,57 @@ execute_fd(char **argv, const char *path_stdout, int fd_stdout, const char *path
 	return WEXITSTATUS(status);
 }
 
+/*
+  execute a compiler backend, capturing all output to the given paths
+  the full path to the compiler to run is in argv[0]
+*/
+int
+execute_fd(char **argv, const char *path_stdout, int fd_stdout, const char *path_stderr, int fd_stderr, char **env_vars)
+{
+	pid_t pid;
+	int status;
+
+	pid = spawn_fd(argv, path_stdout, fd_stdout, path_stderr, fd_stderr,
+	               env_vars, false);
+	if (waitpid(pid, &status, 0) != pid) {
+		fatal("waitpid failed: %s", strerror(errno));
+	}
+
+	return exit_code(status);
+}
+
+/*
+  start a compiler backend like execute_fd, but return its pid without
+  waiting for it; the child leads its own process group, so killpg can stop
+  it. Collect it with execute_poll.
+*/
+pid_t
+execute_async(char **argv, const char *path_stdout, const char *path_stderr,
+              char **env_vars)
+{
+	return spawn_fd(argv, path_stdout, 0, path_stderr, 0, env_vars, true);
+}
+
+/*
+  collect the exit code of a child started by execute_async, waiting for it
+  only if block is true. Returns true if the child has finished.
+*/
+bool
+execute_poll(pid_t pid, bool block, int *status)
+{
+	int wstatus;
+	pid_t ret = waitpid(pid, &wstatus, block ? 0 : WNOHANG);
+
+	if (ret == 0) {
+		return false;
+	}
+	if (ret != pid) {
+		fatal("waitpid failed: %s", strerror(errno));
+	}
+	*status = exit_code(wstatus);
+	return true;
+}
+
 int
 execute(char **argv, const char *path_stdout, const char *path_stderr)
 {
@@ -28,7 +28,10 @@ struct nullary_exit_function {
 	void (*function)(void);
 };
 
-static struct exit_function *exit_functions;
+static THREAD_LOCAL struct exit_function *exit_functions;
+
+/* Where x_exit returns to instead of exiting, if anywhere. */
+static THREAD_LOCAL jmp_buf *return_point;
 
 static void
 call_nullary_exit_function(void *context)
@@ -39,11 +42,17 @@ call_nullary_exit_function(void *context)
 }
 
 /*
- * Initialize exit functions. Must be called once before exitfn_add* are used.
+ * Initialize exit functions. Must be called before exitfn_add* are used; later
+ * calls, from any thread, do nothing.
  */
 void
 exitfn_init(void)
 {
+	static int initialized;
+
+	if (__sync_lock_test_and_set(&initialized, 1)) {
+		return;
+	}
 	if (atexit(exitfn_call) != 0) {
 		fatal("atexit failed: %s", strerror(errno));
 	}
@@ -101,3 +110,27 @@ exitfn_call(void)
 	}
 	exit_functions = NULL;
 }
+
+/*
+ * Make x_exit return to POINT (with setjmp returning the exit status plus
+ * one) instead of exiting, or exit again if POINT is NULL.
+ */
+void
+exitfn_set_return_point(jmp_buf *point)
+{
+	return_point = point;
+}
+
+/*
+ * Call the added functions and exit with STATUS, or return to the caller's
+ * return point; see exitfn_set_return_point.
+ */
+void
+x_exit(int status)
+{
+	if (return_point) {
+		exitfn_call();
+		longjmp(*return_point, status + 1);
+	}
+	exit(status);
+}
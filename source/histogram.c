@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Fixed-size log-linear histograms, in the style of HdrHistogram, used for
+ * the daemon's latency statistics.
+ *
+ * Values below HISTOGRAM_SUB_BUCKETS get a bucket each. Above that, every
+ * power of two is divided into HISTOGRAM_SUB_BUCKETS / 2 equal buckets, so
+ * recording is O(1), memory use is constant, and percentiles are accurate to
+ * within 1/16 of the true value however long the tail is.
+ */
+
+#include "ccache.h"
+#include "histogram.h"
+
+#define HALF_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+
+static unsigned
+highest_bit(uint64_t value)
+{
+	unsigned bit = 0;
+	while (value >>= 1) {
+		bit++;
+	}
+	return bit;
+}
+
+void
+histogram_reset(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+/*
+ * Return the bucket that value is counted in.
+ */
+size_t
+histogram_bucket_index(uint64_t value)
+{
+	unsigned bit, shift;
+
+	if (value < HISTOGRAM_SUB_BUCKETS) {
+		return value;
+	}
+	bit = highest_bit(value);
+	if (bit >= HISTOGRAM_MAX_BITS) {
+		return HISTOGRAM_BUCKETS - 1;
+	}
+	shift = bit - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+	return HISTOGRAM_SUB_BUCKETS
+	       + (bit - HISTOGRAM_SUB_BUCKET_BITS) * HALF_BUCKETS
+	       + ((value >> shift) - HALF_BUCKETS);
+}
+
+/*
+ * Return the smallest value counted in bucket index.
+ */
+uint64_t
+histogram_bucket_low(size_t index)
+{
+	size_t k;
+	unsigned shift;
+
+	if (index < HISTOGRAM_SUB_BUCKETS) {
+		return index;
+	}
+	k = index - HISTOGRAM_SUB_BUCKETS;
+	shift = k / HALF_BUCKETS + 1;
+	return (uint64_t)(k % HALF_BUCKETS + HALF_BUCKETS) << shift;
+}
+
+/*
+ * Return the largest value counted in bucket index. The last bucket is
+ * unbounded.
+ */
+uint64_t
+histogram_bucket_high(size_t index)
+{
+	if (index >= HISTOGRAM_BUCKETS - 1) {
+		return UINT64_MAX;
+	}
+	return histogram_bucket_low(index + 1) - 1;
+}
+
+void
+histogram_record(struct histogram *h, uint64_t value)
+{
+	if (h->count == 0 || value < h->min) {
+		h->min = value;
+	}
+	if (value > h->max) {
+		h->max = value;
+	}
+	h->count++;
+	h->sum += value;
+	h->buckets[histogram_bucket_index(value)]++;
+}
+
+uint64_t
+histogram_mean(const struct histogram *h)
+{
+	return h->count ? h->sum / h->count : 0;
+}
+
+/*
+ * Return a value that at least percentile percent of the recorded values do
+ * not exceed. The answer is the top of the bucket in question, clamped to the
+ * recorded extremes, so it errs on the side of pessimism.
+ */
+uint64_t
+histogram_percentile(const struct histogram *h, double percentile)
+{
+	uint64_t target, seen = 0;
+	double exact;
+	size_t i;
+
+	if (h->count == 0) {
+		return 0;
+	}
+	if (percentile <= 0) {
+		return h->min;
+	}
+	if (percentile >= 100) {
+		return h->max;
+	}
+	exact = percentile / 100 * h->count;
+	target = (uint64_t)exact;
+	if (target < exact || target == 0) {
+		target++;
+	}
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target) {
+			uint64_t value = histogram_bucket_high(i);
+			if (value > h->max) {
+				value = h->max;
+			}
+			if (value < h->min) {
+				value = h->min;
+			}
+			return value;
+		}
+	}
+	return h->max;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+ * Each power of two is split into this many linear sub-buckets, which bounds
+ * the relative error of a recorded value to 1/16.
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+
+/* Values of 2^HISTOGRAM_MAX_BITS and above are recorded in the last bucket. */
+#define HISTOGRAM_MAX_BITS 40
+
+#define HISTOGRAM_BUCKETS \
+	(HISTOGRAM_SUB_BUCKETS \
+	 + (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS) \
+	   * (HISTOGRAM_SUB_BUCKETS / 2))
+
+struct histogram {
+	uint64_t count;   /* number of recorded values */
+	uint64_t sum;     /* sum of recorded values */
+	uint64_t min;     /* smallest recorded value */
+	uint64_t max;     /* largest recorded value */
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_reset(struct histogram *h);
+void histogram_record(struct histogram *h, uint64_t value);
+uint64_t histogram_mean(const struct histogram *h);
+uint64_t histogram_percentile(const struct histogram *h, double percentile);
+size_t histogram_bucket_index(uint64_t value);
+uint64_t histogram_bucket_low(size_t index);
+uint64_t histogram_bucket_high(size_t index);
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The facts about the host that go with every compile posted to the server:
+ * the kernel, the CPU model, how many cores and threads it has, and how much
+ * memory.
+ *
+ * None of them change until the machine is rebooted, but finding them means
+ * reading /proc/cpuinfo, which has a stanza per thread, so they are kept in
+ * a small file in the cache directory with the boot ID they were found
+ * under. A cache directory shared between machines just has the file
+ * rewritten whenever another one posts.
+ */
+
+#include "ccache.h"
+#include "hostinfo.h"
+
+#include <sys/utsname.h>
+
+#define HEADER "cs host 1"
+
+/* The random ID the kernel picks at boot; NULL if there isn't one. */
+static char *
+boot_id(void)
+{
+	char *id = read_text_file("/proc/sys/kernel/random/boot_id", 0);
+
+	if (id) {
+		id[strcspn(id, "\n")] = '\0';
+		if (id[0] == '\0') {
+			free(id);
+			id = NULL;
+		}
+	}
+	return id;
+}
+
+/* Find the facts afresh, from uname and the given /proc files. */
+void
+host_info_collect(struct host_info *info, const char *cpuinfo,
+                  const char *meminfo)
+{
+	struct utsname host;
+	char buffer[400];
+	FILE *f;
+
+	memset(info, 0, sizeof(*info));
+	if (uname(&host) == 0) {
+		info->sysname = x_strdup(host.sysname);
+		info->release = x_strdup(host.release);
+		info->version = x_strdup(host.version);
+		info->machine = x_strdup(host.machine);
+	} else {
+		info->sysname = x_strdup("unknown");
+		info->release = x_strdup("unknown");
+		info->version = x_strdup("unknown");
+		info->machine = x_strdup("unknown");
+	}
+
+	f = fopen(cpuinfo, "r");
+	if (f) {
+		while (fgets(buffer, sizeof(buffer), f)) {
+			char *model = strchr(buffer, ':');
+			if (!str_startswith(buffer, "model name")) {
+				sscanf(buffer, "cpu cores : %d",
+				       &info->cpu_core_count);
+				continue;
+			}
+			info->cpu_thread_count++;
+			if (!info->cpu_model && model && model[1] == ' ') {
+				model += 2;
+				model[strcspn(model, "\r\n")] = '\0';
+				info->cpu_model = x_strdup(model);
+			}
+		}
+		fclose(f);
+	}
+	if (!info->cpu_model) {
+		info->cpu_model = x_strdup("unknown");
+	}
+
+	f = fopen(meminfo, "r");
+	if (f) {
+		while (fgets(buffer, sizeof(buffer), f)) {
+			if (str_startswith(buffer, "MemTotal:")) {
+				char *p = buffer + strlen("MemTotal:");
+				size_t digits;
+				p += strspn(p, " ");
+				digits = strspn(p, "0123456789");
+				if (digits > 0) {
+					info->mem = x_strndup(p, digits);
+				}
+				break;
+			}
+		}
+		fclose(f);
+	}
+	if (!info->mem) {
+		info->mem = x_strdup("unknown");
+	}
+}
+
+/* Take the next line of *text, or return NULL if there are no more. */
+static char *
+next_line(char **text)
+{
+	char *line = *text, *end;
+
+	if (!line) {
+		return NULL;
+	}
+	end = strchr(line, '\n');
+	if (end) {
+		*end = '\0';
+		*text = end + 1;
+	} else {
+		*text = NULL;
+	}
+	return line;
+}
+
+/*
+ * Read the facts kept at path, if they were found under boot_id. Returns
+ * false if they weren't, or there are none.
+ */
+bool
+host_info_read(const char *path, const char *boot_id,
+               struct host_info *info)
+{
+	char *data = read_text_file(path, 0), *text = data;
+	char *lines[10];
+	size_t i;
+
+	if (!data) {
+		return false;
+	}
+	for (i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+		lines[i] = next_line(&text);
+		if (!lines[i]) {
+			free(data);
+			return false;
+		}
+	}
+	if (!str_eq(lines[0], HEADER) || !str_eq(lines[1], boot_id)) {
+		free(data);
+		return false;
+	}
+	info->sysname = x_strdup(lines[2]);
+	info->release = x_strdup(lines[3]);
+	info->version = x_strdup(lines[4]);
+	info->machine = x_strdup(lines[5]);
+	info->cpu_model = x_strdup(lines[6]);
+	info->cpu_core_count = atoi(lines[7]);
+	info->cpu_thread_count = atoi(lines[8]);
+	info->mem = x_strdup(lines[9]);
+	free(data);
+	return true;
+}
+
+/* Keep the facts at path, as found under boot_id. */
+void
+host_info_write(const char *path, const char *boot_id,
+                const struct host_info *info)
+{
+	char *tmp_file = format("%s.tmp.%s", path, tmp_string());
+	FILE *f = fopen(tmp_file, "w");
+	bool ok;
+
+	if (!f) {
+		cc_log("Failed to open %s: %s", tmp_file, strerror(errno));
+		free(tmp_file);
+		return;
+	}
+	ok = fprintf(f, "%s\n%s\n%s\n%s\n%s\n%s\n%s\n%d\n%d\n%s\n",
+	             HEADER, boot_id, info->sysname, info->release,
+	             info->version, info->machine, info->cpu_model,
+	             info->cpu_core_count, info->cpu_thread_count,
+	             info->mem) >= 0;
+	if (fclose(f) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		cc_log("Failed to write %s", tmp_file);
+		tmp_unlink(tmp_file);
+	} else {
+		x_rename(tmp_file, path);
+	}
+	free(tmp_file);
+}
+
+/*
+ * Get the facts about this host: from the file at path, if they were found
+ * since the last boot, or else afresh, keeping them there for next time.
+ */
+void
+host_info_get(const char *path, struct host_info *info)
+{
+	char *id = boot_id();
+
+	if (id && host_info_read(path, id, info)) {
+		free(id);
+		return;
+	}
+	host_info_collect(info, "/proc/cpuinfo", "/proc/meminfo");
+	if (id) {
+		host_info_write(path, id, info);
+		free(id);
+	}
+}
+
+void
+host_info_free(struct host_info *info)
+{
+	free(info->sysname);
+	free(info->release);
+	free(info->version);
+	free(info->machine);
+	free(info->cpu_model);
+	free(info->mem);
+	memset(info, 0, sizeof(*info));
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef HOSTINFO_H
+#define HOSTINFO_H
+
+#include <stdbool.h>
+
+/* What the server is told about the machine a compile ran on. */
+struct host_info {
+	char *sysname;
+	char *release;
+	char *version;
+	char *machine;
+	char *cpu_model;
+	int cpu_core_count;
+	int cpu_thread_count;
+	char *mem;             /* MemTotal, in kB, as /proc/meminfo has it */
+};
+
+void host_info_collect(struct host_info *info, const char *cpuinfo,
+                       const char *meminfo);
+bool host_info_read(const char *path, const char *boot_id,
+                    struct host_info *info);
+void host_info_write(const char *path, const char *boot_id,
+                     const struct host_info *info);
+void host_info_get(const char *path, struct host_info *info);
+void host_info_free(struct host_info *info);
+
+#endif
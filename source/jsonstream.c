@@ -0,0 +1,627 @@
+/* Copyright (c) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* A streaming JSON writer and a pull parser, for the client's side of the
+   conversation with the server.
+
+   The client describes every compile it does to the server, and reads the
+   short replies.  Building a json-c tree for that costs an allocation or
+   two per field, all to be thrown away once the text is made.  The writer
+   puts the text straight into one buffer instead, and the reader picks
+   the fields it wants out of a reply as it goes, keeping nothing but the
+   last string.  */
+
+#include "ccache.h"
+#include "jsonstream.h"
+
+/* Make room for SIZE more bytes, and the terminator, in the buffer of W.  */
+static void
+reserve (struct json_writer *w, size_t size)
+{
+  if (w->length + size + 1 <= w->allocated)
+    return;
+  w->allocated = 2 * w->allocated;
+  if (w->allocated < w->length + size + 1)
+    w->allocated = w->length + size + 1;
+  if (w->allocated < 256)
+    w->allocated = 256;
+  w->buffer = x_realloc (w->buffer, w->allocated);
+}
+
+static void
+append (struct json_writer *w, const char *data, size_t size)
+{
+  reserve (w, size);
+  memcpy (w->buffer + w->length, data, size);
+  w->length += size;
+  w->buffer[w->length] = '\0';
+}
+
+/* Put in the comma, if any, that goes before the next key or value.  */
+static void
+separate (struct json_writer *w)
+{
+  if (w->comma)
+    append (w, ",", 1);
+}
+
+void
+jw_init (struct json_writer *w)
+{
+  w->buffer = NULL;
+  w->length = w->allocated = 0;
+  w->comma = false;
+  reserve (w, 0);
+  w->buffer[0] = '\0';
+}
+
+/* Return the text written, which the caller frees.  */
+char *
+jw_finish (struct json_writer *w)
+{
+  char *buffer = w->buffer;
+
+  w->buffer = NULL;
+  w->length = w->allocated = 0;
+  return buffer;
+}
+
+void
+jw_begin_object (struct json_writer *w)
+{
+  separate (w);
+  append (w, "{", 1);
+  w->comma = false;
+}
+
+void
+jw_end_object (struct json_writer *w)
+{
+  append (w, "}", 1);
+  w->comma = true;
+}
+
+void
+jw_begin_array (struct json_writer *w)
+{
+  separate (w);
+  append (w, "[", 1);
+  w->comma = false;
+}
+
+void
+jw_end_array (struct json_writer *w)
+{
+  append (w, "]", 1);
+  w->comma = true;
+}
+
+/* Write S as a JSON string, without a separator.  */
+static void
+write_string (struct json_writer *w, const char *s)
+{
+  static const char hex[] = "0123456789abcdef";
+
+  append (w, "\"", 1);
+  while (*s)
+    {
+      char escape[4];
+      size_t n = 0;
+
+      /* Copy what needs no escaping in one go.  */
+      while ((unsigned char)s[n] >= 0x20 && s[n] != '"' && s[n] != '\\')
+	n++;
+      append (w, s, n);
+      s += n;
+      if (!*s)
+	break;
+
+      escape[0] = '\\';
+      escape[1] = *s;
+      n = 2;
+      switch (*s)
+	{
+	case '"':
+	case '\\':
+	  break;
+	case '\b':
+	  escape[1] = 'b';
+	  break;
+	case '\f':
+	  escape[1] = 'f';
+	  break;
+	case '\n':
+	  escape[1] = 'n';
+	  break;
+	case '\r':
+	  escape[1] = 'r';
+	  break;
+	case '\t':
+	  escape[1] = 't';
+	  break;
+	default:
+	  escape[1] = 'u';
+	  append (w, escape, 2);
+	  escape[0] = '0';
+	  escape[1] = '0';
+	  escape[2] = hex[(unsigned char)*s >> 4];
+	  escape[3] = hex[*s & 0xf];
+	  n = 4;
+	  break;
+	}
+      append (w, escape, n);
+      s++;
+    }
+  append (w, "\"", 1);
+}
+
+void
+jw_key (struct json_writer *w, const char *key)
+{
+  separate (w);
+  write_string (w, key);
+  append (w, ":", 1);
+  w->comma = false;
+}
+
+/* Write the string S, or null if it is NULL.  */
+void
+jw_string (struct json_writer *w, const char *s)
+{
+  separate (w);
+  if (s)
+    write_string (w, s);
+  else
+    append (w, "null", 4);
+  w->comma = true;
+}
+
+void
+jw_int (struct json_writer *w, int64_t n)
+{
+  char digits[24];
+
+  separate (w);
+  append (w, digits, snprintf (digits, sizeof (digits), "%" PRId64, n));
+  w->comma = true;
+}
+
+void
+jw_bool (struct json_writer *w, bool b)
+{
+  separate (w);
+  if (b)
+    append (w, "true", 4);
+  else
+    append (w, "false", 5);
+  w->comma = true;
+}
+
+/* Write JSON, a value that is already JSON text.  */
+void
+jw_raw (struct json_writer *w, const char *json)
+{
+  separate (w);
+  append (w, json, strlen (json));
+  w->comma = true;
+}
+
+void
+jw_key_string (struct json_writer *w, const char *key, const char *s)
+{
+  jw_key (w, key);
+  jw_string (w, s);
+}
+
+void
+jw_key_int (struct json_writer *w, const char *key, int64_t n)
+{
+  jw_key (w, key);
+  jw_int (w, n);
+}
+
+void
+jw_key_bool (struct json_writer *w, const char *key, bool b)
+{
+  jw_key (w, key);
+  jw_bool (w, b);
+}
+
+/* What a reader may see next.  */
+enum
+{
+  EXPECT_VALUE,
+  EXPECT_VALUE_OR_END,     /* Just inside an array.  */
+  EXPECT_KEY,
+  EXPECT_KEY_OR_END,       /* Just inside an object.  */
+  EXPECT_COMMA_OR_END,
+  EXPECT_NOTHING,          /* After the whole value.  */
+  EXPECT_ERROR
+};
+
+/* The deepest nesting a reader follows.  */
+#define MAX_DEPTH 64
+
+/* Read LENGTH bytes of TEXT, which need not be NUL-terminated.  */
+void
+jr_init (struct json_reader *r, const char *text, size_t length)
+{
+  memset (r, 0, sizeof (*r));
+  r->next = text;
+  r->end = text + length;
+  r->expect = EXPECT_VALUE;
+}
+
+void
+jr_free (struct json_reader *r)
+{
+  free (r->string);
+  r->string = NULL;
+  r->allocated = 0;
+}
+
+static void
+skip_space (struct json_reader *r)
+{
+  while (r->next < r->end
+         && (*r->next == ' ' || *r->next == '\t' || *r->next == '\n'
+             || *r->next == '\r'))
+    r->next++;
+}
+
+static void
+append_string (struct json_reader *r, const char *data, size_t size)
+{
+  if (r->length + size + 1 > r->allocated)
+    {
+      r->allocated = 2 * (r->length + size + 1);
+      r->string = x_realloc (r->string, r->allocated);
+    }
+  memcpy (r->string + r->length, data, size);
+  r->length += size;
+  r->string[r->length] = '\0';
+}
+
+/* Read four hex digits.  Returns -1 if they aren't.  */
+static long
+read_hex4 (struct json_reader *r)
+{
+  long value = 0;
+  int i;
+
+  if (r->end - r->next < 4)
+    return -1;
+  for (i = 0; i < 4; i++)
+    {
+      char c = *r->next++;
+      value <<= 4;
+      if (c >= '0' && c <= '9')
+	value |= c - '0';
+      else if (c >= 'a' && c <= 'f')
+	value |= c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F')
+	value |= c - 'A' + 10;
+      else
+	return -1;
+    }
+  return value;
+}
+
+/* Append code point C, in UTF-8.  */
+static void
+append_utf8 (struct json_reader *r, unsigned long c)
+{
+  char utf8[4];
+  size_t n;
+
+  if (c < 0x80)
+    {
+      utf8[0] = c;
+      n = 1;
+    }
+  else if (c < 0x800)
+    {
+      utf8[0] = 0xc0 | (c >> 6);
+      utf8[1] = 0x80 | (c & 0x3f);
+      n = 2;
+    }
+  else if (c < 0x10000)
+    {
+      utf8[0] = 0xe0 | (c >> 12);
+      utf8[1] = 0x80 | ((c >> 6) & 0x3f);
+      utf8[2] = 0x80 | (c & 0x3f);
+      n = 3;
+    }
+  else
+    {
+      utf8[0] = 0xf0 | (c >> 18);
+      utf8[1] = 0x80 | ((c >> 12) & 0x3f);
+      utf8[2] = 0x80 | ((c >> 6) & 0x3f);
+      utf8[3] = 0x80 | (c & 0x3f);
+      n = 4;
+    }
+  append_string (r, utf8, n);
+}
+
+/* Read the string that starts at the next byte, its opening quote, into
+   the string of R.  Returns false if it isn't a valid one.  */
+static bool
+read_string (struct json_reader *r)
+{
+  r->length = 0;
+  append_string (r, "", 0);
+  r->next++;
+  while (r->next < r->end)
+    {
+      const char *start = r->next;
+      long c, low;
+
+      while (r->next < r->end && *r->next != '"' && *r->next != '\\'
+             && (unsigned char)*r->next >= 0x20)
+	r->next++;
+      append_string (r, start, r->next - start);
+      if (r->next == r->end || (unsigned char)*r->next < 0x20)
+	return false;
+      if (*r->next++ == '"')
+	return true;
+
+      if (r->next == r->end)
+	return false;
+      switch (*r->next++)
+	{
+	case '"':
+	  append_string (r, "\"", 1);
+	  break;
+	case '\\':
+	  append_string (r, "\\", 1);
+	  break;
+	case '/':
+	  append_string (r, "/", 1);
+	  break;
+	case 'b':
+	  append_string (r, "\b", 1);
+	  break;
+	case 'f':
+	  append_string (r, "\f", 1);
+	  break;
+	case 'n':
+	  append_string (r, "\n", 1);
+	  break;
+	case 'r':
+	  append_string (r, "\r", 1);
+	  break;
+	case 't':
+	  append_string (r, "\t", 1);
+	  break;
+	case 'u':
+	  c = read_hex4 (r);
+	  if (c < 0 || (c >= 0xdc00 && c < 0xe000))
+	    return false;
+	  if (c >= 0xd800 && c < 0xdc00)
+	    {
+	      /* The high half of a surrogate pair.  */
+	      if (r->end - r->next < 2 || r->next[0] != '\\'
+		  || r->next[1] != 'u')
+		return false;
+	      r->next += 2;
+	      low = read_hex4 (r);
+	      if (low < 0xdc00 || low >= 0xe000)
+		return false;
+	      c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+	    }
+	  append_utf8 (r, c);
+	  break;
+	default:
+	  return false;
+	}
+    }
+  return false;
+}
+
+/* Read the number that starts at the next byte.  */
+static bool
+read_number (struct json_reader *r)
+{
+  const char *start = r->next;
+  char text[64];
+
+  if (r->next < r->end && *r->next == '-')
+    r->next++;
+  if (r->next == r->end || *r->next < '0' || *r->next > '9')
+    return false;
+  while (r->next < r->end && *r->next >= '0' && *r->next <= '9')
+    r->next++;
+  r->integer = true;
+  if (r->next < r->end && *r->next == '.')
+    {
+      r->integer = false;
+      r->next++;
+      while (r->next < r->end && *r->next >= '0' && *r->next <= '9')
+	r->next++;
+    }
+  if (r->next < r->end && (*r->next == 'e' || *r->next == 'E'))
+    {
+      r->integer = false;
+      r->next++;
+      if (r->next < r->end && (*r->next == '+' || *r->next == '-'))
+	r->next++;
+      while (r->next < r->end && *r->next >= '0' && *r->next <= '9')
+	r->next++;
+    }
+  if ((size_t)(r->next - start) >= sizeof (text))
+    return false;
+  memcpy (text, start, r->next - start);
+  text[r->next - start] = '\0';
+  if (r->integer)
+    r->number = strtoll (text, NULL, 10);
+  else
+    r->number = strtod (text, NULL);
+  return true;
+}
+
+/* Read the literal WORD, the next bytes.  */
+static bool
+read_literal (struct json_reader *r, const char *word)
+{
+  size_t len = strlen (word);
+
+  if ((size_t)(r->end - r->next) < len || memcmp (r->next, word, len) != 0)
+    return false;
+  r->next += len;
+  return true;
+}
+
+/* Note that a value has been read, and return TOKEN.  */
+static enum json_token
+value_read (struct json_reader *r, enum json_token token)
+{
+  r->expect = r->depth > 0 ? EXPECT_COMMA_OR_END : EXPECT_NOTHING;
+  return token;
+}
+
+static enum json_token
+reader_error (struct json_reader *r)
+{
+  r->expect = EXPECT_ERROR;
+  return JT_ERROR;
+}
+
+/* Return the next token of R.  Once there is an error, there is nothing
+   but.  */
+enum json_token
+jr_next (struct json_reader *r)
+{
+  bool in_object = r->depth > 0 && (r->objects >> (r->depth - 1)) & 1;
+  char c;
+
+  skip_space (r);
+  switch (r->expect)
+    {
+    case EXPECT_ERROR:
+      return JT_ERROR;
+    case EXPECT_NOTHING:
+      return r->next == r->end ? JT_END : reader_error (r);
+    case EXPECT_COMMA_OR_END:
+      if (r->next == r->end)
+	return reader_error (r);
+      if (*r->next == ',')
+	{
+	  r->next++;
+	  r->expect = in_object ? EXPECT_KEY : EXPECT_VALUE;
+	  skip_space (r);
+	  break;
+	}
+      if (*r->next != (in_object ? '}' : ']'))
+	return reader_error (r);
+      r->next++;
+      r->depth--;
+      return value_read (r, in_object ? JT_END_OBJECT : JT_END_ARRAY);
+    default:
+      break;
+    }
+
+  if (r->next == r->end)
+    return reader_error (r);
+  c = *r->next;
+
+  if (r->expect == EXPECT_KEY || r->expect == EXPECT_KEY_OR_END)
+    {
+      if (c == '}' && r->expect == EXPECT_KEY_OR_END)
+	{
+	  r->next++;
+	  r->depth--;
+	  return value_read (r, JT_END_OBJECT);
+	}
+      if (c != '"' || !read_string (r))
+	return reader_error (r);
+      skip_space (r);
+      if (r->next == r->end || *r->next != ':')
+	return reader_error (r);
+      r->next++;
+      r->expect = EXPECT_VALUE;
+      return JT_KEY;
+    }
+
+  switch (c)
+    {
+    case ']':
+      if (r->expect != EXPECT_VALUE_OR_END)
+	return reader_error (r);
+      r->next++;
+      r->depth--;
+      return value_read (r, JT_END_ARRAY);
+    case '{':
+    case '[':
+      if (r->depth == MAX_DEPTH)
+	return reader_error (r);
+      r->next++;
+      if (c == '{')
+	r->objects |= (uint64_t)1 << r->depth;
+      else
+	r->objects &= ~((uint64_t)1 << r->depth);
+      r->depth++;
+      r->expect = c == '{' ? EXPECT_KEY_OR_END : EXPECT_VALUE_OR_END;
+      return c == '{' ? JT_BEGIN_OBJECT : JT_BEGIN_ARRAY;
+    case '"':
+      if (!read_string (r))
+	return reader_error (r);
+      return value_read (r, JT_STRING);
+    case 't':
+      if (!read_literal (r, "true"))
+	return reader_error (r);
+      return value_read (r, JT_TRUE);
+    case 'f':
+      if (!read_literal (r, "false"))
+	return reader_error (r);
+      return value_read (r, JT_FALSE);
+    case 'n':
+      if (!read_literal (r, "null"))
+	return reader_error (r);
+      return value_read (r, JT_NULL);
+    default:
+      return read_number (r) ? value_read (r, JT_NUMBER) : reader_error (r);
+    }
+}
+
+/* Skip the rest of the value that TOKEN, just read, began.  Returns false
+   if TOKEN doesn't begin a value, or the value is broken.  */
+bool
+jr_skip (struct json_reader *r, enum json_token token)
+{
+  int depth = r->depth - 1;
+
+  switch (token)
+    {
+    case JT_BEGIN_OBJECT:
+    case JT_BEGIN_ARRAY:
+      while (r->depth > depth)
+	{
+	  token = jr_next (r);
+	  if (token == JT_ERROR || token == JT_END)
+	    return false;
+	}
+      return true;
+    case JT_STRING:
+    case JT_NUMBER:
+    case JT_TRUE:
+    case JT_FALSE:
+    case JT_NULL:
+      return true;
+    default:
+      return false;
+    }
+}
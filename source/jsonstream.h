@@ -0,0 +1,89 @@
+/* Copyright (c) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef JSONSTREAM_H
+#define JSONSTREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A JSON writer.  The text goes straight into one growable buffer, and the
+   commas and colons are put in as needed: inside an object, write each
+   member's key, and then its value.  */
+struct json_writer
+{
+  char *buffer;              /* Always NUL-terminated.  */
+  size_t length, allocated;
+  bool comma;                /* The next key or value needs a comma.  */
+};
+
+void jw_init (struct json_writer *w);
+char *jw_finish (struct json_writer *w);
+void jw_begin_object (struct json_writer *w);
+void jw_end_object (struct json_writer *w);
+void jw_begin_array (struct json_writer *w);
+void jw_end_array (struct json_writer *w);
+void jw_key (struct json_writer *w, const char *key);
+void jw_string (struct json_writer *w, const char *s);
+void jw_int (struct json_writer *w, int64_t n);
+void jw_bool (struct json_writer *w, bool b);
+void jw_raw (struct json_writer *w, const char *json);
+void jw_key_string (struct json_writer *w, const char *key, const char *s);
+void jw_key_int (struct json_writer *w, const char *key, int64_t n);
+void jw_key_bool (struct json_writer *w, const char *key, bool b);
+
+/* The tokens a JSON reader returns.  */
+enum json_token
+{
+  JT_ERROR,
+  JT_END,                    /* Of the text.  */
+  JT_BEGIN_OBJECT,
+  JT_END_OBJECT,
+  JT_BEGIN_ARRAY,
+  JT_END_ARRAY,
+  JT_KEY,
+  JT_STRING,
+  JT_NUMBER,
+  JT_TRUE,
+  JT_FALSE,
+  JT_NULL
+};
+
+/* A JSON pull parser, which returns the tokens of a text one at a time,
+   without building anything.  After a JT_KEY or JT_STRING, STRING holds
+   the text, unescaped; after a JT_NUMBER, NUMBER holds the value, cut to
+   an integer if INTEGER is false.  */
+struct json_reader
+{
+  const char *next, *end;
+  char *string;
+  size_t length, allocated;
+  int64_t number;
+  bool integer;
+  uint64_t objects;          /* A bit per level of nesting, set for an
+                                object rather than an array.  */
+  int depth;
+  int expect;
+};
+
+void jr_init (struct json_reader *r, const char *text, size_t length);
+enum json_token jr_next (struct json_reader *r);
+bool jr_skip (struct json_reader *r, enum json_token token);
+void jr_free (struct json_reader *r);
+
+#endif
@@ -18,18 +18,116 @@
 
 #include "ccache.h"
 
+#include <signal.h>
+
+/* The longest we sleep between attempts, in microseconds. */
+#define MAX_LOCK_SLEEP 100000
+
+#ifndef _WIN32
 /*
- * This function acquires a lockfile for the given path. Returns true if the
- * lock was acquired, otherwise false. If the lock has been considered stale
- * for the number of microseconds specified by staleness_limit, the function
- * will (if possible) break the lock and then try to acquire it again. The
- * staleness limit should be reasonably larger than the longest time the lock
- * can be expected to be held, and the updates of the locked path should
- * probably be made with an atomic rename(2) to avoid corruption in the rare
- * case that the lock is broken by another process.
+ * Return the process ID that CONTENT, the contents of a lock, names if the
+ * lock was taken on this host, otherwise 0.
  */
-bool
-lockfile_acquire(const char *path, unsigned staleness_limit)
+static int
+local_lock_holder(const char *content, const char *hostname)
+{
+	size_t len = strlen(hostname);
+	int pid;
+
+	if (strncmp(content, hostname, len) != 0 || content[len] != ':') {
+		return 0;
+	}
+	pid = atoi(content + len + 1);
+	return pid > 0 ? pid : 0;
+}
+#endif
+
+/*
+ * Return true if CONTENT, the contents of a lock, names a process on this
+ * host that no longer exists, so that the lock can't be released.
+ */
+static bool
+lock_holder_is_gone(const char *content, const char *hostname)
+{
+#ifdef _WIN32
+	(void)content;
+	(void)hostname;
+	return false;
+#else
+	int pid = local_lock_holder(content, hostname);
+	return pid > 0 && kill(pid, 0) == -1 && errno == ESRCH;
+#endif
+}
+
+/*
+ * Return true if CONTENT, the contents of a lock, names a process on this
+ * host that is still running.
+ */
+static bool
+lock_holder_is_alive(const char *content, const char *hostname)
+{
+#ifdef _WIN32
+	(void)content;
+	(void)hostname;
+	return false;
+#else
+	int pid = local_lock_holder(content, hostname);
+	return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+#endif
+}
+
+/*
+ * Return true if LOCKFILE still has the contents CONTENT.
+ */
+static bool
+lock_content_unchanged(const char *lockfile, const char *content)
+{
+#ifdef _WIN32
+	(void)lockfile;
+	(void)content;
+	return true;
+#else
+	char *current = x_readlink(lockfile);
+	bool unchanged = current && str_eq(current, content);
+	free(current);
+	return unchanged;
+#endif
+}
+
+#ifndef _WIN32
+/*
+ * Return true if CONTENT, the contents of a lock, is what this thread of this
+ * process gives the locks it takes (see lockfile_acquire).
+ */
+static bool
+lock_is_ours(const char *content)
+{
+	const char *suffix = tmp_string();
+	size_t len = strlen(content), suffix_len = strlen(suffix);
+
+	return local_lock_holder(content, get_hostname()) == (int)getpid()
+	       && len > suffix_len && content[len - suffix_len - 1] == ':'
+	       && str_eq(content + len - suffix_len, suffix);
+}
+#endif
+
+/*
+ * Remove LOCKFILE without asking whose it is.
+ */
+static void
+remove_lock(const char *lockfile)
+{
+	cc_log("Releasing lock %s", lockfile);
+	tmp_unlink(lockfile);
+}
+
+/*
+ * Acquire the lock of PATH, as described for lockfile_acquire. If
+ * SPARE_LIVE_HOLDER, a lock held by a running process on this host is never
+ * considered stale.
+ */
+static bool
+acquire(const char *path, unsigned staleness_limit, bool spare_live_holder)
 {
 	char *lockfile = format("%s.lock", path);
 	char *my_content = NULL, *content = NULL, *initial_content = NULL;
@@ -45,7 +143,12 @@ lockfile_acquire(const char *path, unsigned staleness_limit)
 
 	while (true) {
 		free(my_content);
-		my_content = format("%s:%d:%d", hostname, (int)getpid(), (int)time(NULL));
+		/*
+		 * The temporary file suffix tells threads of one process apart, so that
+		 * one of them can't mistake another's lock for its own.
+		 */
+		my_content = format("%s:%d:%d:%s", hostname, (int)getpid(),
+		                    (int)time(NULL), tmp_string());
 
 #ifdef _WIN32
 		fd = open(lockfile, O_WRONLY|O_CREAT|O_EXCL|O_BINARY, 0666);
@@ -148,26 +251,28 @@ lockfile_acquire(const char *path, unsigned staleness_limit)
 			acquired = true;
 			goto out;
 		}
-		/*
-		 * A possible improvement here would be to check if the process holding the
-		 * lock is still alive and break the lock early if it isn't.
-		 */
 		cc_log("lockfile_acquire: lock info for %s: %s", lockfile, content);
 		if (!initial_content) {
 			initial_content = x_strdup(content);
 		}
-		if (slept > staleness_limit) {
-			if (str_eq(content, initial_content)) {
-				/* The lock seems to be stale -- break it. */
-				cc_log("lockfile_acquire: breaking %s", lockfile);
-				if (lockfile_acquire(lockfile, staleness_limit)) {
-					lockfile_release(path);
-					lockfile_release(lockfile);
-					to_sleep = 1000;
-					slept = 0;
-					continue;
+		if (lock_holder_is_gone(content, hostname)
+		    || (slept > staleness_limit && str_eq(content, initial_content)
+		        && !(spare_live_holder
+		             && lock_holder_is_alive(content, hostname)))) {
+			/* The lock seems to be stale -- break it. */
+			cc_log("lockfile_acquire: breaking %s", lockfile);
+			if (lockfile_acquire(lockfile, staleness_limit)) {
+				/* Someone else may have broken it first. */
+				if (lock_content_unchanged(lockfile, content)) {
+					remove_lock(lockfile);
 				}
+				lockfile_release(lockfile);
+				to_sleep = 1000;
+				slept = 0;
+				continue;
 			}
+		}
+		if (slept > staleness_limit) {
 			cc_log("lockfile_acquire: gave up acquiring %s", lockfile);
 			goto out;
 		}
@@ -175,7 +280,9 @@ lockfile_acquire(const char *path, unsigned staleness_limit)
 		       lockfile, to_sleep);
 		usleep(to_sleep);
 		slept += to_sleep;
-		to_sleep *= 2;
+		if (to_sleep < MAX_LOCK_SLEEP) {
+			to_sleep *= 2;
+		}
 	}
 
 out:
@@ -192,15 +299,58 @@ out:
 }
 
 /*
- * Release the lockfile for the given path. Assumes that we are the legitimate
- * owner.
+ * This function acquires a lockfile for the given path. Returns true if the
+ * lock was acquired, otherwise false. If the lock has been considered stale
+ * for the number of microseconds specified by staleness_limit, the function
+ * will (if possible) break the lock and then try to acquire it again. A lock
+ * held by a process on this host that has died is broken straight away. The
+ * staleness limit should be reasonably larger than the longest time the lock
+ * can be expected to be held, and the updates of the locked path should
+ * probably be made with an atomic rename(2) to avoid corruption in the rare
+ * case that the lock is broken by another process.
+ */
+bool
+lockfile_acquire(const char *path, unsigned staleness_limit)
+{
+	return acquire(path, staleness_limit, false);
+}
+
+/*
+ * Like lockfile_acquire, but for locks that may rightly be held for longer
+ * than TIMEOUT microseconds: if a running process on this host still holds
+ * the lock when TIMEOUT has passed, give up and return false instead of
+ * breaking it. A lock taken on another host is broken after TIMEOUT, as
+ * lockfile_acquire would, since there is no telling whether its holder is
+ * alive.
+ */
+bool
+lockfile_wait(const char *path, unsigned timeout)
+{
+	return acquire(path, timeout, true);
+}
+
+/*
+ * Release the lockfile for the given path. It is left alone if it names
+ * another holder, since it may have been broken and taken by someone else
+ * after we acquired it.
  */
 void
 lockfile_release(const char *path)
 {
 	char *lockfile = format("%s.lock", path);
-	cc_log("Releasing lock %s", lockfile);
-	tmp_unlink(lockfile);
+#ifndef _WIN32
+	char *content = x_readlink(lockfile);
+
+	if (content && !lock_is_ours(content)) {
+		cc_log("Not releasing lock %s, which is now held by %s", lockfile,
+		       content);
+		free(content);
+		free(lockfile);
+		return;
+	}
+	free(content);
+#endif
+	remove_lock(lockfile);
 	free(lockfile);
 }
 
@@ -23,6 +23,7 @@
 #include "manifest.h"
 #include "murmurhashneutral2.h"
 #include "cloud.h"
+#include "daemon.h"
 
 #include <zlib.h>
 
@@ -554,7 +555,7 @@ manifest_get(struct conf *conf, const char *manifest_path)
 	uint32_t i;
 	struct file_hash *fh = NULL;
 
-	fd = open(manifest_path, O_RDONLY | O_BINARY);
+	open_cache_files(1, &manifest_path, &fd);
 	if (fd == -1) {
 		/* Cache miss. */
 		cc_log("No such manifest file");
@@ -696,6 +697,66 @@ out:
 	return ret;
 }
 
+/*
+ * Copy the entry for the object with the given hash from the manifest file
+ * other_path (for instance one downloaded from the cloud) into the manifest
+ * file manifest_path. Returns true on success, otherwise false.
+ */
+bool
+manifest_merge(const char *manifest_path, const char *other_path,
+               struct file_hash *object_hash)
+{
+	int fd;
+	gzFile f;
+	struct manifest *mf;
+	struct hashtable *included_files = NULL;
+	uint32_t i, j;
+	bool ret = false;
+
+	fd = open(other_path, O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		cc_log("No such manifest file: %s", other_path);
+		return false;
+	}
+	f = gzdopen(fd, "rb");
+	if (!f) {
+		cc_log("Failed to gzdopen manifest file");
+		close(fd);
+		return false;
+	}
+	mf = read_manifest(f);
+	gzclose(f);
+	if (!mf) {
+		cc_log("Error reading manifest file");
+		return false;
+	}
+
+	for (i = mf->n_objects; i > 0; i--) {
+		struct object *obj = &mf->objects[i - 1];
+		if (!file_hashes_equal(&obj->hash, object_hash)) {
+			continue;
+		}
+		included_files = create_hashtable(1000, hash_from_string,
+		                                  strings_equal);
+		for (j = 0; j < obj->n_file_info_indexes; j++) {
+			struct file_info *fi = &mf->file_infos[obj->file_info_indexes[j]];
+			struct file_hash *fh = x_malloc(sizeof(*fh));
+			memcpy(fh->hash, fi->hash, sizeof(fh->hash));
+			fh->size = fi->size;
+			hashtable_insert(included_files, x_strdup(mf->files[fi->index]), fh);
+		}
+		ret = manifest_put(manifest_path, object_hash, included_files);
+		hashtable_destroy(included_files, 1);
+		break;
+	}
+	if (!included_files) {
+		cc_log("No entry for the object in %s", other_path);
+	}
+
+	free_manifest(mf);
+	return ret;
+}
+
 bool
 manifest_dump(const char *manifest_path, FILE *stream)
 {
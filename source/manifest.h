@@ -8,6 +8,8 @@
 struct file_hash *manifest_get(struct conf *conf, const char *manifest_path);
 bool manifest_put(const char *manifest_path, struct file_hash *object_hash,
                   struct hashtable *included_files);
+bool manifest_merge(const char *manifest_path, const char *other_path,
+                    struct file_hash *object_hash);
 bool manifest_dump(const char *manifest_path, FILE *stream);
 
 #endif
@@ -20,7 +20,7 @@
 
 /* NOTE: This code makes no attempt to be fast! */
 
-static struct mdfour *m;
+static THREAD_LOCAL struct mdfour *m;
 
 #define MASK32 (0xffffffff)
 
@@ -0,0 +1,51 @@
+/* Copyright (c) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef MULTIPART_H
+#define MULTIPART_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The call-backs return zero to abort the parse.  */
+struct multipart_callbacks
+{
+  /* A new part has begun.  HEADERS holds the raw header lines, each
+     terminated by CRLF, without the blank line that ends them; it is
+     NUL-terminated, and HEADERSIZE may be zero.  */
+  int (*part_begin) (void *userdata, const char *headers, size_t headersize);
+
+  /* Some body data for the current part.  Data before the first boundary
+     (the preamble) is also delivered here, before any part_begin.  */
+  int (*part_data) (void *userdata, const char *data, size_t size);
+
+  /* The current part, or the preamble, has ended.  */
+  int (*part_end) (void *userdata);
+};
+
+struct multipart_parser;
+
+struct multipart_parser *multipart_new (const char *boundary,
+                                        const struct multipart_callbacks *cb,
+                                        void *userdata);
+int multipart_feed (struct multipart_parser *parser, const char *data,
+                    size_t size);
+int multipart_finish (struct multipart_parser *parser);
+bool multipart_complete (const struct multipart_parser *parser);
+void multipart_free (struct multipart_parser *parser);
+
+#endif
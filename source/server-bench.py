@@ -0,0 +1,155 @@
+#! /usr/bin/env python3
+#
+# Copyright (c) 2012 Mentor Graphics Corporation
+#
+# This program is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation; either version 3 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, write to the Free Software Foundation, Inc., 51
+# Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+from optparse import OptionParser
+from glob import glob
+from os import environ, kill
+from os.path import abspath, join as joinpath
+from shutil import rmtree
+from signal import SIGTERM
+from subprocess import DEVNULL, Popen, check_call
+from tempfile import mkdtemp
+from time import sleep, time
+import socket
+import sys
+
+USAGE = """%prog [options] <compiler>"""
+
+DESCRIPTION = """\
+This program measures the latency of a cache hit on a tiny source file: with
+cs on its own, with cs while a daemon is running, and with cs-client, which
+has the daemon run the whole of cs (see "The compile server" in daemon.c).
+The cache is local (CS_CLOUD_MODE=offline), so the figures are mostly the
+cost of starting cs. Example:
+./server-bench.py --cs ./cs --cs-client ./cs-client gcc
+"""
+
+DEFAULT_CS = "./cs"
+DEFAULT_CS_CLIENT = "./cs-client"
+DEFAULT_REQUESTS = 200
+
+SOURCE = "int f(int x) { return x + 1; }\n"
+
+verbose = False
+
+def progress(msg):
+    if verbose:
+        sys.stderr.write(msg)
+        sys.stderr.flush()
+
+def percentile(values, p):
+    return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+def start_daemon(options, env, cache_dir):
+    daemon = Popen([options.cs, "--daemon"], env=env,
+                   stdout=DEVNULL, stderr=DEVNULL)
+    for _ in range(100):
+        sockets = glob(joinpath(cache_dir, "daemon.*"))
+        if sockets:
+            try:
+                sock = socket.socket(socket.AF_UNIX)
+                sock.connect(sockets[0])
+                sock.close()
+                return daemon
+            except OSError:
+                pass
+        sleep(0.05)
+    kill(daemon.pid, SIGTERM)
+    daemon.wait()
+    raise Exception("the daemon did not start")
+
+def run_mode(tmpdir, options, compiler, name, driver, with_daemon):
+    cache_dir = joinpath(tmpdir, "cache-" + name)
+    check_call(["mkdir", "-p", cache_dir])
+    env = dict(environ)
+    env.update({
+        "CS_DIR": cache_dir,
+        "CS_CACHE_DIR": cache_dir,
+        "CS_CLOUD_MODE": "offline",
+        "CS_BINARY": options.cs})
+    env.pop("CS_LOGFILE", None)
+    command = [driver, compiler, "-c", "test.c", "-o", "test.o"]
+    daemon = start_daemon(options, env, cache_dir) if with_daemon else None
+    try:
+        progress("%s\n" % name)
+        check_call(command, cwd=tmpdir, env=env)
+        # Let the daemon's memory of the missing result expire.
+        sleep(1.1)
+        latencies = []
+        for _ in range(options.requests):
+            start = time()
+            check_call(command, cwd=tmpdir, env=env)
+            latencies.append(time() - start)
+        latencies.sort()
+        print("%-18s  %8d  %8.2f  %8.2f  %8.2f  %8.2f" % (
+            name, len(latencies),
+            1000 * sum(latencies) / len(latencies),
+            1000 * percentile(latencies, 50),
+            1000 * percentile(latencies, 99),
+            1000 * latencies[-1]))
+        sys.stdout.flush()
+    finally:
+        if daemon:
+            kill(daemon.pid, SIGTERM)
+            daemon.wait()
+
+def main(argv):
+    op = OptionParser(usage=USAGE, description=DESCRIPTION)
+    op.add_option(
+        "--cs",
+        help="location of the cs binary (default: %s)" % DEFAULT_CS,
+        default=DEFAULT_CS)
+    op.add_option(
+        "--cs-client",
+        help="location of the cs-client binary (default: %s)"
+        % DEFAULT_CS_CLIENT,
+        default=DEFAULT_CS_CLIENT)
+    op.add_option(
+        "-n", "--requests",
+        help="cache hits to time in each mode (default: %d)"
+        % DEFAULT_REQUESTS,
+        type="int",
+        default=DEFAULT_REQUESTS)
+    op.add_option(
+        "-v", "--verbose",
+        help="print progress messages",
+        action="store_true")
+    (options, args) = op.parse_args(argv[1:])
+    if len(args) != 1:
+        op.error("missing compiler")
+
+    global verbose
+    verbose = options.verbose
+    options.cs = abspath(options.cs)
+    options.cs_client = abspath(options.cs_client)
+
+    tmpdir = mkdtemp(prefix="server-bench.")
+    try:
+        with open(joinpath(tmpdir, "test.c"), "w") as f:
+            f.write(SOURCE)
+        print("%-18s  %8s  %8s  %8s  %8s  %8s" % (
+            "mode", "hits", "mean ms", "p50 ms", "p99 ms", "max ms"))
+        run_mode(tmpdir, options, args[0], "cs", options.cs, False)
+        run_mode(tmpdir, options, args[0], "cs with daemon", options.cs,
+                 True)
+        run_mode(tmpdir, options, args[0], "cs-client", options.cs_client,
+                 True)
+    finally:
+        rmtree(tmpdir)
+
+main(sys.argv)
@@ -0,0 +1,450 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * The result spool, which keeps the results of compiles that could not be
+ * uploaded, for the daemon to send once the server can be reached again.
+ *
+ * The spool is the "spool" directory in the cache directory. Each entry is
+ * a JSON file, named for the time it was written so that the names sort
+ * oldest first. It holds the URL and headers of the upload, and what a
+ * client hands the daemon for one (see "Result uploads" in daemon.c),
+ * except that each file offered refers to a "blob" instead of a shared
+ * memory object. Blobs live in "spool/blobs", named for the hash of their
+ * contents, so that entries with the same source files share them.
+ *
+ * The daemon keeps the spool within spool_size by dropping the oldest
+ * entries, and blobs that no entry refers to any more are dropped with
+ * them, as are those of entries that have been sent and marked as done.
+ * Adding an entry and trimming the spool take a lock on the spool, so that
+ * a blob is never dropped while the entry that will use it is being
+ * written. Each file is also written under a temporary name and renamed
+ * into place, and a blob that no entry has ever referred to, which an
+ * interrupted spool_add may leave, is only dropped once it is an hour old.
+ */
+
+#include "ccache.h"
+#include "hashtable.h"
+#include "hashutil.h"
+#include "spool.h"
+
+#include <dirent.h>
+#include <json.h>
+#include <sys/mman.h>
+
+#define ENTRY_SUFFIX ".json"
+#define DONE_SUFFIX ".done"
+#define BLOB_GRACE 3600
+#define SPOOL_LOCK_STALENESS (30 * 1000 * 1000)
+
+/* The spool for the cache directory in use. Caller frees. */
+char *
+spool_directory(void)
+{
+	return format("%s/spool", conf->cache_dir);
+}
+
+/* Add key's member of from to to, sharing it. */
+static void
+copy_member(json_object *to, json_object *from, const char *key)
+{
+	json_object *member = json_object_object_get(from, key);
+	if (member) {
+		json_object_object_add(to, key, json_object_get(member));
+	}
+}
+
+char *
+spool_blob_path(const char *dir, const char *blob)
+{
+	return format("%s/blobs/%s", dir, blob);
+}
+
+/* Write size bytes of data to path, replacing it whole. */
+static bool
+write_whole_file(const char *path, const void *data, size_t size)
+{
+	char *tmp = format("%s.tmp.%s", path, tmp_string());
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0666);
+	const char *p = data;
+	bool ok = fd != -1;
+
+	while (ok && size > 0) {
+		ssize_t n = write(fd, p, size);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		ok = n > 0;
+		p += n;
+		size -= n;
+	}
+	if (fd != -1 && close(fd) != 0) {
+		ok = false;
+	}
+	if (ok) {
+		ok = x_rename(tmp, path) == 0;
+	} else {
+		cc_log("Failed to write %s: %s", tmp, strerror(errno));
+	}
+	if (!ok) {
+		tmp_unlink(tmp);
+	}
+	free(tmp);
+	return ok;
+}
+
+/*
+ * Copy the contents of the stashed file in the shared memory object
+ * shm_name, mapped with size bytes, into a blob. Returns the blob's name,
+ * which the caller frees, or NULL.
+ */
+static char *
+store_blob(const char *dir, const char *shm_name, size_t size)
+{
+	struct stashed_file *sf;
+	struct mdfour md;
+	struct stat st;
+	char *name = NULL, *path;
+	int fd = shm_open(shm_name, O_RDONLY, 0);
+
+	if (fd == -1) {
+		return NULL;
+	}
+	sf = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (sf == MAP_FAILED) {
+		return NULL;
+	}
+	if (size < sizeof(*sf) || sf->size > size - sizeof(*sf)
+	    || strcmp(sf->shm_name, shm_name) != 0) {
+		munmap(sf, size);
+		return NULL;
+	}
+
+	hash_start(&md);
+	hash_buffer(&md, sf->data, sf->size);
+	name = hash_result(&md);
+	path = spool_blob_path(dir, name);
+	if (stat(path, &st) != 0
+	    && !write_whole_file(path, sf->data, sf->size)) {
+		free(name);
+		name = NULL;
+	}
+	free(path);
+	munmap(sf, size);
+	return name;
+}
+
+/*
+ * Add entry to the spool in dir: a JSON object with the "url" and
+ * "headers" of an upload, its "data" and "sources", and the "files" it
+ * offers, each with a "field", a "name", and a shared memory object
+ * ("shm") and mapping "size". Entry is left as it was. The spool isn't
+ * trimmed: see spool_trim. Returns false if the entry wasn't added.
+ */
+bool
+spool_add(const char *dir, json_object *entry)
+{
+	static unsigned counter;
+	json_object *copy, *files, *offered;
+	char *blob_dir, *path;
+	int i, len;
+	bool ok = true;
+
+	blob_dir = format("%s/blobs", dir);
+	if (create_dir(dir) != 0 || create_dir(blob_dir) != 0) {
+		cc_log("Failed to create %s: %s", blob_dir, strerror(errno));
+		free(blob_dir);
+		return false;
+	}
+	free(blob_dir);
+	if (!lockfile_acquire(dir, SPOOL_LOCK_STALENESS)) {
+		cc_log("Failed to lock %s", dir);
+		return false;
+	}
+
+	files = json_object_new_array();
+	offered = json_object_object_get(entry, "files");
+	len = offered ? json_object_array_length(offered) : 0;
+	for (i = 0; ok && i < len; i++) {
+		json_object *file = json_object_array_get_idx(offered, i);
+		json_object *stored = json_object_new_object();
+		char *blob = store_blob(
+		  dir,
+		  json_object_get_string(json_object_object_get(file, "shm")),
+		  json_object_get_int64(json_object_object_get(file, "size")));
+
+		ok = blob != NULL;
+		copy_member(stored, file, "field");
+		copy_member(stored, file, "name");
+		copy_member(stored, file, "hash");
+		if (blob) {
+			json_object_object_add(stored, "blob",
+			                       json_object_new_string(blob));
+		}
+		json_object_array_add(files, stored);
+		free(blob);
+	}
+	if (!ok) {
+		cc_log("Failed to spool a file offered for upload");
+		json_object_put(files);
+		lockfile_release(dir);
+		return false;
+	}
+
+	copy = json_object_new_object();
+	copy_member(copy, entry, "url");
+	copy_member(copy, entry, "headers");
+	copy_member(copy, entry, "data");
+	copy_member(copy, entry, "sources");
+	json_object_object_add(copy, "files", files);
+
+	path = format("%s/%010lu-%s-%06u" ENTRY_SUFFIX, dir,
+	              (unsigned long)time(NULL), tmp_string(),
+	              __sync_fetch_and_add(&counter, 1));
+	ok = write_whole_file(path, json_object_to_json_string(copy),
+	                      strlen(json_object_to_json_string(copy)));
+	if (ok) {
+		cc_log("Spooled results in %s", path);
+	}
+	free(path);
+	json_object_put(copy);
+	lockfile_release(dir);
+	return ok;
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Set *paths to the files in dir whose names end in suffix, sorted. */
+static int
+list_files(const char *dir, const char *suffix, char ***paths)
+{
+	DIR *d = opendir(dir);
+	struct dirent *de;
+	int count = 0, allocated = 0;
+
+	*paths = NULL;
+	if (!d) {
+		return 0;
+	}
+	while ((de = readdir(d))) {
+		size_t len = strlen(de->d_name), n = strlen(suffix);
+		if (len <= n || !str_eq(de->d_name + len - n, suffix)) {
+			continue;
+		}
+		if (count == allocated) {
+			allocated = allocated ? 2 * allocated : 16;
+			*paths = x_realloc(*paths, allocated * sizeof(**paths));
+		}
+		(*paths)[count++] = format("%s/%s", dir, de->d_name);
+	}
+	closedir(d);
+	qsort(*paths, count, sizeof(**paths), compare_names);
+	return count;
+}
+
+/*
+ * Set *paths to the entries in the spool in dir, oldest first, and return
+ * how many there are. The caller frees the paths and the array.
+ */
+int
+spool_list(const char *dir, char ***paths)
+{
+	return list_files(dir, ENTRY_SUFFIX, paths);
+}
+
+/*
+ * Take the entry at path out of the spool. Its blobs go at the next
+ * spool_trim, unless other entries use them.
+ */
+void
+spool_remove(const char *path)
+{
+	char *done = format("%.*s" DONE_SUFFIX,
+	                    (int)(strlen(path) - strlen(ENTRY_SUFFIX)), path);
+	if (x_rename(path, done) != 0) {
+		x_unlink(path);
+	}
+	free(done);
+}
+
+/* Read the spool entry at path. Returns NULL if it is not one. */
+json_object *
+spool_read(const char *path)
+{
+	char *text = read_text_file(path, 0);
+	json_object *entry = text ? json_tokener_parse(text) : NULL;
+
+	free(text);
+	if (is_error(entry)) {
+		return NULL;
+	}
+	if (!json_object_is_type(entry, json_type_object)
+	    || !json_object_is_type(json_object_object_get(entry, "url"),
+	                            json_type_string)
+	    || !json_object_is_type(json_object_object_get(entry, "data"),
+	                            json_type_object)) {
+		json_object_put(entry);
+		return NULL;
+	}
+	return entry;
+}
+
+static uint64_t
+size_of(const char *path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 ? file_size(&st) : 0;
+}
+
+/*
+ * Add delta to the counts in refs of the blobs in dir that the spool entry
+ * at path refers to. Returns the size of those whose count fell to zero.
+ */
+static uint64_t
+count_blobs(const char *dir, const char *path, struct hashtable *refs,
+            int delta)
+{
+	json_object *entry = spool_read(path), *files;
+	uint64_t freed = 0;
+	int i, len;
+
+	if (!entry) {
+		return 0;
+	}
+	files = json_object_object_get(entry, "files");
+	len = files ? json_object_array_length(files) : 0;
+	for (i = 0; i < len; i++) {
+		json_object *file = json_object_array_get_idx(files, i);
+		const char *blob =
+		  json_object_get_string(json_object_object_get(file, "blob"));
+		int *count;
+
+		if (!blob) {
+			continue;
+		}
+		count = hashtable_search(refs, (void *)blob);
+		if (!count) {
+			count = x_calloc(1, sizeof(*count));
+			hashtable_insert(refs, x_strdup(blob), count);
+		}
+		*count += delta;
+		if (*count == 0) {
+			char *blob_path = spool_blob_path(dir, blob);
+			freed += size_of(blob_path);
+			free(blob_path);
+		}
+	}
+	json_object_put(entry);
+	return freed;
+}
+
+/*
+ * Drop the oldest entries from the spool in dir until it holds no more than
+ * limit bytes, and the blobs that are no longer used. This goes through the
+ * whole spool, so it is left to the daemon, now and then.
+ */
+void
+spool_trim(const char *dir, uint64_t limit)
+{
+	struct hashtable *refs;
+	char **paths, **done, *blob_dir;
+	uint64_t total = 0;
+	int i, count, ndone;
+	DIR *d;
+	struct dirent *de;
+	time_t now = time(NULL);
+
+	if (!lockfile_acquire(dir, SPOOL_LOCK_STALENESS)) {
+		cc_log("Failed to lock %s", dir);
+		return;
+	}
+	blob_dir = format("%s/blobs", dir);
+	count = spool_list(dir, &paths);
+	ndone = list_files(dir, DONE_SUFFIX, &done);
+	refs = create_hashtable(64, hash_from_string, strings_equal);
+	for (i = 0; i < count; i++) {
+		total += size_of(paths[i]);
+		count_blobs(dir, paths[i], refs, 1);
+	}
+
+	/* The blobs of removed entries go now if nothing else uses them. */
+	for (i = 0; i < ndone; i++) {
+		count_blobs(dir, done[i], refs, 0);
+		x_unlink(done[i]);
+		free(done[i]);
+	}
+	free(done);
+
+	/* What the blobs hold counts only once. */
+	d = opendir(blob_dir);
+	while (d && (de = readdir(d))) {
+		char *path;
+		if (de->d_name[0] != '.') {
+			path = format("%s/%s", blob_dir, de->d_name);
+			total += size_of(path);
+			free(path);
+		}
+	}
+
+	for (i = 0; i < count && total > limit; i++) {
+		cc_log("Spool full: dropping %s", paths[i]);
+		total -= size_of(paths[i]);
+		total -= count_blobs(dir, paths[i], refs, -1);
+		x_unlink(paths[i]);
+	}
+
+	if (d) {
+		rewinddir(d);
+	}
+	while (d && (de = readdir(d))) {
+		int *refcount = hashtable_search(refs, de->d_name);
+		struct stat st;
+		char *path;
+
+		if (de->d_name[0] == '.' || (refcount && *refcount > 0)) {
+			continue;
+		}
+		/*
+		 * Entries being added are locked out, so a blob whose entries
+		 * have all gone is unused; one that no entry has mentioned may
+		 * still be the work of an interrupted spool_add.
+		 */
+		path = format("%s/%s", blob_dir, de->d_name);
+		if (stat(path, &st) == 0
+		    && (refcount || st.st_mtime + BLOB_GRACE < now)) {
+			x_unlink(path);
+		}
+		free(path);
+	}
+	if (d) {
+		closedir(d);
+	}
+
+	for (i = 0; i < count; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+	free(blob_dir);
+	hashtable_destroy(refs, 1);
+	lockfile_release(dir);
+}
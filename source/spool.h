@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+struct json_object;
+
+char *spool_directory(void);
+bool spool_add(const char *dir, struct json_object *entry);
+int spool_list(const char *dir, char ***paths);
+struct json_object *spool_read(const char *path);
+void spool_remove(const char *path);
+char *spool_blob_path(const char *dir, const char *blob);
+void spool_trim(const char *dir, uint64_t limit);
+
+#endif
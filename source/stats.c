@@ -34,13 +34,7 @@
 #include <string.h>
 #include <unistd.h>
 
-extern char *stats_file;
-extern struct conf *conf;
-extern unsigned lock_staleness_limit;
-extern char *primary_config_path;
-extern char *secondary_config_path1, *secondary_config_path2;
-
-static struct counters *counter_updates;
+static THREAD_LOCAL struct counters *counter_updates;
 
 #define FLAG_NOZERO 1 /* don't zero with the -z option */
 #define FLAG_ALWAYS 2 /* always show, even if zero */
@@ -59,6 +53,10 @@ static struct {
 	{ STATS_CACHEHIT_CPP, "cache hit (preprocessed)       ", NULL, FLAG_ALWAYS },
         { STATS_CACHEHIT_CLOUD, "cache hit (cloud)              ", NULL, FLAG_ALWAYS },
 	{ STATS_TOCACHE,      "cache miss                     ", NULL, FLAG_ALWAYS },
+	{ STATS_DEDUPLICATED, "compiled by concurrent process ", NULL, 0 },
+	{ STATS_RACE_CLOUD_WON, "race won by the cloud          ", NULL, 0 },
+	{ STATS_RACE_COMPILES, "race compiles started          ", NULL, 0 },
+	{ STATS_RACE_WASTED, "race compiles stopped          ", NULL, 0 },
 	{ STATS_LINK,         "called for link                ", NULL, 0 },
 	{ STATS_PREPROCESSING, "called for preprocessing       ", NULL, 0 },
 	{ STATS_MULTIPLE,     "multiple source files          ", NULL, 0 },
@@ -249,6 +247,10 @@ stats_flush(void)
 		}
 	}
 
+	/* The updates are on disk; the thread's next compile starts afresh. */
+	counters_free(counter_updates);
+	counter_updates = NULL;
+
 	if (conf->max_files != 0
 	    && counters->data[STATS_NUMFILES] > conf->max_files / 16) {
 		need_cleanup = true;
@@ -263,6 +265,7 @@ stats_flush(void)
 		cleanup_dir(conf, p);
 		free(p);
 	}
+	counters_free(counters);
 }
 
 /* update a normal stat */
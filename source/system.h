@@ -38,6 +38,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -82,4 +83,14 @@ typedef bool _Bool;
 #  define __bool_true_false_are_defined 1
 #endif
 
+/*
+ * State that belongs to one compilation, but lives outside its
+ * compile_context, is kept per thread.
+ */
+#ifdef HAVE_THREAD_LOCAL
+#  define THREAD_LOCAL __thread
+#else
+#  define THREAD_LOCAL
+#endif
+
 #endif /* CCACHE_SYSTEM_H */
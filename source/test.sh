@@ -23,6 +23,7 @@ unset CS_BASEDIR
 unset CS_CC
 unset CS_COMPILERCHECK
 unset CS_COMPRESS
+unset CS_COSTS_LOG
 unset CS_CPP2
 unset CS_CACHE_DIR
 unset CS_DISABLE
@@ -2031,6 +2032,646 @@ b"
 b"
 }
 
+# Write a stand-in for the cloud server to cloud-server.py. It speaks HTTPS,
+# keeps what it is given in the directory named by its third argument, logs
+# the requests it gets to cloud-server.log, and prints its port when ready.
+# Cache lookups stall for as many seconds as a "delay" file in the store says,
+# and while there is a "down" file, requests get no answer at all. Objects
+# offered by hash are asked for as content, kept by hash for every upload.
+# It accepts gzip-encoded parts, logging them, and gzips the objects it sends
+# to clients that accept that, giving the hash of those it was told. Cache
+# hits honour Range requests, and while there is a "cut" file, the next is
+# cut off half way through; with a "corrupt" file, objects are sent damaged.
+write_cloud_server() {
+    cat <<'EOF' >cloud-server.py
+import gzip, hashlib, http.server, json, os, ssl, sys, time
+from email.parser import BytesParser
+from email.policy import HTTP
+
+cert, key, store = sys.argv[1:4]
+log = open("cloud-server.log", "a")
+BOUNDARY = "cs-test"
+
+def part(headers, data):
+    return (("\r\n--%s\r\n%s\r\n\r\n" % (BOUNDARY, "\r\n".join(headers)))
+            .encode() + data)
+
+def save(name, data):
+    path = os.path.join(store, name)
+    with open(path + ".tmp", "wb") as f:
+        f.write(data)
+    os.replace(path + ".tmp", path)
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *args):
+        pass
+
+    def reply(self, code, body, ctype, headers=(), length=None):
+        self.send_response(code)
+        self.send_header("Content-Type", ctype)
+        self.send_header("Content-Length", str(length or len(body)))
+        self.send_header("Accept-Encoding", "gzip")
+        for header in headers:
+            self.send_header(*header.split(": ", 1))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def reply_parts(self, parts):
+        body = b"".join(parts) + ("\r\n--%s--\r\n" % BOUNDARY).encode()
+        ctype = 'multipart/mixed; boundary="%s"' % BOUNDARY
+        etag = '"%s"' % hashlib.md5(body).hexdigest()
+        headers = ["Accept-Ranges: bytes", "ETag: " + etag]
+        ranges = self.headers.get("Range", "")
+        if ranges.startswith("bytes=") and self.headers["If-Range"] == etag:
+            start = int(ranges[len("bytes="):].split("-")[0])
+            log.write("RANGE %d\n" % start)
+            log.flush()
+            headers.append("Content-Range: bytes %d-%d/%d"
+                           % (start, len(body) - 1, len(body)))
+            self.reply(206, body[start:], ctype, headers)
+        elif self.cut:
+            # Send the first half, and hang up.
+            os.unlink(os.path.join(store, "cut"))
+            self.reply(200, body[:len(body) // 2], ctype, headers, len(body))
+            self.close_connection = True
+        else:
+            self.reply(200, body, ctype, headers)
+
+    def attachment(self, name, path):
+        headers = ["Content-Type: application/octet-stream",
+                   "Content-Location: /x?file=" + name,
+                   "Content-Disposition: attachment; filename=" + name]
+        with open(path, "rb") as f:
+            data = f.read()
+        if os.path.exists(path + ".hash"):
+            with open(path + ".hash") as f:
+                headers.append("Content-Hash: " + f.read())
+        if os.path.exists(os.path.join(store, "corrupt")):
+            data = data[:-1] + bytes([data[-1] ^ 1])
+        if "gzip" in self.headers.get("Accept-Encoding", ""):
+            headers.append("Content-Encoding: gzip")
+            data = gzip.compress(data, mtime=0)
+        return part(headers, data)
+
+    def read_body(self):
+        if self.headers.get("Transfer-Encoding") != "chunked":
+            return self.rfile.read(int(self.headers["Content-Length"]))
+        body = b""
+        while True:
+            size = int(self.rfile.readline().split(b";")[0], 16)
+            body += self.rfile.read(size)
+            self.rfile.readline()
+            if size == 0:
+                return body
+
+    def down(self):
+        if not os.path.exists(os.path.join(store, "down")):
+            return False
+        self.close_connection = True
+        return True
+
+    def do_GET(self):
+        log.write("GET %s\n" % self.path)
+        log.flush()
+        if self.down():
+            return
+        kind, key = self.path.split("/")[-2:]
+        path = os.path.join(store, key)
+        delay = os.path.join(store, "delay")
+        # Settle the cut as the request comes in: a reply delayed past the
+        # end of its test mustn't take the cut meant for a later one.
+        self.cut = os.path.exists(os.path.join(store, "cut"))
+        if kind == "cache" and os.path.exists(delay):
+            with open(delay) as f:
+                time.sleep(int(f.read()))
+        if kind == "cache" and os.path.exists(path + ".o"):
+            parts = [part(["Content-Type: application/json",
+                           "Content-Location: /x?file=data"],
+                          b'{"exit_status": 0}'),
+                     self.attachment("object", path + ".o")]
+            if os.path.exists(path + ".stderr"):
+                parts.append(self.attachment("stderr", path + ".stderr"))
+            self.reply_parts(parts)
+        elif kind == "manifest" and os.path.exists(path + ".manifest"):
+            self.reply_parts([self.attachment("manifest",
+                                              path + ".manifest")])
+        else:
+            self.reply(404, b"not found", "text/plain")
+
+    def do_POST(self):
+        body = self.read_body()
+        if self.down():
+            return
+        form = BytesParser(policy=HTTP).parsebytes(
+            b"Content-Type: " + self.headers["Content-Type"].encode()
+            + b"\r\n\r\n" + body)
+        fields = {}
+        for p in form.iter_parts():
+            name = p.get_param("name", header="content-disposition")
+            payload = p.get_payload(decode=True)
+            if p["Content-Encoding"]:
+                log.write("ENCODED %s %s\n" % (name, p["Content-Encoding"]))
+                payload = gzip.decompress(payload)
+            if name == "content":
+                # Content is named by its hash, and kept for any upload.
+                log.write("CONTENT %s\n" % p.get_filename())
+                save(p.get_filename() + ".content", payload)
+            else:
+                fields[name] = payload
+        if self.path.endswith("/batch"):
+            # Item i's files are in the fields named "i.<field>".
+            batch = json.loads(fields["batch"])
+            log.write("BATCH %d\n" % len(batch))
+            results = []
+            for i, item in enumerate(batch):
+                prefix = "%d." % i
+                results.append(self.store(item["data"], dict(
+                    (name[len(prefix):], fields[name]) for name in fields
+                    if name.startswith(prefix))))
+            reply = {"results": results}
+        else:
+            log.write("POST %s\n" % " ".join(sorted(fields)))
+            reply = self.store(json.loads(fields["data"]), fields)
+        log.flush()
+        self.reply(200, json.dumps(reply).encode(), "application/json")
+
+    def store(self, data, fields):
+        key = "%s-%s" % (data["cpp_hash"], data["toolchain_id"])
+        content = os.path.join(store, "%s.content" % data.get("object_hash"))
+        if "object" not in fields and os.path.exists(content):
+            with open(content, "rb") as f:
+                fields["object"] = f.read()
+        if "object" in fields:
+            if data["stderr"]:
+                save(key + ".stderr", data["stderr"].encode())
+            save(key + ".o", fields["object"])
+            if "object_hash" in data:
+                save(key + ".o.hash", data["object_hash"].encode())
+        if "manifest" in fields:
+            save(data["manifest"] + ".manifest", fields["manifest"])
+        needed = []
+        if "manifest" in data and not os.path.exists(
+                os.path.join(store, data["manifest"] + ".manifest")):
+            needed.append(data["manifest"])
+        if (data["exit_status"] == 0
+                and not os.path.exists(os.path.join(store, key + ".o"))):
+            if "object_hash" in data and not needed:
+                return {"result": "content needed",
+                        "data": [data["object_hash"]]}
+            needed.append(data["object_path"])
+        if needed:
+            return {"result": "files needed", "data": needed}
+        return {"result": "success"}
+
+class Server(http.server.ThreadingHTTPServer):
+    def handle_error(self, request, client_address):
+        # Clients going away mid-request is nothing to report.
+        if not issubclass(sys.exc_info()[0], (ConnectionError, ssl.SSLError)):
+            super().handle_error(request, client_address)
+
+server = Server(("127.0.0.1", 0), Handler)
+context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+context.load_cert_chain(cert, key)
+server.socket = context.wrap_socket(server.socket, server_side=True)
+print(server.server_address[1], flush=True)
+server.serve_forever()
+EOF
+}
+
+# Start a daemon for the current cache directory and wait for its socket.
+start_cloud_daemon() {
+    mkdir -p $CS_CACHE_DIR
+    $CS --daemon >/dev/null 2>&1 &
+    cloud_pids="$cloud_pids $!"
+    i=0
+    while [ -z "`ls $CS_CACHE_DIR | grep '^daemon\.'`" ]; do
+        if [ $i -ge 100 ]; then
+            test_failed "The daemon did not start"
+        fi
+        sleep 0.1
+        i=`expr $i + 1`
+    done
+}
+
+# Wait for the stand-in server to hold a file matching a pattern.
+wait_for_cloud_file() {
+    i=0
+    while [ `find cloud-store -name "$1" | wc -l` -eq 0 ]; do
+        if [ $i -ge 100 ]; then
+            test_failed "No $1 was uploaded"
+        fi
+        sleep 0.1
+        i=`expr $i + 1`
+    done
+}
+
+# Wait for the daemon to have uploaded a number of results.
+wait_for_uploads() {
+    i=0
+    while ! $CS --daemon-stats | grep -q "^result uploads *$1 done, 0 failed"; do
+        if [ $i -ge 100 ]; then
+            test_failed "The daemon did not upload the results"
+        fi
+        sleep 0.1
+        i=`expr $i + 1`
+    done
+}
+
+# Wait for a statistics counter to reach a value. Results from the cloud are
+# counted once they have been posted in the background.
+wait_for_stat() {
+    i=0
+    while [ "`getstat "$1"`" != "$2" ]; do
+        if [ $i -ge 100 ]; then
+            checkstat "$1" "$2"
+        fi
+        sleep 0.1
+        i=`expr $i + 1`
+    done
+}
+
+cloud_suite() {
+    if ! python3 -c 'import ssl' 2>/dev/null \
+       || ! openssl version >/dev/null 2>&1; then
+        echo "python3 or openssl is missing; skipping the cloud suite"
+        return
+    fi
+
+    unset CS_NODIRECT
+    cloud_pids=
+    trap 'kill $cloud_pids 2>/dev/null' EXIT
+    saved_cache_dir=$CS_CACHE_DIR
+
+    openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+        -addext subjectAltName=DNS:localhost,IP:127.0.0.1 \
+        -keyout cloud-key.pem -out cloud-cert.pem >/dev/null 2>&1
+    write_cloud_server
+    rm -rf cloud-store cloud-server.log
+    mkdir cloud-store
+    python3 cloud-server.py cloud-cert.pem cloud-key.pem cloud-store \
+        >cloud-server.port &
+    cloud_pids="$cloud_pids $!"
+    i=0
+    while [ ! -s cloud-server.port ]; do
+        if [ $i -ge 100 ]; then
+            test_failed "The stand-in server did not start"
+        fi
+        sleep 0.1
+        i=`expr $i + 1`
+    done
+
+    CS_CLOUD_MODE=remote
+    CS_KEY=test
+    CS_SERVER=localhost:`cat cloud-server.port`
+    CS_DAEMON_CA_BUNDLE=`pwd`/cloud-cert.pem
+    export CS_KEY CS_SERVER CS_DAEMON_CA_BUNDLE
+
+    cat <<EOF >cloud.h
+int cloud_header;
+EOF
+    cat <<EOF >cloud.c
+#include "cloud.h"
+int cloud_source;
+EOF
+    backdate cloud.h
+    CS_DISABLE=1 $COMPILER -c -o reference_cloud.o cloud.c
+
+    testname="upload manifest"
+    CS_CACHE_DIR=`pwd`/.cscache-cloud1
+    start_cloud_daemon
+    $CS $COMPILER -c cloud.c
+    wait_for_stat 'cache miss' 1
+    wait_for_cloud_file '*.manifest'
+    wait_for_cloud_file '*.o'
+    # The daemon held the conversation with the server, not the client.
+    wait_for_uploads 1
+
+    testname="cloud hit from manifest"
+    CS_CACHE_DIR=`pwd`/.cscache-cloud2
+    start_cloud_daemon
+    rm -f cloud.o
+    : >$CS_LOGFILE
+    $CS $COMPILER -c cloud.c
+    wait_for_stat 'cache hit (cloud)' 1
+    checkstat 'cache hit (direct)' 0
+    checkstat 'cache hit (preprocessed)' 0
+    checkstat 'cache miss' 0
+    compare_file reference_cloud.o cloud.o
+    if grep -q "Running preprocessor" $CS_LOGFILE; then
+        test_failed "The preprocessor ran"
+    fi
+
+    testname="direct hit after cloud manifest"
+    $CS $COMPILER -c cloud.c
+    wait_for_stat 'cache hit (direct)' 1
+    checkstat 'cache hit (cloud)' 1
+    compare_file reference_cloud.o cloud.o
+
+    testname="cloud manifest with changed include"
+    CS_CACHE_DIR=`pwd`/.cscache-cloud3
+    start_cloud_daemon
+    cat <<EOF >cloud.h
+int cloud_header_changed;
+EOF
+    backdate cloud.h
+    $CS $COMPILER -c cloud.c
+    wait_for_stat 'cache miss' 1
+    checkstat 'cache hit (cloud)' 0
+
+    testname="race cancels a slow download"
+    CS_CACHE_DIR=`pwd`/.cscache-cloud4
+    start_cloud_daemon
+    echo 30 >cloud-store/delay
+    start=`date +%s`
+    CS_CLOUD_MODE=race $CS $COMPILER -c cloud.c
+    wait_for_stat 'cache miss' 1
+    if [ `expr \`date +%s\` - $start` -ge 10 ]; then
+        test_failed "The compile waited for the download"
+    fi
+    i=0
+    while ! $CS --daemon-stats | grep -q '^cancelled requests *1$'; do
+        if [ $i -ge 100 ]; then
+            test_failed "The download was not cancelled"
+        fi
+        sleep 0.1
+        i=`expr $i + 1`
+    done
+    rm cloud-store/delay
+
+    testname="race won by the cloud"
+    cat <<EOF >slow-compiler.sh
+#!/bin/sh
+# Compile slowly, but preprocess at the usual speed.
+case " \$* " in *" -E "*) ;; *) sleep 3 ;; esac
+exec $COMPILER "\$@"
+EOF
+    chmod +x slow-compiler.sh
+    CS_CACHE_DIR=`pwd`/.cscache-cloud5
+    start_cloud_daemon
+    CS_NODIRECT=1 $CS ./slow-compiler.sh -c cloud.c
+    wait_for_stat 'cache miss' 1
+    wait_for_uploads 1
+    CS_CACHE_DIR=`pwd`/.cscache-cloud6
+    start_cloud_daemon
+    start=`date +%s`
+    CS_NODIRECT=1 CS_CLOUD_MODE=race $CS ./slow-compiler.sh -c cloud.c
+    if [ `expr \`date +%s\` - $start` -ge 3 ]; then
+        test_failed "The compile waited for the compiler"
+    fi
+    wait_for_stat 'cache hit (cloud)' 1
+    checkstat 'cache miss' 0
+    checkfilecount 0 '*.L' $CS_CACHE_DIR
+    checkstat 'race won by the cloud' 1
+    checkstat 'race compiles started' 1
+    checkstat 'race compiles stopped' 1
+
+    testname="hedged race"
+    cat <<EOF >cloud2.c
+int cloud_source2;
+EOF
+    cat <<EOF >cloud3.c
+int cloud_source3;
+EOF
+    CS_CACHE_DIR=`pwd`/.cscache-cloud5
+    CS_NODIRECT=1 $CS ./slow-compiler.sh -c cloud2.c
+    wait_for_stat 'cache miss' 2
+    wait_for_uploads 2
+    CS_CACHE_DIR=`pwd`/.cscache-cloud7
+    CS_COSTS_LOG=1
+    export CS_COSTS_LOG
+    start_cloud_daemon
+    # With no history, the compiler starts at once. The slow miss and
+    # compile then set the head start to min(2s, 3s * 0.5).
+    echo 2 >cloud-store/delay
+    CS_NODIRECT=1 CS_CLOUD_MODE=hedged $CS ./slow-compiler.sh -c cloud3.c
+    wait_for_stat 'cache miss' 1
+    checkstat 'race compiles started' 1
+    echo 1 >cloud-store/delay
+    start=`date +%s`
+    CS_NODIRECT=1 CS_CLOUD_MODE=hedged $CS ./slow-compiler.sh -c cloud.c
+    if [ `expr \`date +%s\` - $start` -ge 3 ]; then
+        test_failed "The compile waited for the compiler"
+    fi
+    wait_for_stat 'cache hit (cloud)' 1
+    checkstat 'race won by the cloud' 1
+    checkstat 'race compiles started' 1
+    if [ -n "`getstat 'race compiles stopped'`" ]; then
+        test_failed "A compile was started and stopped"
+    fi
+
+    testname="hedged race clamped to the compile time"
+    CS_NODIRECT=1 CS_CLOUD_MODE=hedged CS_HEDGE_FRACTION=0.1 \
+        $CS ./slow-compiler.sh -c cloud2.c
+    wait_for_stat 'cache hit (cloud)' 2
+    checkstat 'race won by the cloud' 2
+    checkstat 'race compiles started' 2
+    checkstat 'race compiles stopped' 1
+    checkfilecount 0 '*.L' $CS_CACHE_DIR
+    rm cloud-store/delay
+
+    testname="simulate smart mode"
+    # Only the miss measured both a compile and a GET.
+    $CS --simulate-smart >simulate.out
+    if ! grep -q '^Replayed 1 of 3 recorded compiles$' simulate.out; then
+        test_failed "Unexpected simulation: `cat simulate.out`"
+    fi
+    unset CS_COSTS_LOG
+
+    testname="slow cloud falls back to compiling"
+    CS_CACHE_DIR=`pwd`/.cscache-cloud8
+    CS_DAEMON_BREAKER_TRIP=2
+    CS_DAEMON_BREAKER_PROBE=1
+    export CS_DAEMON_BREAKER_TRIP CS_DAEMON_BREAKER_PROBE
+    start_cloud_daemon
+    unset CS_DAEMON_BREAKER_TRIP CS_DAEMON_BREAKER_PROBE
+    echo 5 >cloud-store/delay
+    start=`date +%s`
+    CS_NODIRECT=1 CS_CLOUD_DEADLINE=500 $CS $COMPILER -c cloud2.c
+    CS_NODIRECT=1 CS_CLOUD_DEADLINE=500 $CS $COMPILER -c cloud3.c
+    if [ `expr \`date +%s\` - $start` -ge 4 ]; then
+        test_failed "The compiles waited for the cloud"
+    fi
+    wait_for_stat 'cache miss' 2
+    checkstat 'cache hit (cloud)' 0
+
+    testname="circuit breaker"
+    if ! $CS --daemon-stats | grep -q '^circuit breaker *open (1 trips'; then
+        test_failed "The circuit breaker did not open"
+    fi
+    start=`date +%s`
+    CS_NODIRECT=1 $CS $COMPILER -c cloud.c
+    if [ `expr \`date +%s\` - $start` -ge 2 ]; then
+        test_failed "The compile waited for the cloud"
+    fi
+    wait_for_stat 'cache miss' 3
+    if ! $CS --daemon-stats | grep -q '^circuit breaker .* 1 GETs refused'; then
+        test_failed "The GET was not refused"
+    fi
+    rm cloud-store/delay
+    i=0
+    while ! $CS --daemon-stats | grep -q '^circuit breaker *closed'; do
+        if [ $i -ge 100 ]; then
+            test_failed "The circuit breaker did not close"
+        fi
+        sleep 0.1
+        i=`expr $i + 1`
+    done
+
+    testname="batched uploads"
+    CS_CACHE_DIR=`pwd`/.cscache-cloud9
+    CS_DAEMON_BATCH_DELAY=2000
+    export CS_DAEMON_BATCH_DELAY
+    start_cloud_daemon
+    unset CS_DAEMON_BATCH_DELAY
+    objects=`find cloud-store -name '*.o' | wc -l`
+    for n in 1 2 3; do
+        echo "int batched_source$n;" >batch$n.c
+        CS_NODIRECT=1 $CS $COMPILER -c batch$n.c
+    done
+    wait_for_uploads 3
+    # All three went in one request, and so did their objects.
+    if ! grep -q '^BATCH 3$' cloud-server.log; then
+        test_failed "The uploads were not batched"
+    fi
+    if ! $CS --daemon-stats | grep -q '^upload batches *2, carrying 6'; then
+        test_failed "The objects were not batched"
+    fi
+    if [ `find cloud-store -name '*.o' | wc -l` -ne `expr $objects + 3` ]; then
+        test_failed "The objects were not stored"
+    fi
+
+    testname="content sent once"
+    CS_CACHE_DIR=`pwd`/.cscache-cloud11
+    CS_DAEMON_BATCH_DELAY=2000
+    export CS_DAEMON_BATCH_DELAY
+    start_cloud_daemon
+    unset CS_DAEMON_BATCH_DELAY
+    objects=`find cloud-store -name '*.o' | wc -l`
+    sent=`grep -c '^CONTENT ' cloud-server.log`
+    echo "int shared_content;" >shared.c
+    for flag in -Wall -Wextra; do
+        CS_NODIRECT=1 $CS $COMPILER $flag -c shared.c
+    done
+    wait_for_uploads 2
+    # The objects are the same, so the second upload waited for the first
+    # to send it, and then only named it.
+    if [ `grep -c '^CONTENT ' cloud-server.log` -ne `expr $sent + 1` ]; then
+        test_failed "The object was not sent just once"
+    fi
+    if ! $CS --daemon-stats | grep -q '^upload content *1 files sent, 1 shared'; then
+        test_failed "The object was not shared"
+    fi
+    if [ `find cloud-store -name '*.o' | wc -l` -ne `expr $objects + 2` ]; then
+        test_failed "The objects were not stored"
+    fi
+
+    testname="content the server has already"
+    CS_NODIRECT=1 $CS $COMPILER -Wshadow -c shared.c
+    wait_for_uploads 3
+    if [ `grep -c '^CONTENT ' cloud-server.log` -ne `expr $sent + 1` ]; then
+        test_failed "The object was sent again"
+    fi
+    if [ `find cloud-store -name '*.o' | wc -l` -ne `expr $objects + 3` ]; then
+        test_failed "The object was not stored"
+    fi
+
+    testname="spool results while the server is down"
+    CS_CACHE_DIR=`pwd`/.cscache-cloud10
+    CS_DAEMON_SPOOL_RETRY=1
+    export CS_DAEMON_SPOOL_RETRY
+    start_cloud_daemon
+    unset CS_DAEMON_SPOOL_RETRY
+    touch cloud-store/down
+    echo "int spooled_source;" >spool.c
+    CS_NODIRECT=1 $CS $COMPILER -c spool.c
+    i=0
+    while ! $CS --daemon-stats | grep -q '^result spool *1 spooled'; do
+        if [ $i -ge 100 ]; then
+            test_failed "The results were not spooled"
+        fi
+        sleep 0.1
+        i=`expr $i + 1`
+    done
+    checkfilecount 1 '*.json' $CS_CACHE_DIR/spool
+    objects=`find cloud-store -name '*.o' | wc -l`
+
+    testname="replay the spool once the server is back"
+    rm cloud-store/down
+    wait_for_uploads 1
+    if ! $CS --daemon-stats | grep -q '^result spool *1 spooled, 1 replayed'; then
+        test_failed "The spool was not replayed"
+    fi
+    if [ `find cloud-store -name '*.o' | wc -l` -ne `expr $objects + 1` ]; then
+        test_failed "The object was not stored"
+    fi
+    checkfilecount 0 '*.json' $CS_CACHE_DIR/spool
+    checkfilecount 0 '*-*' $CS_CACHE_DIR/spool/blobs
+
+    testname="encoded upload"
+    CS_CACHE_DIR=`pwd`/.cscache-cloud12
+    start_cloud_daemon
+    # An object big enough to be worth encoding.
+    echo "int encoded_data[] = {`seq -s , 1 8192`};" >encoded.c
+    CS_DISABLE=1 $COMPILER -c -o reference_encoded.o encoded.c
+    CS_NODIRECT=1 $CS $COMPILER -c encoded.c
+    wait_for_uploads 1
+    if ! grep -q '^ENCODED [a-z]* gzip$' cloud-server.log; then
+        test_failed "The object was not encoded"
+    fi
+    if ! $CS --daemon-stats | grep -q '^encoded uploads *1 parts'; then
+        test_failed "The encoded upload was not counted"
+    fi
+
+    testname="encoded download"
+    CS_CACHE_DIR=`pwd`/.cscache-cloud13
+    start_cloud_daemon
+    rm -f encoded.o
+    CS_NODIRECT=1 $CS $COMPILER -c encoded.c
+    wait_for_stat 'cache hit (cloud)' 1
+    compare_file reference_encoded.o encoded.o
+    if ! $CS --daemon-stats | grep -q '^encoded downloads *1 parts'; then
+        test_failed "The encoded download was not counted"
+    fi
+
+    testname="resumed download"
+    CS_CACHE_DIR=`pwd`/.cscache-cloud14
+    start_cloud_daemon
+    rm -f encoded.o
+    touch cloud-store/cut
+    CS_NODIRECT=1 $CS $COMPILER -c encoded.c
+    wait_for_stat 'cache hit (cloud)' 1
+    checkstat 'cache miss' 0
+    compare_file reference_encoded.o encoded.o
+    if ! grep -q '^RANGE [1-9]' cloud-server.log; then
+        test_failed "The download was not resumed with a range"
+    fi
+    if ! $CS --daemon-stats | grep -q '^resumed downloads *1, [1-9]'; then
+        test_failed "The resumed download was not counted"
+    fi
+
+    testname="download failing its hash"
+    CS_CACHE_DIR=`pwd`/.cscache-cloud15
+    start_cloud_daemon
+    rm -f encoded.o
+    touch cloud-store/corrupt
+    CS_NODIRECT=1 $CS $COMPILER -c encoded.c
+    rm cloud-store/corrupt
+    wait_for_stat 'cache miss' 1
+    checkstat 'cache hit (cloud)' 0
+    compare_file reference_encoded.o encoded.o
+    if ! $CS --daemon-stats | grep -q '1 failed their hash$'; then
+        test_failed "The damaged object was not caught"
+    fi
+
+    kill $cloud_pids 2>/dev/null
+    trap - EXIT
+    CS_CACHE_DIR=$saved_cache_dir
+    CS_CLOUD_MODE=offline
+    unset CS_KEY CS_SERVER CS_DAEMON_CA_BUNDLE
+}
+
 ######################################################################
 # main program
 
@@ -2111,6 +2752,7 @@ cleanup
 pch
 upgrade
 prefix
+cloud         !win32
 "
 
 case $host_os in
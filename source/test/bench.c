@@ -0,0 +1,545 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Microbenchmarks for the hot paths of the daemon and the client. Run them
+ * all with "make bench", or a single one with "test/bench NAME".
+ */
+
+#include "ccache.h"
+#include "encoding.h"
+#include "hostinfo.h"
+#include "jsonstream.h"
+#include "multipart.h"
+
+#include <json.h>
+#include <sys/time.h>
+
+static double
+seconds(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* A cheap, deterministic pseudo-random number generator. */
+static uint32_t bench_seed = 1;
+
+static uint32_t
+bench_rand(void)
+{
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return bench_seed >> 8;
+}
+
+/* Set result to the seconds a call takes, repeating it for a second. */
+#define TIME_CALLS(result, call) \
+	do { \
+		double start = seconds(); \
+		unsigned calls = 0; \
+		do { \
+			call; \
+			calls++; \
+			result = seconds() - start; \
+		} while (result < 1.0); \
+		result /= calls; \
+	} while (false)
+
+/* ------------------------------------------------------------------------ */
+
+static size_t multipart_bytes;
+static unsigned multipart_parts;
+
+static int
+count_begin(void *userdata, const char *headers, size_t headersize)
+{
+	(void)userdata;
+	(void)headers;
+	(void)headersize;
+	multipart_parts++;
+	return 1;
+}
+
+static int
+count_data(void *userdata, const char *data, size_t size)
+{
+	(void)userdata;
+	(void)data;
+	multipart_bytes += size;
+	return 1;
+}
+
+static int
+count_end(void *userdata)
+{
+	(void)userdata;
+	return 1;
+}
+
+static const struct multipart_callbacks counting_callbacks = {
+	count_begin, count_data, count_end
+};
+
+/*
+ * Build a response shaped like a cache hit from the server: a JSON data part,
+ * a stderr part and an object file attachment of object_size bytes. The
+ * object is random, with a sprinkling of near-miss delimiters.
+ */
+static char *
+make_cache_hit_response(size_t object_size, size_t *size)
+{
+	static const char boundary[] = "cs-bench-9a8b7c6d5e4f";
+	char *head, *tail, *response;
+	size_t head_len, tail_len, i;
+
+	head = format(
+		"\r\n--%s\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Location: /v1.0/cache/0123-4567?file=data\r\n\r\n"
+		"{\"exit_status\": 0}\r\n"
+		"--%s\r\n"
+		"Content-Disposition: attachment; filename=stderr\r\n\r\n"
+		"\r\n--%s\r\n"
+		"Content-Disposition: attachment; filename=object\r\n\r\n",
+		boundary, boundary, boundary);
+	tail = format("\r\n--%s--\r\n", boundary);
+	head_len = strlen(head);
+	tail_len = strlen(tail);
+
+	*size = head_len + object_size + tail_len;
+	response = x_malloc(*size);
+	memcpy(response, head, head_len);
+	for (i = 0; i < object_size; i++) {
+		response[head_len + i] = (char)bench_rand();
+	}
+	for (i = 0; i + 12 < object_size; i += 4096 + bench_rand() % 4096) {
+		memcpy(response + head_len + i, "\r\n--cs-bench", 12);
+	}
+	memcpy(response + head_len + object_size, tail, tail_len);
+
+	free(head);
+	free(tail);
+	return response;
+}
+
+static void
+bench_multipart(void)
+{
+	static const struct {
+		const char *name;
+		size_t min_chunk, max_chunk;
+	} patterns[] = {
+		{"16 KiB blocks", 16384, 16384},
+		{"1 B - 16 KiB", 1, 16384},
+		{"1 B - 1 KiB", 1, 1024},
+		{"1 B - 64 B", 1, 64},
+	};
+	size_t object_size = 4 * 1024 * 1024;
+	size_t size, p;
+	char *response = make_cache_hit_response(object_size, &size);
+
+	printf("multipart: %zu byte response, boundary split at random\n", size);
+	for (p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+		size_t total = 0;
+		double start = seconds(), elapsed;
+
+		do {
+			struct multipart_parser *parser =
+				multipart_new("cs-bench-9a8b7c6d5e4f", &counting_callbacks, NULL);
+			size_t offset = 0;
+
+			multipart_bytes = 0;
+			multipart_parts = 0;
+			while (offset < size) {
+				size_t n = patterns[p].min_chunk;
+				if (patterns[p].max_chunk > n) {
+					n += bench_rand() % (patterns[p].max_chunk - n + 1);
+				}
+				if (n > size - offset) {
+					n = size - offset;
+				}
+				multipart_feed(parser, response + offset, n);
+				offset += n;
+			}
+			multipart_finish(parser);
+			if (!multipart_complete(parser) || multipart_parts != 3
+			    || multipart_bytes < object_size) {
+				fatal("multipart benchmark parsed the response wrongly");
+			}
+			multipart_free(parser);
+			total += size;
+			elapsed = seconds() - start;
+		} while (elapsed < 1.0);
+
+		printf("  %-16s %8.1f MB/s\n", patterns[p].name,
+		       total / elapsed / 1000000);
+	}
+	free(response);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static int
+discard(void *userdata, const char *data, size_t size)
+{
+	(void)data;
+	*(size_t *)userdata += size;
+	return 1;
+}
+
+/* How small, and how fast, each content encoding makes an object on its way
+ * to and from the server. The benchmark's own executable stands in for a
+ * compiled object, since it has debug information much like one. */
+static void
+bench_encoding(void)
+{
+	static const struct {
+		enum encoding encoding;
+		int level;
+	} settings[] = {
+		{ENCODING_GZIP, 1},
+		{ENCODING_GZIP, 6},
+		{ENCODING_ZSTD, 1},
+		{ENCODING_ZSTD, 3},
+		{ENCODING_ZSTD, 9},
+	};
+	char *data, *encoded;
+	size_t size, encoded_size, buffer_size, s;
+
+	if (!read_file("/proc/self/exe", 0, &data, &size)) {
+		fatal("Failed to read /proc/self/exe");
+	}
+	buffer_size = size + size / 8 + 65536;
+	encoded = x_malloc(buffer_size);
+	printf("encoding: %zu byte executable\n", size);
+	for (s = 0; s < sizeof(settings) / sizeof(settings[0]); s++) {
+		size_t total = 0, decoded;
+		double start = seconds(), encode_time, decode_time;
+		long n;
+
+		if (!encoding_supported(settings[s].encoding)) {
+			continue;
+		}
+		do {
+			struct encoder *encoder = encoder_new(settings[s].encoding,
+			                                      settings[s].level, data, size);
+			encoded_size = 0;
+			do {
+				size_t room = buffer_size - encoded_size;
+				n = encoder_read(encoder, encoded + encoded_size,
+				                 room < 16384 ? room : 16384);
+				encoded_size += n > 0 ? n : 0;
+			} while (n > 0);
+			encoder_free(encoder);
+			if (n < 0) {
+				fatal("encoding benchmark failed to encode");
+			}
+			total += size;
+			encode_time = seconds() - start;
+		} while (encode_time < 1.0);
+		encode_time /= total;
+
+		total = 0;
+		start = seconds();
+		do {
+			struct decoder *decoder = decoder_new(settings[s].encoding, discard,
+			                                      &decoded);
+			decoded = 0;
+			if (!decoder_feed(decoder, encoded, encoded_size)
+			    || !decoder_finish(decoder) || decoded != size) {
+				fatal("encoding benchmark failed to decode");
+			}
+			decoder_free(decoder);
+			total += size;
+			decode_time = seconds() - start;
+		} while (decode_time < 1.0);
+		decode_time /= total;
+
+		printf("  %-4s level %-2d %5.1f%% on the wire,"
+		       " %7.1f MB/s encode, %7.1f MB/s decode\n",
+		       encoding_name(settings[s].encoding), settings[s].level,
+		       100.0 * encoded_size / size,
+		       1 / encode_time / 1000000, 1 / decode_time / 1000000);
+	}
+	free(encoded);
+	free(data);
+}
+
+/* ------------------------------------------------------------------------ */
+
+#define JSON_SOURCES 150
+
+static const char json_arg[] = "-I/usr/local/include/some/project";
+static const char json_hash[] = "fedcba9876543210fedcba9876543210-4321";
+
+/* Describe a compile much as the client does for the server, with the
+ * in-tree writer. */
+static char *
+describe_with_writer(char **sources)
+{
+	struct json_writer w;
+	int i;
+
+	jw_init(&w);
+	jw_begin_object(&w);
+	jw_key_string(&w, "cpp_hash", "0123456789abcdef0123456789abcdef-12345");
+	jw_key_string(&w, "stderr", "warning: \"x\" is unused\n");
+	jw_key_int(&w, "exit_status", 0);
+	jw_key(&w, "args");
+	jw_begin_array(&w);
+	for (i = 0; i < 20; i++) {
+		jw_string(&w, json_arg);
+	}
+	jw_end_array(&w);
+	jw_key(&w, "overall_duration");
+	jw_begin_array(&w);
+	jw_int(&w, 1);
+	jw_int(&w, 234567);
+	jw_end_array(&w);
+	jw_key(&w, "sources");
+	jw_begin_object(&w);
+	for (i = 0; i < JSON_SOURCES; i++) {
+		jw_key_string(&w, sources[i], json_hash);
+	}
+	jw_end_object(&w);
+	jw_key(&w, "client_config");
+	jw_begin_object(&w);
+	jw_key_bool(&w, "direct_mode", true);
+	jw_key_int(&w, "compression_level", 6);
+	jw_end_object(&w);
+	jw_end_object(&w);
+	return jw_finish(&w);
+}
+
+/* The same, with a json-c tree, as the client used to. */
+static char *
+describe_with_json_c(char **sources)
+{
+	json_object *jobj = json_object_new_object(), *jarray, *jsubobj;
+	char *text;
+	int i;
+
+	json_object_object_add(
+	  jobj, "cpp_hash",
+	  json_object_new_string("0123456789abcdef0123456789abcdef-12345"));
+	json_object_object_add(
+	  jobj, "stderr", json_object_new_string("warning: \"x\" is unused\n"));
+	json_object_object_add(jobj, "exit_status", json_object_new_int(0));
+	jarray = json_object_new_array();
+	for (i = 0; i < 20; i++) {
+		json_object_array_add(jarray, json_object_new_string(json_arg));
+	}
+	json_object_object_add(jobj, "args", jarray);
+	jarray = json_object_new_array();
+	json_object_array_add(jarray, json_object_new_int(1));
+	json_object_array_add(jarray, json_object_new_int(234567));
+	json_object_object_add(jobj, "overall_duration", jarray);
+	jsubobj = json_object_new_object();
+	for (i = 0; i < JSON_SOURCES; i++) {
+		json_object_object_add(jsubobj, sources[i],
+		                       json_object_new_string(json_hash));
+	}
+	json_object_object_add(jobj, "sources", jsubobj);
+	jsubobj = json_object_new_object();
+	json_object_object_add(jsubobj, "direct_mode",
+	                       json_object_new_boolean(true));
+	json_object_object_add(jsubobj, "compression_level",
+	                       json_object_new_int(6));
+	json_object_object_add(jobj, "client_config", jsubobj);
+	text = x_strdup(json_object_to_json_string(jobj));
+	json_object_put(jobj);
+	return text;
+}
+
+/* Pick the "result" out of a reply, and count the names in its "data". */
+static int
+read_reply_with_reader(const char *reply, size_t size)
+{
+	struct json_reader r;
+	enum json_token token;
+	int names = 0;
+
+	jr_init(&r, reply, size);
+	if (jr_next(&r) == JT_BEGIN_OBJECT) {
+		while ((token = jr_next(&r)) == JT_KEY) {
+			bool data = str_eq(r.string, "data");
+			token = jr_next(&r);
+			if (data && token == JT_BEGIN_ARRAY) {
+				while (jr_next(&r) == JT_STRING) {
+					names++;
+				}
+			} else if (!jr_skip(&r, token)) {
+				break;
+			}
+		}
+	}
+	jr_free(&r);
+	return names;
+}
+
+static int
+read_reply_with_json_c(const char *reply)
+{
+	json_object *jobj = json_tokener_parse(reply);
+	json_object *data = json_object_object_get(jobj, "data");
+	int names = json_object_array_length(data);
+
+	json_object_put(jobj);
+	return names;
+}
+
+/* How fast the client writes the description of a compile, and reads the
+ * reply to it, with the in-tree streaming writer and reader, and with the
+ * json-c trees they replaced. */
+static void
+bench_json(void)
+{
+	char *sources[JSON_SOURCES], *text, *reply;
+	size_t size;
+	double writer, json_c;
+	int i;
+
+	for (i = 0; i < JSON_SOURCES; i++) {
+		sources[i] = format("/usr/include/c++/9/bits/header_%u.h",
+		                    bench_rand() % 100000);
+	}
+	text = describe_with_writer(sources);
+	size = strlen(text);
+	printf("json: %zu byte description, %d sources\n", size, JSON_SOURCES);
+	free(text);
+
+	TIME_CALLS(writer, free(describe_with_writer(sources)));
+	TIME_CALLS(json_c, free(describe_with_json_c(sources)));
+	printf("  write %7.1f us in-tree, %7.1f us json-c\n",
+	       writer * 1000000, json_c * 1000000);
+
+	reply = x_strdup("{\"result\": \"files needed\", \"data\": [");
+	for (i = 0; i < JSON_SOURCES; i++) {
+		reformat(&reply, "%s%s\"%s\"",
+		         reply, i ? ", " : "", sources[i]);
+	}
+	reformat(&reply, "%s]}", reply);
+	size = strlen(reply);
+	if (read_reply_with_reader(reply, size) != JSON_SOURCES
+	    || read_reply_with_json_c(reply) != JSON_SOURCES) {
+		fatal("json benchmark failed to read its reply");
+	}
+	TIME_CALLS(writer, read_reply_with_reader(reply, size));
+	TIME_CALLS(json_c, read_reply_with_json_c(reply));
+	printf("  read  %7.1f us in-tree, %7.1f us json-c (%zu byte reply)\n",
+	       writer * 1000000, json_c * 1000000, size);
+
+	free(reply);
+	for (i = 0; i < JSON_SOURCES; i++) {
+		free(sources[i]);
+	}
+}
+
+/* ------------------------------------------------------------------------ */
+
+#define HOST_THREADS 128
+
+/* What finding the host facts for a post costs on a many-core machine, with
+ * the first stanza of this one's cpuinfo repeated for each thread, against
+ * reading them back from the file they are kept in. */
+static void
+bench_host(void)
+{
+	char dir[] = "/tmp/cs-bench.XXXXXX";
+	char *cpuinfo, *stanza, *end, *text, *kept;
+	struct host_info info;
+	double collect, read;
+	FILE *f;
+	int i;
+
+	stanza = read_text_file("/proc/cpuinfo", 0);
+	if (!stanza || !mkdtemp(dir)) {
+		fatal("host benchmark failed to set up");
+	}
+	end = strstr(stanza, "\n\n");
+	if (end) {
+		end[2] = '\0';
+	}
+	text = x_strdup("");
+	for (i = 0; i < HOST_THREADS; i++) {
+		reformat(&text, "%s%s", text, stanza);
+	}
+	cpuinfo = format("%s/cpuinfo", dir);
+	kept = format("%s/host", dir);
+	f = fopen(cpuinfo, "w");
+	if (!f || fputs(text, f) < 0 || fclose(f) != 0) {
+		fatal("host benchmark failed to write %s", cpuinfo);
+	}
+	printf("host: %d-thread cpuinfo, %zu bytes\n", HOST_THREADS,
+	       strlen(text));
+	free(text);
+	free(stanza);
+
+	host_info_collect(&info, cpuinfo, "/proc/meminfo");
+	if (info.cpu_thread_count != HOST_THREADS) {
+		fatal("host benchmark counted %d threads",
+		      info.cpu_thread_count);
+	}
+	host_info_write(kept, "bench", &info);
+	host_info_free(&info);
+
+	TIME_CALLS(collect, (host_info_collect(&info, cpuinfo, "/proc/meminfo"),
+	                     host_info_free(&info)));
+	TIME_CALLS(read, (host_info_read(kept, "bench", &info),
+	                  host_info_free(&info)));
+	printf("  collect %7.1f us, read back %7.1f us\n",
+	       collect * 1000000, read * 1000000);
+
+	unlink(cpuinfo);
+	unlink(kept);
+	rmdir(dir);
+	free(cpuinfo);
+	free(kept);
+}
+
+/* ------------------------------------------------------------------------ */
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} benchmarks[] = {
+	{"multipart", bench_multipart},
+	{"encoding", bench_encoding},
+	{"json", bench_json},
+	{"host", bench_host},
+};
+
+int
+main(int argc, char **argv)
+{
+	size_t i;
+	bool found = false;
+
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+		if (argc < 2 || str_eq(argv[1], benchmarks[i].name)) {
+			benchmarks[i].run();
+			found = true;
+		}
+	}
+	if (!found) {
+		fprintf(stderr, "Unknown benchmark: %s\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
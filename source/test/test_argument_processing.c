@@ -25,8 +25,6 @@
 #include "test/framework.h"
 #include "test/util.h"
 
-extern struct conf *conf;
-
 TEST_SUITE(argument_processing)
 
 TEST(dash_E_should_result_in_called_for_preprocessing)
@@ -91,7 +89,6 @@ TEST(dependency_flags_that_take_an_argument_should_not_require_space_delimiter)
 
 TEST(sysroot_should_be_rewritten_if_basedir_is_used)
 {
-	extern char *current_working_dir;
 	struct args *orig =
 		args_init_from_string("cc --sysroot=/some/directory -c foo.c");
 	struct args *act_cpp = NULL, *act_cc = NULL;
@@ -20,7 +20,7 @@
 #include "test/framework.h"
 #include "test/util.h"
 
-#define N_CONFIG_ITEMS 26
+#define N_CONFIG_ITEMS 35
 static struct {
 	char *descr;
 	const char *origin;
@@ -77,6 +77,15 @@ TEST(conf_create)
 	CHECK_STR_EQ("", conf->temporary_dir);
 	CHECK_INT_EQ(UINT_MAX, conf->umask);
 	CHECK(!conf->unify);
+	CHECK_STR_EQ("api.cloudsourcery.com", conf->cloud_server);
+	CHECK_STR_EQ("smart", conf->cloud_mode);
+	CHECK_STR_EQ("", conf->cloud_user_key);
+	CHECK_INT_EQ(0, conf->cloud_deadline);
+	CHECK(!conf->costs_log);
+	CHECK(conf->hedge_fraction == 0.5);
+	CHECK_INT_EQ(90, conf->hedge_percentile);
+	CHECK_INT_EQ(60, conf->inflight_timeout);
+	CHECK_INT_EQ(64 * 1000 * 1000, conf->spool_size);
 	conf_free(conf);
 }
 
@@ -260,6 +269,24 @@ TEST(conf_read_invalid_unsigned)
 	conf_free(conf);
 }
 
+TEST(conf_read_invalid_double)
+{
+	struct conf *conf = conf_create();
+	char *errmsg;
+
+	create_file("cs.conf", "hedge_fraction = -0.5");
+	CHECK(!conf_read(conf, "cs.conf", &errmsg));
+	CHECK_STR_EQ_FREE2("cs.conf:1: invalid non-negative number: \"-0.5\"",
+	                   errmsg);
+
+	create_file("cs.conf", "hedge_fraction = half");
+	CHECK(!conf_read(conf, "cs.conf", &errmsg));
+	CHECK_STR_EQ_FREE2("cs.conf:1: invalid non-negative number: \"half\"",
+	                   errmsg);
+
+	conf_free(conf);
+}
+
 TEST(verify_absolute_base_dir)
 {
 	struct conf *conf = conf_create();
@@ -293,6 +320,23 @@ TEST(verify_dir_levels)
 	conf_free(conf);
 }
 
+TEST(verify_percentile)
+{
+	struct conf *conf = conf_create();
+	char *errmsg;
+
+	create_file("cs.conf", "hedge_percentile = 0");
+	CHECK(!conf_read(conf, "cs.conf", &errmsg));
+	CHECK_STR_EQ_FREE2("cs.conf:1: percentile must be between 1 and 100",
+	                   errmsg);
+	create_file("cs.conf", "hedge_percentile = 101");
+	CHECK(!conf_read(conf, "cs.conf", &errmsg));
+	CHECK_STR_EQ_FREE2("cs.conf:1: percentile must be between 1 and 100",
+	                   errmsg);
+
+	conf_free(conf);
+}
+
 TEST(conf_update_from_environment)
 {
 	struct conf *conf = conf_create();
@@ -364,6 +408,15 @@ TEST(conf_print_items)
 		"td",
 		022,
 		true,
+		"cs",
+		"cm",
+		"ck",
+		500,
+		true,
+		0.25,
+		99,
+		30,
+		32 * 1000 * 1000,
 		NULL
 	};
 	size_t n = 0;
@@ -402,6 +455,15 @@ TEST(conf_print_items)
 	CHECK_STR_EQ("temporary_dir = td", received_conf_items[n++].descr);
 	CHECK_STR_EQ("umask = 022", received_conf_items[n++].descr);
 	CHECK_STR_EQ("unify = true", received_conf_items[n++].descr);
+	CHECK_STR_EQ("cloud_server = cs", received_conf_items[n++].descr);
+	CHECK_STR_EQ("cloud_mode = cm", received_conf_items[n++].descr);
+	CHECK_STR_EQ("cloud_key = ck", received_conf_items[n++].descr);
+	CHECK_STR_EQ("cloud_deadline = 500", received_conf_items[n++].descr);
+	CHECK_STR_EQ("costs_log = true", received_conf_items[n++].descr);
+	CHECK_STR_EQ("hedge_fraction = 0.25", received_conf_items[n++].descr);
+	CHECK_STR_EQ("hedge_percentile = 99", received_conf_items[n++].descr);
+	CHECK_STR_EQ("inflight_timeout = 30", received_conf_items[n++].descr);
+	CHECK_STR_EQ("spool_size = 32.0M", received_conf_items[n++].descr);
 
 	for (i = 0; i < N_CONFIG_ITEMS; ++i) {
 		char *expected = format("origin%zu", i);
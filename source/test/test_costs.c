@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "ccache.h"
+#include "costs.h"
+#include "test/framework.h"
+#include "test/util.h"
+
+static struct cost_observation
+observation(int32_t compile_time, int32_t get_time, int cloud_hit)
+{
+	struct cost_observation obs;
+	obs.compile_time = compile_time;
+	obs.get_time = get_time;
+	obs.cloud_hit = cloud_hit;
+	obs.object_size = 1000;
+	return obs;
+}
+
+/* A record of n compiles, each observing obs. */
+static struct cost_record
+record_of(int n, struct cost_observation obs)
+{
+	struct cost_record record;
+	memset(&record, 0, sizeof(record));
+	while (n-- > 0) {
+		costs_observe(&record, &obs);
+	}
+	return record;
+}
+
+TEST_SUITE(costs)
+
+TEST(observations_should_be_smoothed)
+{
+	struct cost_record record;
+	struct cost_observation obs = observation(1000, 100, 1);
+
+	memset(&record, 0, sizeof(record));
+	costs_observe(&record, &obs);
+	CHECK_INT_EQ(1000, record.compile_time);
+	CHECK_INT_EQ(100, record.hit_time);
+	CHECK_INT_EQ(0, record.miss_time);
+	CHECK_INT_EQ(1, record.cloud_tries);
+	CHECK_INT_EQ(1, record.cloud_hits);
+
+	obs = observation(2000, 300, 0);
+	costs_observe(&record, &obs);
+	CHECK_INT_EQ(1250, record.compile_time);
+	CHECK_INT_EQ(100, record.hit_time);
+	CHECK_INT_EQ(300, record.miss_time);
+	CHECK_INT_EQ(2, record.cloud_tries);
+	CHECK_INT_EQ(1, record.cloud_hits);
+
+	/* Nothing measured: nothing changes. */
+	obs = observation(-1, -1, -1);
+	costs_observe(&record, &obs);
+	CHECK_INT_EQ(1250, record.compile_time);
+	CHECK_INT_EQ(2, record.cloud_tries);
+}
+
+TEST(unknown_units_should_race_only_on_an_idle_machine)
+{
+	struct cost_record record = record_of(1, observation(1000, -1, -1));
+
+	CHECK_INT_EQ(COST_RACE, costs_choose(NULL, 0.5, 8));
+	CHECK_INT_EQ(COST_REMOTE, costs_choose(NULL, 4, 8));
+	CHECK_INT_EQ(COST_RACE, costs_choose(&record, 0.5, 8));
+	CHECK_INT_EQ(COST_REMOTE, costs_choose(&record, 4, 8));
+}
+
+TEST(an_idle_machine_should_race_a_cloud_that_can_win)
+{
+	struct cost_record record = record_of(4, observation(1000, 100, 1));
+	CHECK_INT_EQ(COST_RACE, costs_choose(&record, 0, 8));
+}
+
+TEST(a_busy_machine_should_ask_a_cloud_that_hits)
+{
+	struct cost_record record = record_of(4, observation(1000, 100, 1));
+	CHECK_INT_EQ(COST_REMOTE, costs_choose(&record, 16, 8));
+}
+
+TEST(a_cloud_slower_than_the_compiler_should_be_skipped)
+{
+	struct cost_record record = record_of(4, observation(100, 1000, 0));
+	CHECK_INT_EQ(COST_LOCAL, costs_choose(&record, 0, 8));
+}
+
+TEST(a_skipped_cloud_should_be_raced_now_and_then)
+{
+	struct cost_record record = record_of(4, observation(100, 1000, 0));
+	struct cost_observation local = observation(100, -1, -1);
+	struct cost_observation faster = observation(100, 20, 1);
+	int i;
+
+	for (i = 1; i < COSTS_EXPLORE_EVERY; i++) {
+		CHECK_INT_EQ(COST_LOCAL, costs_choose(&record, 0, 8));
+		costs_observe(&record, &local);
+	}
+	CHECK_INT_EQ(COSTS_EXPLORE_EVERY - 1, record.cloud_skips);
+	CHECK_INT_EQ(COST_RACE, costs_choose(&record, 0, 8));
+
+	/* The race finds the cloud faster now, so it keeps racing. */
+	for (i = 0; i < 4; i++) {
+		costs_observe(&record, &faster);
+	}
+	CHECK_INT_EQ(0, record.cloud_skips);
+	CHECK_INT_EQ(COST_RACE, costs_choose(&record, 0, 8));
+}
+
+TEST(records_should_survive_in_the_database)
+{
+	uint8_t keys[3][16];
+	const uint8_t *key0 = keys[0], *key1 = keys[1], *key2 = keys[2];
+	struct cost_record record;
+	struct cost_observation obs = observation(500, 50, 1);
+	int i;
+
+	memset(keys, 0, sizeof(keys));
+	keys[0][15] = 1;
+	keys[1][15] = 2;
+	keys[2][15] = 3;
+
+	CHECK(!costs_lookup("costs", keys[0], &record));
+	costs_update("costs", &key0, 1, &obs, NULL);
+	obs = observation(700, 70, 0);
+	costs_update("costs", &key1, 1, &obs, NULL);
+	costs_update("costs", &key1, 1, &obs, NULL);
+
+	CHECK(costs_lookup("costs", keys[0], &record));
+	CHECK_INT_EQ(500, record.compile_time);
+	CHECK_INT_EQ(50, record.hit_time);
+	CHECK_INT_EQ(1, record.cloud_tries);
+	CHECK(costs_lookup("costs", keys[1], &record));
+	CHECK_INT_EQ(700, record.compile_time);
+	CHECK_INT_EQ(70, record.miss_time);
+	CHECK_INT_EQ(2, record.cloud_tries);
+	CHECK(!costs_lookup("costs", keys[2], &record));
+
+	/* Keys that share slots displace each other, but only when full. */
+	for (i = 0; i < 20; i++) {
+		keys[2][4] = i;
+		costs_update("costs", &key2, 1, &obs, NULL);
+	}
+	CHECK(!costs_lookup("costs", keys[0], &record));
+	keys[2][4] = 19;
+	CHECK(costs_lookup("costs", keys[2], &record));
+}
+
+TEST(one_update_should_cover_every_key)
+{
+	uint8_t key0[16], key1[16];
+	const uint8_t *keys[] = {key0, key1};
+	struct cost_record record;
+	struct cost_observation obs = observation(500, 50, 1);
+
+	memset(key0, 1, sizeof(key0));
+	memset(key1, 2, sizeof(key1));
+	costs_update("costs", keys, 2, &obs, NULL);
+	CHECK(costs_lookup("costs", key0, &record));
+	CHECK_INT_EQ(500, record.compile_time);
+	CHECK(costs_lookup("costs", key1, &record));
+	CHECK_INT_EQ(500, record.compile_time);
+	CHECK(!path_exists("costs.log"));
+}
+
+#ifndef _WIN32
+TEST(an_update_should_not_wait_for_a_lock_file)
+{
+	uint8_t key[16];
+	const uint8_t *keys[] = {key};
+	struct cost_record record;
+	struct cost_observation obs = observation(500, 50, 1);
+	char *content;
+
+	/* As if a running process held the lock file the database once had. */
+	content = format("%s:%d:0", get_hostname(), (int)getpid());
+	CHECK_INT_EQ(0, symlink(content, "costs.lock"));
+	free(content);
+
+	memset(key, 3, sizeof(key));
+	costs_update("costs", keys, 1, &obs, NULL);
+	CHECK(costs_lookup("costs", key, &record));
+	CHECK(is_symlink("costs.lock"));
+}
+#endif
+
+TEST(a_big_log_should_be_moved_aside)
+{
+	struct cost_observation obs = observation(2000, -1, -1);
+	struct cost_log_entry local = {"local", 0, 8, NULL};
+	char *big = x_malloc(1024 * 1024 + 2);
+	char *text;
+
+	memset(big, 'x', 1024 * 1024 + 1);
+	big[1024 * 1024 + 1] = '\0';
+	create_file("costs.log", big);
+	free(big);
+
+	costs_update("costs", NULL, 0, &obs, &local);
+	CHECK(path_exists("costs.log.old"));
+	text = read_text_file("costs.log", 0);
+	CHECK_STR_EQ_FREE2("local 0.00 8 0 0 0 0 0 2000 -1 -1 1000\n", text);
+}
+
+TEST(a_database_that_is_not_one_should_be_replaced)
+{
+	uint8_t key[16];
+	const uint8_t *keys[] = {key};
+	struct cost_record record;
+	struct cost_observation obs = observation(500, 50, 1);
+
+	memset(key, 7, sizeof(key));
+	create_file("costs", "something else");
+	CHECK(!costs_lookup("costs", key, &record));
+	costs_update("costs", keys, 1, &obs, NULL);
+	CHECK(costs_lookup("costs", key, &record));
+}
+
+TEST(the_simulator_should_replay_the_log)
+{
+	struct cost_observation obs;
+	struct cost_record record = record_of(4, observation(1000, 100, 1));
+	struct cost_log_entry remote = {"remote", 0, 8, &record};
+	struct cost_log_entry local = {"local", 0, 8, NULL};
+	FILE *log, *out;
+	char *text;
+
+	/* A cloud hit, with the compile time from the record, and a local
+	   compile with nothing to go on, which can't be replayed. */
+	obs = observation(-1, 100, 1);
+	costs_update("costs", NULL, 0, &obs, &remote);
+	obs = observation(2000, -1, -1);
+	costs_update("costs", NULL, 0, &obs, &local);
+
+	log = fopen("costs.log", "r");
+	out = fopen("out", "w");
+	CHECK_INT_EQ(1, costs_simulate(log, out));
+	fclose(log);
+	fclose(out);
+	text = read_text_file("out", 0);
+	CHECK(strstr(text, "Replayed 1 of 2 recorded compiles\n"));
+	CHECK(strstr(text, "recorded        0.100 s      0.000 s\n"));
+	CHECK(strstr(text, "local           1.000 s      1.000 s\n"));
+	CHECK(strstr(text, "remote          0.100 s      0.000 s\n"));
+	CHECK(strstr(text, "race            0.100 s      0.100 s\n"));
+	CHECK(strstr(text, "smart           0.100 s      0.100 s\n"));
+	free(text);
+}
+
+TEST_SUITE_END
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "ccache.h"
+#include "encoding.h"
+#include "test/framework.h"
+
+struct sink {
+	char *data;
+	size_t size;
+};
+
+static int
+collect(void *userdata, const char *data, size_t size)
+{
+	struct sink *sink = userdata;
+	sink->data = x_realloc(sink->data, sink->size + size);
+	memcpy(sink->data + sink->size, data, size);
+	sink->size += size;
+	return 1;
+}
+
+/* Data that compresses, but not to nothing. */
+static char *
+make_data(size_t size)
+{
+	char *data = x_malloc(size);
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		data[i] = "abcdefgh"[(i * 7 + i / 100) % 8];
+	}
+	return data;
+}
+
+/* Encode data with encoding, reading at most step bytes at a time. */
+static char *
+encode(enum encoding encoding, const char *data, size_t size, size_t step,
+       size_t *encoded_size)
+{
+	struct encoder *encoder = encoder_new(encoding, 1, data, size);
+	char *encoded = NULL;
+	long n;
+
+	*encoded_size = 0;
+	do {
+		encoded = x_realloc(encoded, *encoded_size + step);
+		n = encoder_read(encoder, encoded + *encoded_size, step);
+		if (n < 0) {
+			break;
+		}
+		*encoded_size += n;
+	} while (n > 0);
+	encoder_free(encoder);
+	return encoded;
+}
+
+/* Check that data survives a round trip through encoding, fed to the
+ * decoder step bytes at a time. */
+static bool
+round_trip(enum encoding encoding, size_t size, size_t step)
+{
+	char *data = make_data(size), *encoded;
+	size_t encoded_size, offset;
+	struct sink sink = {NULL, 0};
+	struct decoder *decoder = decoder_new(encoding, collect, &sink);
+	bool ok = true;
+
+	encoded = encode(encoding, data, size, step, &encoded_size);
+	for (offset = 0; ok && offset < encoded_size; offset += step) {
+		size_t n = step;
+		if (n > encoded_size - offset) {
+			n = encoded_size - offset;
+		}
+		ok = decoder_feed(decoder, encoded + offset, n);
+	}
+	ok = ok && decoder_finish(decoder)
+	     && sink.size == size && memcmp(sink.data, data, size) == 0;
+	decoder_free(decoder);
+	free(sink.data);
+	free(encoded);
+	free(data);
+	return ok;
+}
+
+TEST_SUITE(encoding)
+
+TEST(names_should_parse_ignoring_case)
+{
+	enum encoding encoding = ENCODING_IDENTITY;
+
+	CHECK(encoding_parse("GZip", 4, &encoding));
+	CHECK_INT_EQ(ENCODING_GZIP, encoding);
+	CHECK(encoding_parse("x-gzip", 6, &encoding));
+	CHECK_INT_EQ(ENCODING_GZIP, encoding);
+	CHECK(encoding_parse("zstd, gzip", 4, &encoding));
+	CHECK_INT_EQ(ENCODING_ZSTD, encoding);
+	CHECK(!encoding_parse("br", 2, &encoding));
+	CHECK(!encoding_parse("gzipped", 7, &encoding));
+}
+
+TEST(gzip_should_round_trip)
+{
+	CHECK(round_trip(ENCODING_GZIP, 0, 4096));
+	CHECK(round_trip(ENCODING_GZIP, 100000, 16384));
+	CHECK(round_trip(ENCODING_GZIP, 300000, 7));
+}
+
+TEST(identity_should_round_trip)
+{
+	CHECK(round_trip(ENCODING_IDENTITY, 100000, 999));
+}
+
+#ifdef HAVE_LIBZSTD
+TEST(zstd_should_round_trip)
+{
+	CHECK(round_trip(ENCODING_ZSTD, 0, 4096));
+	CHECK(round_trip(ENCODING_ZSTD, 100000, 16384));
+	CHECK(round_trip(ENCODING_ZSTD, 300000, 7));
+}
+#endif
+
+TEST(truncated_streams_should_fail)
+{
+	char *data = make_data(100000), *encoded;
+	size_t encoded_size;
+	struct sink sink = {NULL, 0};
+	struct decoder *decoder = decoder_new(ENCODING_GZIP, collect, &sink);
+
+	encoded = encode(ENCODING_GZIP, data, 100000, 4096, &encoded_size);
+	CHECK(decoder_feed(decoder, encoded, encoded_size - 1));
+	CHECK(!decoder_finish(decoder));
+	decoder_free(decoder);
+	free(sink.data);
+	free(encoded);
+	free(data);
+}
+
+TEST(corrupt_streams_should_fail)
+{
+	struct sink sink = {NULL, 0};
+	struct decoder *decoder = decoder_new(ENCODING_GZIP, collect, &sink);
+
+	CHECK(!decoder_feed(decoder, "not gzip at all", 15));
+	decoder_free(decoder);
+	free(sink.data);
+}
+
+TEST_SUITE_END
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "ccache.h"
+#include "histogram.h"
+#include "test/framework.h"
+#include "test/util.h"
+
+TEST_SUITE(histogram)
+
+TEST(empty_histogram_should_report_zero)
+{
+	struct histogram h;
+
+	histogram_reset(&h);
+	CHECK_INT_EQ(0, h.count);
+	CHECK_INT_EQ(0, histogram_mean(&h));
+	CHECK_INT_EQ(0, histogram_percentile(&h, 50));
+	CHECK_INT_EQ(0, histogram_percentile(&h, 100));
+}
+
+TEST(small_values_should_have_their_own_buckets)
+{
+	uint64_t i;
+
+	for (i = 0; i < HISTOGRAM_SUB_BUCKETS; i++) {
+		CHECK_INT_EQ(i, histogram_bucket_index(i));
+		CHECK_INT_EQ(i, histogram_bucket_low(i));
+		CHECK_INT_EQ(i, histogram_bucket_high(i));
+	}
+}
+
+TEST(buckets_should_be_contiguous_and_accurate)
+{
+	size_t i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+		uint64_t low = histogram_bucket_low(i);
+		uint64_t high = histogram_bucket_high(i);
+
+		CHECK(low <= high);
+		CHECK(histogram_bucket_low(i + 1) == high + 1);
+		CHECK(histogram_bucket_index(low) == i);
+		CHECK(histogram_bucket_index(high) == i);
+		CHECK((high - low) * 16 <= low);
+	}
+}
+
+TEST(huge_values_should_land_in_last_bucket)
+{
+	struct histogram h;
+
+	histogram_reset(&h);
+	histogram_record(&h, UINT64_MAX / 2);
+	CHECK_INT_EQ(HISTOGRAM_BUCKETS - 1, histogram_bucket_index(UINT64_MAX / 2));
+	CHECK_INT_EQ(1, h.buckets[HISTOGRAM_BUCKETS - 1]);
+	CHECK(histogram_percentile(&h, 50) == UINT64_MAX / 2);
+}
+
+TEST(record_should_track_count_min_max_and_mean)
+{
+	struct histogram h;
+
+	histogram_reset(&h);
+	histogram_record(&h, 300);
+	histogram_record(&h, 100);
+	histogram_record(&h, 200);
+	CHECK_INT_EQ(3, h.count);
+	CHECK_INT_EQ(100, h.min);
+	CHECK_INT_EQ(300, h.max);
+	CHECK_INT_EQ(200, histogram_mean(&h));
+}
+
+TEST(percentiles_should_be_within_bucket_precision)
+{
+	struct histogram h;
+	uint64_t i, p50, p99;
+
+	histogram_reset(&h);
+	for (i = 1; i <= 10000; i++) {
+		histogram_record(&h, i * 100);
+	}
+
+	p50 = histogram_percentile(&h, 50);
+	CHECK(p50 >= 500000 && p50 <= 500000 + 500000 / 16);
+	p99 = histogram_percentile(&h, 99);
+	CHECK(p99 >= 990000 && p99 <= 990000 + 990000 / 16);
+	CHECK_INT_EQ(1000000, histogram_percentile(&h, 100));
+	CHECK_INT_EQ(100, histogram_percentile(&h, 0));
+}
+
+TEST(percentiles_should_see_the_tail)
+{
+	struct histogram h;
+	int i;
+
+	histogram_reset(&h);
+	for (i = 0; i < 990; i++) {
+		histogram_record(&h, 1000);
+	}
+	for (i = 0; i < 10; i++) {
+		histogram_record(&h, 5000000);
+	}
+
+	CHECK(histogram_percentile(&h, 50) < 1100);
+	CHECK(histogram_percentile(&h, 99) < 1100);
+	CHECK(histogram_percentile(&h, 99.9) == 5000000);
+}
+
+TEST_SUITE_END
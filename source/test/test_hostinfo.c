@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "ccache.h"
+#include "hostinfo.h"
+#include "test/framework.h"
+#include "test/util.h"
+
+/* A cpuinfo with a stanza for each of threads threads. */
+static void
+create_cpuinfo(const char *path, int threads)
+{
+	char *text = x_strdup("");
+	int i;
+
+	for (i = 0; i < threads; i++) {
+		reformat(&text,
+		         "%sprocessor\t: %d\n"
+		         "vendor_id\t: GenuineIntel\n"
+		         "model name\t: Test CPU @ 3.00GHz\n"
+		         "cpu cores\t: %d\n"
+		         "flags\t\t: fpu vme de pse tsc msr pae mce cx8\n"
+		         "\n",
+		         text, i, threads / 2);
+	}
+	create_file(path, text);
+	free(text);
+}
+
+TEST_SUITE(hostinfo)
+
+TEST(facts_should_be_collected_from_proc_files)
+{
+	struct host_info info;
+
+	create_cpuinfo("cpuinfo", 8);
+	create_file("meminfo",
+	            "MemTotal:       16318756 kB\nMemFree:         1234 kB\n");
+	host_info_collect(&info, "cpuinfo", "meminfo");
+	CHECK_STR_EQ("Test CPU @ 3.00GHz", info.cpu_model);
+	CHECK_INT_EQ(4, info.cpu_core_count);
+	CHECK_INT_EQ(8, info.cpu_thread_count);
+	CHECK_STR_EQ("16318756", info.mem);
+	CHECK(info.sysname[0] != '\0');
+	host_info_free(&info);
+}
+
+TEST(missing_facts_should_be_unknown)
+{
+	struct host_info info;
+
+	create_file("meminfo", "MemTotal: lots\n");
+	host_info_collect(&info, "nonexistent", "meminfo");
+	CHECK_STR_EQ("unknown", info.cpu_model);
+	CHECK_INT_EQ(0, info.cpu_core_count);
+	CHECK_INT_EQ(0, info.cpu_thread_count);
+	CHECK_STR_EQ("unknown", info.mem);
+	host_info_free(&info);
+}
+
+TEST(facts_should_be_kept_for_their_boot)
+{
+	struct host_info info, kept;
+
+	create_cpuinfo("cpuinfo", 2);
+	create_file("meminfo", "MemTotal: 1024 kB\n");
+	host_info_collect(&info, "cpuinfo", "meminfo");
+	host_info_write("host", "boot-1", &info);
+
+	CHECK(host_info_read("host", "boot-1", &kept));
+	CHECK_STR_EQ(info.sysname, kept.sysname);
+	CHECK_STR_EQ(info.release, kept.release);
+	CHECK_STR_EQ(info.version, kept.version);
+	CHECK_STR_EQ(info.machine, kept.machine);
+	CHECK_STR_EQ("Test CPU @ 3.00GHz", kept.cpu_model);
+	CHECK_INT_EQ(1, kept.cpu_core_count);
+	CHECK_INT_EQ(2, kept.cpu_thread_count);
+	CHECK_STR_EQ("1024", kept.mem);
+	host_info_free(&kept);
+
+	CHECK(!host_info_read("host", "boot-2", &kept));
+	CHECK(!host_info_read("nonexistent", "boot-1", &kept));
+	host_info_free(&info);
+}
+
+TEST(broken_files_should_not_be_read)
+{
+	struct host_info info;
+
+	create_file("host", "cs host 1\nboot-1\nLinux\n");
+	CHECK(!host_info_read("host", "boot-1", &info));
+	create_file("host", "cs host 0\nboot-1\na\nb\nc\nd\ne\n1\n2\nf\n");
+	CHECK(!host_info_read("host", "boot-1", &info));
+}
+
+TEST_SUITE_END
@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "ccache.h"
+#include "jsonstream.h"
+#include "test/framework.h"
+
+#include <json.h>
+
+/* Read text to its end, and return the tokens as a string of letters, one
+ * per token, with E for an error. */
+static char *
+tokens(const char *text)
+{
+	static const char letters[] = "E.{}[]ksn10-";
+	struct json_reader r;
+	char result[100];
+	size_t n = 0;
+	enum json_token token;
+
+	jr_init(&r, text, strlen(text));
+	do {
+		token = jr_next(&r);
+		result[n++] = letters[token];
+	} while (token != JT_END && token != JT_ERROR
+	         && n < sizeof(result) - 1);
+	result[n] = '\0';
+	jr_free(&r);
+	return x_strdup(result);
+}
+
+/* Read the single string value text, and return it unescaped. */
+static char *
+read_string(const char *text)
+{
+	struct json_reader r;
+	char *s = NULL;
+
+	jr_init(&r, text, strlen(text));
+	if (jr_next(&r) == JT_STRING) {
+		s = x_strdup(r.string);
+	}
+	jr_free(&r);
+	return s;
+}
+
+TEST_SUITE(jsonstream)
+
+TEST(writer_should_separate_members_and_elements)
+{
+	struct json_writer w;
+
+	jw_init(&w);
+	jw_begin_object(&w);
+	jw_key_string(&w, "a", "x");
+	jw_key(&w, "b");
+	jw_begin_array(&w);
+	jw_int(&w, 1);
+	jw_int(&w, -2);
+	jw_begin_object(&w);
+	jw_end_object(&w);
+	jw_begin_array(&w);
+	jw_end_array(&w);
+	jw_end_array(&w);
+	jw_key_bool(&w, "c", true);
+	jw_key_string(&w, "d", NULL);
+	jw_key(&w, "e");
+	jw_raw(&w, "{\"f\":false}");
+	jw_key_int(&w, "g", INT64_C(9876543210));
+	jw_end_object(&w);
+	CHECK_STR_EQ_FREE2(
+	  "{\"a\":\"x\",\"b\":[1,-2,{},[]],\"c\":true,\"d\":null,"
+	  "\"e\":{\"f\":false},\"g\":9876543210}",
+	  jw_finish(&w));
+}
+
+TEST(writer_should_escape_strings)
+{
+	struct json_writer w;
+	json_object *jobj;
+	char *text;
+
+	jw_init(&w);
+	jw_begin_array(&w);
+	jw_string(&w,
+	          "quote\" backslash\\ tab\t nl\n cr\r \x01 \x1f caf\xc3\xa9");
+	jw_end_array(&w);
+	text = jw_finish(&w);
+	CHECK_STR_EQ(
+	  "[\"quote\\\" backslash\\\\ tab\\t nl\\n cr\\r \\u0001 \\u001f"
+	  " caf\xc3\xa9\"]",
+	  text);
+
+	/* And json-c reads back what was written. */
+	jobj = json_tokener_parse(text);
+	CHECK(jobj && !is_error(jobj));
+	CHECK_STR_EQ(
+	  "quote\" backslash\\ tab\t nl\n cr\r \x01 \x1f caf\xc3\xa9",
+	  json_object_get_string(json_object_array_get_idx(jobj, 0)));
+	json_object_put(jobj);
+	free(text);
+}
+
+TEST(reader_should_return_tokens)
+{
+	CHECK_STR_EQ_FREE2("{ksk[n1-0]knk{}}.",
+	                   tokens(" {\"a\": \"b\", \"c\": [1, true, null,"
+	                          " false], \"d\": -1.5e3, \"e\": {}} "));
+	CHECK_STR_EQ_FREE2("[[[]]].", tokens("[[[]]]"));
+	CHECK_STR_EQ_FREE2("s.", tokens("\"\""));
+	CHECK_STR_EQ_FREE2("n.", tokens("0"));
+}
+
+TEST(reader_should_read_numbers)
+{
+	struct json_reader r;
+
+	jr_init(&r, "[-9876543210, 2.5, 1e2]", 23);
+	CHECK_INT_EQ(JT_BEGIN_ARRAY, jr_next(&r));
+	CHECK_INT_EQ(JT_NUMBER, jr_next(&r));
+	CHECK(r.integer);
+	CHECK(r.number == INT64_C(-9876543210));
+	CHECK_INT_EQ(JT_NUMBER, jr_next(&r));
+	CHECK(!r.integer);
+	CHECK_INT_EQ(2, r.number);
+	CHECK_INT_EQ(JT_NUMBER, jr_next(&r));
+	CHECK(!r.integer);
+	CHECK_INT_EQ(100, r.number);
+	CHECK_INT_EQ(JT_END_ARRAY, jr_next(&r));
+	CHECK_INT_EQ(JT_END, jr_next(&r));
+	jr_free(&r);
+}
+
+TEST(reader_should_unescape_strings)
+{
+	CHECK_STR_EQ_FREE2(
+	  "a\"b\\c/d\be\ff\ng\rh\ti",
+	  read_string("\"a\\\"b\\\\c\\/d\\be\\ff\\ng\\rh\\ti\""));
+	CHECK_STR_EQ_FREE2("A\xc3\xa9\xe2\x82\xac",
+	                   read_string("\"\\u0041\\u00e9\\u20AC\""));
+	/* U+1F600, as a surrogate pair. */
+	CHECK_STR_EQ_FREE2("\xf0\x9f\x98\x80",
+	                   read_string("\"\\ud83d\\ude00\""));
+	CHECK(!read_string("\"\\ud83d\""));
+	CHECK(!read_string("\"\\ude00\""));
+	CHECK(!read_string("\"\\x\""));
+	CHECK(!read_string("\"tab\tinside\""));
+	CHECK(!read_string("\"unterminated"));
+}
+
+TEST(reader_should_stop_at_errors)
+{
+	CHECK_STR_EQ_FREE2("[nE", tokens("[1,]"));
+	CHECK_STR_EQ_FREE2("{E", tokens("{\"a\"}"));
+	CHECK_STR_EQ_FREE2("{ksE", tokens("{\"a\": \"b\",}"));
+	CHECK_STR_EQ_FREE2("{knE", tokens("{\"a\": 1]"));
+	CHECK_STR_EQ_FREE2("[nE", tokens("[1"));
+	CHECK_STR_EQ_FREE2("n.", tokens("1"));
+	CHECK_STR_EQ_FREE2("nE", tokens("1 2"));
+	CHECK_STR_EQ_FREE2("{}E", tokens("{} x"));
+	CHECK_STR_EQ_FREE2("E", tokens("tru"));
+	CHECK_STR_EQ_FREE2("E", tokens("]"));
+	CHECK_STR_EQ_FREE2("E", tokens(""));
+}
+
+TEST(reader_should_limit_nesting)
+{
+	char text[200], *result;
+
+	memset(text, '[', sizeof(text) - 1);
+	text[sizeof(text) - 1] = '\0';
+	result = tokens(text);
+	CHECK(strchr(result, 'E'));
+	free(result);
+}
+
+TEST(reader_should_skip_values)
+{
+	const char *text = "{\"a\": {\"b\": [1, {\"c\": []}]}, \"d\": 2}";
+	struct json_reader r;
+
+	jr_init(&r, text, strlen(text));
+	CHECK_INT_EQ(JT_BEGIN_OBJECT, jr_next(&r));
+	CHECK_INT_EQ(JT_KEY, jr_next(&r));
+	CHECK(jr_skip(&r, jr_next(&r)));
+	CHECK_INT_EQ(JT_KEY, jr_next(&r));
+	CHECK_STR_EQ("d", r.string);
+	CHECK(jr_skip(&r, jr_next(&r)));
+	CHECK_INT_EQ(JT_END_OBJECT, jr_next(&r));
+	CHECK_INT_EQ(JT_END, jr_next(&r));
+	CHECK(!jr_skip(&r, JT_END));
+	jr_free(&r);
+
+	text = "[{\"a\": [}]";
+	jr_init(&r, text, strlen(text));
+	CHECK_INT_EQ(JT_BEGIN_ARRAY, jr_next(&r));
+	CHECK(!jr_skip(&r, jr_next(&r)));
+	jr_free(&r);
+}
+
+TEST_SUITE_END
@@ -76,6 +76,57 @@ TEST(failed_lock_breaking)
 	create_file("test.lock", "");
 	CHECK(!lockfile_acquire("test", 1000));
 }
+
+TEST(lock_of_dead_process_is_broken_at_once)
+{
+	char *content;
+	pid_t pid;
+
+	/* A process that is sure not to exist any more. */
+	pid = fork();
+	if (pid == 0) {
+		_exit(0);
+	}
+	CHECK(pid > 0);
+	CHECK_INT_EQ(pid, waitpid(pid, NULL, 0));
+
+	content = format("%s:%d:0", get_hostname(), (int)pid);
+	CHECK_INT_EQ(0, symlink(content, "test.lock"));
+	free(content);
+
+	/* Without the shortcut, this would wait for an hour. */
+	CHECK(lockfile_acquire("test", 3600U * 1000000));
+	content = x_readlink("test.lock");
+	CHECK(content);
+	CHECK(str_startswith(content, get_hostname()));
+	CHECK_INT_EQ(getpid(), atoi(content + strlen(get_hostname()) + 1));
+	free(content);
+}
+
+TEST(wait_should_not_break_lock_of_live_process)
+{
+	char *content, *p;
+
+	content = format("%s:%d:0", get_hostname(), (int)getpid());
+	CHECK_INT_EQ(0, symlink(content, "test.lock"));
+
+	CHECK(!lockfile_wait("test", 1000));
+	p = x_readlink("test.lock");
+	CHECK_STR_EQ_FREE12(content, p);
+}
+
+TEST(release_should_leave_lock_taken_by_someone_else)
+{
+	char *p;
+
+	CHECK(lockfile_acquire("test", 1000));
+	CHECK_INT_EQ(0, unlink("test.lock"));
+	CHECK_INT_EQ(0, symlink("foo", "test.lock"));
+
+	lockfile_release("test");
+	p = x_readlink("test.lock");
+	CHECK_STR_EQ_FREE2("foo", p);
+}
 #endif
 
 TEST_SUITE_END
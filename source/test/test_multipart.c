@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "ccache.h"
+#include "multipart.h"
+#include "test/framework.h"
+#include "test/util.h"
+
+#define MAX_PARTS 8
+
+/* Part 0 is the preamble. */
+struct recording {
+	int parts;
+	int ended;
+	char *headers[MAX_PARTS];
+	char *data[MAX_PARTS];
+	size_t datasize[MAX_PARTS];
+};
+
+static int
+record_begin(void *userdata, const char *headers, size_t headersize)
+{
+	struct recording *r = userdata;
+	if (++r->parts >= MAX_PARTS) {
+		return 0;
+	}
+	r->headers[r->parts] = x_strndup(headers, headersize);
+	r->data[r->parts] = x_strdup("");
+	return 1;
+}
+
+static int
+record_data(void *userdata, const char *data, size_t size)
+{
+	struct recording *r = userdata;
+	size_t old = r->datasize[r->parts];
+	r->data[r->parts] = x_realloc(r->data[r->parts], old + size + 1);
+	memcpy(r->data[r->parts] + old, data, size);
+	r->data[r->parts][old + size] = '\0';
+	r->datasize[r->parts] += size;
+	return 1;
+}
+
+static int
+record_end(void *userdata)
+{
+	struct recording *r = userdata;
+	r->ended++;
+	return 1;
+}
+
+static const struct multipart_callbacks recorder = {
+	record_begin, record_data, record_end
+};
+
+static void
+free_recording(struct recording *r)
+{
+	int i;
+	for (i = 0; i < MAX_PARTS; i++) {
+		free(r->headers[i]);
+		free(r->data[i]);
+	}
+	memset(r, 0, sizeof(*r));
+}
+
+/*
+ * Parse message in chunks of random size (or all at once if max_chunk is 0),
+ * and return whether the message was complete.
+ */
+static bool
+parse(const char *message, size_t size, size_t max_chunk, struct recording *r)
+{
+	struct multipart_parser *parser = multipart_new("XyZ", &recorder, r);
+	size_t offset = 0;
+	bool complete;
+
+	memset(r, 0, sizeof(*r));
+	while (offset < size) {
+		size_t n = max_chunk ? 1 + rand() % max_chunk : size;
+		if (n > size - offset) {
+			n = size - offset;
+		}
+		multipart_feed(parser, message + offset, n);
+		offset += n;
+	}
+	multipart_finish(parser);
+	complete = multipart_complete(parser);
+	multipart_free(parser);
+	return complete;
+}
+
+static const char message[] =
+	"preamble\r\n"
+	"--XyZ\r\n"
+	"Content-Type: application/json\r\n"
+	"Content-Location: x?file=data\r\n"
+	"\r\n"
+	"{\"exit_status\": 0}\r\n"
+	"--XyZ\r\n"
+	"Content-Disposition: attachment; filename=object\r\n"
+	"\r\n"
+	"\r\n--X\r\n--Xy\r\r\n--XyY\n-\r\n--\r\n"
+	"\r\n--XyZ--\r\n"
+	"epilogue\r\n--XyZ\r\n";
+
+TEST_SUITE(multipart)
+
+TEST(whole_message_should_be_split_into_parts)
+{
+	struct recording r;
+
+	CHECK(parse(message, strlen(message), 0, &r));
+	CHECK_INT_EQ(2, r.parts);
+	CHECK_INT_EQ(3, r.ended);
+	CHECK_STR_EQ("preamble", r.data[0]);
+	CHECK_STR_EQ("Content-Type: application/json\r\n"
+	              "Content-Location: x?file=data\r\n", r.headers[1]);
+	CHECK_STR_EQ("{\"exit_status\": 0}", r.data[1]);
+	CHECK_STR_EQ("Content-Disposition: attachment; filename=object\r\n",
+	              r.headers[2]);
+	CHECK_STR_EQ("\r\n--X\r\n--Xy\r\r\n--XyY\n-\r\n--\r\n", r.data[2]);
+	free_recording(&r);
+}
+
+TEST(random_chunks_should_give_the_same_parts)
+{
+	struct recording whole, r;
+	size_t max_chunk;
+	int i, j;
+
+	parse(message, strlen(message), 0, &whole);
+	srand(1);
+	for (max_chunk = 1; max_chunk < 20; max_chunk++) {
+		for (i = 0; i < 20; i++) {
+			CHECK(parse(message, strlen(message), max_chunk, &r));
+			CHECK_INT_EQ(whole.parts, r.parts);
+			CHECK_INT_EQ(whole.ended, r.ended);
+			for (j = 0; j <= whole.parts; j++) {
+				CHECK_STR_EQ(whole.data[j], r.data[j]);
+				if (j > 0) {
+					CHECK_STR_EQ(whole.headers[j], r.headers[j]);
+				}
+			}
+			free_recording(&r);
+		}
+	}
+	free_recording(&whole);
+}
+
+TEST(delimiter_at_start_of_body_should_be_recognized)
+{
+	static const char body[] = "--XyZ\r\n\r\nhello\r\n--XyZ--";
+	struct recording r;
+
+	CHECK(parse(body, strlen(body), 0, &r));
+	CHECK_INT_EQ(1, r.parts);
+	CHECK_INT_EQ(0, r.datasize[0]);
+	CHECK_STR_EQ("", r.headers[1]);
+	CHECK_STR_EQ("hello", r.data[1]);
+	free_recording(&r);
+}
+
+TEST(crlf_before_first_delimiter_should_belong_to_it)
+{
+	static const char body[] = "\r\n--XyZ\r\nA: b\r\n\r\nhello\r\n--XyZ--\r\n";
+	struct recording r;
+
+	CHECK(parse(body, strlen(body), 0, &r));
+	CHECK_INT_EQ(1, r.parts);
+	CHECK_INT_EQ(0, r.datasize[0]);
+	CHECK_STR_EQ("A: b\r\n", r.headers[1]);
+	CHECK_STR_EQ("hello", r.data[1]);
+	free_recording(&r);
+}
+
+TEST(truncated_message_should_be_incomplete)
+{
+	static const char body[] = "--XyZ\r\nA: b\r\n\r\nhello\r\n--X";
+	struct recording r;
+
+	CHECK(!parse(body, strlen(body), 0, &r));
+	CHECK_INT_EQ(1, r.parts);
+	CHECK_INT_EQ(2, r.ended);
+	CHECK_STR_EQ("hello\r\n--X", r.data[1]);
+	free_recording(&r);
+}
+
+TEST(binary_data_should_pass_through)
+{
+	char body[1000];
+	struct recording r;
+	size_t i, n;
+
+	n = sprintf(body, "--XyZ\r\n\r\n");
+	for (i = 0; i < 256; i++) {
+		body[n++] = (char)i;
+	}
+	n += sprintf(body + n, "\r\n--XyZ--");
+
+	CHECK(parse(body, n, 7, &r));
+	CHECK_INT_EQ(256, r.datasize[1]);
+	for (i = 0; i < 256; i++) {
+		CHECK_INT_EQ(i, (unsigned char)r.data[1][i]);
+	}
+	free_recording(&r);
+}
+
+TEST_SUITE_END
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "ccache.h"
+#include "spool.h"
+#include "test/framework.h"
+#include "test/util.h"
+
+#include <json.h>
+
+/* Spool an upload offering the file at path, stashed. */
+static bool
+spool_file(const char *path, const char *content)
+{
+	struct stashed_file *sf;
+	json_object *entry, *files, *file;
+	bool ok;
+
+	create_file(path, content);
+	sf = find_stashed_file(path);
+	file = json_object_new_object();
+	json_object_object_add(file, "field", json_object_new_string("object"));
+	json_object_object_add(file, "name", json_object_new_string(path));
+	json_object_object_add(file, "shm", json_object_new_string(sf->shm_name));
+	json_object_object_add(file, "size",
+	                       json_object_new_int64(sizeof(*sf) + sf->size));
+	files = json_object_new_array();
+	json_object_array_add(files, file);
+
+	entry = json_object_new_object();
+	json_object_object_add(entry, "url", json_object_new_string("https://x/"));
+	json_object_object_add(entry, "data", json_object_new_object());
+	json_object_object_add(entry, "files", files);
+	ok = spool_add("spool", entry);
+	json_object_put(entry);
+	delete_stashed_files();
+	forget_stashed_files();
+	return ok;
+}
+
+/* The blob holding the first file offered by the entry at path. */
+static char *
+blob_of(const char *path)
+{
+	json_object *entry = spool_read(path);
+	json_object *file = json_object_array_get_idx(
+	  json_object_object_get(entry, "files"), 0);
+	char *blob = spool_blob_path(
+	  "spool", json_object_get_string(json_object_object_get(file, "blob")));
+	json_object_put(entry);
+	return blob;
+}
+
+static void
+free_paths(char **paths, int count)
+{
+	while (count-- > 0) {
+		free(paths[count]);
+	}
+	free(paths);
+}
+
+TEST_SUITE(spool)
+
+TEST(entries_should_keep_copies_of_the_files)
+{
+	char **paths, *blob, *text;
+
+	CHECK(spool_file("a.o", "object a"));
+	CHECK_INT_EQ(1, spool_list("spool", &paths));
+	blob = blob_of(paths[0]);
+	text = read_text_file(blob, 0);
+	CHECK_STR_EQ_FREE2("object a", text);
+	free(blob);
+	free_paths(paths, 1);
+}
+
+TEST(entries_should_share_blobs)
+{
+	char **paths, *blob0, *blob1;
+
+	CHECK(spool_file("a.o", "same"));
+	CHECK(spool_file("b.o", "same"));
+	CHECK_INT_EQ(2, spool_list("spool", &paths));
+	blob0 = blob_of(paths[0]);
+	blob1 = blob_of(paths[1]);
+	CHECK_STR_EQ(blob0, blob1);
+	free(blob0);
+	free(blob1);
+	free_paths(paths, 2);
+}
+
+TEST(trim_should_drop_the_oldest_entries)
+{
+	char **paths, *oldest, *newest;
+	struct stat st;
+	uint64_t kept;
+
+	CHECK(spool_file("a.o", "an object that takes up room"));
+	CHECK(spool_file("b.o", "b"));
+	CHECK_INT_EQ(2, spool_list("spool", &paths));
+	oldest = blob_of(paths[0]);
+	newest = blob_of(paths[1]);
+	stat(paths[1], &st);
+	kept = file_size(&st);
+	stat(newest, &st);
+	kept += file_size(&st);
+	free_paths(paths, 2);
+
+	spool_trim("spool", kept);
+	CHECK_INT_EQ(1, spool_list("spool", &paths));
+	CHECK(!path_exists(oldest));
+	CHECK(path_exists(newest));
+	free(oldest);
+	free(newest);
+	free_paths(paths, 1);
+}
+
+TEST(removed_entries_should_give_up_their_blobs)
+{
+	char **paths, *blob0, *blob1;
+
+	CHECK(spool_file("a.o", "a"));
+	CHECK(spool_file("b.o", "b"));
+	CHECK_INT_EQ(2, spool_list("spool", &paths));
+	blob0 = blob_of(paths[0]);
+	blob1 = blob_of(paths[1]);
+
+	spool_remove(paths[0]);
+	free_paths(paths, 2);
+	CHECK_INT_EQ(1, spool_list("spool", &paths));
+	free_paths(paths, 1);
+	spool_trim("spool", conf->spool_size);
+	CHECK(!path_exists(blob0));
+	CHECK(path_exists(blob1));
+	free(blob0);
+	free(blob1);
+}
+
+TEST(adding_should_leave_trimming_to_the_daemon)
+{
+	char **paths;
+
+	conf->spool_size = 1;
+	CHECK(spool_file("a.o", "a"));
+	CHECK(spool_file("b.o", "b"));
+	CHECK_INT_EQ(2, spool_list("spool", &paths));
+	free_paths(paths, 2);
+}
+
+TEST(trim_should_keep_new_blobs_of_no_entry)
+{
+	create_dir("spool");
+	create_dir("spool/blobs");
+	create_file("spool/blobs/orphan", "being spooled");
+	spool_trim("spool", conf->spool_size);
+	CHECK(path_exists("spool/blobs/orphan"));
+}
+
+TEST_SUITE_END
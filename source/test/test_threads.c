@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2012 Mentor Graphics Corporation
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This file contains tests for running compiles on several threads of one
+ * process with ccache_compile.
+ */
+
+#include "ccache.h"
+#include "counters.h"
+#include "test/framework.h"
+#include "test/util.h"
+
+#include <pthread.h>
+
+#define N_SOURCES 4
+#define N_THREADS 8
+
+/*
+ * A stand-in for the compiler: the preprocessor copies the source to standard
+ * output and the compiler copies its input to the object file. The input file
+ * always comes last.
+ */
+static const char fake_compiler[] =
+	"#!/bin/sh\n"
+	"out=\n"
+	"while [ $# -gt 1 ]; do\n"
+	"  if [ \"$1\" = -o ]; then out=$2; shift; fi\n"
+	"  shift\n"
+	"done\n"
+	"if [ -n \"$out\" ]; then cp \"$1\" \"$out\"; else cat \"$1\"; fi\n";
+
+/*
+ * A stand-in for "cs --daemon" that exits at once, so the compiles find no
+ * daemon and go offline after setting up their cloud state.
+ */
+static const char fake_daemon[] = "#!/bin/sh\nexit 0\n";
+
+struct compile_job {
+	pthread_t thread;
+	char *argv[7];
+	int status;
+};
+
+static void *
+run_compile(void *context)
+{
+	struct compile_job *job = context;
+	job->status = ccache_compile(6, job->argv);
+	return NULL;
+}
+
+/* Compile source i % N_SOURCES to object i on thread i, for each i. */
+static void
+compile_in_parallel(struct compile_job *jobs, const char *compiler)
+{
+	int i;
+
+	for (i = 0; i < N_THREADS; i++) {
+		jobs[i].argv[0] = "cs";
+		jobs[i].argv[1] = (char *)compiler;
+		jobs[i].argv[2] = "-c";
+		jobs[i].argv[3] = format("src%d.c", i % N_SOURCES);
+		jobs[i].argv[4] = "-o";
+		jobs[i].argv[5] = format("obj%d.o", i);
+		jobs[i].argv[6] = NULL;
+		jobs[i].status = -1;
+		if (pthread_create(&jobs[i].thread, NULL, run_compile, &jobs[i]) != 0) {
+			jobs[i].thread = 0;
+		}
+	}
+	for (i = 0; i < N_THREADS; i++) {
+		if (jobs[i].thread) {
+			pthread_join(jobs[i].thread, NULL);
+		}
+	}
+}
+
+static void
+free_jobs(struct compile_job *jobs)
+{
+	int i;
+
+	for (i = 0; i < N_THREADS; i++) {
+		free(jobs[i].argv[3]);
+		free(jobs[i].argv[5]);
+	}
+}
+
+/* Sum a counter over the cache's statistics files. */
+static unsigned
+cache_counter(const char *cache_dir, enum stats stat)
+{
+	unsigned result = 0;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		struct counters *counters = counters_init(STATS_END);
+		char *path = format("%s/%x/stats", cache_dir, i);
+		stats_read(path, counters);
+		result += counters->data[stat];
+		counters_free(counters);
+		free(path);
+	}
+	return result;
+}
+
+TEST_SUITE(threads)
+
+TEST(parallel_compiles_share_one_cache)
+{
+	struct compile_job jobs[N_THREADS];
+	char *cwd = gnu_getcwd();
+	char *compiler = format("%s/compiler.sh", cwd);
+	char *cache_dir = format("%s/cache", cwd);
+	char *config = format("%s/cs.conf", cwd);
+	char *cloud_mode = getenv("CS_CLOUD_MODE");
+	char *path = format("%s/bin:%s", cwd, getenv("PATH"));
+	char *old_path = x_strdup(getenv("PATH"));
+	unsigned misses, hits;
+	mode_t mask = umask(022);
+	struct stat st;
+	int i;
+
+	umask(mask);
+
+	create_file("compiler.sh", fake_compiler);
+	CHECK_INT_EQ(0, chmod("compiler.sh", 0755));
+	for (i = 0; i < N_SOURCES; i++) {
+		char *source = format("src%d.c", i);
+		char *text = format("int f%d;\n", i);
+		create_file(source, text);
+		free(source);
+		free(text);
+	}
+	create_file("cs.conf", "umask = 027\n");
+	CHECK_INT_EQ(0, mkdir("bin", 0755));
+	create_file("bin/cs", fake_daemon);
+	CHECK_INT_EQ(0, chmod("bin/cs", 0755));
+
+	if (cloud_mode) {
+		cloud_mode = x_strdup(cloud_mode);
+	}
+	setenv("CS_CACHE_DIR", cache_dir, 1);
+	setenv("CS_CONFIGPATH", config, 1);
+	/*
+	 * A cloud mode and key make each compile set up its cloud state, which
+	 * ccache_compile must free again (run under a leak checker to see).
+	 */
+	setenv("CS_CLOUD_MODE", "local", 1);
+	setenv("CS_KEY", "test", 1);
+	setenv("PATH", path, 1);
+	setenv("CS_COMPILERCHECK", "content", 1);
+
+	/* Each source is wanted by two threads at once. */
+	compile_in_parallel(jobs, compiler);
+	for (i = 0; i < N_THREADS; i++) {
+		char *expected = format("int f%d;\n", i % N_SOURCES);
+		CHECK_INT_EQ(0, jobs[i].status);
+		CHECK_STR_EQ_FREE1(expected, read_text_file(jobs[i].argv[5], 0));
+		x_unlink(jobs[i].argv[5]);
+	}
+	free_jobs(jobs);
+	misses = cache_counter(cache_dir, STATS_TOCACHE);
+	hits = cache_counter(cache_dir, STATS_CACHEHIT_DIR)
+	       + cache_counter(cache_dir, STATS_CACHEHIT_CPP)
+	       + cache_counter(cache_dir, STATS_DEDUPLICATED);
+	CHECK(misses >= N_SOURCES);
+	CHECK_INT_EQ(N_THREADS, misses + hits);
+
+	/* Now everything is in the cache. */
+	compile_in_parallel(jobs, compiler);
+	for (i = 0; i < N_THREADS; i++) {
+		char *expected = format("int f%d;\n", i % N_SOURCES);
+		CHECK_INT_EQ(0, jobs[i].status);
+		CHECK_STR_EQ_FREE1(expected, read_text_file(jobs[i].argv[5], 0));
+		CHECK_INT_EQ(0, stat(jobs[i].argv[5], &st));
+		CHECK_INT_EQ(0640, st.st_mode & 0777);
+	}
+	free_jobs(jobs);
+	CHECK_INT_EQ(misses, cache_counter(cache_dir, STATS_TOCACHE));
+	CHECK_INT_EQ(hits + N_THREADS,
+	             cache_counter(cache_dir, STATS_CACHEHIT_DIR)
+	             + cache_counter(cache_dir, STATS_CACHEHIT_CPP)
+	             + cache_counter(cache_dir, STATS_DEDUPLICATED));
+
+	/* The umask setting doesn't change the umask of the process. */
+	CHECK_INT_EQ(mask, umask(mask));
+
+	x_unsetenv("CS_CACHE_DIR");
+	x_unsetenv("CS_CONFIGPATH");
+	x_unsetenv("CS_COMPILERCHECK");
+	x_unsetenv("CS_KEY");
+	setenv("PATH", old_path, 1);
+	if (cloud_mode) {
+		setenv("CS_CLOUD_MODE", cloud_mode, 1);
+		free(cloud_mode);
+	} else {
+		x_unsetenv("CS_CLOUD_MODE");
+	}
+	free(old_path);
+	free(path);
+	free(config);
+	free(cache_dir);
+	free(compiler);
+	free(cwd);
+}
+
+TEST_SUITE_END
@@ -34,9 +34,15 @@
  
    Unlike ccache, using "mtime" or "content" mode does not change the
    hashed data. However, in "content" mode the hashes will be
-   verified each time.  */
+   verified each time.
+
+   A running daemon remembers each toolchain identity it is told about
+   and vouches for it, in either mode, until it sees one of the files
+   change, so most compiles need neither the cache file nor the
+   hashing.  */
 
 #include "ccache.h"
+#include "daemon.h"
 #include "language.h"
 #include "zlib/zlib.h"
 
@@ -53,6 +59,7 @@ struct tool
   const char *id;  /* Used as hash_delimiter and key in .tool_id file.  */
   char *path;  /* Absolute path of the tool.  */
   char *hash;  /* MD4 "hash-size" string.  */
+  char *stat;  /* Its stat data when hashed (see tool_stat), or NULL.  */
 
   struct tool *next;
 };
@@ -61,15 +68,24 @@ struct tool_hashes
 {
   struct tool *tools, *last;
 
-  char *version;
   char *config;
   char *specs_hash;		/* The specs does not need a path.  */
+
+  /* The specs files that were hashed, if any, and their stat data; only
+     known after hashing.  */
+  char **specs_files;
+  char **specs_stats;
+  int n_specs_files;
 };
 
+/* How long, in microseconds, the lock on a .tool_id file may be held
+   before other processes consider it stale.  */
+#define TOOL_ID_LOCK_STALENESS (30 * 1000 * 1000)
+
 /* We cache the computed hashes here to avoid duplicated effort.  */
-static struct tool_hashes toolchain_hashes;
-static char *toolchain_id = NULL;
-static char **compiler_discovery_args = NULL;
+static THREAD_LOCAL struct tool_hashes toolchain_hashes;
+static THREAD_LOCAL char *toolchain_id = NULL;
+static THREAD_LOCAL char **compiler_discovery_args = NULL;
 
 /* Open a compressed tool_id cache file.
    Return a gzFile or NULL if there was an error.  */
@@ -233,69 +249,182 @@ call_compiler (const char *option, bool keep_stderr)
   return result;
 }
 
+/* The stat data of the file at PATH that the daemon checks a toolchain
+   against: "DEV INO SIZE MTIME CTIME".  Returns a new string, or NULL if
+   the file can't be stat'ed.  */
+static char *
+tool_stat (const char *path)
+{
+  struct stat st;
+
+  if (stat (path, &st) != 0)
+    return NULL;
+  return format ("%llu %llu %lld %lld %lld", (unsigned long long)st.st_dev,
+                 (unsigned long long)st.st_ino, (long long)st.st_size,
+                 (long long)st.st_mtime, (long long)st.st_ctime);
+}
+
 /* Asks the compiler where tool NAME is and then searches for it on
-   the path.  If found, add the tool to the list in toolchain_hashes.
-   If the tool is not found, and OPTIONAL is not true, exit via fatal().  */
-static void
-generate_one_tool_hash (const char *id, const char *name, bool optional)
+   the path.  Returns the path, or NULL if the tool isn't there.  */
+static char *
+locate_tool (const char *name)
 {
-  struct tool *result;
-  struct mdfour hash;
   char *tool_path;
   char *option = format ("-print-prog-name=%s", name);
 
   /* Ask the compiler where the other tools are.  */
   tool_path = call_compiler (option, false);
-  strtok (tool_path, "\r\n");
   free (option);
-  if (strcmp (tool_path, name) == 0)
+  if (tool_path)
+    strtok (tool_path, "\r\n");
+  if (!tool_path || strcmp (tool_path, name) == 0)
     {
       /* The compiler does not know, or does not care.
          This means it just gets picked up from the path,
          if it exists at all.  */
       free (tool_path);
       tool_path = find_executable (name, MYNAME);
+    }
+  return tool_path;
+}
 
-      if (tool_path == NULL)
-	{
-	  if (!optional)
-	    fatal ("Could not locate tool '%s'", name);
-	  else
-	    {
-	      cc_log ("Tool '%s' not present", name);
-	      return;		/* Some toolchains don't need this tool.  */
-	    }
-	}
+/* A tool being located and hashed by a child process.  Each call of the
+   compiler costs a process spawn, and hashing a large binary (cc1plus is
+   tens of megabytes) is slow, so all the tools are done at once.  */
+struct tool_probe
+{
+  const char *id;
+  const char *name;
+  bool optional;
+
+  pid_t pid;
+  int fd;			/* Read end of the pipe from the child.  */
+};
+
+/* Write STR, with its terminating nul, to FD.  */
+static bool
+write_string (int fd, const char *str)
+{
+  size_t len = strlen (str) + 1, done = 0;
+
+  while (done < len)
+    {
+      ssize_t n = write (fd, str + done, len - done);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      done += n;
+    }
+  return true;
+}
+
+/* Start a child process that locates and hashes the tool in PROBE.  It
+   writes the path, the hash and the stat data it was hashed against, each
+   nul-terminated, to a pipe, or nothing at all if the tool isn't there.  */
+static void
+start_tool_probe (struct tool_probe *probe)
+{
+  int pipefd[2];
+
+  if (pipe (pipefd) != 0)
+    fatal ("Could not create pipe");
+  probe->pid = fork ();
+  if (probe->pid == -1)
+    fatal ("Failed to fork: %s", strerror (errno));
+
+  if (probe->pid == 0)
+    {
+      char *tool_path;
+      struct mdfour hash;
+
+      /* Leave the tidying up to the parent.  */
+      exitfn_reset ();
+      close (pipefd[0]);
+
+      tool_path = locate_tool (probe->name);
+      if (tool_path)
+        {
+          char *stat_data = tool_stat (tool_path);
+          hash_start (&hash);
+          hash_file (&hash, tool_path);
+          if (!write_string (pipefd[1], tool_path)
+              || !write_string (pipefd[1], hash_result (&hash))
+              || !write_string (pipefd[1], stat_data ? stat_data : ""))
+            _exit (1);
+        }
+      _exit (0);
     }
 
-  cc_log ("Tool '%s' is %s", name, tool_path);
+  close (pipefd[1]);
+  probe->fd = pipefd[0];
+}
 
-  hash_start (&hash);
-  hash_file (&hash, tool_path);
+/* Collect the result of PROBE, and add the tool to the list in
+   toolchain_hashes.  If the tool is not found, and it is not optional,
+   exit via fatal().  */
+static void
+finish_tool_probe (struct tool_probe *probe)
+{
+  struct tool *result;
+  char *data = NULL, *hash, *stat_data;
+  size_t size = 0;
+  char buffer[1024];
+  ssize_t num;
+  int status;
+
+  while ((num = read (probe->fd, buffer, sizeof (buffer))) != 0)
+    {
+      if (num == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          fatal ("Error reading from pipe");
+        }
+      data = x_realloc (data, size + num + 1);
+      memcpy (data + size, buffer, num);
+      size += num;
+    }
+  close (probe->fd);
+
+  if (waitpid (probe->pid, &status, 0) != probe->pid)
+    fatal ("waitpid failed: %s", strerror (errno));
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    fatal ("Could not identify tool '%s'", probe->name);
+
+  if (size == 0)
+    {
+      if (!probe->optional)
+        fatal ("Could not locate tool '%s'", probe->name);
+      cc_log ("Tool '%s' not present", probe->name);
+      return;		/* Some toolchains don't need this tool.  */
+    }
+  data[size] = '\0';
+  hash = data + strlen (data) + 1;
+  stat_data = hash + strlen (hash) + 1;
+  if (stat_data >= data + size)
+    fatal ("Could not identify tool '%s'", probe->name);
+
+  cc_log ("Tool '%s' is %s", probe->name, data);
 
   result = malloc (sizeof (struct tool));
-  result->id = id;
-  result->path = tool_path;
-  result->hash = hash_result (&hash);
+  result->id = probe->id;
+  result->path = x_strdup (data);
+  result->hash = x_strdup (hash);
+  result->stat = stat_data[0] ? x_strdup (stat_data) : NULL;
   result->next = NULL;
+  free (data);
 
   toolchain_hashes.last->next = result;
   toolchain_hashes.last = result;
 }
 
-/* Call the compiler with -v and --version and capture the output.
+/* Call the compiler with -v and capture the output.
    Store the data in toolchain_hashes.  */
 static void
 capture_compiler_version_data (void)
 {
-  char *version, *config;
-
-  version = call_compiler ("--version", false);
-  strtok (version, "\r\n"); /* Trim the copyright notice. */
-  toolchain_hashes.version = version;
-
-  config = call_compiler ("-v", true);
-  toolchain_hashes.config = config;
+  toolchain_hashes.config = call_compiler ("-v", true);
 }
 
 /* Locate the specs files used by the compiler (using '-v' data) and
@@ -334,9 +463,20 @@ generate_specs_hash (void)
           str += len;
 
           /* We've found a specs file; hash it.  */
+          toolchain_hashes.specs_files
+            = x_realloc (toolchain_hashes.specs_files,
+                         (toolchain_hashes.n_specs_files + 1)
+                         * sizeof (char *));
+          toolchain_hashes.specs_stats
+            = x_realloc (toolchain_hashes.specs_stats,
+                         (toolchain_hashes.n_specs_files + 1)
+                         * sizeof (char *));
+          toolchain_hashes.specs_stats[toolchain_hashes.n_specs_files]
+            = tool_stat (spec_file);
           hash_delimiter (&hash, "specs_file");
           hash_file (&hash, spec_file);
-          free (spec_file);
+          toolchain_hashes.specs_files[toolchain_hashes.n_specs_files++]
+            = spec_file;
         }
       else
         /* No more specs files.  */
@@ -356,16 +496,35 @@ generate_tool_hashes (const char *path)
   struct mdfour hash;
   enum supported_tools what_tool;
   struct tool *tool;
+  struct tool_probe probes[] = {
+    {"cc1", "cc1", false, 0, -1},
+    {"cc1plus", "cc1plus", true, 0, -1},
+    {"cc1obj", "cc1obj", true, 0, -1},
+    {"cc1objplus", "cc1objplus", true, 0, -1},
+    {"assembler", "as", false, 0, -1},
+    {"collect2", "collect2", false, 0, -1},
+    {"linker", "ld", false, 0, -1},
+    {"lto_plugin", "lto_plugin", true, 0, -1}
+  };
+  int n_probes = sizeof (probes) / sizeof (probes[0]);
+  int i;
 
   if (toolchain_id)
     return;
 
   what_tool = recognize_tool_signature (path);
 
+  /* Set the other tools going before doing anything else.  The order of
+     the list matters to the ID, so they're collected in order.  */
+  if (what_tool == TOOL_GCC_DRIVER)
+    for (i = 0; i < n_probes; i++)
+      start_tool_probe (&probes[i]);
+
   /* Hash the primary tool.  */
+  toolchain_hashes.tools = malloc (sizeof (struct tool));
+  toolchain_hashes.tools->stat = tool_stat (path);
   hash_start (&hash);
   hash_file (&hash, path);
-  toolchain_hashes.tools = malloc (sizeof (struct tool));
   toolchain_hashes.tools->id = "primary";
   toolchain_hashes.tools->path = strdup (path);
   toolchain_hashes.tools->hash = hash_result (&hash);
@@ -377,15 +536,8 @@ generate_tool_hashes (const char *path)
       capture_compiler_version_data ();
       generate_specs_hash ();
 
-      generate_one_tool_hash ("cc1", "cc1", false);
-      generate_one_tool_hash ("cc1plus", "cc1plus", true);
-      generate_one_tool_hash ("cc1obj", "cc1obj", true);
-      generate_one_tool_hash ("cc1objplus", "cc1objplus", true);
-
-      generate_one_tool_hash ("assembler", "as", false);
-      generate_one_tool_hash ("collect2", "collect2", false);
-      generate_one_tool_hash ("linker", "ld", false);
-      generate_one_tool_hash ("lto_plugin", "lto_plugin", true);
+      for (i = 0; i < n_probes; i++)
+        finish_tool_probe (&probes[i]);
     }
 
   /* Calculate the Toolchain ID.  */
@@ -479,6 +631,7 @@ create_tool_id_file (const char *id_cache_path)
     }
 
   unlink (tmp_file);
+  free (tmp_file);
 
   if (gf)
     gzclose (gf);
@@ -487,6 +640,41 @@ create_tool_id_file (const char *id_cache_path)
   return;
 }
 
+/* Tell the daemon, if one is running, that KEY identifies the toolchain
+   in toolchain_hashes, so that it can answer for us next time.  It checks
+   the files against the stat data we found them with, so a toolchain with
+   a file that couldn't be stat'ed isn't registered.  */
+static void
+register_with_daemon (const char *key)
+{
+  const char **paths, **stats;
+  struct tool *tool;
+  int n = 0, i;
+
+  for (tool = toolchain_hashes.tools; tool; tool = tool->next)
+    n++;
+  n += toolchain_hashes.n_specs_files;
+  paths = x_malloc (n * sizeof (char *));
+  stats = x_malloc (n * sizeof (char *));
+  n = 0;
+  for (tool = toolchain_hashes.tools; tool; tool = tool->next)
+    {
+      paths[n] = tool->path;
+      stats[n++] = tool->stat;
+    }
+  for (i = 0; i < toolchain_hashes.n_specs_files; i++)
+    {
+      paths[n] = toolchain_hashes.specs_files[i];
+      stats[n++] = toolchain_hashes.specs_stats[i];
+    }
+  for (i = 0; i < n && stats[i]; i++)
+    ;
+  if (i == n)
+    register_daemon_tool_id (key, toolchain_id, n, paths, stats);
+  free (stats);
+  free (paths);
+}
+
 /* Helper function: like gzgets but without any trailing EOLN chars.  */
 static char *
 gzgets_trimmed (gzFile gf, char *buf, int len)
@@ -505,7 +693,7 @@ void
 tool_id_calculate (const char *path, struct stat *st, bool rehash)
 {
   struct mdfour stat_hash;
-  char *id_cache_name, *id_cache_path;
+  char *id_cache_name, *id_cache_path, *daemon_key;
   gzFile gf = NULL;
   char buffer[100];
   int i;
@@ -544,15 +732,44 @@ tool_id_calculate (const char *path, struct stat *st, bool rehash)
   id_cache_name = hash_result (&stat_hash);
   id_cache_path = get_path_in_cache (id_cache_name, ".tool_id");
 
+  /* The daemon must not vouch for the contents of a toolchain that was
+     only identified by its mtime.  */
+  daemon_key = format ("%s-%s", id_cache_name, rehash ? "content" : "mtime");
+  toolchain_id = query_daemon_tool_id (daemon_key);
+  if (toolchain_id)
+    {
+      cc_log ("Toolchain ID from the daemon: %s", toolchain_id);
+      free (daemon_key);
+      free (id_cache_path);
+      free (id_cache_name);
+      return;
+    }
+
   gf = open_tool_id (id_cache_path);
   if (!gf)
     {
-      /* No such file.  We've not seen this tool before.  */
-      cc_log ("New tool detected: %s (size=%ld, mtime=%ld)", path,
-	      st->st_size, st->st_mtime);
-      generate_tool_hashes(path);
-      create_tool_id_file (id_cache_path);
-      return;
+      /* After a toolchain upgrade, every job of a parallel build gets
+         here at once.  Only one of them needs to do the work; the rest
+         wait for its result.  */
+      bool locked = lockfile_acquire (id_cache_path, TOOL_ID_LOCK_STALENESS);
+      gf = open_tool_id (id_cache_path);
+      if (!gf)
+        {
+          /* No such file.  We've not seen this tool before.  */
+          cc_log ("New tool detected: %s (size=%ld, mtime=%ld)", path,
+                  st->st_size, st->st_mtime);
+          generate_tool_hashes(path);
+          create_tool_id_file (id_cache_path);
+          if (locked)
+            lockfile_release (id_cache_path);
+          register_with_daemon (daemon_key);
+          free (daemon_key);
+          free (id_cache_path);
+          free (id_cache_name);
+          return;
+        }
+      if (locked)
+        lockfile_release (id_cache_path);
     }
 
   cc_log ("Reading toolchain id from %s", id_cache_path);
@@ -613,6 +830,7 @@ tool_id_calculate (const char *path, struct stat *st, bool rehash)
             if (gzgets_trimmed (gf, buffer, sizeof (buffer)) == NULL)
               goto error;
             tool->path = x_strdup (buffer);
+            tool->stat = tool_stat (tool->path);
             if (gzgets_trimmed (gf, buffer, sizeof (buffer)) == NULL)
               goto error;
             tool->hash = x_strdup (buffer);
@@ -635,6 +853,10 @@ tool_id_calculate (const char *path, struct stat *st, bool rehash)
     }
 
   gzclose (gf);
+  register_with_daemon (daemon_key);
+  free (daemon_key);
+  free (id_cache_path);
+  free (id_cache_name);
   return;
 
 error:
@@ -658,6 +880,10 @@ recreate:
   }
   generate_tool_hashes (path);
   create_tool_id_file (id_cache_path);
+  register_with_daemon (daemon_key);
+  free (daemon_key);
+  free (id_cache_path);
+  free (id_cache_name);
 }
 
 /* Return the unique toolchain ID for the given compiler.
@@ -667,7 +893,6 @@ tool_id_get(void)
 {
   if (toolchain_id == NULL)
     {
-      extern struct conf *conf;
       if (str_eq(conf->compiler_check, "mtime")
           || str_eq(conf->compiler_check, "content"))
         fatal ("Toolchain ID is uninitialized in toold_get_id()");
@@ -676,3 +901,43 @@ tool_id_get(void)
     }
   return toolchain_id;
 }
+
+/* Forget the toolchain, so that the thread's next compile, which may use
+   another compiler, works it out afresh.  */
+void
+tool_id_reset (void)
+{
+  struct tool *tool, *next;
+  int i;
+
+  for (tool = toolchain_hashes.tools; tool; tool = next)
+    {
+      next = tool->next;
+      free (tool->path);
+      free (tool->hash);
+      free (tool->stat);
+      free (tool);
+    }
+  free (toolchain_hashes.config);
+  free (toolchain_hashes.specs_hash);
+  for (i = 0; i < toolchain_hashes.n_specs_files; i++)
+    {
+      free (toolchain_hashes.specs_files[i]);
+      free (toolchain_hashes.specs_stats[i]);
+    }
+  free (toolchain_hashes.specs_files);
+  free (toolchain_hashes.specs_stats);
+  memset (&toolchain_hashes, 0, sizeof (toolchain_hashes));
+
+  free (toolchain_id);
+  toolchain_id = NULL;
+
+  if (compiler_discovery_args)
+    {
+      free (compiler_discovery_args[0]);
+      for (i = 2; compiler_discovery_args[i]; i++)
+        free (compiler_discovery_args[i]);
+      free (compiler_discovery_args);
+      compiler_discovery_args = NULL;
+    }
+}
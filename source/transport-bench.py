@@ -0,0 +1,314 @@
+#! /usr/bin/env python3
+#
+# Copyright (c) 2012 Mentor Graphics Corporation
+#
+# This program is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation; either version 3 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, write to the Free Software Foundation, Inc., 51
+# Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+from optparse import OptionParser
+from glob import glob
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from os import environ, getpid, kill, unlink
+from os.path import abspath, join as joinpath
+from shutil import rmtree
+from signal import SIGTERM
+from subprocess import DEVNULL, Popen, check_call
+from tempfile import mkdtemp
+from threading import Thread
+from time import sleep, time
+import socket
+import struct
+import sys
+
+USAGE = """%prog [options]"""
+
+DESCRIPTION = """\
+This program measures how the cs daemon's connection to the cloud server
+performs with HTTP/1.1 (one connection per transfer) and with HTTP/2
+(transfers multiplexed over one connection).  It runs a local stand-in
+server behind nghttpx, which terminates TLS and offers both protocols, and
+then has 1, 8 and 64 concurrent clients fetch cache hits through the
+daemon, reporting request throughput and latency percentiles. Example:
+./transport-bench.py --cs ./cs --latency 20
+"""
+
+DEFAULT_CS = "./cs"
+DEFAULT_CLIENTS = "1,8,64"
+DEFAULT_LATENCY = 10
+DEFAULT_REQUESTS = 256
+DEFAULT_SIZE = 64 * 1024
+
+BOUNDARY = "transport-bench"
+
+MODES = [
+    ("HTTP/1.1", "0"),
+    ("HTTP/2", "1")]
+
+verbose = False
+
+def progress(msg):
+    if verbose:
+        sys.stderr.write(msg)
+        sys.stderr.flush()
+
+###############################################################################
+# The stand-in server: answers every GET with a cache hit after a delay.
+
+def make_handler(latency, size):
+    obj = bytes(range(256)) * (size // 256 + 1)
+    body = (
+        ("\r\n--%s\r\n"
+         "Content-Type: application/json\r\n"
+         "Content-Location: x?file=data\r\n\r\n"
+         "{\"exit_status\": 0}\r\n"
+         "--%s\r\n"
+         "Content-Type: application/octet-stream\r\n"
+         "Content-Disposition: attachment; filename=object\r\n\r\n"
+         % (BOUNDARY, BOUNDARY)).encode()
+        + obj[:size]
+        + ("\r\n--%s--\r\n" % BOUNDARY).encode())
+
+    class Handler(BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def log_message(self, *args):
+            pass
+
+        def do_GET(self):
+            sleep(latency)
+            self.send_response(200)
+            self.send_header(
+                "Content-Type",
+                "multipart/mixed; boundary=\"%s\"" % BOUNDARY)
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+    return Handler
+
+class BackendServer(ThreadingHTTPServer):
+    # nghttpx opens a backend connection per stream; the default listen
+    # queue of 5 would drop connections and add SYN retry delays.
+    request_queue_size = 256
+    daemon_threads = True
+
+def start_server(tmpdir, options):
+    backend = BackendServer(
+        ("127.0.0.1", 0),
+        make_handler(options.latency / 1000.0, options.size))
+    Thread(target=backend.serve_forever, daemon=True).start()
+
+    key = joinpath(tmpdir, "key.pem")
+    cert = joinpath(tmpdir, "cert.pem")
+    check_call(
+        ["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes",
+         "-days", "1", "-subj", "/CN=localhost",
+         "-addext", "subjectAltName=DNS:localhost,IP:127.0.0.1",
+         "-keyout", key, "-out", cert],
+        stdout=DEVNULL, stderr=DEVNULL)
+
+    probe = socket.socket()
+    probe.bind(("127.0.0.1", 0))
+    port = probe.getsockname()[1]
+    probe.close()
+    proxy = Popen(
+        [options.nghttpx,
+         "--frontend=127.0.0.1,%d" % port,
+         "--backend=127.0.0.1,%d" % backend.server_address[1],
+         "--backend-connections-per-host=256",
+         "--workers=1", "--no-ocsp",
+         "--errorlog-file=" + joinpath(tmpdir, "nghttpx.log"),
+         key, cert],
+        stdout=DEVNULL, stderr=DEVNULL)
+    for _ in range(100):
+        try:
+            socket.create_connection(("127.0.0.1", port)).close()
+            break
+        except OSError:
+            sleep(0.05)
+    else:
+        raise Exception("nghttpx did not start")
+    return backend, proxy, cert, "https://localhost:%d" % port
+
+###############################################################################
+# A client, speaking the daemon's Unix socket protocol.
+
+def recvn(sock, n):
+    data = b""
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise EOFError("daemon closed the connection")
+        data += chunk
+    return data
+
+def fetch(sock, url):
+    url = url.encode()
+    sock.sendall(b"U" + struct.pack("<I", len(url)) + url + b"R")
+    code = None
+    while True:
+        c = recvn(sock, 1)
+        if c == b"C":
+            return code
+        elif c in b"EF":
+            return None
+        elif c == b"R":
+            code = struct.unpack("<H", recvn(sock, 2))[0]
+        elif c == b"D":
+            hsize, dsize = struct.unpack("<II", recvn(sock, 8))
+            recvn(sock, hsize + dsize)
+        elif c == b"A":
+            hsize, fsize, tsize = struct.unpack("<III", recvn(sock, 12))
+            recvn(sock, hsize + fsize)
+            unlink(recvn(sock, tsize).decode())
+        else:
+            raise Exception("unexpected reply %r" % c)
+
+def connect(socket_path):
+    # The daemon accepts one connection per loop, so a crowd of clients
+    # can overflow its listen queue.
+    for _ in range(100):
+        try:
+            sock = socket.socket(socket.AF_UNIX)
+            sock.connect(socket_path)
+            return sock
+        except OSError:
+            sock.close()
+            sleep(0.01)
+    raise Exception("cannot connect to the daemon")
+
+def run_client(socket_path, base_url, client, count, latencies, errors):
+    sock = connect(socket_path)
+    for i in range(count):
+        start = time()
+        if fetch(sock, "%s/v1.0/cache/%d-%d-%d" % (
+                base_url, getpid(), client, i)) != 200:
+            errors.append(1)
+        latencies.append(time() - start)
+    sock.close()
+
+###############################################################################
+
+def percentile(values, p):
+    return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+def run_mode(tmpdir, options, cert, base_url, name, http2):
+    cache_dir = joinpath(tmpdir, "cache-" + http2)
+    check_call(["mkdir", "-p", joinpath(cache_dir, "tmp")])
+    env = dict(environ)
+    env.update({
+        "CS_DIR": cache_dir,
+        "CS_CACHE_DIR": cache_dir,
+        "CS_DAEMON_HTTP2": http2,
+        "CS_DAEMON_CA_BUNDLE": cert,
+        "CS_DAEMON_CACHE_SIZE": "0"})
+    daemon = Popen([options.cs, "--daemon"], env=env,
+                   stdout=DEVNULL, stderr=DEVNULL)
+    try:
+        for _ in range(100):
+            sockets = glob(joinpath(cache_dir, "daemon.*"))
+            if sockets:
+                connect(sockets[0]).close()
+                break
+            sleep(0.05)
+        else:
+            raise Exception("the daemon did not start")
+        for clients in [int(x) for x in options.clients.split(",")]:
+            progress("%s, %d clients\n" % (name, clients))
+            latencies = []
+            errors = []
+            count = max(1, options.requests // clients)
+            threads = [
+                Thread(target=run_client,
+                       args=(sockets[0], base_url, i, count, latencies,
+                             errors))
+                for i in range(clients)]
+            start = time()
+            for t in threads:
+                t.start()
+            for t in threads:
+                t.join()
+            elapsed = time() - start
+            latencies.sort()
+            print("%-8s  %7d  %8d  %9.1f  %8.1f  %8.1f  %8.1f  %6d" % (
+                name, clients, len(latencies), len(latencies) / elapsed,
+                1000 * percentile(latencies, 50),
+                1000 * percentile(latencies, 99),
+                1000 * latencies[-1], len(errors)))
+            sys.stdout.flush()
+    finally:
+        kill(daemon.pid, SIGTERM)
+        daemon.wait()
+
+def main(argv):
+    op = OptionParser(usage=USAGE, description=DESCRIPTION)
+    op.add_option(
+        "--cs",
+        help="location of the cs binary (default: %s)" % DEFAULT_CS,
+        default=DEFAULT_CS)
+    op.add_option(
+        "--clients",
+        help="comma-separated client counts (default: %s)" % DEFAULT_CLIENTS,
+        default=DEFAULT_CLIENTS)
+    op.add_option(
+        "--latency",
+        help="server think time in milliseconds (default: %d)"
+        % DEFAULT_LATENCY,
+        type="float",
+        default=DEFAULT_LATENCY)
+    op.add_option(
+        "--nghttpx",
+        help="location of nghttpx (default: nghttpx)",
+        default="nghttpx")
+    op.add_option(
+        "-n", "--requests",
+        help="requests per run, shared by the clients (default: %d)"
+        % DEFAULT_REQUESTS,
+        type="int",
+        default=DEFAULT_REQUESTS)
+    op.add_option(
+        "-s", "--size",
+        help="object size in bytes (default: %d)" % DEFAULT_SIZE,
+        type="int",
+        default=DEFAULT_SIZE)
+    op.add_option(
+        "-v", "--verbose",
+        help="print progress messages",
+        action="store_true")
+    (options, args) = op.parse_args(argv[1:])
+    if args:
+        op.error("unexpected arguments")
+
+    global verbose
+    verbose = options.verbose
+    options.cs = abspath(options.cs)
+
+    tmpdir = mkdtemp(prefix="transport-bench.")
+    backend = proxy = None
+    try:
+        backend, proxy, cert, base_url = start_server(tmpdir, options)
+        print("%-8s  %7s  %8s  %9s  %8s  %8s  %8s  %6s" % (
+            "protocol", "clients", "requests", "req/s", "p50 ms", "p99 ms",
+            "max ms", "errors"))
+        for (name, http2) in MODES:
+            run_mode(tmpdir, options, cert, base_url, name, http2)
+    finally:
+        if proxy:
+            proxy.terminate()
+            proxy.wait()
+        if backend:
+            backend.shutdown()
+        rmtree(tmpdir)
+
+main(sys.argv)
@@ -50,7 +50,7 @@ static const char *const s_tokens[] = {
 #define C_FLOAT 64
 #define C_SIGN  128
 
-static struct {
+static THREAD_LOCAL struct {
 	unsigned char type;
 	unsigned char num_toks;
 	const char *toks[7];
@@ -62,7 +62,7 @@ build_table(void)
 {
 	unsigned char c;
 	int i;
-	static bool done;
+	static THREAD_LOCAL bool done;
 
 	if (done) return;
 	done = true;
@@ -98,8 +98,8 @@ build_table(void)
 static void
 pushchar(struct mdfour *hash, unsigned char c)
 {
-	static unsigned char buf[64];
-	static size_t len;
+	static THREAD_LOCAL unsigned char buf[64];
+	static THREAD_LOCAL size_t len;
 
 	if (c == 0) {
 		if (len > 0) {
@@ -0,0 +1,309 @@
+#! /usr/bin/env python3
+#
+# Copyright (c) 2012 Mentor Graphics Corporation
+#
+# This program is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation; either version 3 of the License, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, write to the Free Software Foundation, Inc., 51
+# Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+from optparse import OptionParser
+from email.parser import BytesParser
+from email.policy import HTTP
+from glob import glob
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from os import environ, getpid, kill
+from os.path import abspath, join as joinpath
+from shutil import rmtree
+from signal import SIGTERM
+from subprocess import DEVNULL, Popen, check_call
+from tempfile import mkdtemp
+from threading import Condition, Thread
+from time import sleep, time
+import json
+import socket
+import ssl
+import struct
+import sys
+
+USAGE = """%prog [options]"""
+
+DESCRIPTION = """\
+This program measures how fast the cs daemon uploads the results that
+clients hand it, sending each upload in a request of its own and in
+batches to the batch endpoint. It runs a local stand-in server, which takes
+a fixed think time over each request, and then has concurrent clients hand
+results to the daemon, reporting the uploads stored per second and per
+request. Example: ./upload-bench.py --cs ./cs --latency 20
+"""
+
+DEFAULT_CS = "./cs"
+DEFAULT_CLIENTS = 8
+DEFAULT_DELAY = 100
+DEFAULT_LATENCY = 10
+DEFAULT_UPLOADS = 512
+DEFAULT_SIZE = 1024
+
+MODES = [
+    ("single", "1"),
+    ("batched", "64")]
+
+verbose = False
+
+def progress(msg):
+    if verbose:
+        sys.stderr.write(msg)
+        sys.stderr.flush()
+
+###############################################################################
+# The stand-in server: stores every upload it is sent, after a delay.
+
+class Tally:
+    def __init__(self):
+        self.uploads = 0
+        self.requests = 0
+        self.changed = Condition()
+
+    def add(self, uploads):
+        with self.changed:
+            self.uploads += uploads
+            self.requests += 1
+            self.changed.notify_all()
+
+    def wait_for(self, uploads, timeout):
+        with self.changed:
+            return self.changed.wait_for(
+                lambda: self.uploads >= uploads, timeout)
+
+def make_handler(latency, tally):
+    class Handler(BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def log_message(self, *args):
+            pass
+
+        def do_POST(self):
+            body = self.rfile.read(int(self.headers["Content-Length"]))
+            form = BytesParser(policy=HTTP).parsebytes(
+                b"Content-Type: " + self.headers["Content-Type"].encode()
+                + b"\r\n\r\n" + body)
+            fields = {}
+            for p in form.iter_parts():
+                fields[p.get_param("name", header="content-disposition")] = \
+                    p.get_payload(decode=True)
+            sleep(latency)
+            if self.path.endswith("/batch"):
+                count = len(json.loads(fields["batch"]))
+                reply = {"results": [{"result": "success"}] * count}
+            else:
+                count = 1
+                reply = {"result": "success"}
+            tally.add(count)
+            body = json.dumps(reply).encode()
+            self.send_response(200)
+            self.send_header("Content-Type", "application/json")
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+    return Handler
+
+class Server(ThreadingHTTPServer):
+    request_queue_size = 256
+    daemon_threads = True
+
+    def handle_error(self, request, client_address):
+        # The daemon dropping connections when it exits is nothing to report.
+        if not issubclass(sys.exc_info()[0], (ConnectionError, ssl.SSLError)):
+            super().handle_error(request, client_address)
+
+def start_server(tmpdir, options, tally):
+    key = joinpath(tmpdir, "key.pem")
+    cert = joinpath(tmpdir, "cert.pem")
+    check_call(
+        ["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes",
+         "-days", "1", "-subj", "/CN=localhost",
+         "-addext", "subjectAltName=DNS:localhost,IP:127.0.0.1",
+         "-keyout", key, "-out", cert],
+        stdout=DEVNULL, stderr=DEVNULL)
+
+    server = Server(("127.0.0.1", 0),
+                    make_handler(options.latency / 1000.0, tally))
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.load_cert_chain(cert, key)
+    server.socket = context.wrap_socket(server.socket, server_side=True)
+    Thread(target=server.serve_forever, daemon=True).start()
+    return server, cert, "https://localhost:%d" % server.server_address[1]
+
+###############################################################################
+# A client, speaking the daemon's Unix socket protocol.
+
+def recvn(sock, n):
+    data = b""
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise EOFError("daemon closed the connection")
+        data += chunk
+    return data
+
+def message(code, data):
+    return code + struct.pack("<I", len(data)) + data
+
+def hand_over(socket_path, base_url, client, number, padding):
+    data = {"cpp_hash": "%d-%d-%d" % (getpid(), client, number),
+            "toolchain_id": "bench", "exit_status": 0, "stderr": padding}
+    job = json.dumps({"data": data, "sources": {}, "files": []})
+    sock = connect(socket_path)
+    sock.sendall(
+        message(b"U", ("%s/v1.0/cache/" % base_url).encode())
+        + message(b"H", b"X-CLIENT-SESSION-ID: %d" % client)
+        + message(b"Q", job.encode()))
+    taken = recvn(sock, 1) == b"Q"
+    sock.close()
+    return taken
+
+def connect(socket_path):
+    # The daemon accepts one connection per loop, so a crowd of clients
+    # can overflow its listen queue.
+    for _ in range(100):
+        try:
+            sock = socket.socket(socket.AF_UNIX)
+            sock.connect(socket_path)
+            return sock
+        except OSError:
+            sock.close()
+            sleep(0.01)
+    raise Exception("cannot connect to the daemon")
+
+def run_client(socket_path, base_url, client, count, padding, errors):
+    for i in range(count):
+        if not hand_over(socket_path, base_url, client, i, padding):
+            errors.append(1)
+
+###############################################################################
+
+def run_mode(tmpdir, options, tally, cert, base_url, name, batch_count):
+    cache_dir = joinpath(tmpdir, "cache-" + name)
+    check_call(["mkdir", "-p", joinpath(cache_dir, "tmp")])
+    env = dict(environ)
+    env.update({
+        "CS_DIR": cache_dir,
+        "CS_CACHE_DIR": cache_dir,
+        "CS_DAEMON_HTTP2": "0",
+        "CS_DAEMON_CA_BUNDLE": cert,
+        "CS_DAEMON_BATCH_COUNT": batch_count,
+        "CS_DAEMON_BATCH_DELAY": str(options.delay)})
+    daemon = Popen([options.cs, "--daemon"], env=env,
+                   stdout=DEVNULL, stderr=DEVNULL)
+    try:
+        for _ in range(100):
+            sockets = glob(joinpath(cache_dir, "daemon.*"))
+            if sockets:
+                connect(sockets[0]).close()
+                break
+            sleep(0.05)
+        else:
+            raise Exception("the daemon did not start")
+        progress("%s, %d clients\n" % (name, options.clients))
+        errors = []
+        count = max(1, options.uploads // options.clients)
+        total = count * options.clients
+        uploads, requests = tally.uploads, tally.requests
+        threads = [
+            Thread(target=run_client,
+                   args=(sockets[0], base_url, i, count,
+                         "x" * options.size, errors))
+            for i in range(options.clients)]
+        start = time()
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        handed = time() - start
+        if not tally.wait_for(uploads + total - len(errors), 600):
+            errors.append(1)
+        elapsed = time() - start
+        uploads = tally.uploads - uploads
+        requests = tally.requests - requests
+        print("%-8s  %7d  %8d  %9.1f  %8d  %9.2f  %10.1f  %6d" % (
+            name, options.clients, uploads, uploads / elapsed, requests,
+            uploads / max(1, requests), 1000 * handed / total, len(errors)))
+        sys.stdout.flush()
+    finally:
+        kill(daemon.pid, SIGTERM)
+        daemon.wait()
+
+def main(argv):
+    op = OptionParser(usage=USAGE, description=DESCRIPTION)
+    op.add_option(
+        "--cs",
+        help="location of the cs binary (default: %s)" % DEFAULT_CS,
+        default=DEFAULT_CS)
+    op.add_option(
+        "--clients",
+        help="concurrent clients (default: %d)" % DEFAULT_CLIENTS,
+        type="int",
+        default=DEFAULT_CLIENTS)
+    op.add_option(
+        "--delay",
+        help="longest an upload waits for a batch, in milliseconds"
+        " (default: %d)" % DEFAULT_DELAY,
+        type="int",
+        default=DEFAULT_DELAY)
+    op.add_option(
+        "--latency",
+        help="server think time in milliseconds (default: %d)"
+        % DEFAULT_LATENCY,
+        type="float",
+        default=DEFAULT_LATENCY)
+    op.add_option(
+        "-n", "--uploads",
+        help="uploads per run, shared by the clients (default: %d)"
+        % DEFAULT_UPLOADS,
+        type="int",
+        default=DEFAULT_UPLOADS)
+    op.add_option(
+        "-s", "--size",
+        help="padding in each upload's data, in bytes (default: %d)"
+        % DEFAULT_SIZE,
+        type="int",
+        default=DEFAULT_SIZE)
+    op.add_option(
+        "-v", "--verbose",
+        help="print progress messages",
+        action="store_true")
+    (options, args) = op.parse_args(argv[1:])
+    if args:
+        op.error("unexpected arguments")
+
+    global verbose
+    verbose = options.verbose
+    options.cs = abspath(options.cs)
+
+    tmpdir = mkdtemp(prefix="upload-bench.")
+    server = None
+    try:
+        tally = Tally()
+        server, cert, base_url = start_server(tmpdir, options, tally)
+        print("%-8s  %7s  %8s  %9s  %8s  %9s  %10s  %6s" % (
+            "mode", "clients", "uploads", "uploads/s", "requests",
+            "per req", "hand-in ms", "errors"))
+        for (name, batch_count) in MODES:
+            run_mode(tmpdir, options, tally, cert, base_url, name,
+                     batch_count)
+    finally:
+        if server:
+            server.shutdown()
+        rmtree(tmpdir)
+
+main(sys.argv)
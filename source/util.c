@@ -34,18 +34,20 @@
 
 #include <sys/mman.h>
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 #ifdef _WIN32
 #include <windows.h>
 #include <sys/locking.h>
 #endif
 
-static FILE *logfile;
+static THREAD_LOCAL FILE *logfile;
 
 static bool
 init_log(void)
 {
-	extern struct conf *conf;
-
 	if (logfile) {
 		return true;
 	}
@@ -68,12 +70,17 @@ log_prefix(bool log_updated_time)
 	char timestamp[100];
 	struct timeval tv;
 	struct tm *tm;
-	static char prefix[200];
+#ifdef HAVE_LOCALTIME_R
+	struct tm tm_buffer;
+#endif
+	static THREAD_LOCAL char prefix[200];
 
 	if (log_updated_time) {
 		gettimeofday(&tv, NULL);
 #ifdef __MINGW64_VERSION_MAJOR
 		tm = _localtime32(&tv.tv_sec);
+#elif defined(HAVE_LOCALTIME_R)
+		tm = localtime_r(&tv.tv_sec, &tm_buffer);
 #else
 		tm = localtime(&tv.tv_sec);
 #endif
@@ -142,6 +149,19 @@ cc_log(const char *format, ...)
 	}
 }
 
+/*
+ * Close the log file, so that the next message opens the one named by the
+ * current configuration.
+ */
+void
+cc_log_reset(void)
+{
+	if (logfile) {
+		fclose(logfile);
+		logfile = NULL;
+	}
+}
+
 /*
  * Write a message to the log file (adding a newline) without flushing and with
  * a reused timestamp.
@@ -238,14 +258,31 @@ mkstemp(char *template)
 int
 copy_file(const char *src, const char *dest, int compress_level)
 {
-	int fd_in = -1, fd_out = -1;
+	int fd_in, errnum;
+
+	fd_in = open(src, O_RDONLY | O_BINARY);
+	if (fd_in == -1) {
+		errnum = errno;
+		cc_log("open error: %s", strerror(errno));
+		errno = errnum;
+		return -1;
+	}
+	return copy_fd_to_file(fd_in, src, dest, compress_level);
+}
+
+/*
+ * Like copy_file(), but reads the already opened src from fd_in, which is
+ * closed afterwards.
+ */
+int
+copy_fd_to_file(int fd_in, const char *src, const char *dest,
+                int compress_level)
+{
+	int fd_out = -1;
 	gzFile gz_in = NULL, gz_out = NULL;
 	char buf[10240];
 	int n, written;
 	char *tmp_name;
-#ifndef _WIN32
-	mode_t mask;
-#endif
 	struct stat st;
 	int errnum;
 
@@ -255,19 +292,13 @@ copy_file(const char *src, const char *dest, int compress_level)
 	fd_out = mkstemp(tmp_name);
 	if (fd_out == -1) {
 		cc_log("mkstemp error: %s", strerror(errno));
+		close(fd_in);
 		goto error;
 	}
 
 	cc_log("Copying %s to %s via %s (%scompressed)",
 	       src, dest, tmp_name, compress_level > 0 ? "" : "un");
 
-	/* open source file */
-	fd_in = open(src, O_RDONLY | O_BINARY);
-	if (fd_in == -1) {
-		cc_log("open error: %s", strerror(errno));
-		goto error;
-	}
-
 	gz_in = gzdopen(fd_in, "rb");
 	if (!gz_in) {
 		cc_log("gzdopen(src) error: %s", strerror(errno));
@@ -352,9 +383,7 @@ copy_file(const char *src, const char *dest, int compress_level)
 
 #ifndef _WIN32
 	/* get perms right on the tmp file */
-	mask = umask(0);
-	fchmod(fd_out, 0666 & ~mask);
-	umask(mask);
+	fchmod(fd_out, 0666 & ~get_umask());
 #endif
 
 	/* the close can fail on NFS if out of space */
@@ -493,13 +522,42 @@ create_parent_dirs(const char *path)
 	return res;
 }
 
+#ifndef _WIN32
+static mode_t process_umask;
+static pthread_once_t process_umask_once = PTHREAD_ONCE_INIT;
+
+static void
+read_process_umask(void)
+{
+	process_umask = umask(0);
+	umask(process_umask);
+}
+
+/*
+ * Return the permission bits to clear on the files we create: the umask
+ * setting, or else the umask of the process. umask() can only be read by
+ * changing it, which isn't safe while other threads create files, so the
+ * latter is read once, on the first call; ccache_compile makes that call
+ * before it starts a compile.
+ */
+mode_t
+get_umask(void)
+{
+	pthread_once(&process_umask_once, read_process_umask);
+	if (conf && conf->umask != UINT_MAX) {
+		return conf->umask;
+	}
+	return process_umask;
+}
+#endif
+
 /*
  * Return a static string with the current hostname.
  */
 const char *
 get_hostname(void)
 {
-	static char hostname[200] = "";
+	static THREAD_LOCAL char hostname[200] = "";
 
 	if (!hostname[0]) {
 		strcpy(hostname, "unknown");
@@ -514,20 +572,41 @@ get_hostname(void)
 
 /*
  * Return a string to be used to distinguish temporary files. Also tries to
- * cope with NFS by adding the local hostname.
+ * cope with NFS by adding the local hostname. Threads after the first add a
+ * number of their own.
  */
+static THREAD_LOCAL char *tmp_string_value;
+
 const char *
 tmp_string(void)
 {
-	static char *ret;
+	static THREAD_LOCAL pid_t ret_pid;
+	static unsigned threads;
+	char *ret = tmp_string_value;
 
-	if (!ret) {
-		ret = format("%s.%u", get_hostname(), (unsigned)getpid());
+	if (!ret || ret_pid != getpid()) {
+		unsigned thread = __sync_fetch_and_add(&threads, 1);
+		free(ret);
+		ret_pid = getpid();
+		if (thread == 0) {
+			ret = format("%s.%u", get_hostname(), (unsigned)ret_pid);
+		} else {
+			ret = format("%s.%u.%u", get_hostname(), (unsigned)ret_pid, thread);
+		}
+		tmp_string_value = ret;
 	}
 
 	return ret;
 }
 
+/* Free this thread's tmp_string. The next call makes a new one. */
+void
+tmp_string_reset(void)
+{
+	free(tmp_string_value);
+	tmp_string_value = NULL;
+}
+
 /*
  * Return the hash result as a hex string. Size -1 means don't include size
  * suffix. Caller frees.
@@ -1484,8 +1563,8 @@ subst_env_in_string(const char *str, char **errmsg)
 
 /*--------------------------------------------------------------------*/
 /* Static data for the source files we have cached.  */
-static struct hashtable *stashed_files = NULL;
-static int stashed_file_count = 0;
+static THREAD_LOCAL struct hashtable *stashed_files = NULL;
+static unsigned stashed_file_count = 0; /* For all threads. */
 
 /*
  * Reads the content of a file into mmapped memory and sets up the memory
@@ -1538,7 +1617,8 @@ read_file_and_stash (const char* path, size_t size_in, char** data,
     return false;
 
   /* Create a new shared_memory object.  */
-  share_name = format("/cs-saved_file.%d.%d", getpid(), stashed_file_count++);
+  share_name = format("/cs-saved_file.%d.%u", getpid(),
+                      __sync_fetch_and_add(&stashed_file_count, 1));
   shmd = shm_open(share_name, O_CREAT | O_RDWR, 0600);
   if (shmd == -1 || ftruncate (shmd, allocated) == -1)
     {
@@ -1636,7 +1716,7 @@ delete_stashed_files (void)
 {
   struct hashtable_itr *iter;
 
-  if (!stashed_files)
+  if (!stashed_files || hashtable_count(stashed_files) == 0)
     return;
 
   iter = hashtable_iterator(stashed_files);
@@ -1644,4 +1724,28 @@ delete_stashed_files (void)
       struct stashed_file *sf = hashtable_iterator_value(iter);
       shm_unlink (sf->shm_name);
   } while (hashtable_iterator_advance(iter));
+  free(iter);
+}
+
+/* Unmap the stashed files and forget them, but leave their shared names
+   to delete_stashed_files.  */
+void
+forget_stashed_files (void)
+{
+  struct hashtable_itr *iter;
+
+  if (!stashed_files)
+    return;
+
+  if (hashtable_count(stashed_files) > 0)
+    {
+      iter = hashtable_iterator(stashed_files);
+      do {
+	  struct stashed_file *sf = hashtable_iterator_value(iter);
+	  munmap(sf, sf->size + sizeof(*sf));
+      } while (hashtable_iterator_advance(iter));
+      free(iter);
+    }
+  hashtable_destroy(stashed_files, 0);
+  stashed_files = NULL;
 }